@@ -0,0 +1,60 @@
+--
+-- bench/alloc.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Allocation-heavy benchmark, which mimics what a job does: building
+-- document trees, cloning and copying option tables, and creating lots
+-- of short strings which are discarded right away. Run it with both the
+-- pool and the system allocator to compare them:
+--
+--   ./chisel -L src -S bench/alloc.lua [rounds=N]
+--   ./chisel -L src -a -S bench/alloc.lua [rounds=N]
+--
+
+local T        = lib.doctree
+local deepcopy = lib.util.deepcopy
+local rupdate  = lib.util.rupdate
+local sprintf  = string.format
+
+local rounds = tonumber (chisel.options.rounds) or 20
+local nodes  = tonumber (chisel.options.nodes) or 20000
+
+local options = {
+  dot_distance = 2.5; line_spacing = "single"; characters_per_line = 32;
+  lines_per_page = 26; graphics_dot_distance = 1.6; copies = 1;
+}
+
+local function job ()
+  local doc = T.document:clone { children = {} }
+  for i = 1, nodes do
+    local opts = rupdate (deepcopy (options), { lines_per_page = i % 30 })
+    local part = T.part:clone { options = opts }
+    part:add_child (T.text:clone { data = sprintf ("line %i of the text\n", i) })
+    doc:add_child (part)
+  end
+  return doc
+end
+
+collectgarbage ()
+local start = chisel.now ()
+for _ = 1, rounds do
+  job ()
+end
+local elapsed = chisel.now () - start
+
+print (("%i rounds x %i nodes: %.3fs (%.1f nodes/s)"):format (rounds,
+       nodes, elapsed, rounds * nodes / elapsed))
+
+local stats = chisel.allocstats ()
+if stats then
+  print (("pool: %i allocs, %i frees, %i reallocs, %i small, %i large"):format (
+         stats.allocs, stats.frees, stats.reallocs, stats.small, stats.large))
+  print (("pool: %.1f KiB in use, %.1f KiB peak, %.1f KiB reserved, " ..
+         "%i chunks released"):format (stats.in_use / 1024, stats.peak / 1024,
+         stats.reserved / 1024, stats.released))
+else
+  print ("system allocator in use, no statistics available")
+end
@@ -0,0 +1,83 @@
+--
+-- bench/cancel.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures how long chiseltodev takes to exit after being sent SIGTERM,
+-- which is what CUPS does to cancel a job. A synthetic document is
+-- rendered in two ways, and the process is signalled after a while:
+--
+--  * busy: the output goes to /dev/null, so the time is spent rendering.
+--  * slow: the output goes to a virtual embosser (the devsim script) which
+--    reads it at the given throughput, in pages per minute, so the time is
+--    spent waiting for writes to complete. After the signal, the reset
+--    sequence still has to be read by the embosser.
+--
+-- Run with:
+--
+--   ./chisel -L src -S bench/cancel.lua [rounds=N] [delay=S] [throttle=N]
+--
+
+local rounds   = tonumber (chisel.options.rounds) or 5
+local delay    = tonumber (chisel.options.delay) or 0.5
+local throttle = tonumber (chisel.options.throttle) or 3000
+local device   = chisel.options.device or "indexbraille/everest"
+
+local chisel_cmd = ("./chisel -L %s"):format (chisel.libdir)
+local path = os.tmpname ()
+local fifo = os.tmpname ()
+os.remove (fifo)
+os.execute ("mkfifo " .. fifo)
+
+-- Many parts with different options, and text which has to be wrapped.
+local words = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+                "adipiscing", "elit", "sed", "eiusmod", "tempor" }
+local doc = assert (io.open (path, "w"))
+doc:write ("options { wrap_text = true }\ndocument {\n")
+for i = 1, 20000 do
+  local text = {}
+  for j = 1, 40 do
+    text[j] = words[(i * j) % #words + 1]
+  end
+  doc:write (("  part { lines_per_page = %i } { text %q; };\n"):format (
+             20 + i % 5, table.concat (text, " ") .. "\n"))
+end
+doc:write ("}\n")
+doc:close ()
+
+
+-- Starts the command (after the reader of its output, if any), signals
+-- it after the delay, and returns the time it took to exit, and its exit
+-- status.
+local function cancel (output, reader)
+  local proc = io.popen (("sh -c '%s echo $$; exec %s -S chiseltodev " ..
+                          "device=%s < %s > %s 2> /dev/null'"):format (
+                          reader or "", chisel_cmd, device, path, output))
+  local pid = proc:read ("*l")
+  chisel.sleep (delay)
+  local start = chisel.now ()
+  os.execute ("kill -TERM " .. pid)
+  local _, _, status = proc:close ()
+  return chisel.now () - start, status
+end
+
+local function measure (name, output, reader)
+  local times = {}
+  local status
+  for i = 1, rounds do
+    times[i], status = cancel (output, reader)
+  end
+  table.sort (times)
+  print (("%-6s median %7.1f ms, max %7.1f ms (exit status %s)"):format (
+         name, times[math.floor ((rounds + 1) / 2)] * 1000,
+         times[rounds] * 1000, tostring (status)))
+end
+
+measure ("busy", "/dev/null")
+measure ("slow", fifo, ("%s -S devsim device=%s throttle=%i < %s > /dev/null &"
+         ):format (chisel_cmd, device, throttle, fifo))
+
+os.remove (path)
+os.remove (fifo)
@@ -0,0 +1,66 @@
+--
+-- bench/canvas.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures how fast shapes are drawn as braille graphics, in cells per
+-- second, using a diagram with a grid of circles, discs, polygons and
+-- lines which covers a canvas of the given size (in cells and lines):
+--
+--   ./chisel -L src -S bench/canvas.lua [cpl=N] [lines=N] [shapes=N]
+--            [repeat=N]
+--
+-- The number of "shapes" is that of each kind, in each row and column of
+-- the grid.
+--
+
+local cpl     = tonumber (chisel.options.cpl) or 400
+local lines   = tonumber (chisel.options.lines) or 1000
+local nshapes = tonumber (chisel.options.shapes) or 10
+local nrepeat = tonumber (chisel.options["repeat"]) or 5
+
+-- Canvas size in dots, and size of each square of the grid.
+local width, height = 2 * cpl, 3 * lines
+local dx, dy = width / nshapes, height / nshapes
+local r = math.min (dx, dy) / 4
+
+local shapes = {}
+for i = 0, nshapes - 1 do
+  for j = 0, nshapes - 1 do
+    local x, y = i * dx, j * dy
+    shapes[#shapes+1] = { kind = "circle", x + dx / 4, y + dy / 4, r * 0.9 }
+    shapes[#shapes+1] = { kind = "circle", x + dx * 3 / 4, y + dy / 4, r * 0.9;
+                          fill = true }
+    shapes[#shapes+1] = { kind = "fill", x, y + dy / 2, x + dx / 2, y + dy / 2,
+                          x + dx / 4, y + dy }
+    shapes[#shapes+1] = { kind = "polyline", closed = true, x + dx / 2,
+                          y + dy / 2, x + dx, y + dy / 2, x + dx, y + dy }
+    shapes[#shapes+1] = { kind = "line", x, y, x + dx, y + dy }
+  end
+end
+
+local draw = lib.raster.draw
+local options = { width = width; height = height }
+local output
+
+local times = {}
+for i = 1, nrepeat do
+  local start = chisel.now ()
+  output = draw (shapes, options)
+  times[i] = chisel.now () - start
+end
+table.sort (times)
+local median = times[math.floor ((nrepeat + 1) / 2)]
+
+local ndots = 0
+for c in output:gmatch ("[^ \n]") do
+  ndots = ndots + 1
+end
+
+print (("canvas:     %i cells per line, %i lines (%i x %i dots)"):format (cpl,
+       lines, width, height))
+print (("shapes:     %i (%i cells with dots)"):format (#shapes, ndots))
+print (("draw:       %.3f s, %.1f M cells/s"):format (median,
+       cpl * lines / median / 1e6))
@@ -0,0 +1,46 @@
+--
+-- bench/contract.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures the throughput of contracted braille translation, in
+-- characters per second, over a text file (by default, the book from
+-- the benchmark corpus):
+--
+--   ./chisel -L src -S bench/contract.lua [input=FILE] [table=NAME]
+--            [repeat=N]
+--
+
+local input   = chisel.options.input or "bench/corpus/book.txt"
+local name    = chisel.options.table or "en-us-g2"
+local nrepeat = tonumber (chisel.options["repeat"]) or 5
+
+local path = ("%s/data/_contractions/%s.ctb"):format (chisel.libdir, name)
+local start = chisel.now ()
+local tab = assert (lib.contract.open (path))
+local load_time = chisel.now () - start
+
+local f = assert (io.open (input, "rb"))
+local text = f:read ("*a")
+f:close ()
+
+local times, output = {}, nil
+for i = 1, nrepeat do
+  start = chisel.now ()
+  output = tab:translate (text)
+  times[i] = chisel.now () - start
+end
+table.sort (times)
+
+local median = times[math.floor ((nrepeat + 1) / 2)]
+local stats = tab:stats ()
+
+print (("table:      %s (%i rules, %i nodes, %i bytes, loaded in %.3f ms)"):format (
+       name, stats.rules, stats.nodes, stats.size, load_time * 1000))
+print (("input:      %s (%i characters)"):format (input, #text))
+print (("output:     %i cells (%.1f%% of the input)"):format (#output,
+       #output / #text * 100))
+print (("time:       %.3f s (median of %i)"):format (median, nrepeat))
+print (("throughput: %.2f M characters/s"):format (#text / median / 1e6))
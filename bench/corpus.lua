@@ -0,0 +1,160 @@
+--
+-- bench/corpus.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Generates the synthetic corpus used by bench/run.lua. The contents are
+-- pseudo-random, but always the same for a given set of parameters:
+--
+--   ./chisel -L src -S bench/corpus.lua out=DIR [lines=N] [parts=N]
+--            [pages=N] [raws=N] [jobs=N]
+--
+-- Files written to DIR:
+--
+--   book.txt       Plain text book of "lines" lines, for texttochisel.
+--   book.chsl      The same book, as a Chisel document.
+--   parts.chsl     Document with "parts" parts, each with its options.
+--   graphics.chsl  Document with "pages" full pages of graphics.
+--   raw.chsl       Document with "raws" raw elements, for many outputs.
+--   job-NNNN.chsl  A number of "jobs" small documents, and a "manifest"
+--                  listing them, to be rendered in batch mode.
+--
+
+local sprintf = string.format
+local schar   = string.char
+local tconcat = table.concat
+
+local outdir = chisel.options.out
+if not outdir then
+  chisel.die ("Usage: corpus.lua out=DIR [lines=N] [parts=N] [pages=N] " ..
+              "[raws=N] [jobs=N]\n")
+end
+
+local nlines = tonumber (chisel.options.lines) or 100000
+local nparts = tonumber (chisel.options.parts) or 20000
+local npages = tonumber (chisel.options.pages) or 2000
+local nraws  = tonumber (chisel.options.raws)  or 20000
+local njobs  = tonumber (chisel.options.jobs)  or 200
+
+os.execute (sprintf ("mkdir -p %q", outdir))
+
+
+-- Linear congruential generator: math.random() is not guaranteed to
+-- produce the same sequence everywhere, and the corpus must be stable.
+local seed = 42
+local function random (n)
+  seed = (seed * 1103515245 + 12345) % 2147483648
+  return 1 + seed % n
+end
+
+local words = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+  "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+  "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam",
+  "quis", "nostrud", "exercitation", "ullamco", "laboris", "nisi",
+}
+
+local function sentence ()
+  local t = {}
+  for i = 1, 3 + random (8) do
+    t[i] = words[random (#words)]
+  end
+  return tconcat (t, " ")
+end
+
+local function create (name)
+  return assert (io.open (outdir .. "/" .. name, "wb"))
+end
+
+local function write_book (out, text)
+  out:write ("options {\n  lines_per_page = 26;\n}\n")
+  out:write ("document {\n  text {\n")
+  for _, line in ipairs (text) do
+    out:write (sprintf ("    %q,\n", line .. "\n"))
+  end
+  out:write ("  }\n}\n")
+end
+
+
+-- Plain text book, in both formats.
+local book = {}
+for i = 1, nlines do
+  book[i] = sentence ()
+end
+
+local out = create ("book.txt")
+out:write (tconcat (book, "\n"), "\n")
+out:close ()
+
+out = create ("book.chsl")
+write_book (out, book)
+out:close ()
+
+
+-- Lots of parts, each one changing some option.
+out = create ("parts.chsl")
+out:write ("document {\n")
+for i = 1, nparts do
+  out:write (sprintf ("  part { lines_per_page = %i; top_margin = %i } {\n",
+                      20 + random (6), random (3) - 1))
+  out:write (sprintf ("    text (%q);\n  };\n", sentence () .. "\n"))
+end
+out:write ("}\n")
+out:close ()
+
+
+-- Full pages of graphics. Each cell is a character in the 0x20-0x5F range,
+-- which is what devices expect for 6-dot graphics.
+out = create ("graphics.chsl")
+out:write ("options {\n  graphics_dot_distance = 1.6;\n}\n")
+out:write ("document {\n")
+for _ = 1, npages do
+  local rows = {}
+  for row = 1, 26 do
+    local cells = {}
+    for col = 1, 32 do
+      cells[col] = schar (0x1F + random (64))
+    end
+    rows[row] = tconcat (cells)
+  end
+  out:write (sprintf ("  graphics (%q);\n", tconcat (rows, "\r\n") .. "\r\n"))
+end
+out:write ("}\n")
+out:close ()
+
+
+-- Raw data for several outputs: only some of the elements match a given
+-- device, the rest have to be skipped by the renderer.
+local outputs = {
+  "indexbraille-v4", "indexbraille/everest", "indexbraille/",
+  "otherbrand-v1", "otherbrand/model",
+}
+out = create ("raw.chsl")
+out:write ("document {\n")
+for i = 1, nraws do
+  out:write (sprintf ("  raw (%q, %q);\n", outputs[random (#outputs)],
+                      "\027DBT0;" .. sentence ()))
+  if i % 10 == 0 then
+    out:write (sprintf ("  text (%q);\n", sentence () .. "\n"))
+  end
+end
+out:write ("}\n")
+out:close ()
+
+
+-- Small jobs, for batch mode.
+local manifest = create ("manifest")
+for i = 1, njobs do
+  local name = sprintf ("job-%04i.chsl", i)
+  local text = {}
+  for j = 1, 10 + random (40) do
+    text[j] = sentence ()
+  end
+  out = create (name)
+  write_book (out, text)
+  out:close ()
+  manifest:write (outdir, "/", name, "\n")
+end
+manifest:close ()
@@ -0,0 +1,85 @@
+--
+-- bench/devices.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures how fast the list of devices is obtained, which is what
+-- "chisel-ppd list" does each time CUPS looks for drivers. A synthetic
+-- data directory with the given number of manufacturers and models of
+-- each one is created, and listed in two ways:
+--
+--  * stat: listing the names, and checking each one with fs.isdir(),
+--    which is how device.list() used to work.
+--  * dtype: using device.list(), which takes the types from the entries
+--    returned by fs.dir().
+--
+-- Run with:
+--
+--   ./chisel -L src -S bench/devices.lua [manufacturers=N] [models=N]
+--            [rounds=N]
+--
+-- The difference is larger when the metadata is not in the cache (e.g.
+-- network file systems, or after "echo 2 > /proc/sys/vm/drop_caches").
+--
+
+local nmanufacturers = tonumber (chisel.options.manufacturers) or 20
+local nmodels        = tonumber (chisel.options.models) or 200
+local rounds         = tonumber (chisel.options.rounds) or 20
+
+local fs = lib.fs
+
+local root = os.tmpname ()
+os.remove (root)
+for i = 1, nmanufacturers do
+  local path = ("%s/data/manufacturer%i"):format (root, i)
+  os.execute ("mkdir -p " .. path .. "/_private")
+  for j = 1, nmodels do
+    io.open (("%s/model%i.lua"):format (path, j), "w"):close ()
+  end
+end
+os.execute ("mkdir -p " .. root .. "/data/_common")
+
+
+-- The previous implementation of device.list("*").
+local function list_stat ()
+  local data = chisel.libdir .. "/data/"
+  local result = {}
+  for _, mf in ipairs (fs.listdir (data)) do
+    if mf:sub (1, 1) ~= "_" and fs.isdir (data .. mf) then
+      for _, model in ipairs (fs.listdir (data .. mf)) do
+        if model:sub (1, 1) ~= "_" and not fs.isdir (data .. mf .. "/" .. model) then
+          result[#result + 1] = mf .. "/" .. model:sub (1, -5)
+        end
+      end
+    end
+  end
+  return result
+end
+
+local function list_dtype ()
+  return lib.device.list ("*")
+end
+
+local function measure (name, list)
+  local times = {}
+  local count
+  for i = 1, rounds do
+    local start = chisel.now ()
+    count = #list ()
+    times[i] = chisel.now () - start
+  end
+  table.sort (times)
+  local median = times[math.floor ((rounds + 1) / 2)]
+  print (("%-6s %6i devices, median %7.3f ms, %10.0f entries/s"):format (
+         name, count, median * 1000, count / median))
+end
+
+local libdir = chisel.libdir
+chisel.libdir = root
+measure ("stat", list_stat)
+measure ("dtype", list_dtype)
+chisel.libdir = libdir
+
+os.execute ("rm -rf " .. root)
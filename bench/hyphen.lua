@@ -0,0 +1,84 @@
+--
+-- bench/hyphen.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures the lines and pages saved by hyphenating words when wrapping
+-- text, and the throughput of hyphenation lookups in words per second,
+-- over a text file (by default, the book from the benchmark corpus):
+--
+--   ./chisel -L src -S bench/hyphen.lua [input=FILE] [patterns=NAME]
+--            [cpl=N] [lpp=N] [reflow=no] [repeat=N]
+--
+-- Lines in the input are joined into paragraphs, which are separated by
+-- blank lines, unless "reflow=no" is given.
+--
+
+local input   = chisel.options.input or "bench/corpus/book.txt"
+local name    = chisel.options.patterns or "en-us"
+local cpl     = tonumber (chisel.options.cpl) or 32
+local lpp     = tonumber (chisel.options.lpp) or 26
+local reflow  = chisel.options.reflow ~= "no"
+local nrepeat = tonumber (chisel.options["repeat"]) or 5
+
+local path = ("%s/data/_hyphenation/%s.htb"):format (chisel.libdir, name)
+local tab = assert (lib.hyphen.open (path))
+
+local f = assert (io.open (input, "rb"))
+local text = f:read ("*a")
+f:close ()
+
+if reflow then
+  text = text:gsub ("([^\n])\n([^\n])", "%1 %2")
+end
+
+local function layout (hyphenator)
+  local formatter = lib.formatter.new {
+    characters_per_line = cpl;
+    lines_per_page      = lpp;
+    hyphenator          = hyphenator;
+  }
+  local start = chisel.now ()
+  formatter:format (text)
+  formatter:flush ()
+  return formatter:stats (), chisel.now () - start
+end
+
+local plain, plain_time = layout (false)
+local hyph, hyph_time = layout (tab)
+
+local words = {}
+for word in text:gmatch ("%a+") do
+  words[#words+1] = word
+end
+
+local times = {}
+for i = 1, nrepeat do
+  local hyphenate = tab.hyphenate
+  local start = chisel.now ()
+  for j = 1, #words do
+    hyphenate (tab, words[j])
+  end
+  times[i] = chisel.now () - start
+end
+table.sort (times)
+local median = times[math.floor ((nrepeat + 1) / 2)]
+
+local function saved (a, b)
+  return (a - b) / a * 100
+end
+
+print (("patterns:   %s (%i patterns)"):format (name, tab:stats ().patterns))
+print (("input:      %s (%i characters, %i words)"):format (input, #text, #words))
+print (("layout:     %i characters per line, %i lines per page%s"):format (cpl,
+       lpp, reflow and ", reflowed" or ""))
+print (("plain:      %i lines, %i pages (%.3f s)"):format (plain.lines,
+       plain.pages, plain_time))
+print (("hyphenated: %i lines, %i pages (%.3f s, %i words hyphenated)"):format (
+       hyph.lines, hyph.pages, hyph_time, hyph.hyphenated))
+print (("saved:      %.1f%% lines, %.1f%% pages"):format (
+       saved (plain.lines, hyph.lines), saved (plain.pages, hyph.pages)))
+print (("throughput: %.2f M words/s (median of %i)"):format (
+       #words / median / 1e6, nrepeat))
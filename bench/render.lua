@@ -0,0 +1,69 @@
+--
+-- bench/render.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Measures the throughput of the rendering step alone: a synthetic
+-- document with many parts and text nodes is rendered several times,
+-- discarding the output. Run with:
+--
+--   ./chisel -L src -S bench/render.lua [rounds=N] [parts=N]
+--   ./chisel -L src -S bench/render.lua device=indexbraille/basic-d
+--   ./chisel -L src -S bench/render.lua doc=graphics
+--
+-- With "doc=graphics", each part contains a graphics element as well,
+-- which switches to the graphics options and back. The number of device
+-- commands written per second is reported, as most of the time goes to
+-- changing options for parts and graphics.
+--
+
+local T = lib.doctree
+
+local rounds = tonumber (chisel.options.rounds) or 10
+local parts  = tonumber (chisel.options.parts) or 20000
+local kind   = chisel.options.doc or "parts"
+local dev    = lib.device.get (chisel.options.device or "indexbraille/everest")
+
+if kind ~= "parts" and kind ~= "graphics" then
+  chisel.die ("Unknown document kind %q, use 'parts' or 'graphics'\n", kind)
+end
+
+local doc = T.document:clone { children = {}, options = {} }
+for i = 1, parts do
+  local part = T.part:clone { options = { lines_per_page = 20 + i % 5 } }
+  part:add_child (T.text:clone { data = "Lorem ipsum dolor sit amet.\n" })
+  if kind == "graphics" then
+    part:add_child (T.graphics:clone { data = "=?L\n" })
+  end
+  doc:add_child (part)
+end
+
+-- Count the commands once, outside of the measured rounds. Note that
+-- renderers are shared, so this one is replaced by the next one.
+local output = {}
+local count = assert (dev:create_renderer (function (self, data)
+  output[#output + 1] = data
+  return self
+end))
+doc:render (count:reset ())
+local commands = select (2, table.concat (output):gsub ("\027%u%u%u?[^;]*;", ""))
+output = nil
+
+local bytes = 0
+local rend = assert (dev:create_renderer (function (self, data)
+  bytes = bytes + #data
+  return self
+end))
+
+collectgarbage ()
+local start = chisel.now ()
+for _ = 1, rounds do
+  doc:render (rend:reset ())
+end
+local elapsed = chisel.now () - start
+
+print (("%i rounds x %i %s, loglevel %i: %.3fs (%.1f parts/s, %.2f MB/s, %.1f k commands/s)"):format (
+       rounds, parts, kind, chisel.loglevel, elapsed, rounds * parts / elapsed,
+       bytes / elapsed / 1e6, rounds * commands / elapsed / 1e3))
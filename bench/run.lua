@@ -0,0 +1,237 @@
+--
+-- bench/run.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- End-to-end benchmark runner. Each case runs one of the programs as a
+-- separate process over a file of the corpus generated by corpus.lua,
+-- and the median of the wall clock times is taken. An additional run
+-- with memory accounting enabled (-M) provides the time spent in each
+-- phase, and the peak resident set size. Usually run with "make bench":
+--
+--   ./chisel -L src -S bench/run.lua [corpus=DIR] [results=FILE]
+--            [baseline=FILE] [threshold=0.1] [min_delta=0.01] [repeat=N]
+--            [chisel=PATH] [libdir=DIR] [device=ID] [only=PATTERN]
+--            [check=0]
+--
+-- Results are written as JSON to the "results" file (standard output by
+-- default). When a "baseline" file from a previous run exists, times are
+-- compared with it: cases that changed less than the "threshold" (as a
+-- fraction, 10% by default) or by less than "min_delta" seconds (0.01 by
+-- default, for the cases which take a few milliseconds) are considered
+-- noise, and if any case got slower than that, the exit status is non-zero.
+-- With "check=0" slower cases are still reported, but the exit status is
+-- zero, which "make bench-baseline" uses to replace an outdated baseline.
+--
+
+local sprintf = string.format
+
+local corpus    = chisel.options.corpus or "bench/corpus"
+local chsl      = chisel.options.chisel or "./chisel"
+local libdir    = chisel.options.libdir or "src"
+local device    = chisel.options.device or "indexbraille/everest"
+local nrepeat   = tonumber (chisel.options["repeat"]) or 5
+local threshold = tonumber (chisel.options.threshold) or 0.1
+local min_delta = tonumber (chisel.options.min_delta) or 0.01
+local only      = chisel.options.only
+local check     = chisel.options.check ~= "0"
+local outdir    = corpus .. "/out"
+
+if not lib.fs.isdir (corpus) then
+  chisel.die ("Corpus directory %q does not exist, create it with:\n" ..
+              "  %s -L %s -S bench/corpus.lua out=%s\n",
+              corpus, chsl, libdir, corpus)
+end
+os.execute (sprintf ("mkdir -p %q", outdir))
+
+
+local function file_size (path)
+  local f = io.open (path, "rb")
+  if f == nil then
+    return 0
+  end
+  local size = f:seek ("end")
+  f:close ()
+  return size
+end
+
+local function manifest_size (path)
+  local bytes, count = 0, 0
+  for line in io.lines (path) do
+    bytes = bytes + file_size (line)
+    count = count + 1
+  end
+  return bytes, count
+end
+
+
+-- Each case has a command line (with "%s" where the extra chisel flags
+-- go), the number of bytes processed, and the number of jobs done.
+local cases = {}
+
+local function add_case (name, script, args, input, output, bytes, jobs)
+  local command = sprintf ("%q -L %q %%s -S %s %s", chsl, libdir, script, args)
+  if input then
+    command = command .. sprintf (" < %q", input)
+  end
+  command = command .. sprintf (" > %q", output or "/dev/null")
+  cases[#cases+1] = {
+    name    = name;
+    command = command;
+    output  = output;
+    bytes   = bytes or (input and file_size (input)) or 0;
+    jobs    = jobs or 1;
+  }
+end
+
+add_case ("texttochisel-book", "texttochisel", "",
+          corpus .. "/book.txt", outdir .. "/book.chsl")
+for _, name in ipairs { "book", "parts", "graphics", "raw" } do
+  add_case ("chiseltodev-" .. name, "chiseltodev", "device=" .. device,
+            sprintf ("%s/%s.chsl", corpus, name),
+            sprintf ("%s/%s.raw", outdir, name))
+end
+add_case ("chiseltodev-batch", "chiseltodev",
+          sprintf ("device=%s out=%q manifest=%q 2> /dev/null", device,
+                   outdir, corpus .. "/manifest"),
+          nil, nil, manifest_size (corpus .. "/manifest"))
+add_case ("chisel-ppd-list", "chisel-ppd", "list", nil,
+          outdir .. "/list.txt")
+add_case ("chisel-ppd-cat", "chisel-ppd", "cat " .. device, nil,
+          outdir .. "/device.ppd")
+
+
+local function run (command)
+  local start = chisel.now ()
+  local ok = os.execute (command)
+  local elapsed = chisel.now () - start
+  if not ok then
+    chisel.die ("Command failed: %s\n", command)
+  end
+  return elapsed
+end
+
+local function median (t)
+  table.sort (t)
+  local n = #t
+  if n % 2 == 1 then
+    return t[(n + 1) / 2]
+  end
+  return (t[n / 2] + t[n / 2 + 1]) / 2
+end
+
+local function run_case (case)
+  local times = {}
+  for i = 1, nrepeat do
+    times[i] = run (case.command:format (""))
+  end
+  case.seconds = median (times)
+
+  -- Cases with no input are measured by the amount of output produced.
+  if case.bytes == 0 and case.output then
+    case.bytes = file_size (case.output)
+  end
+
+  -- Instrumented run, to get the time for each phase and the peak RSS.
+  local memstat = outdir .. "/memstat.json"
+  run (case.command:format (sprintf ("-M %q", memstat)))
+  local f = assert (io.open (memstat, "rb"))
+  local report = f:read ("*a")
+  f:close ()
+
+  case.maxrss_kb = tonumber (report:match ('"maxrss_kb":(%d+)')) or 0
+  case.phases = {}
+  for name, time in report:gmatch ('"name":"(.-)".-"time":([%d%.]+)') do
+    case.phases[#case.phases+1] = { name = name; time = tonumber (time) }
+  end
+end
+
+
+-- Baseline results: only the fields needed for the comparison are read.
+-- This relies on the layout produced by format_case(), which writes each
+-- case in a line of its own.
+local function load_baseline (path)
+  local f = path and io.open (path, "rb")
+  if f == nil then
+    return nil
+  end
+  local baseline = {}
+  for line in f:lines () do
+    local name, seconds = line:match ('"name":"(.-)","seconds":([%d%.e%-]+)')
+    if name then
+      baseline[name] = tonumber (seconds)
+    end
+  end
+  f:close ()
+  return baseline
+end
+
+local function format_case (case)
+  local phases = {}
+  for i, phase in ipairs (case.phases) do
+    phases[i] = sprintf ('"%s":%.6f', phase.name, phase.time)
+  end
+  return sprintf ('{"name":"%s","seconds":%.6f,"bytes":%i,"jobs":%i,' ..
+                  '"mb_per_s":%.3f,"jobs_per_s":%.3f,"maxrss_kb":%i,' ..
+                  '"phases":{%s}}', case.name, case.seconds, case.bytes,
+                  case.jobs, case.bytes / case.seconds / 1e6,
+                  case.jobs / case.seconds, case.maxrss_kb,
+                  table.concat (phases, ","))
+end
+
+
+local baseline = load_baseline (chisel.options.baseline)
+local slower = 0
+local lines = {}
+
+io.stderr:write (("%-20s %9s %9s %9s %10s  %s\n"):format ("case", "time",
+                 "MB/s", "jobs/s", "max RSS", baseline and "baseline" or ""))
+
+for _, case in ipairs (cases) do
+  if not only or case.name:find (only) then
+    run_case (case)
+    lines[#lines+1] = format_case (case)
+
+    local verdict = ""
+    local base = baseline and baseline[case.name]
+    if base then
+      local change = case.seconds / base - 1
+      if math.abs (case.seconds - base) < min_delta then
+        verdict = "same"
+      elseif change > threshold then
+        verdict = "slower"
+        slower = slower + 1
+      elseif change < -threshold then
+        verdict = "faster"
+      else
+        verdict = "same"
+      end
+      verdict = sprintf ("%+6.1f%% %s", change * 100, verdict)
+    end
+
+    io.stderr:write (("%-20s %8.3fs %9.2f %9.2f %7i KiB  %s\n"):format (
+                     case.name, case.seconds, case.bytes / case.seconds / 1e6,
+                     case.jobs / case.seconds, case.maxrss_kb, verdict))
+  end
+end
+
+local results = io.stdout
+if chisel.options.results then
+  results = assert (io.open (chisel.options.results, "wb"))
+end
+results:write (sprintf ('{"version":"%s","device":"%s","repeat":%i,' ..
+                        '"cases":[\n', chisel.version, device, nrepeat))
+results:write (table.concat (lines, ",\n"), "\n]}\n")
+if results ~= io.stdout then
+  results:close ()
+end
+
+if slower > 0 then
+  io.stderr:write (("%i case(s) slower than the baseline by more than %.0f%%\n"):format (
+                   slower, threshold * 100))
+  if check then
+    os.exit (1)
+  end
+end
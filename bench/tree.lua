@@ -0,0 +1,57 @@
+--
+-- bench/tree.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Compares document trees made of tables with packed trees: loads a
+-- document, and measures the memory used by the Lua heap once loaded,
+-- the time a full garbage collection cycle takes while the tree is
+-- alive, and the time needed to render it. Use -M to get the peak RSS:
+--
+--   ./chisel -L src -M - -S bench/tree.lua input=FILE [tree=packed]
+--
+
+local input  = chisel.options.input or "bench/corpus/book.chsl"
+local packed = chisel.options.tree == "packed"
+local dev    = lib.device.get (chisel.options.device or "indexbraille/everest")
+
+collectgarbage ()
+local base = collectgarbage ("count")
+
+chisel.phase ("parse")
+local start = chisel.now ()
+local doc = assert (lib.loader.parse (input, packed))
+local parse_time = chisel.now () - start
+
+chisel.phase ("gc")
+collectgarbage ()
+local heap = collectgarbage ("count") - base
+
+local gc_time = {}
+for i = 1, 5 do
+  start = chisel.now ()
+  collectgarbage ()
+  gc_time[i] = chisel.now () - start
+end
+table.sort (gc_time)
+
+chisel.phase ("render")
+local bytes = 0
+local rend = assert (dev:create_renderer (function (self, data)
+  bytes = bytes + #data
+  return self
+end))
+start = chisel.now ()
+doc:render (rend)
+local render_time = chisel.now () - start
+
+print (("%s: %s tree, %.1f KiB heap, parse %.3fs, full GC %.2f ms, render %.3fs"):format (
+       input, packed and "packed" or "table", heap, parse_time,
+       gc_time[3] * 1e3, render_time))
+if packed then
+  local stats = doc._tree:stats ()
+  print (("  %i nodes, %i strings, %.1f KiB payload, %.1f KiB deduplicated"):format (
+         stats.nodes, stats.strings, stats.payload / 1024, stats.deduped / 1024))
+end
@@ -23,32 +23,86 @@ assert (chisel,
 assert (type (chisel) == "table",
         "type of \"chisel\" is not \"table\"")
 
+local function _write(format, ...)
+	stderr:write (format:format (...))
+	stderr:flush ()
+end
+
 local function _log(level, format, ...)
 	if chisel.loglevel >= level then
-		stderr:write (format:format (...))
-		stderr:flush ()
+		if type (format) == "function" then
+			_write (format ())
+		else
+			_write (format, ...)
+		end
 	end
 end
 
+local function _nolog () end
+
+--- Logging
+-- @section logging
+
+--- Whether verbose messages are enabled.
+--
+-- Arguments to the logging functions are evaluated before the functions
+-- check whether messages are to be written. Code which needs to do some
+-- work to obtain those arguments, like converting a table to a string,
+-- should check this flag first:
+--
+--	if log_verbose_enabled then
+--		log_verbose ("options: %s\n", tstring (options))
+--	end
+--
+log_verbose_enabled = false
+
+--- Whether debug messages are enabled.
+--
+-- @see log_verbose_enabled
+--
+log_debug_enabled = false
+
 --- Send a verbose message to stderr.
 --
 -- Formats a message string, and sends it to the standard error output, but
--- only if `chisel.loglevel` is non-zero.
+-- only if `chisel.loglevel` is non-zero. Instead of a format string, a
+-- function returning the format string and its arguments can be passed,
+-- which will only be called if the message is to be written.
 --
 -- @param format Format string.
 -- @param ... Format string arguments.
+-- @function log_verbose
 --
-log_verbose = function (format, ...) _log(1, format, ...) end
 
 --- Send a debug message to stderr.
 --
 -- Formats a message string, and sends it to the standard error output, but
--- only if `chisel.loglevel` is above `1`.
+-- only if `chisel.loglevel` is above `1`. Like with @{log_verbose}, a
+-- function can be passed instead of the format string.
 --
 -- @param format Format string.
 -- @param ... Format string arguments.
+-- @function log_debug
+--
+
+--- Changes the logging level.
 --
-log_debug = function (format, ...) _log(2, format, ...) end
+-- Updates `chisel.loglevel`, and rebinds the logging functions: disabled
+-- ones do nothing at all, not even checking the level.
+--
+-- @param level New logging level.
+--
+function log_setlevel (level)
+	chisel.loglevel = level
+	log_verbose_enabled = level >= 1
+	log_debug_enabled = level >= 2
+	log_verbose = log_verbose_enabled and
+		function (format, ...) _log(1, format, ...) end or _nolog
+	log_debug = log_debug_enabled and
+		function (format, ...) _log(2, format, ...) end or _nolog
+end
+
+log_setlevel (chisel.loglevel)
 
 
 log_verbose ("chisel %s\n", chisel.version)
@@ -63,6 +117,9 @@ log_debug (" - interactive = %i\n", chisel.interactive)
 
 --- Formats a message to the standard error stream and exits.
 --
+-- The events recorded in the trace ring, if any, are written after the
+-- message, as for uncaught errors (see the `-T` command line flag).
+--
 -- @param format Format string *(optional)*.
 -- @param ... Format string arguments *(optional)*.
 function chisel.die (format, ...)
@@ -70,6 +127,7 @@ function chisel.die (format, ...)
 		stderr:write (format:format (...))
 		stderr:flush ()
 	end
+	require ("trace").dump ()
 	exit (1)
 end
 
@@ -0,0 +1,467 @@
+/*
+ * alloc.c
+ * Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+/*
+ * Size-class pool allocator for the Lua VM.
+ *
+ * A chisel job is a short burst of many small allocations (document tree
+ * nodes, option tables, copies of them, short strings) which are mostly
+ * thrown away when the job finishes. Small requests are rounded up to
+ * a multiple of POOL_GRANULE and served from chunks of POOL_CHUNK_SIZE
+ * bytes, each one dedicated to a size class while it has blocks in use:
+ * blocks are taken from the free list of the chunk, or by bumping a
+ * pointer inside it.
+ *
+ * Chunks are aligned to their size, so the chunk of a block is found by
+ * masking its address, and it keeps a count of the blocks in use. When
+ * it drops to zero the chunk is empty: it is kept as a spare, which may
+ * be used later for any size class, or returned to the system if there
+ * are already POOL_SPARE_MAX spares. Memory which a finished job (or any
+ * other garbage) was using is thus released as the collector frees it,
+ * and the pool does not keep the peak usage of the program.
+ *
+ * Requests bigger than POOL_SMALL_MAX go to realloc(), but they are
+ * linked in a list so they can be released in one go by chsl_pool_free().
+ *
+ * Lua always passes the size of the block being freed or resized, which
+ * means the size class of a pointer is known without storing any header
+ * in small blocks.
+ */
+
+#include "../lua/lua.h"
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef POOL_GRANULE
+#define POOL_GRANULE 16
+#endif /* !POOL_GRANULE */
+
+#ifndef POOL_SMALL_MAX
+#define POOL_SMALL_MAX 512
+#endif /* !POOL_SMALL_MAX */
+
+/* Must be a power of two, and a multiple of the page size. */
+#ifndef POOL_CHUNK_SIZE
+#define POOL_CHUNK_SIZE (64 * 1024)
+#endif /* !POOL_CHUNK_SIZE */
+
+#ifndef POOL_SPARE_MAX
+#define POOL_SPARE_MAX 8
+#endif /* !POOL_SPARE_MAX */
+
+#define POOL_NCLASSES (POOL_SMALL_MAX / POOL_GRANULE)
+
+#define pool_class(size) (((size) - 1) / POOL_GRANULE)
+#define pool_class_size(c) (((c) + 1) * POOL_GRANULE)
+
+#define pool_chunk_of(ptr) \
+    ((pool_chunk*) ((uintptr_t) (ptr) & ~((uintptr_t) POOL_CHUNK_SIZE - 1)))
+
+
+typedef struct pool_free  pool_free;
+typedef struct pool_chunk pool_chunk;
+typedef struct pool_large pool_large;
+
+struct pool_free {
+    pool_free *next;
+};
+
+struct pool_chunk {
+    pool_chunk *prev;      /* Links in the list the chunk is in.       */
+    pool_chunk *next;
+    pool_free  *free;      /* Blocks given back.                       */
+    char       *bump;      /* Next never used byte.                    */
+    unsigned    used;      /* Blocks handed out and not given back.    */
+    unsigned    cls;       /* Size class the chunk is serving.         */
+};
+
+/* Blocks start after the header, aligned to POOL_GRANULE. */
+#define POOL_CHUNK_HEADER \
+    ((sizeof (pool_chunk) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+struct pool_large {
+    pool_large *prev;
+    pool_large *next;
+};
+
+typedef struct {
+    size_t in_use;     /* Bytes requested by Lua and not yet freed.   */
+    size_t peak;       /* Maximum value reached by in_use.             */
+    size_t reserved;   /* Bytes obtained from the system for chunks.   */
+    size_t allocs;     /* Number of new blocks handed out.             */
+    size_t frees;      /* Number of blocks given back.                 */
+    size_t reallocs;   /* Number of resizes of existing blocks.        */
+    size_t small;      /* Blocks served from the size classes.         */
+    size_t large;      /* Blocks served by the system allocator.       */
+    size_t released;   /* Number of chunks returned to the system.     */
+} pool_stats;
+
+typedef struct chsl_pool {
+    pool_chunk *partial[POOL_NCLASSES];  /* Chunks with room, by class. */
+    pool_chunk *full;      /* Chunks without room, of any class.         */
+    pool_chunk *spare;     /* Empty chunks.                              */
+    unsigned    nspare;
+    pool_large  large;     /* Sentinel of the list of large blocks.      */
+    pool_stats  stats;
+} chsl_pool;
+
+
+chsl_pool*
+chsl_pool_new (void)
+{
+    chsl_pool *pool = calloc (1, sizeof (chsl_pool));
+    if (pool)
+        pool->large.prev = pool->large.next = &pool->large;
+    return pool;
+}
+
+
+static inline void
+chunk_push (pool_chunk **list, pool_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = *list;
+    if (*list)
+        (*list)->prev = chunk;
+    *list = chunk;
+}
+
+static inline void
+chunk_unlink (pool_chunk **list, pool_chunk *chunk)
+{
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        *list = chunk->next;
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+}
+
+static inline int
+chunk_is_full (const pool_chunk *chunk)
+{
+    return chunk->free == NULL &&
+           chunk->bump + pool_class_size (chunk->cls) >
+           (char*) chunk + POOL_CHUNK_SIZE;
+}
+
+
+/*
+ * Maps a chunk aligned to its size: more than needed is mapped, and the
+ * pages before and after the aligned chunk are unmapped.
+ */
+static pool_chunk*
+chunk_map (void)
+{
+    size_t size = 2 * POOL_CHUNK_SIZE;
+    char *area, *chunk;
+
+    area = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return NULL;
+
+    chunk = (char*) (((uintptr_t) area + POOL_CHUNK_SIZE - 1) &
+                     ~((uintptr_t) POOL_CHUNK_SIZE - 1));
+    if (chunk > area)
+        munmap (area, chunk - area);
+    munmap (chunk + POOL_CHUNK_SIZE, area + size - chunk - POOL_CHUNK_SIZE);
+    return (pool_chunk*) chunk;
+}
+
+
+/* Obtains a chunk for a size class, reusing a spare one if possible. */
+static pool_chunk*
+chunk_get (chsl_pool *pool, unsigned c)
+{
+    pool_chunk *chunk;
+
+    if ((chunk = pool->spare) != NULL) {
+        chunk_unlink (&pool->spare, chunk);
+        pool->nspare--;
+    }
+    else {
+        if ((chunk = chunk_map ()) == NULL)
+            return NULL;
+        pool->stats.reserved += POOL_CHUNK_SIZE;
+    }
+
+    chunk->free = NULL;
+    chunk->bump = (char*) chunk + POOL_CHUNK_HEADER;
+    chunk->used = 0;
+    chunk->cls  = c;
+    chunk_push (&pool->partial[c], chunk);
+    return chunk;
+}
+
+
+/* Keeps an empty chunk as a spare, or returns it to the system. */
+static void
+chunk_put (chsl_pool *pool, pool_chunk *chunk)
+{
+    if (pool->nspare < POOL_SPARE_MAX) {
+        chunk_push (&pool->spare, chunk);
+        pool->nspare++;
+    }
+    else {
+        munmap (chunk, POOL_CHUNK_SIZE);
+        pool->stats.reserved -= POOL_CHUNK_SIZE;
+        pool->stats.released++;
+    }
+}
+
+
+static inline void*
+pool_small_alloc (chsl_pool *pool, size_t size)
+{
+    unsigned c = pool_class (size);
+    pool_chunk *chunk = pool->partial[c];
+    pool_free *block;
+
+    if (chunk == NULL && (chunk = chunk_get (pool, c)) == NULL)
+        return NULL;
+
+    if ((block = chunk->free) != NULL) {
+        chunk->free = block->next;
+    }
+    else {
+        block = (pool_free*) chunk->bump;
+        chunk->bump += pool_class_size (c);
+    }
+    chunk->used++;
+
+    if (chunk_is_full (chunk)) {
+        chunk_unlink (&pool->partial[c], chunk);
+        chunk_push (&pool->full, chunk);
+    }
+    return block;
+}
+
+
+/*
+ * Gives back a small block. Its class is taken from the chunk, which
+ * may differ from that of the size, see the shrinking in chsl_pool_alloc().
+ */
+static inline void
+pool_small_free (chsl_pool *pool, void *ptr)
+{
+    pool_chunk *chunk = pool_chunk_of (ptr);
+    pool_free *block = ptr;
+    int was_full = chunk_is_full (chunk);
+
+    block->next = chunk->free;
+    chunk->free = block;
+
+    if (--chunk->used == 0) {
+        chunk_unlink (was_full ? &pool->full : &pool->partial[chunk->cls],
+                      chunk);
+        chunk_put (pool, chunk);
+    }
+    else if (was_full) {
+        chunk_unlink (&pool->full, chunk);
+        chunk_push (&pool->partial[chunk->cls], chunk);
+    }
+}
+
+
+static void*
+pool_large_realloc (chsl_pool *pool, void *ptr, size_t nsize)
+{
+    pool_large *block = ptr ? ((pool_large*) ptr) - 1 : NULL;
+    pool_large *nblock;
+    int failed = 0;
+
+    if (block) {
+        block->prev->next = block->next;
+        block->next->prev = block->prev;
+    }
+
+    if ((nblock = realloc (block, sizeof (pool_large) + nsize)) == NULL) {
+        if (block == NULL)
+            return NULL;
+        nblock = block; /* Relink the old block, which is still valid. */
+        failed = 1;
+    }
+
+    nblock->prev = &pool->large;
+    nblock->next = pool->large.next;
+    nblock->next->prev = nblock;
+    pool->large.next = nblock;
+    return failed ? NULL : nblock + 1;
+}
+
+
+static void
+pool_large_free (chsl_pool *pool, void *ptr)
+{
+    pool_large *block = ((pool_large*) ptr) - 1;
+    (void) pool;
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    free (block);
+}
+
+
+/*
+ * Allocation function, with the semantics of lua_Alloc. The pool
+ * must be passed as the "ud" argument to lua_newstate().
+ */
+void*
+chsl_pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    chsl_pool *pool = ud;
+    void *nptr;
+
+    if (ptr == NULL)
+        osize = 0; /* osize encodes the type of object instead */
+
+    if (nsize == 0) {
+        if (ptr) {
+            if (osize <= POOL_SMALL_MAX)
+                pool_small_free (pool, ptr);
+            else
+                pool_large_free (pool, ptr);
+            pool->stats.in_use -= osize;
+            pool->stats.frees++;
+        }
+        return NULL;
+    }
+
+    if (ptr == NULL) {
+        if (nsize <= POOL_SMALL_MAX) {
+            nptr = pool_small_alloc (pool, nsize);
+            pool->stats.small++;
+        }
+        else {
+            nptr = pool_large_realloc (pool, NULL, nsize);
+            pool->stats.large++;
+        }
+        pool->stats.allocs++;
+    }
+    else if (osize <= POOL_SMALL_MAX && nsize <= POOL_SMALL_MAX) {
+        pool->stats.reallocs++;
+        if (pool_class (osize) == pool_class (nsize)) {
+            nptr = ptr;
+        }
+        else if ((nptr = pool_small_alloc (pool, nsize)) != NULL) {
+            memcpy (nptr, ptr, osize < nsize ? osize : nsize);
+            pool_small_free (pool, ptr);
+        }
+        else if (nsize < osize) {
+            /* Shrinking must not fail: keep using the bigger block. */
+            nptr = ptr;
+        }
+    }
+    else if (osize > POOL_SMALL_MAX && nsize > POOL_SMALL_MAX) {
+        pool->stats.reallocs++;
+        nptr = pool_large_realloc (pool, ptr, nsize);
+    }
+    else {
+        /* Moving a block between the size classes and the system. */
+        pool->stats.reallocs++;
+        nptr = (nsize <= POOL_SMALL_MAX) ? pool_small_alloc (pool, nsize)
+                                         : pool_large_realloc (pool, NULL, nsize);
+        if (nptr != NULL) {
+            memcpy (nptr, ptr, osize < nsize ? osize : nsize);
+            if (osize <= POOL_SMALL_MAX)
+                pool_small_free (pool, ptr);
+            else
+                pool_large_free (pool, ptr);
+        }
+    }
+
+    if (nptr == NULL)
+        return NULL; /* The old block, if any, is left untouched. */
+
+    pool->stats.in_use += nsize - osize;
+    if (pool->stats.in_use > pool->stats.peak)
+        pool->stats.peak = pool->stats.in_use;
+    return nptr;
+}
+
+
+/*
+ * Releases everything allocated from the pool at once, keeping up to
+ * POOL_SPARE_MAX chunks as spares. This must only be called when no Lua
+ * state using the pool is alive anymore.
+ */
+static void
+pool_reset (chsl_pool *pool)
+{
+    pool_chunk *chunk;
+    unsigned c;
+
+    assert (pool);
+
+    while (pool->large.next != &pool->large)
+        pool_large_free (pool, pool->large.next + 1);
+
+    for (c = 0; c < POOL_NCLASSES; c++) {
+        while ((chunk = pool->partial[c]) != NULL) {
+            chunk_unlink (&pool->partial[c], chunk);
+            chunk_put (pool, chunk);
+        }
+    }
+    while ((chunk = pool->full) != NULL) {
+        chunk_unlink (&pool->full, chunk);
+        chunk_put (pool, chunk);
+    }
+
+    pool->stats.in_use = 0;
+}
+
+
+void
+chsl_pool_free (chsl_pool *pool)
+{
+    pool_chunk *chunk;
+
+    if (pool == NULL)
+        return;
+
+    pool_reset (pool);
+    while ((chunk = pool->spare) != NULL) {
+        chunk_unlink (&pool->spare, chunk);
+        munmap (chunk, POOL_CHUNK_SIZE);
+    }
+    free (pool);
+}
+
+
+/*
+ * Pushes a table with the allocation statistics of a pool.
+ */
+void
+chsl_pool_pushstats (lua_State *L, chsl_pool *pool)
+{
+    assert (L);
+    assert (pool);
+
+    lua_createtable (L, 0, 12);
+#define STAT_ITEM(_name) \
+    lua_pushnumber (L, (lua_Number) pool->stats._name); \
+    lua_setfield (L, -2, #_name)
+    STAT_ITEM (in_use);
+    STAT_ITEM (peak);
+    STAT_ITEM (reserved);
+    STAT_ITEM (allocs);
+    STAT_ITEM (frees);
+    STAT_ITEM (reallocs);
+    STAT_ITEM (small);
+    STAT_ITEM (large);
+    STAT_ITEM (released);
+#undef STAT_ITEM
+    lua_pushnumber (L, POOL_SMALL_MAX);
+    lua_setfield (L, -2, "small_max");
+    lua_pushnumber (L, POOL_CHUNK_SIZE);
+    lua_setfield (L, -2, "chunk_size");
+    lua_pushnumber (L, POOL_SPARE_MAX);
+    lua_setfield (L, -2, "spare_max");
+}
@@ -0,0 +1,525 @@
+/***
+Translation of UTF-8 text to braille ASCII.
+
+Embossers expect text in *braille ASCII*: each byte selects one six-dot
+cell. A translator converts UTF-8 input to that encoding:
+
+ * ASCII characters are passed through unchanged. Runs of them are found
+   using SSE2 when available (or a word at a time otherwise), and a
+   string which is all ASCII is returned as-is, without copying it.
+ * Characters from the Unicode *Braille Patterns* block (U+2800–U+28FF)
+   are converted to the byte for the same cell, using a table of 64
+   bytes indexed by dot pattern. Dots 7 and 8 are ignored.
+ * Other characters are looked up in a table of code points, which can
+   map each one to any string.
+ * Characters not found anywhere are replaced by a configurable string.
+
+Bytes which are not valid UTF-8 are passed through, so documents which
+are already in the encoding expected by the device keep working. Input
+can be fed in pieces, a multi-byte sequence split between two calls to
+@{translate} is handled correctly.
+
+@module braille
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#define BRAILLE_MT "chisel.braille"
+
+#define BRAILLE_CELLS    64
+#define BRAILLE_MAX_OUT 255
+
+
+typedef struct {
+    uint32_t      code;     /* Zero for empty slots. */
+    unsigned      offset;   /* Offset in the output buffer. */
+    unsigned char length;
+} braille_entry;
+
+typedef struct {
+    char           cells[BRAILLE_CELLS];
+    char           unknown[BRAILLE_MAX_OUT];
+    unsigned char  unknown_len;
+
+    braille_entry *entries;    /* Open addressing, size is a power of two. */
+    unsigned       nentries;
+    unsigned       size;
+    char          *output;     /* Replacement strings. */
+    unsigned       output_len;
+
+    unsigned char  pending[4]; /* Incomplete sequence from the last call. */
+    unsigned char  npending;
+    lua_Number     nunknown;
+} braille_translator;
+
+
+static inline braille_translator*
+check_translator (lua_State *L, int index)
+{
+    return (braille_translator*) luaL_checkudata (L, index, BRAILLE_MT);
+}
+
+
+/*
+ * Returns the length of the run of ASCII characters at the start of
+ * the buffer.
+ */
+static size_t
+ascii_run (const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i*) (p + i)));
+        if (mask) {
+#if defined(__GNUC__)
+            return i + __builtin_ctz (mask);
+#else
+            break;
+#endif /* __GNUC__ */
+        }
+    }
+#else
+    for (; i + sizeof (uint64_t) <= n; i += sizeof (uint64_t)) {
+        uint64_t word;
+        memcpy (&word, p + i, sizeof (uint64_t));
+        if (word & UINT64_C (0x8080808080808080))
+            break;
+    }
+#endif /* __SSE2__ */
+
+    while (i < n && p[i] < 0x80)
+        i++;
+    return i;
+}
+
+
+/*
+ * Decodes the UTF-8 sequence at the start of the buffer. Returns the
+ * number of bytes used, zero if the sequence is incomplete (but valid
+ * so far), or -1 if the first byte does not start a valid sequence.
+ */
+static int
+utf8_decode (const unsigned char *p, size_t n, uint32_t *code)
+{
+    uint32_t c = p[0], min;
+    int len, i;
+
+    if (c < 0x80) {
+        *code = c;
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        len = 2; c &= 0x1F; min = 0x80;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3; c &= 0x0F; min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4; c &= 0x07; min = 0x10000;
+    } else {
+        return -1;
+    }
+
+    for (i = 1; i < len; i++) {
+        if ((size_t) i >= n)
+            return 0;
+        if ((p[i] & 0xC0) != 0x80)
+            return -1;
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return -1;
+
+    *code = c;
+    return len;
+}
+
+
+static braille_entry*
+braille_lookup (braille_entry *entries, unsigned size, uint32_t code)
+{
+    unsigned i = (code * 2654435761u) & (size - 1);
+    while (entries[i].code && entries[i].code != code)
+        i = (i + 1) & (size - 1);
+    return &entries[i];
+}
+
+
+static int
+braille_grow (braille_translator *t)
+{
+    unsigned size = t->size ? t->size * 2 : 64;
+    braille_entry *entries = calloc (size, sizeof (braille_entry));
+    unsigned i;
+
+    if (entries == NULL)
+        return 0;
+
+    for (i = 0; i < t->size; i++)
+        if (t->entries[i].code)
+            *braille_lookup (entries, size, t->entries[i].code) = t->entries[i];
+
+    free (t->entries);
+    t->entries = entries;
+    t->size = size;
+    return 1;
+}
+
+
+static int
+braille_add (braille_translator *t, uint32_t code, const char *str, size_t len)
+{
+    braille_entry *entry;
+    char *output;
+
+    if ((t->nentries + 1) * 2 > t->size && !braille_grow (t))
+        return 0;
+
+    if (len) {
+        if ((output = realloc (t->output, t->output_len + len)) == NULL)
+            return 0;
+        t->output = output;
+    }
+
+    entry = braille_lookup (t->entries, t->size, code);
+    if (entry->code == 0)
+        t->nentries++;
+
+    entry->code   = code;
+    entry->offset = t->output_len;
+    entry->length = (unsigned char) len;
+    memcpy (t->output + t->output_len, str, len);
+    t->output_len += len;
+    return 1;
+}
+
+
+static void
+translate_code (braille_translator *t, luaL_Buffer *b, uint32_t code)
+{
+    if (code >= 0x2800 && code <= 0x28FF) {
+        luaL_addchar (b, t->cells[code & (BRAILLE_CELLS - 1)]);
+        return;
+    }
+
+    if (t->nentries) {
+        const braille_entry *entry = braille_lookup (t->entries, t->size, code);
+        if (entry->code) {
+            luaL_addlstring (b, t->output + entry->offset, entry->length);
+            return;
+        }
+    }
+
+    luaL_addlstring (b, t->unknown, t->unknown_len);
+    t->nunknown++;
+}
+
+
+/*
+ * Translates the buffer, adding the result to "b". Returns the number of
+ * bytes at the end which form an incomplete sequence, and were not used.
+ */
+static size_t
+translate_buffer (braille_translator *t, luaL_Buffer *b,
+                  const unsigned char *p, size_t n)
+{
+    while (n) {
+        size_t run = ascii_run (p, n);
+        uint32_t code;
+        int len;
+
+        if (run) {
+            luaL_addlstring (b, (const char*) p, run);
+            p += run;
+            if (!(n -= run))
+                break;
+        }
+
+        /*
+         * Braille patterns are E2 A0..A3 80..BF, and the low six bits of
+         * the last byte are the dots 1-6 of the cell.
+         */
+        if (n >= 3 && p[0] == 0xE2) {
+            char *out = luaL_prepbuffsize (b, n / 3);
+            size_t i = 0;
+            while (n >= 3 && p[0] == 0xE2 && (p[1] & 0xFC) == 0xA0 &&
+                   (p[2] & 0xC0) == 0x80) {
+                out[i++] = t->cells[p[2] & (BRAILLE_CELLS - 1)];
+                p += 3;
+                n -= 3;
+            }
+            luaL_addsize (b, i);
+        }
+        if (n == 0 || *p < 0x80)
+            continue;
+
+        if ((len = utf8_decode (p, n, &code)) == 0)
+            return n;
+
+        if (len < 0) {
+            /* Not UTF-8: pass the byte through. */
+            luaL_addchar (b, *p);
+            len = 1;
+        } else {
+            translate_code (t, b, code);
+        }
+        p += len;
+        n -= len;
+    }
+    return 0;
+}
+
+
+static void
+check_output (lua_State *L, const char *what, size_t len)
+{
+    if (len > BRAILLE_MAX_OUT)
+        luaL_error (L, "%s: replacement string is too long "
+                    "(maximum is %d bytes)", what, BRAILLE_MAX_OUT);
+}
+
+
+/***
+Creates a translator.
+
+The table describing the translation may contain the following fields:
+
+ * `cells`: String of 64 bytes, the byte sent to the device for each
+   six-dot cell, indexed by dot pattern (dot 1 is the lowest bit). This
+   field is mandatory.
+ * `chars`: Table which maps characters (as code points or UTF-8
+   strings) to their replacements in braille ASCII.
+ * `unknown`: Replacement for characters which cannot be translated
+   (by default, a space).
+
+@function new
+@param spec Table describing the translation.
+@return A translator object.
+*/
+static int
+braille_new (lua_State *L)
+{
+    braille_translator *t;
+    const char *str;
+    size_t len;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+
+    t = lua_newuserdata (L, sizeof (braille_translator));
+    memset (t, 0, sizeof (braille_translator));
+    luaL_setmetatable (L, BRAILLE_MT);
+
+    lua_getfield (L, 1, "cells");
+    str = lua_tolstring (L, -1, &len);
+    if (str == NULL || len != BRAILLE_CELLS)
+        return luaL_argerror (L, 1, "'cells' must be a string of 64 bytes");
+    memcpy (t->cells, str, BRAILLE_CELLS);
+    lua_pop (L, 1);
+
+    lua_getfield (L, 1, "unknown");
+    str = luaL_optlstring (L, -1, " ", &len);
+    check_output (L, "unknown", len);
+    memcpy (t->unknown, str, len);
+    t->unknown_len = (unsigned char) len;
+    lua_pop (L, 1);
+
+    lua_getfield (L, 1, "chars");
+    if (lua_istable (L, -1)) {
+        lua_pushnil (L);
+        while (lua_next (L, -2)) {
+            uint32_t code = 0;
+
+            if (lua_type (L, -2) == LUA_TNUMBER) {
+                lua_Number n = lua_tonumber (L, -2);
+                if (n < 1 || n > 0x10FFFF)
+                    return luaL_error (L, "chars: invalid code point %f", n);
+                code = (uint32_t) n;
+            } else if (lua_type (L, -2) == LUA_TSTRING) {
+                str = lua_tolstring (L, -2, &len);
+                if (len == 0 || utf8_decode ((const unsigned char*) str, len,
+                                             &code) != (int) len)
+                    return luaL_error (L, "chars: key '%s' is not a single "
+                                       "UTF-8 character", str);
+            } else {
+                return luaL_error (L, "chars: keys must be numbers or strings");
+            }
+
+            if (code < 0x80)
+                return luaL_error (L, "chars: ASCII characters (code %d) are "
+                                   "always passed through", (int) code);
+
+            str = luaL_checklstring (L, -1, &len);
+            check_output (L, "chars", len);
+            if (!braille_add (t, code, str, len))
+                return luaL_error (L, "out of memory");
+            lua_pop (L, 1);
+        }
+    } else if (!lua_isnil (L, -1)) {
+        return luaL_argerror (L, 1, "'chars' must be a table");
+    }
+    lua_pop (L, 1);
+
+    return 1;
+}
+
+
+/***
+Translator objects.
+@section translator
+*/
+
+/***
+Translates a piece of UTF-8 text.
+
+When the text ends with an incomplete multi-byte sequence, it is kept
+and translated when the rest of it is passed in the next call.
+
+@function translator:translate
+@param data String to translate.
+@return Translated string.
+*/
+static int
+braille_translate (lua_State *L)
+{
+    braille_translator *t = check_translator (L, 1);
+    const unsigned char *p;
+    luaL_Buffer b;
+    size_t n, rest;
+
+    p = (const unsigned char*) luaL_checklstring (L, 2, &n);
+
+    /* Fast path: all ASCII, return the input string itself. */
+    if (t->npending == 0 && ascii_run (p, n) == n) {
+        lua_settop (L, 2);
+        return 1;
+    }
+
+    luaL_buffinitsize (L, &b, n);
+
+    /* Complete the sequence left over from the previous call. */
+    while (t->npending && n) {
+        uint32_t code;
+        int len;
+
+        t->pending[t->npending++] = *p++;
+        n--;
+
+        if ((len = utf8_decode (t->pending, t->npending, &code)) > 0) {
+            translate_code (t, &b, code);
+            t->npending = 0;
+        } else if (len < 0) {
+            /* Pass the first byte through, and retry with the others. */
+            unsigned char retry[sizeof (t->pending)];
+            size_t nretry = t->npending - 1;
+
+            luaL_addchar (&b, t->pending[0]);
+            memcpy (retry, t->pending + 1, nretry);
+            rest = translate_buffer (t, &b, retry, nretry);
+            memcpy (t->pending, retry + nretry - rest, rest);
+            t->npending = (unsigned char) rest;
+        }
+    }
+
+    rest = translate_buffer (t, &b, p, n);
+    if (rest) {
+        assert (t->npending == 0 && rest < sizeof (t->pending));
+        memcpy (t->pending, p + n - rest, rest);
+        t->npending = (unsigned char) rest;
+    }
+
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Finishes a translation.
+
+An incomplete multi-byte sequence left over from the last call to
+@{translator:translate} is not valid UTF-8, so it is returned unchanged.
+
+@function translator:flush
+@return String with the remaining output, which may be empty.
+*/
+static int
+braille_flush (lua_State *L)
+{
+    braille_translator *t = check_translator (L, 1);
+    lua_pushlstring (L, (const char*) t->pending, t->npending);
+    t->npending = 0;
+    return 1;
+}
+
+
+/***
+Number of characters which could not be translated so far.
+
+@function translator:unknown
+@return Number of characters replaced by the `unknown` string.
+*/
+static int
+braille_unknown (lua_State *L)
+{
+    lua_pushnumber (L, check_translator (L, 1)->nunknown);
+    return 1;
+}
+
+
+static int
+braille_gc (lua_State *L)
+{
+    braille_translator *t = check_translator (L, 1);
+    free (t->entries);
+    free (t->output);
+    t->entries = NULL;
+    t->output = NULL;
+    t->size = t->nentries = 0;
+    return 0;
+}
+
+
+static const luaL_Reg braille_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, braille_ ## _name }
+    REG_ITEM (translate),
+    REG_ITEM (flush),
+    REG_ITEM (unknown),
+#undef REG_ITEM
+    { "__gc", braille_gc },
+    { NULL, NULL }
+};
+
+static const luaL_Reg braille_funcs[] =
+{
+    { "new", braille_new },
+    { NULL, NULL }
+};
+
+
+int
+lua_braille_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, BRAILLE_MT);
+    luaL_setfuncs (L, braille_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, braille_funcs);
+    return 1;
+}
@@ -16,6 +16,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
 
 #define CHSL_VERSION "0.1"
 
@@ -27,6 +30,21 @@
 #define CHSL_REPL_MAXINPUT 512
 #endif /* !CHSL_REPL_MAXINPUT */
 
+#ifndef CHSL_PROFILE_RATE
+#define CHSL_PROFILE_RATE 1000
+#endif /* !CHSL_PROFILE_RATE */
+
+#ifndef CHSL_TRACE_SIZE
+#define CHSL_TRACE_SIZE 512
+#endif /* !CHSL_TRACE_SIZE */
+
+#ifndef CHSL_CANCEL_TIMEOUT
+#define CHSL_CANCEL_TIMEOUT 2
+#endif /* !CHSL_CANCEL_TIMEOUT */
+
+#define CHSL_STRINGIFY_(x) #x
+#define CHSL_STRINGIFY(x)  CHSL_STRINGIFY_(x)
+
 #define CHSL_REPL_PROMPT1 "(chisel) "
 #define CHSL_REPL_PROMPT2 "    ...) "
 
@@ -36,6 +54,18 @@
     "   -L PATH   Set library path (default: " CHSL_LIBDIR ")\n"   \
     "   -S NAME   Script to run (default: same as program name)\n" \
     "   -v        Be verbose. Use twice for debugging output\n"    \
+    "   -a        Use the system memory allocator for the Lua VM\n" \
+    "   -M PATH   Write a memory usage report at exit (JSON, or\n" \
+    "             a table in stderr if PATH is '-')\n"            \
+    "   -m N      With -M, attribute allocations to the Lua\n"     \
+    "             function running, sampled every N instructions\n" \
+    "   -P PATH   Sample the Lua call stack, and write the result\n" \
+    "             in folded stacks format (for flame graphs)\n"    \
+    "   -p N      With -P, sample every N instructions (default: "  \
+    CHSL_STRINGIFY (CHSL_PROFILE_RATE) ")\n"                       \
+    "   -T N      Keep the last N trace events, dumped on errors\n" \
+    "             (default: " CHSL_STRINGIFY (CHSL_TRACE_SIZE)       \
+    ", zero disables tracing)\n"                                   \
     "   -i        Run an interactive Lua interpreter.\n\n"         \
     "Useable options vary depending on the script being run.\n\n"
 
@@ -70,6 +100,62 @@ static char *g_libdir = CHSL_LIBDIR;
 static char *g_script = NULL;
 static int   g_loglvl = 0;
 static int   g_repl   = 0;
+static int   g_sysalloc = 0;
+
+
+/* Pool allocator for the Lua VM, see alloc.c */
+typedef struct chsl_pool chsl_pool;
+extern chsl_pool* chsl_pool_new       (void);
+extern void*      chsl_pool_alloc     (void*, void*, size_t, size_t);
+extern void       chsl_pool_free      (chsl_pool*);
+extern void       chsl_pool_pushstats (lua_State*, chsl_pool*);
+
+static chsl_pool *g_pool = NULL;
+
+/* System allocator, as used by luaL_newstate() */
+static void*
+chisel_sysalloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    (void) ud;
+    (void) osize;
+    if (nsize == 0) {
+        free (ptr);
+        return NULL;
+    }
+    return realloc (ptr, nsize);
+}
+
+/* Event tracing, see trace.c */
+extern int  chsl_trace_init (size_t);
+extern void chsl_trace_dump (FILE*);
+extern void chsl_trace_free (void);
+
+static long g_trace_size = CHSL_TRACE_SIZE;
+
+/* Memory accounting, see memstat.c */
+typedef struct chsl_memstat chsl_memstat;
+extern chsl_memstat* chsl_memstat_new    (lua_Alloc, void*, int);
+extern void*         chsl_memstat_alloc  (void*, void*, size_t, size_t);
+extern void          chsl_memstat_phase  (lua_State*, chsl_memstat*, const char*);
+extern void          chsl_memstat_sample (lua_State*, chsl_memstat*, lua_Debug*);
+extern void          chsl_memstat_report (lua_State*, chsl_memstat*, FILE*, int);
+extern void          chsl_memstat_detach (lua_State*, chsl_memstat*);
+extern void          chsl_memstat_free   (chsl_memstat*);
+
+/* Sampling profiler, see profile.c */
+typedef struct chsl_profile chsl_profile;
+extern chsl_profile* chsl_profile_new    (void);
+extern void          chsl_profile_sample (lua_State*, chsl_profile*);
+extern void          chsl_profile_write  (chsl_profile*, FILE*);
+extern void          chsl_profile_free   (chsl_profile*);
+
+static chsl_profile *g_profile      = NULL;
+static const char   *g_profile_path = NULL;
+static int           g_profile_rate = CHSL_PROFILE_RATE;
+
+static chsl_memstat *g_memstat      = NULL;
+static const char   *g_memstat_path = NULL;
+static int           g_memstat_rate = 0;
 
 
 static int
@@ -86,6 +172,281 @@ traceback (lua_State *L)
 }
 
 
+/*
+ * Returns the value of a monotonic clock, in seconds. Only differences
+ * between two values are meaningful, which is what scripts need to
+ * measure how long something took.
+ */
+static int
+chisel_now (lua_State *L)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    lua_pushnumber (L, (lua_Number) ts.tv_sec + ts.tv_nsec / 1e9);
+    return 1;
+}
+
+
+/*
+ * Suspends the process for the given number of seconds, which may have
+ * a fractional part. Sleeping continues after signals are handled.
+ */
+static int
+chisel_sleep (lua_State *L)
+{
+    lua_Number seconds = luaL_checknumber (L, 1);
+    struct timespec ts;
+
+    if (seconds > 0) {
+        ts.tv_sec = (time_t) seconds;
+        ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+        while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+    return 0;
+}
+
+
+/*
+ * Returns a table with statistics from the pool allocator, or nil when
+ * the system allocator is being used.
+ */
+static int
+chisel_allocstats (lua_State *L)
+{
+    if (g_pool)
+        chsl_pool_pushstats (L, g_pool);
+    else
+        lua_pushnil (L);
+    return 1;
+}
+
+
+/*
+ * Sets the name of the current phase of the program, which is used to
+ * attribute memory usage when running with -M. Does nothing otherwise.
+ */
+static int
+chisel_phase (lua_State *L)
+{
+    const char *name = luaL_checkstring (L, 1);
+    if (g_memstat)
+        chsl_memstat_phase (L, g_memstat, name);
+    return 0;
+}
+
+
+/*
+ * Both the profiler and the memory accounting use the count hook. It is
+ * installed with the smallest of the rates, and each one of them keeps
+ * a countdown of instructions to honor its own rate. The count is given
+ * some jitter on each call, which avoids aliasing with loops that run a
+ * fixed number of instructions per iteration.
+ */
+static int g_hook_rate = 0;
+static int g_hook_count = 0;
+static int g_profile_ticks = 0;
+static int g_memstat_ticks = 0;
+
+/* Signal handling is below; the hook must not undo a pending stop. */
+static volatile sig_atomic_t g_stop_pending;
+static void chisel_stop (lua_State *L, lua_Debug *ar);
+
+static void
+chisel_hook (lua_State *L, lua_Debug *ar)
+{
+    if (g_profile && (g_profile_ticks -= g_hook_count) <= 0) {
+        g_profile_ticks += g_profile_rate;
+        chsl_profile_sample (L, g_profile);
+    }
+    if (g_memstat && g_memstat_rate > 0 &&
+        (g_memstat_ticks -= g_hook_count) <= 0) {
+        g_memstat_ticks += g_memstat_rate;
+        chsl_memstat_sample (L, g_memstat, ar);
+    }
+
+    g_hook_count = g_hook_rate / 2 + 1 + rand () % g_hook_rate;
+    lua_sethook (L, chisel_hook, LUA_MASKCOUNT, g_hook_count);
+
+    /*
+     * A signal which arrived while sampling installed chisel_stop, which
+     * was just replaced. Checking after re-arming leaves no window: if the
+     * signal comes later, its handler installs chisel_stop again.
+     */
+    if (g_stop_pending)
+        lua_sethook (L, chisel_stop,
+                     LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
+
+static void
+chisel_sethook (lua_State *L)
+{
+    g_hook_rate = 0;
+    if (g_profile)
+        g_hook_rate = g_profile_rate;
+    if (g_memstat && g_memstat_rate > 0 &&
+        (g_hook_rate == 0 || g_memstat_rate < g_hook_rate))
+        g_hook_rate = g_memstat_rate;
+
+    if (g_hook_rate > 0)
+        lua_sethook (L, chisel_hook, LUA_MASKCOUNT, g_hook_count = g_hook_rate);
+    else
+        lua_sethook (L, NULL, 0, 0);
+}
+
+
+static void
+profile_write (lua_State *L)
+{
+    FILE *out;
+
+    if (!g_profile)
+        return;
+
+    if ((out = fopen (g_profile_path, "w")) != NULL) {
+        chsl_profile_write (g_profile, out);
+        fclose (out);
+    }
+    else {
+        fprintf (stderr, "could not write profile to '%s'\n", g_profile_path);
+    }
+    chsl_profile_free (g_profile);
+    g_profile = NULL;
+    chisel_sethook (L);
+}
+
+
+static void
+memstat_report (lua_State *L)
+{
+    FILE *out;
+
+    if (!g_memstat)
+        return;
+
+    if (strcmp (g_memstat_path, "-") == 0) {
+        chsl_memstat_report (L, g_memstat, stderr, 0);
+    }
+    else if ((out = fopen (g_memstat_path, "w")) != NULL) {
+        chsl_memstat_report (L, g_memstat, out, 1);
+        fclose (out);
+    }
+    else {
+        fprintf (stderr, "could not write memory report to '%s'\n",
+                 g_memstat_path);
+    }
+    chsl_memstat_detach (L, g_memstat);
+    chsl_memstat_free (g_memstat);
+    g_memstat = NULL;
+    chisel_sethook (L);
+}
+
+
+/*
+ * Scripts may finish by calling os.exit(), which does not close the
+ * Lua state: make sure that the reports are written in that case, too.
+ */
+static lua_State *g_exit_L = NULL;
+
+static void
+chisel_atexit (void)
+{
+    profile_write (g_exit_L);
+    memstat_report (g_exit_L);
+}
+
+
+/*
+ * Cancellation: CUPS sends SIGTERM to cancel a job, and users press
+ * Ctrl-C. The first signal is only noted, and a hook is installed which
+ * raises an error from the Lua code being run, so scripts unwind through
+ * their usual error handling and may leave the device in a known state
+ * (chisel.interrupted() tells them why). Handlers are installed without
+ * SA_RESTART, so a write blocked on a slow device returns right away.
+ * Cleaning up must take less than CHSL_CANCEL_TIMEOUT seconds: after that
+ * SIGALRM terminates the process, and so does a second signal.
+ */
+static volatile sig_atomic_t g_interrupted = 0;
+static volatile sig_atomic_t g_stop_pending = 0;
+static lua_State *g_signal_L = NULL;
+static int g_cancel_timeout = 0;
+
+int
+chsl_interrupted (void)
+{
+    return g_interrupted;
+}
+
+
+static void
+chisel_stop (lua_State *L, lua_Debug *ar)
+{
+    (void) ar;
+    g_stop_pending = 0;
+    chisel_sethook (L);  /* Restore the profiling hook, if any. */
+    luaL_error (L, "interrupted (%s)", strsignal (g_interrupted));
+}
+
+
+static void
+chisel_signal (int signum)
+{
+    g_interrupted = signum;
+    g_stop_pending = 1;
+    if (g_cancel_timeout > 0)
+        alarm (g_cancel_timeout);
+    lua_sethook (g_signal_L, chisel_stop,
+                 LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
+
+static void
+chisel_catch_signals (lua_State *L, int catch)
+{
+    struct sigaction sa;
+
+    memset (&sa, 0, sizeof (sa));
+    sigemptyset (&sa.sa_mask);
+    if (catch) {
+        sa.sa_handler = chisel_signal;
+        sa.sa_flags = SA_RESETHAND;
+        g_interrupted = 0;
+        g_stop_pending = 0;
+        g_signal_L = L;
+    }
+    else {
+        sa.sa_handler = SIG_DFL;
+    }
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+}
+
+
+/*
+ * Returns the number of the signal which interrupted the script, or nil
+ * if it was not interrupted.
+ */
+static int
+chisel_interrupted (lua_State *L)
+{
+    if (g_interrupted)
+        lua_pushinteger (L, g_interrupted);
+    else
+        lua_pushnil (L);
+    return 1;
+}
+
+
+static int
+chisel_panic (lua_State *L)
+{
+    luai_writestringerror ("PANIC: unprotected error in call to Lua API (%s)\n",
+                           lua_tostring (L, -1));
+    return 0;  /* return to Lua to abort */
+}
+
+
 static int
 chisel_lua_init (lua_State *L, int argc, char **argv)
 {
@@ -114,6 +475,16 @@ chisel_lua_init (lua_State *L, int argc, char **argv)
     lua_setfield   (L, -2, "pid");
     lua_pushnumber (L, getppid ());
     lua_setfield   (L, -2, "ppid");
+    lua_pushcfunction (L, chisel_now);
+    lua_setfield      (L, -2, "now");
+    lua_pushcfunction (L, chisel_sleep);
+    lua_setfield      (L, -2, "sleep");
+    lua_pushcfunction (L, chisel_allocstats);
+    lua_setfield      (L, -2, "allocstats");
+    lua_pushcfunction (L, chisel_phase);
+    lua_setfield      (L, -2, "phase");
+    lua_pushcfunction (L, chisel_interrupted);
+    lua_setfield      (L, -2, "interrupted");
 
 #if CHSL_CUPS
     lua_pushboolean (L, 1);
@@ -255,8 +626,10 @@ repl_docall (lua_State *L, int narg, int nres)
     lua_pushcfunction (L, traceback);      /* push traceback function */
     lua_insert (L, base);                  /* put it under chunk and args */
 
-    /* TODO Handle signals so Ctrl-C gets the user back to a prompt. */
+    /* Ctrl-C interrupts the chunk, and gets the user back to a prompt. */
+    chisel_catch_signals (L, 1);
     status = lua_pcall (L, narg, nres, base);
+    chisel_catch_signals (L, 0);
 
     lua_remove (L, base);                  /* remove traceback function */
     return status;
@@ -303,6 +676,15 @@ repl (lua_State *L)
 /* Additional, chisel-provided Lua libraries */
 extern int lua_fs_open (lua_State*);
 extern int lua_cups_open (lua_State*);
+extern int lua_trace_open (lua_State*);
+extern int lua_packedtree_open (lua_State*);
+extern int lua_braille_open (lua_State*);
+extern int lua_contract_open (lua_State*);
+extern int lua_formatter_open (lua_State*);
+extern int lua_hyphen_open (lua_State*);
+extern int lua_raster_open (lua_State*);
+extern int lua_v4command_open (lua_State*);
+extern int lua_tee_open (lua_State*);
 
 
 static int
@@ -317,6 +699,15 @@ lua_main (lua_State *L)
     luaL_openlibs (L);
     chisel_lua_init (L, argc, argv);
     luaL_requiref (L, "fs", lua_fs_open, 1);
+    luaL_requiref (L, "trace", lua_trace_open, 0);
+    luaL_requiref (L, "packedtree", lua_packedtree_open, 0);
+    luaL_requiref (L, "braille", lua_braille_open, 0);
+    luaL_requiref (L, "contract", lua_contract_open, 0);
+    luaL_requiref (L, "formatter", lua_formatter_open, 0);
+    luaL_requiref (L, "hyphen", lua_hyphen_open, 0);
+    luaL_requiref (L, "raster", lua_raster_open, 0);
+    luaL_requiref (L, "v4command", lua_v4command_open, 0);
+    luaL_requiref (L, "tee", lua_tee_open, 0);
 #if CHSL_CUPS
     /*
      * Last argument is zero to not define the module in the global
@@ -326,10 +717,15 @@ lua_main (lua_State *L)
 #endif /* CHSL_CUPS */
     lua_gc (L, LUA_GCRESTART, 0);
 
+    if (g_memstat)
+        chsl_memstat_phase (L, g_memstat, "script");
+
     if (g_repl && isatty (STDIN_FILENO)) {
         repl (L);
     }
     else {
+        g_cancel_timeout = CHSL_CANCEL_TIMEOUT;
+        chisel_catch_signals (L, 1);
         lua_pushcfunction (L, traceback);
         if (luaL_loadfile (L, g_repl ? NULL : g_script) != LUA_OK ||
             lua_pcall (L, 0, 0, -2) != LUA_OK)
@@ -382,10 +778,16 @@ int
 main (int argc, char *argv[])
 {
     lua_State *L = NULL;
+    lua_Alloc allocf = NULL;
+    void *allocud = NULL;
     int status;
 
-    while ((status = getopt (argc, argv, "viS:L:h")) != -1) {
+    while ((status = getopt (argc, argv, "viaM:m:P:p:T:S:L:h")) != -1) {
         switch (status) {
+            case 'a': /* Use the system allocator. */
+                g_sysalloc = 1;
+                break;
+
             case 'i': /* Interactive interpreter. */
                 g_repl = 1;
                 break;
@@ -394,6 +796,28 @@ main (int argc, char *argv[])
                 g_loglvl++;
                 break;
 
+            case 'M': /* Memory usage report. */
+                g_memstat_path = optarg;
+                break;
+
+            case 'm': /* Sampling rate for allocation sites. */
+                g_memstat_rate = atoi (optarg);
+                break;
+
+            case 'P': /* Profiler output. */
+                g_profile_path = optarg;
+                break;
+
+            case 'p': /* Profiler sampling rate. */
+                if ((g_profile_rate = atoi (optarg)) <= 0)
+                    g_profile_rate = CHSL_PROFILE_RATE;
+                break;
+
+            case 'T': /* Size of the trace ring. */
+                if ((g_trace_size = atol (optarg)) < 0)
+                    g_trace_size = 0;
+                break;
+
             case 'L': /* Set library path. */
                 g_libdir = optarg;
                 break;
@@ -440,13 +864,58 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
     }
 
-    if ((L = luaL_newstate ()) == NULL) {
+    if (!chsl_trace_init (g_trace_size)) {
+        fprintf (stderr,
+                 "%s: could not allocate trace buffer.\n",
+                 argv[0]);
+        exit (EXIT_FAILURE);
+    }
+    /* Also when scripts finish with os.exit(), e.g. from chisel.die() */
+    atexit (chsl_trace_free);
+
+    if (g_sysalloc)
+        allocf = chisel_sysalloc;
+    else if ((g_pool = chsl_pool_new ()) != NULL) {
+        allocf = chsl_pool_alloc;
+        allocud = g_pool;
+    }
+
+    /*
+     * Memory accounting wraps the allocator before the Lua state exists,
+     * so the memory used by the state itself is part of the "boot" phase
+     * and of the peak.
+     */
+    if (allocf && g_memstat_path) {
+        if ((g_memstat = chsl_memstat_new (allocf, allocud,
+                                           g_memstat_rate > 0)) == NULL) {
+            fprintf (stderr, "%s: could not set up memory accounting.\n", argv[0]);
+            exit (EXIT_FAILURE);
+        }
+        allocf = chsl_memstat_alloc;
+        allocud = g_memstat;
+    }
+
+    if (allocf && (L = lua_newstate (allocf, allocud)) != NULL)
+        lua_atpanic (L, chisel_panic);
+
+    if (L == NULL) {
         fprintf (stderr,
                  "%s: could not initialize Lua VM.\n",
                  argv[0]);
         exit (EXIT_FAILURE);
     }
 
+    if (g_profile_path && (g_profile = chsl_profile_new ()) == NULL) {
+        fprintf (stderr, "%s: could not set up the profiler.\n", argv[0]);
+        exit (EXIT_FAILURE);
+    }
+
+    if (g_memstat || g_profile) {
+        g_exit_L = L;
+        atexit (chisel_atexit);
+        chisel_sethook (L);
+    }
+
     /*
      * Push remanining option arguments, and do a protected call to
      * lua_main above, which will add them to the Lua environment.
@@ -462,8 +931,12 @@ main (int argc, char *argv[])
             msg = "(error object is not a string)";
         luai_writestringerror ("%s: ", argv[0]);
         luai_writestringerror ("%s\n", msg);
+        chsl_trace_dump (stderr);
     }
+    profile_write (L);
+    memstat_report (L);
     lua_close (L);
+    chsl_pool_free (g_pool);
     return (status == LUA_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
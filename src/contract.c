@@ -0,0 +1,828 @@
+/***
+Contracted braille translation.
+
+Translates text to contracted (grade 2) braille, using tables of rules.
+Each rule replaces a sequence of characters by a sequence of braille
+cells, written in braille ASCII, and may be restricted to a position in
+words (e.g. a rule for `"be"` which only applies at the beginning of a
+word). At each position of the input, the longest rule which can be
+applied is used, and characters for which no rule applies are copied to
+the output as they are.
+
+Tables also define the indicators used for capital letters (for a single
+letter, and for whole words in capitals), for numbers, and the letter
+sign which tells letters apart from digits after a number. A period or
+comma between two digits is part of the number.
+
+Rules are compiled with @{compile} into an *image*: a trie laid out in
+flat arrays, which uses offsets instead of pointers, and can be saved
+to a file and later used with @{open} without any further processing,
+as it is mapped in memory. The tables shipped with Chisel are compiled
+at build time, see `src/data/_contractions/` and the
+`compile-contractions` script.
+
+@module contract
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CONTRACT_MT      "chisel.contract"
+#define CONTRACT_MAGIC   "CHCT"
+#define CONTRACT_VERSION 2
+
+/* Conditions on the characters around a match. */
+#define BEFORE_SPACE  0x01
+#define BEFORE_LETTER 0x02
+#define AFTER_SPACE   0x04
+#define AFTER_LETTER  0x08
+
+
+/*
+ * Image layout. Everything is stored in native byte order; the version
+ * field doubles as a byte order check. Sections follow the header in
+ * this order, so that each one is aligned:
+ *
+ *   uint32_t       root[256]       Children of the root node.
+ *   contract_node  nodes[nnodes]   Node zero is the root.
+ *   uint32_t       edge_node[nedges]
+ *   contract_rule  rules[nrules]
+ *   unsigned char  edge_char[nedges]
+ *   char           bytes[nbytes]   Replacement strings.
+ */
+
+typedef struct {
+    uint32_t offset;    /* Offset in the replacement strings. */
+    uint8_t  length;    /* Zero for undefined indicators.     */
+    uint8_t  flags;
+    uint16_t unused;
+} contract_rule;
+
+typedef struct {
+    uint32_t edges;     /* First edge, edges are sorted by character. */
+    uint16_t nedges;
+    uint16_t nrules;
+    uint32_t rules;     /* First rule, in the order they were given.  */
+} contract_node;
+
+typedef struct {
+    char          magic[4];
+    uint32_t      version;
+    uint32_t      nnodes;
+    uint32_t      nedges;
+    uint32_t      nrules;
+    uint32_t      nbytes;
+    contract_rule capsign;
+    contract_rule capword;
+    contract_rule numsign;
+    contract_rule letsign;
+    contract_rule decpoint;
+    contract_rule digits[10];
+} contract_header;
+
+
+typedef struct {
+    const contract_header *header;
+    const uint32_t        *root;
+    const contract_node   *nodes;
+    const uint32_t        *edge_node;
+    const contract_rule   *rules;
+    const unsigned char   *edge_char;
+    const char            *bytes;
+
+    void                  *mapping;   /* Only for images from files. */
+    size_t                 size;
+} contract_table;
+
+
+static inline contract_table*
+check_table (lua_State *L, int index)
+{
+    return (contract_table*) luaL_checkudata (L, index, CONTRACT_MT);
+}
+
+
+static inline int
+is_upper (unsigned c)
+{
+    return c >= 'A' && c <= 'Z';
+}
+
+static inline int
+is_lower (unsigned c)
+{
+    return c >= 'a' && c <= 'z';
+}
+
+/* Bytes of multi-byte UTF-8 sequences are considered letters. */
+static inline int
+is_letter (unsigned c)
+{
+    return is_upper (c) || is_lower (c) || c >= 0x80;
+}
+
+static inline unsigned
+to_lower (unsigned c)
+{
+    return is_upper (c) ? c + ('a' - 'A') : c;
+}
+
+
+/*
+ * Image validation and setup.
+ */
+
+static const char*
+table_setup (contract_table *t, const void *image, size_t size)
+{
+    const contract_header *h = image;
+    const char *p = image;
+    size_t need;
+    uint32_t i;
+
+    if ((uintptr_t) image % sizeof (uint32_t))
+        return "misaligned image";
+    if (size < sizeof (contract_header) ||
+        memcmp (h->magic, CONTRACT_MAGIC, 4) != 0)
+        return "not a contraction table";
+    if (h->version != CONTRACT_VERSION)
+        return "unsupported version, or wrong byte order";
+
+    need = sizeof (contract_header) + 256 * sizeof (uint32_t)
+         + (size_t) h->nnodes * sizeof (contract_node)
+         + (size_t) h->nedges * (sizeof (uint32_t) + 1)
+         + (size_t) h->nrules * sizeof (contract_rule)
+         + h->nbytes;
+    if (need != size || h->nnodes == 0)
+        return "truncated or corrupt image";
+
+    t->header    = h;
+    t->root      = (const uint32_t*) (p += sizeof (contract_header));
+    t->nodes     = (const contract_node*) (p += 256 * sizeof (uint32_t));
+    t->edge_node = (const uint32_t*) (p += h->nnodes * sizeof (contract_node));
+    t->rules     = (const contract_rule*) (p += h->nedges * sizeof (uint32_t));
+    t->edge_char = (const unsigned char*) (p += h->nrules * sizeof (contract_rule));
+    t->bytes     = (p += h->nedges);
+
+    /* Check all indexes once, so translation does not need to. */
+    for (i = 0; i < 256; i++)
+        if (t->root[i] >= h->nnodes)
+            return "corrupt image (root)";
+    for (i = 0; i < h->nnodes; i++) {
+        const contract_node *n = &t->nodes[i];
+        if ((size_t) n->edges + n->nedges > h->nedges ||
+            (size_t) n->rules + n->nrules > h->nrules)
+            return "corrupt image (nodes)";
+    }
+    for (i = 0; i < h->nedges; i++)
+        if (t->edge_node[i] == 0 || t->edge_node[i] >= h->nnodes)
+            return "corrupt image (edges)";
+    for (i = 0; i < h->nrules; i++)
+        if ((size_t) t->rules[i].offset + t->rules[i].length > h->nbytes)
+            return "corrupt image (rules)";
+    for (i = 0; i < 14; i++)
+        if ((size_t) (&h->capsign)[i].offset + (&h->capsign)[i].length > h->nbytes)
+            return "corrupt image (indicators)";
+
+    return NULL;
+}
+
+
+/***
+Loads a compiled table from a file.
+
+The file is mapped in memory, and used as-is.
+
+@function open
+@param path Path to the file.
+@return A table object, or `nil` and an error message.
+*/
+static int
+contract_open (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    contract_table *t;
+    const char *err;
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+
+    if (fstat (fd, &st) != 0) {
+        close (fd);
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+    if (st.st_size == 0) {
+        close (fd);
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: empty file", path);
+        return 2;
+    }
+
+    mapping = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (mapping == MAP_FAILED) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+
+    t = lua_newuserdata (L, sizeof (contract_table));
+    memset (t, 0, sizeof (contract_table));
+    t->mapping = mapping;
+    t->size = st.st_size;
+    luaL_setmetatable (L, CONTRACT_MT);
+
+    if ((err = table_setup (t, mapping, st.st_size)) != NULL) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, err);
+        return 2;
+    }
+    return 1;
+}
+
+
+/***
+Uses a compiled table kept in a string.
+
+@function new
+@param image String with a table image, as returned by @{compile}.
+@return A table object.
+*/
+static int
+contract_new (lua_State *L)
+{
+    size_t size;
+    const char *image = luaL_checklstring (L, 1, &size);
+    contract_table *t;
+    const char *err;
+
+    t = lua_newuserdata (L, sizeof (contract_table));
+    memset (t, 0, sizeof (contract_table));
+    luaL_setmetatable (L, CONTRACT_MT);
+
+    if ((err = table_setup (t, image, size)) != NULL)
+        return luaL_argerror (L, 1, err);
+
+    /* Keep the string alive as long as the table. */
+    lua_createtable (L, 1, 0);
+    lua_pushvalue (L, 1);
+    lua_rawseti (L, -2, 1);
+    lua_setuservalue (L, -2);
+    return 1;
+}
+
+
+/*
+ * Compilation.
+ */
+
+typedef struct {
+    uint32_t      child;     /* First child, children sorted by character. */
+    uint32_t      sibling;
+    unsigned char ch;
+} build_node;
+
+typedef struct {
+    uint32_t      node;
+    contract_rule rule;
+} build_rule;
+
+typedef struct {
+    build_node *nodes;
+    uint32_t    nnodes;
+    build_rule *rules;
+    uint32_t    nrules;
+    int         strings;    /* Stack index of the replacement strings. */
+    int         nstrings;
+    uint32_t    nbytes;
+} build_state;
+
+
+static const struct {
+    const char *name;
+    uint8_t     flags;
+} build_opcodes[] = {
+    { "always",     0                            },
+    { "word",       BEFORE_SPACE  | AFTER_SPACE  },
+    { "begword",    BEFORE_SPACE  | AFTER_LETTER },
+    { "endword",    BEFORE_LETTER | AFTER_SPACE  },
+    { "midword",    BEFORE_LETTER | AFTER_LETTER },
+    { "begmidword", AFTER_LETTER                 },
+    { "midendword", BEFORE_LETTER                },
+    { NULL, 0 }
+};
+
+
+static uint32_t
+build_child (build_state *s, uint32_t parent, unsigned char ch)
+{
+    uint32_t *link = &s->nodes[parent].child;
+    uint32_t id;
+
+    while (*link && s->nodes[*link].ch < ch)
+        link = &s->nodes[*link].sibling;
+    if (*link && s->nodes[*link].ch == ch)
+        return *link;
+
+    id = s->nnodes++;
+    s->nodes[id].ch = ch;
+    s->nodes[id].sibling = *link;
+    *link = id;
+    return id;
+}
+
+
+/*
+ * Adds the replacement string at the top of the stack (which is popped)
+ * to the list of strings to be written in the image.
+ */
+static contract_rule
+build_string (lua_State *L, build_state *s, const char *what)
+{
+    contract_rule rule;
+    size_t len;
+
+    if (lua_type (L, -1) != LUA_TSTRING)
+        luaL_error (L, "%s: replacement must be a string", what);
+    if ((len = lua_rawlen (L, -1)) > 255)
+        luaL_error (L, "%s: replacement is too long", what);
+
+    memset (&rule, 0, sizeof (rule));
+    rule.offset = s->nbytes;
+    rule.length = (uint8_t) len;
+    s->nbytes += len;
+    lua_rawseti (L, s->strings, ++s->nstrings);
+    return rule;
+}
+
+
+/* Rules are sorted by node, keeping the order they were given in. */
+static int
+build_rule_cmp (const void *a, const void *b)
+{
+    const build_rule *ra = a, *rb = b;
+    if (ra->node != rb->node)
+        return ra->node < rb->node ? -1 : 1;
+    return ra->rule.unused < rb->rule.unused ? -1 : 1;
+}
+
+
+/***
+Compiles a set of rules.
+
+The rules are given in a table, which may contain:
+
+ * `capsign`: Indicator for a capital letter.
+ * `capword`: Indicator for a word written in capitals.
+ * `numsign`: Indicator for the start of a number.
+ * `letsign`: Indicator for a letter in the `a`-`j` range right after a
+   number.
+ * `decpoint`: Cells for a period between digits (a decimal point). When
+   not given, the rules for `"."` are used, like for commas.
+ * `digits`: Table with the cells for each digit, indexed by digit
+   (e.g. `["1"] = "A"`).
+ * Rules, in the array part. Each rule is a table with an *opcode*, the
+   sequence of characters to match, and its replacement, e.g.
+   `{ "begword", "con", "3" }`. Matching ignores case. The opcodes
+   are `always`, `word` (the match must be a whole word), `begword`,
+   `midword`, `endword` (at the beginning, middle, or end of a word),
+   `begmidword` and `midendword` (not at the end, or not at the
+   beginning of a word).
+
+When more than one rule matches the same characters, the first one
+which can be applied is used.
+
+@function compile
+@param rules Table with the rules.
+@return String with the compiled table, which can be passed to @{new},
+  or saved to a file and loaded with @{open}.
+*/
+static int
+contract_compile (lua_State *L)
+{
+    static const char *indicators[] = {
+        "capsign", "capword", "numsign", "letsign", "decpoint"
+    };
+    contract_header header;
+    contract_node *nodes;
+    uint32_t *order, *newid, *edge_node, root[256];
+    unsigned char *edge_char;
+    contract_rule *rules;
+    build_state s;
+    uint32_t i, j, nedges, nchars, maxnodes;
+    luaL_Buffer b;
+    int n;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    n = luaL_len (L, 1);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, CONTRACT_MAGIC, 4);
+    header.version = CONTRACT_VERSION;
+
+    /* Count characters in rules, to know the maximum number of nodes. */
+    for (nchars = 0, i = 1; i <= (uint32_t) n; i++) {
+        size_t len = 0;
+        lua_rawgeti (L, 1, i);
+        luaL_argcheck (L, lua_istable (L, -1), 1, "rules must be tables");
+        lua_rawgeti (L, -1, 2);
+        if (lua_tolstring (L, -1, &len) == NULL || len == 0)
+            return luaL_error (L, "rule %d: characters must be a non-empty "
+                               "string", (int) i);
+        nchars += len;
+        lua_pop (L, 2);
+    }
+    maxnodes = nchars + 1;
+
+    if (n > UINT16_MAX)
+        return luaL_error (L, "too many rules");
+
+    memset (&s, 0, sizeof (s));
+    s.nodes = lua_newuserdata (L, maxnodes * sizeof (build_node));
+    s.rules = lua_newuserdata (L, (n + 1) * sizeof (build_rule));
+    memset (s.nodes, 0, maxnodes * sizeof (build_node));
+    s.nnodes = 1;
+    lua_newtable (L);
+    s.strings = lua_gettop (L);
+
+    for (i = 0; i < sizeof (indicators) / sizeof (indicators[0]); i++) {
+        lua_getfield (L, 1, indicators[i]);
+        if (!lua_isnil (L, -1))
+            (&header.capsign)[i] = build_string (L, &s, indicators[i]);
+        else
+            lua_pop (L, 1);
+    }
+
+    lua_getfield (L, 1, "digits");
+    if (lua_istable (L, -1)) {
+        for (i = 0; i < 10; i++) {
+            char digit = '0' + i;
+            lua_pushlstring (L, &digit, 1);
+            lua_rawget (L, -2);
+            if (!lua_isnil (L, -1))
+                header.digits[i] = build_string (L, &s, "digits");
+            else
+                lua_pop (L, 1);
+        }
+    }
+    lua_pop (L, 1);
+
+    for (i = 1; i <= (uint32_t) n; i++) {
+        const unsigned char *chars;
+        const char *opcode;
+        uint32_t node = 0;
+        size_t len, k, op;
+        build_rule *r;
+
+        lua_rawgeti (L, 1, i);
+        lua_rawgeti (L, -1, 1);
+        opcode = lua_tostring (L, -1);
+        for (op = 0; build_opcodes[op].name; op++)
+            if (opcode && strcmp (opcode, build_opcodes[op].name) == 0)
+                break;
+        if (build_opcodes[op].name == NULL)
+            return luaL_error (L, "rule %d: invalid opcode '%s'", (int) i,
+                               opcode ? opcode : "?");
+        lua_pop (L, 1);
+
+        lua_rawgeti (L, -1, 2);
+        chars = (const unsigned char*) lua_tolstring (L, -1, &len);
+        for (k = 0; k < len; k++)
+            node = build_child (&s, node, (unsigned char) to_lower (chars[k]));
+        lua_pop (L, 1);
+
+        lua_rawgeti (L, -1, 3);
+        r = &s.rules[s.nrules++];
+        r->node = node;
+        r->rule = build_string (L, &s, "rule");
+        r->rule.flags = build_opcodes[op].flags;
+        r->rule.unused = (uint16_t) i;  /* Temporarily, for sorting. */
+        lua_pop (L, 1);
+    }
+
+
+    /*
+     * Number nodes in breadth-first order: the children of each node get
+     * consecutive numbers, and their edges can be stored together.
+     */
+    order = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    newid = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    nodes = lua_newuserdata (L, s.nnodes * sizeof (contract_node));
+    edge_node = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    edge_char = lua_newuserdata (L, s.nnodes);
+    rules = lua_newuserdata (L, (s.nrules + 1) * sizeof (contract_rule));
+
+    order[0] = 0;
+    newid[0] = 0;
+    for (i = 0, j = 1, nedges = 0; i < s.nnodes; i++) {
+        uint32_t child;
+        memset (&nodes[i], 0, sizeof (contract_node));
+        nodes[i].edges = nedges;
+        for (child = s.nodes[order[i]].child; child;
+             child = s.nodes[child].sibling) {
+            newid[child] = j;
+            order[j++] = child;
+            edge_node[nedges] = newid[child];
+            edge_char[nedges] = s.nodes[child].ch;
+            nedges++;
+            nodes[i].nedges++;
+        }
+    }
+    assert (j == s.nnodes);
+
+    memset (root, 0, sizeof (root));
+    for (i = 0; i < nodes[0].nedges; i++)
+        root[edge_char[i]] = edge_node[i];
+
+    for (i = 0; i < s.nrules; i++)
+        s.rules[i].node = newid[s.rules[i].node];
+    qsort (s.rules, s.nrules, sizeof (build_rule), build_rule_cmp);
+
+    for (i = 0; i < s.nrules; i++) {
+        contract_node *node = &nodes[s.rules[i].node];
+        if (node->nrules++ == 0)
+            node->rules = i;
+        rules[i] = s.rules[i].rule;
+        rules[i].unused = 0;
+    }
+
+    header.nnodes = s.nnodes;
+    header.nedges = nedges;
+    header.nrules = s.nrules;
+    header.nbytes = s.nbytes;
+
+    luaL_buffinit (L, &b);
+    luaL_addlstring (&b, (const char*) &header, sizeof (header));
+    luaL_addlstring (&b, (const char*) root, sizeof (root));
+    luaL_addlstring (&b, (const char*) nodes, s.nnodes * sizeof (contract_node));
+    luaL_addlstring (&b, (const char*) edge_node, nedges * sizeof (uint32_t));
+    luaL_addlstring (&b, (const char*) rules, s.nrules * sizeof (contract_rule));
+    luaL_addlstring (&b, (const char*) edge_char, nedges);
+    for (i = 1; i <= (uint32_t) s.nstrings; i++) {
+        size_t len;
+        const char *str;
+        lua_rawgeti (L, s.strings, i);
+        str = lua_tolstring (L, -1, &len);
+        luaL_addlstring (&b, str, len);
+        lua_pop (L, 1);
+    }
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/*
+ * Translation.
+ */
+
+static inline void
+add_rule (luaL_Buffer *b, const contract_table *t, const contract_rule *r)
+{
+    luaL_addlstring (b, t->bytes + r->offset, r->length);
+}
+
+
+static inline uint32_t
+find_child (const contract_table *t, uint32_t node, unsigned char ch)
+{
+    const contract_node *n = &t->nodes[node];
+    const unsigned char *chars = t->edge_char + n->edges;
+    unsigned lo = 0, hi = n->nedges;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (chars[mid] < ch)
+            lo = mid + 1;
+        else if (chars[mid] > ch)
+            hi = mid;
+        else
+            return t->edge_node[n->edges + mid];
+    }
+    return 0;
+}
+
+
+static inline int
+has_digit (const contract_header *h, unsigned c)
+{
+    return c >= '0' && c <= '9' && h->digits[c - '0'].length;
+}
+
+
+static inline int
+rule_applies (const contract_rule *r, int before, int after)
+{
+    return !((r->flags & BEFORE_SPACE  &&  before) ||
+             (r->flags & BEFORE_LETTER && !before) ||
+             (r->flags & AFTER_SPACE   &&  after ) ||
+             (r->flags & AFTER_LETTER  && !after ));
+}
+
+
+/***
+Translates text.
+
+@function table:translate
+@param text String to translate.
+@return Translated string.
+*/
+static int
+contract_translate (lua_State *L)
+{
+    const contract_table *t = check_table (L, 1);
+    const contract_header *h = t->header;
+    const unsigned char *s;
+    int number = 0, capsword = 0;
+    size_t n, i = 0;
+    luaL_Buffer b;
+
+    luaL_argcheck (L, h != NULL, 1, "invalid table");
+    s = (const unsigned char*) luaL_checklstring (L, 2, &n);
+    luaL_buffinitsize (L, &b, n);
+
+    while (i < n) {
+        const contract_rule *best = NULL;
+        size_t bestlen = 0, j;
+        unsigned c = s[i];
+        int before = i > 0 && is_letter (s[i - 1]);
+        uint32_t node;
+
+        if (!is_letter (c))
+            capsword = 0;
+
+        /*
+         * Numbers. A period or comma followed by a digit continues the
+         * number, so no number sign is repeated after it (e.g. "3.14").
+         */
+        if (has_digit (h, c)) {
+            if (!number)
+                add_rule (&b, t, &h->numsign);
+            add_rule (&b, t, &h->digits[c - '0']);
+            number = 1;
+            i++;
+            continue;
+        }
+        if (number && (c == '.' || c == ',') &&
+            i + 1 < n && has_digit (h, s[i + 1])) {
+            if (c == '.' && h->decpoint.length) {
+                add_rule (&b, t, &h->decpoint);
+                i++;
+                continue;
+            }
+        } else if (number) {
+            number = 0;
+            if (to_lower (c) >= 'a' && to_lower (c) <= 'j')
+                add_rule (&b, t, &h->letsign);
+        }
+
+        /* Capitals: whole words, or single letters. */
+        if (!before && is_letter (c)) {
+            size_t upper = 0;
+            capsword = 1;
+            for (j = i; j < n && is_letter (s[j]); j++) {
+                if (is_lower (s[j])) {
+                    capsword = 0;
+                    break;
+                }
+                upper += is_upper (s[j]);
+            }
+            capsword = capsword && upper > 1 && h->capword.length;
+            if (capsword)
+                add_rule (&b, t, &h->capword);
+        }
+        if (is_upper (c) && !capsword)
+            add_rule (&b, t, &h->capsign);
+
+        /*
+         * Longest match. Inside words with mixed case, matches stop before
+         * capital letters, which need their own indicator.
+         */
+        for (node = t->root[to_lower (c)], j = i + 1; node; j++) {
+            const contract_node *nd = &t->nodes[node];
+            if (nd->nrules) {
+                int after = j < n && is_letter (s[j]);
+                uint32_t k;
+                for (k = 0; k < nd->nrules; k++) {
+                    if (rule_applies (&t->rules[nd->rules + k], before, after)) {
+                        best = &t->rules[nd->rules + k];
+                        bestlen = j - i;
+                        break;
+                    }
+                }
+            }
+            if (j >= n || (is_upper (s[j]) && !capsword))
+                break;
+            node = find_child (t, node, (unsigned char) to_lower (s[j]));
+        }
+
+        if (best) {
+            add_rule (&b, t, best);
+            i += bestlen;
+        } else {
+            luaL_addchar (&b, c);
+            i++;
+        }
+    }
+
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Obtains information about a table.
+
+@function table:stats
+@return Table with the number of `nodes`, `edges`, `rules`, and the
+  `size` of the image in bytes.
+*/
+static int
+contract_stats (lua_State *L)
+{
+    const contract_table *t = check_table (L, 1);
+    luaL_argcheck (L, t->header != NULL, 1, "invalid table");
+
+    lua_createtable (L, 0, 4);
+    lua_pushinteger (L, t->header->nnodes);
+    lua_setfield (L, -2, "nodes");
+    lua_pushinteger (L, t->header->nedges);
+    lua_setfield (L, -2, "edges");
+    lua_pushinteger (L, t->header->nrules);
+    lua_setfield (L, -2, "rules");
+    lua_pushinteger (L, sizeof (contract_header) + 256 * sizeof (uint32_t)
+                        + t->header->nnodes * sizeof (contract_node)
+                        + t->header->nedges * (sizeof (uint32_t) + 1)
+                        + t->header->nrules * sizeof (contract_rule)
+                        + t->header->nbytes);
+    lua_setfield (L, -2, "size");
+    return 1;
+}
+
+
+static int
+contract_gc (lua_State *L)
+{
+    contract_table *t = check_table (L, 1);
+    if (t->mapping)
+        munmap (t->mapping, t->size);
+    memset (t, 0, sizeof (contract_table));
+    return 0;
+}
+
+
+static const luaL_Reg contract_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, contract_ ## _name }
+    REG_ITEM (translate),
+    REG_ITEM (stats),
+#undef REG_ITEM
+    { "__gc", contract_gc },
+    { NULL, NULL }
+};
+
+static const luaL_Reg contract_funcs[] =
+{
+#define REG_ITEM(_name)  { #_name, contract_ ## _name }
+    REG_ITEM (compile),
+    REG_ITEM (open),
+    REG_ITEM (new),
+#undef REG_ITEM
+    { NULL, NULL }
+};
+
+
+int
+lua_contract_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, CONTRACT_MT);
+    luaL_setfuncs (L, contract_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, contract_funcs);
+    return 1;
+}
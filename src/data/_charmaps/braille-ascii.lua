@@ -0,0 +1,35 @@
+#! /usr/bin/env lua
+--
+-- braille-ascii.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- North American Braille Computer Code, also known as "braille ASCII".
+-- This is the table used by default by most embossers.
+
+-- Byte sent for each six-dot cell, in Unicode order: the character at
+-- position N (starting at zero) is used for the cell U+2800+N, where each
+-- bit of N is one dot, from dot 1 (lowest bit) to dot 6.
+cells = " A1B'K2L@CIF/MSP\"E3H9O6R^DJG>NTQ,*5<-U8V.%[$+X!&;:4\\0Z7(_?W]#Y)="
+
+-- Characters which cannot be translated are left blank.
+unknown = " "
+
+-- Typographic characters which have an ASCII equivalent.
+chars = {
+	[0x00A0] = " ";    -- No-break space.
+	[0x00AD] = "";     -- Soft hyphen.
+	[0x2010] = "-";    -- Hyphen.
+	[0x2011] = "-";    -- Non-breaking hyphen.
+	[0x2013] = "-";    -- En dash.
+	[0x2014] = "--";   -- Em dash.
+	[0x2018] = "'";    -- Left single quotation mark.
+	[0x2019] = "'";    -- Right single quotation mark.
+	[0x201C] = "\"";   -- Left double quotation mark.
+	[0x201D] = "\"";   -- Right double quotation mark.
+	[0x2026] = "...";  -- Horizontal ellipsis.
+	[0x2028] = "\n";   -- Line separator.
+	[0x2029] = "\n";   -- Paragraph separator.
+}
@@ -10,6 +10,9 @@ manufacturer = "Index Braille"
 renderer     = "indexbraille-v4"
 throughput   = 4
 
+-- Text is sent in braille ASCII; see data/_charmaps/ for the tables.
+charmap      = "braille-ascii"
+
 options = {
 	pagesize = {
 		default = "Letter";
@@ -69,6 +72,38 @@ options = {
     double = 10.0;
   };
 
+	-- Copies are made by the device, see the "DMC" command. It needs a
+	-- default value for the number given in documents to be applied.
+	copies = {
+		default = 1;
+		minimum = 1;
+		maximum = 10000;
+	};
+
+	-- Margins, in characters and lines. They need a default value for
+	-- the values given in documents to be applied.
+	binding_margin = {
+		default = 0;
+		minimum = 0;
+	};
+	top_margin = {
+		default = 0;
+		minimum = 0;
+	};
+
+	-- Line breaking and pagination is left to the embosser by default.
+	wrap_text = {
+		default = false;
+	};
+	hyphenation = {
+		default = "none";
+	};
+
+	-- Text is sent as-is by default; the embosser may still translate it.
+	translation = {
+		default = "none";
+	};
+
 	-- The default "characters_per_line" and "lines_per_page" will be
 	-- calculated using the values for "dot_distance", "line_spacing"
 	-- and the size of the chosen paper -- Thus, they do not need to
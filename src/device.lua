@@ -20,9 +20,7 @@ local pairs    = pairs
 local pcall    = pcall
 local type     = type
 local isdir    = fs.isdir
-local listdir  = fs.listdir
-local imap     = lib.ml.imap
-local ifilter  = lib.ml.ifilter
+local readdir  = fs.dir
 local extend   = lib.ml.extend
 local callable = lib.ml.callable
 local rupdate  = lib.util.rupdate
@@ -79,6 +77,8 @@ local ppd_template = {
   -- chisel{Renderer,DeviceId} attributes (see comment below).
   [[*cupsVersion: 1.2]];
   [[*cupsFilter: "application/x-chisel-text 0 chiseltodev"]];
+  -- Copies are made by chiseltodev, which gets their number from CUPS.
+  [[*cupsManualCopies: True]];
   function (data)
     return sprintf ("*chiselDeviceId: \"%s\"", data.id)
   end;
@@ -354,6 +354,10 @@ local function calculate_iarea_and_paperdim (psize, media)
 end
 
 
+-- Translation tables, loaded on demand by device:create_translator().
+local charmaps = {}
+
+
 --- Device data base class.
 --
 -- The `device` is a class used to describe devices (printers, embossers).
@@ -456,6 +460,52 @@ local device = object:extend
   end;
 
 
+  --- Creates a translator for the text sent to the device.
+  --
+  -- The translation table is named by the `charmap` attribute of the
+  -- device data, and it is loaded from `data/_charmaps/<name>.lua`.
+  --
+  -- @return A translator created with `braille.new()`, or `nil` if the
+  -- device does not have a `charmap` (text is then sent as-is).
+  -- @function device:create_translator
+  --
+  create_translator = function (self)
+    local spec = self:get_charmap ()
+    if spec == nil then
+      return nil
+    end
+    return lib.braille.new (spec)
+  end;
+
+
+  --- Obtains the translation table for the text sent to the device.
+  --
+  -- @return Table with the contents of `data/_charmaps/<name>.lua` (the
+  -- `cells` string gives the byte sent for each six-dot cell), or `nil`
+  -- if the device does not have a `charmap`.
+  -- @function device:get_charmap
+  --
+  get_charmap = function (self)
+    if self.charmap == nil then
+      return nil
+    end
+
+    local spec = charmaps[self.charmap]
+    if spec == nil then
+      local path = sprintf ("%s/data/_charmaps/%s.lua", chisel.libdir,
+                            self.charmap)
+      spec = {}
+      local chunk, err = loadfile (path, "t", spec)
+      if chunk == nil then
+        error (err)
+      end
+      chunk ()
+      charmaps[self.charmap] = spec
+    end
+    return spec
+  end;
+
+
   --- Obtains supported media information.
   --
   -- @param name Name of the media, e.g. `"Letter"`, `"A4"`, or any other
@@ -562,6 +612,29 @@ local function is_valid_manufacturer (item)
          isdir (chisel.libdir .. "/data/" .. item)
 end
 
+-- Lists the subdirectories (or the files) of a directory under the data
+-- directory, skipping names which start with an underscore. Types are
+-- taken from the directory entries, and only symbolic links need a stat()
+-- to know whether they point to a directory.
+local function scan_data (path, want_dirs, fix_name)
+  local result = {}
+  path = chisel.libdir .. "/data/" .. path
+  local entries = readdir (path)
+  if entries == nil then
+    return result
+  end
+  for name, kind in entries do
+    if name:sub (1, 1) ~= "_" then
+      local is_dir = kind == "directory" or
+                     (kind == "link" and isdir (path .. "/" .. name) == true)
+      if is_dir == want_dirs then
+        result[#result + 1] = fix_name and fix_name (name) or name
+      end
+    end
+  end
+  return result
+end
+
 --- List supported devices and manufacturers.
 --
 -- @param manufacturer Omitting the argument, returns a list of all the
@@ -577,7 +650,7 @@ local list_devices
 function list_devices (manufacturer)
   if manufacturer == nil then
     -- List all manufacturers
-    return ifilter (listdir (chisel.libdir .. "/data"), is_valid_manufacturer)
+    return scan_data ("", true)
   elseif manufacturer == "*" then
     -- List all models of all manufacturers
     local result = {}
@@ -587,11 +660,6 @@ function list_devices (manufacturer)
     return result
   else
     -- List models for a particular manufacturer
-    local function is_valid_device_name (item)
-      return item:sub (1, 1) ~= "_" and
-             not isdir (chisel.libdir .. "/data/" .. manufacturer .. "/" .. item)
-    end
-
     local function fix_name (item)
       -- Prepend the manufacturer and remove the ".lua" suffix
       return manufacturer .. "/" .. item:sub (1, -5)
@@ -604,8 +672,7 @@ function list_devices (manufacturer)
 
     -- List files for the manufacturer directory, filter out invalid
     -- names, and prepare the names in a format suitable for returning.
-    local files = listdir (chisel.libdir .. "/data/" .. manufacturer)
-    return imap (fix_name, ifilter (files, is_valid_device_name))
+    return scan_data (manufacturer, false, fix_name)
   end
 end
 
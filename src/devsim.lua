@@ -0,0 +1,480 @@
+---
+-- Virtual embosser for the Index Braille V4 protocol.
+--
+-- Decodes the data streams written by the `indexbraille-v4` renderer, and
+-- lays out their contents in pages the way a device would, so rendering
+-- can be tested and benchmarked without a physical device (see the
+-- `devsim` script). Commands are escape sequences like `ESC DCH32;`, and
+-- the data between `ESC 0x01` and `ESC 0x02` is six-dot graphics.
+--
+-- Lines are wrapped when they are longer than `characters_per_line` minus
+-- the `binding_margin`, and each line (either text or graphics) takes one
+-- of the `lines_per_page` minus `top_margin` lines of a page. A new page
+-- is started when a line does not fit in the current one, and for each
+-- form feed.
+--
+-- Page images use the geometry of @{device:calculate_text_area}: text
+-- cells are `dot_distance + cell_spacing` wide, and lines of text are
+-- `2 * dot_distance + line_spacing` apart. Cells of graphics are
+-- `2 * dot_distance` wide, so dots are evenly spaced, and lines of
+-- graphics (three dots tall) are `line_spacing` apart.
+--
+-- @copyright 2012 Adrian Perez <aperez@igalia.com>
+-- @license Distributed under terms of the MIT license.
+--
+
+local tconcat  = table.concat
+local sfind    = string.find
+local ssub     = string.sub
+local sbyte    = string.byte
+local srep     = string.rep
+local mfloor   = math.floor
+local mceil    = math.ceil
+local u_to_mm  = lib.util.u_to_mm
+local tonumber = tonumber
+local ipairs   = ipairs
+local type     = type
+
+local M = {}
+
+
+--- Dot distances for each code of the `DGD` command, in millimeters.
+--
+local dot_distances = { [0] = 2.0; [1] = 2.5; [2] = 1.6 }
+
+
+--- Options set by each command, and functions which convert their
+-- arguments. Conversions return `nil` for invalid arguments.
+--
+local commands = {
+  DGD = { "dot_distance", function (v) return dot_distances[v] end };
+  DLS = { "line_spacing", function (v) return v > 0 and v / 10 or nil end };
+  DCH = { "characters_per_line", function (v) return v > 0 and v or nil end };
+  DLP = { "lines_per_page", function (v) return v > 0 and v or nil end };
+  DTM = { "top_margin", function (v) return v end };
+  DBI = { "binding_margin", function (v) return v end };
+  DMC = { "copies", function (v) return v > 0 and v or nil end };
+}
+
+
+--- Radius of the dots in page images, in millimeters.
+--
+local dot_radius = 0.5
+
+
+--- Simulated device.
+--
+-- Created with @{new}. The `on_page` attribute may be set to a function,
+-- which is called with the simulator and each page when it is complete.
+-- A page is a table with these fields:
+--
+-- * `number`: Page number, starting at one.
+-- * `top_margin`: Number of lines left empty at the top of the page.
+-- * `lines`: Array of lines, each one a table with the `mode` (`"text"`
+--   or `"graphics"`), the `data` (a string with a byte for each cell),
+--   and the `dot_distance`, `line_spacing`, `cell_spacing` and
+--   `binding_margin` used for the line.
+--
+-- @table simulator
+--
+local simulator = object:extend
+{
+  --- Statistics: numbers of `bytes` decoded, `pages`, `lines`, lines
+  -- `wrapped` because they were too long, `graphics` blocks, `commands`
+  -- (and in `command`, a count for each one), option `switches` which
+  -- changed a value, `redundant` commands which did not, `unknown` and
+  -- `invalid` commands, and the number of `copies` requested.
+  -- @field stats
+
+  on_page = function (self, page) end;
+
+  --- Decodes a piece of a data stream.
+  --
+  -- Streams can be fed in pieces split at any point.
+  --
+  -- @param data String with the data.
+  -- @return The simulator itself.
+  -- @function simulator:feed
+  --
+  feed = function (self, data)
+    local stats = self.stats
+    local pos, len = 1, #data
+
+    if self._start == nil then
+      self._start = chisel.now ()
+    end
+    stats.bytes = stats.bytes + len
+
+    while pos <= len do
+      local state = self._state
+
+      if state == "data" then
+        local stop = sfind (data, "[\027\n\r\f]", pos) or len + 1
+        if self._after_cr then
+          self._after_cr = false
+          if stop == pos and sbyte (data, pos) == 10 then
+            stop, pos = nil, pos + 1
+          end
+        end
+        if stop ~= nil then
+          if stop > pos then
+            self:put (ssub (data, pos, stop - 1))
+          end
+          if stop <= len then
+            local c = sbyte (data, stop)
+            if c == 27 then
+              self._state = "esc"
+            elseif c == 12 then
+              self:form_feed ()
+            else
+              self:end_line ()
+              self._after_cr = (c == 13)
+            end
+          end
+          pos = stop + 1
+        end
+
+      elseif state == "esc" then
+        local c = sbyte (data, pos)
+        pos = pos + 1
+        if c == 1 then
+          self:set_mode ("graphics")
+          self._state = "data"
+        elseif c == 2 then
+          self:set_mode ("text")
+          self._state = "data"
+        else
+          self._command = { string.char (c) }
+          self._state = "command"
+        end
+
+      else -- state == "command"
+        local stop = sfind (data, ";", pos, true)
+        local command = self._command
+        command[#command + 1] = ssub (data, pos, (stop or len + 1) - 1)
+        if stop then
+          self:command (tconcat (command))
+          self._command = nil
+          self._state = "data"
+          pos = stop + 1
+        else
+          pos = len + 1
+        end
+      end
+    end
+    return self
+  end;
+
+  --- Ends the data stream, completing the last page.
+  --
+  -- @return The statistics (see @{simulator.stats}). The `truncated`
+  -- field is set if the stream ended in the middle of a command, or in
+  -- graphics mode.
+  -- @function simulator:finish
+  --
+  finish = function (self)
+    if self._state ~= "data" or self._mode ~= "text" then
+      self.stats.truncated = true
+    end
+    if self._column > 0 then
+      self:end_line ()
+    end
+    if #self._page.lines > 0 then
+      self:end_page ()
+    end
+    return self.stats
+  end;
+
+  --- Runs a command (without the leading `ESC` and the final `;`).
+  -- @param command String with the command.
+  -- @function simulator:command
+  --
+  command = function (self, command)
+    local stats = self.stats
+    stats.commands = stats.commands + 1
+
+    local name, arg = command:match ("^(%u%u%u)(%d+)$")
+    local spec = name and commands[name]
+    if spec == nil then
+      if command:sub (1, 2) == "DV" then
+        name, self.version = "DV", command:sub (3)
+      else
+        stats.unknown = stats.unknown + 1
+        log_debug ("devsim: unknown command %q\n", command)
+        return
+      end
+    else
+      local option, value = spec[1], spec[2] (tonumber (arg))
+      if value == nil then
+        stats.invalid = stats.invalid + 1
+        log_debug ("devsim: invalid command %q\n", command)
+        return
+      end
+      if self.options[option] == value then
+        stats.redundant = stats.redundant + 1
+      else
+        stats.switches = stats.switches + 1
+        self.options[option] = value
+      end
+      if option == "copies" then
+        stats.copies = value
+      elseif #self._page.lines == 0 and self._page[option] ~= nil then
+        -- Layout changes apply to the current page while it is empty.
+        self._page[option] = value
+      end
+    end
+    stats.command[name] = (stats.command[name] or 0) + 1
+  end;
+
+  --- Switches between text and graphics mode.
+  -- @param mode Either `"text"` or `"graphics"`.
+  -- @function simulator:set_mode
+  --
+  set_mode = function (self, mode)
+    if self._column > 0 then
+      self:end_line ()
+    end
+    if mode == "graphics" and self._mode ~= "graphics" then
+      self.stats.graphics = self.stats.graphics + 1
+    end
+    self._mode = mode
+  end;
+
+  --- Obtains the number of cells which fit in a line.
+  -- @function simulator:line_width
+  --
+  line_width = function (self)
+    local options = self.options
+    if self._mode == "graphics" then
+      local cells = mfloor (self.paper.area_width / (2 * options.dot_distance))
+      local margin = mceil (options.binding_margin *
+                            (options.dot_distance + options.cell_spacing) /
+                            (2 * options.dot_distance))
+      return math.max (1, cells - margin)
+    end
+    return math.max (1, options.characters_per_line - options.binding_margin)
+  end;
+
+  --- Adds characters to the current line, wrapping it as needed.
+  -- @param data String with the characters.
+  -- @function simulator:put
+  --
+  put = function (self, data)
+    local width = self:line_width ()
+    local pos, len = 1, #data
+    while pos <= len do
+      if self._column >= width then
+        self:end_line ()
+        self.stats.wrapped = self.stats.wrapped + 1
+      end
+      local n = math.min (width - self._column, len - pos + 1)
+      local line = self._line
+      line[#line + 1] = ssub (data, pos, pos + n - 1)
+      self._column = self._column + n
+      pos = pos + n
+    end
+  end;
+
+  --- Ends the current line, starting a new page first if it does not fit.
+  -- @function simulator:end_line
+  --
+  end_line = function (self)
+    local options = self.options
+    local page = self._page
+    if #page.lines >= math.max (1, page.lines_per_page - page.top_margin) then
+      self:end_page ()
+      page = self._page
+    end
+
+    page.lines[#page.lines + 1] = {
+      mode           = self._mode;
+      data           = tconcat (self._line);
+      dot_distance   = options.dot_distance;
+      line_spacing   = options.line_spacing;
+      cell_spacing   = options.cell_spacing;
+      binding_margin = options.binding_margin;
+    }
+    self.stats.lines = self.stats.lines + 1
+    self._line, self._column = {}, 0
+  end;
+
+  --- Ends the current line, if it is not empty, and the current page.
+  -- @function simulator:form_feed
+  --
+  form_feed = function (self)
+    if self._column > 0 then
+      self:end_line ()
+    end
+    self:end_page ()
+  end;
+
+  --- Ends the current page, and starts a new one.
+  -- @function simulator:end_page
+  --
+  end_page = function (self)
+    local stats = self.stats
+    local page = self._page
+    stats.pages = stats.pages + 1
+    page.number = stats.pages
+    self:on_page (page)
+
+    -- Wait until the device would have embossed all the pages so far.
+    if self.throughput then
+      local due = self._start + stats.pages * stats.copies * 60 / self.throughput
+      chisel.sleep (due - chisel.now ())
+    end
+
+    self._page = {
+      lines          = {};
+      lines_per_page = self.options.lines_per_page;
+      top_margin     = self.options.top_margin;
+    }
+  end;
+
+  --- Creates an image of a page.
+  --
+  -- @param page Page, as passed to @{simulator.on_page}.
+  -- @param resolution Pixels per millimeter *(Optional, default 4)*.
+  -- @return Image, see @{raster}.
+  -- @function simulator:page_image
+  --
+  page_image = function (self, page, resolution)
+    resolution = resolution or 4
+    local paper, patterns = self.paper, self._patterns
+    local shapes = {}
+    local y = paper.top
+
+    for i, line in ipairs (page.lines) do
+      local dd, ls = line.dot_distance, line.line_spacing
+      if i == 1 then
+        y = y + page.top_margin * (2 * dd + ls)
+      end
+
+      local x = paper.left + line.binding_margin * (dd + line.cell_spacing)
+      local cell_width, line_height, row_height
+      if line.mode == "graphics" then
+        cell_width, line_height, row_height = 2 * dd, ls, ls / 3
+      else
+        cell_width, line_height, row_height = dd + line.cell_spacing,
+                                              2 * dd + ls, dd
+      end
+
+      for c = 1, #line.data do
+        local pattern = patterns[sbyte (line.data, c)] or 0
+        for dot = 0, 5 do
+          if mfloor (pattern / 2^dot) % 2 == 1 then
+            shapes[#shapes + 1] = {
+              kind = "circle"; fill = true;
+              x + (c - 1) * cell_width + mfloor (dot / 3) * dd,
+              y + (dot % 3) * row_height,
+              dot_radius,
+            }
+          end
+        end
+      end
+      y = y + line_height
+    end
+
+    local image = lib.raster.new (mceil (paper.width * resolution),
+                                  mceil (paper.height * resolution))
+    return image:paint (shapes, { x_scale = resolution; y_scale = resolution })
+  end;
+}
+
+
+--- Writes a page as text, like it would be embossed.
+--
+-- Lines are indented by the binding margin, and the top margin is left
+-- as empty lines.
+--
+-- @param page Page, as passed to @{simulator.on_page}.
+-- @return String with a line of text for each line of the page.
+--
+function M.page_text (page)
+  local result = {}
+  for _ = 1, page.top_margin do
+    result[#result + 1] = ""
+  end
+  for _, line in ipairs (page.lines) do
+    result[#result + 1] = srep (" ", line.binding_margin) .. line.data
+  end
+  result[#result + 1] = ""
+  return tconcat (result, "\n")
+end
+
+
+--- Creates a simulator for a device.
+--
+-- @param device Device data (see @{device.get}). Its default options are
+-- the initial state of the simulator, and its default paper size is used
+-- for page images.
+-- @param throughput When given, decoding is slowed down to emboss this
+-- number of pages per minute *(Optional)*.
+-- @return A @{simulator}.
+--
+function M.new (device, throughput)
+  local default = device.default
+  local options = {
+    dot_distance        = default.dot_distance;
+    line_spacing        = default.line_spacing;
+    cell_spacing        = default.cell_spacing or 3.5;
+    characters_per_line = default.characters_per_line;
+    lines_per_page      = default.lines_per_page;
+    top_margin          = default.top_margin or 0;
+    binding_margin      = default.binding_margin or 0;
+    copies              = 1;
+  }
+  if type (options.line_spacing) == "string" then
+    options.line_spacing = device.options.line_spacing[options.line_spacing]
+  end
+
+  -- Paper size and printable area, in millimeters.
+  local media = device:get_media_info (default.pagesize)
+  local paper = {
+    width      = u_to_mm (media.width);
+    height     = u_to_mm (media.height);
+    left       = u_to_mm (media.left_margin);
+    top        = u_to_mm (media.top_margin);
+    area_width = u_to_mm (media.right_margin - media.left_margin);
+  }
+
+  -- Dot pattern for each byte. Lowercase letters (and the characters which
+  -- follow them in ASCII) are the same as their uppercase counterparts.
+  local patterns = {}
+  local charmap = device:get_charmap ()
+  if charmap ~= nil and charmap.cells ~= nil then
+    for i = 1, #charmap.cells do
+      patterns[sbyte (charmap.cells, i)] = i - 1
+    end
+    for c = 0x60, 0x7E do
+      if patterns[c] == nil then
+        patterns[c] = patterns[c - 0x20]
+      end
+    end
+  end
+
+  return simulator:clone {
+    device     = device;
+    throughput = throughput;
+    options    = options;
+    paper      = paper;
+    stats      = {
+      bytes = 0; pages = 0; lines = 0; wrapped = 0; graphics = 0;
+      commands = 0; switches = 0; redundant = 0; unknown = 0; invalid = 0;
+      copies = 1; command = {};
+    };
+
+    _patterns = patterns;
+    _state    = "data";
+    _mode     = "text";
+    _line     = {};
+    _column   = 0;
+    _page     = {
+      lines          = {};
+      lines_per_page = options.lines_per_page;
+      top_margin     = options.top_margin;
+    };
+  }
+end
+
+return M
@@ -9,7 +9,11 @@
 
 local M = {}
 local tinsert = table.insert
-local strsplit = lib.ml.split
+local setmetatable = setmetatable
+local rawset = rawset
+local tconcat = table.concat
+local pairs, ipairs, next = pairs, ipairs, next
+local render_tree, render_packed -- Defined below.
 
 --- Base element.
 -- @section base_element
@@ -28,6 +32,10 @@ local strsplit = lib.ml.split
 -- * `data`: Arbitrary data attached to the element. Usually leaf elements
 --   (like [text](#Text_element)) use this to store their associated data.
 --
+-- * `kind`: Type of the node, shared by all the elements cloned from the
+--   same prototype (`"document"`, `"part"`, `"text"`...). It is used to
+--   pick the renderer functions for the node, see @{render_tree}.
+--
 -- @table element
 --
 M.element = object:extend
@@ -185,11 +193,13 @@ M.element = object:extend
 --
 M.document = M.element:extend
 {
+	kind = "document";
+
 	--- Renders a document.
 	-- @param renderer Output @{renderer}.
 	-- @function document:render
 	render = function (self, renderer)
-		self:walk ("document", renderer)
+		render_tree (self, renderer)
 	end;
 }
 
@@ -206,13 +216,17 @@ M.document = M.element:extend
 --
 M.part = M.element:extend
 {
+  kind = "part";
+
   --- Renders a part.
+  --
+  -- The options of the part are set in the renderer before rendering its
+  -- children, and the options active before are restored afterwards.
+  --
   -- @param renderer Output @{renderer}.
   -- @function part:render
   render = function (self, renderer)
-    local saved_options = renderer:get_options ()
-    self:walk ("part", renderer:set_options (self.options))
-    renderer:set_options (saved_options)
+    render_tree (self, renderer)
   end;
 }
 
@@ -228,11 +242,13 @@ M.part = M.element:extend
 --
 M.text = M.element:extend
 {
+	kind = "text";
+
 	--- Renders text.
 	-- @param renderer Output @{renderer}.
 	-- @function text:render
 	render = function (self, renderer)
-		self:walk ("text", renderer)
+		render_tree (self, renderer)
 	end;
 }
 
@@ -250,11 +266,13 @@ M.text = M.element:extend
 --
 M.graphics = M.element:extend
 {
+  kind = "graphics";
+
   --- Renders text as braille graphics.
   -- @param renderer Output @{renderer}.
   -- @function graphics:render
   render = function (self, renderer)
-    self:walk ("graphics", renderer)
+    render_tree (self, renderer)
   end;
 }
 
@@ -284,32 +302,546 @@ M.graphics = M.element:extend
 --
 M.raw = M.element:extend
 {
+	kind = "raw";
+
+	--- Checks whether the raw data applies to the output of a renderer.
+	-- @param renderer Output @{renderer}.
+	-- @return Whether the `output` attribute matches the renderer.
+	-- @function raw:matches
+	matches = function (self, renderer)
+		local slash = self.output:find ("/", 1, true)
+
+		if slash == nil then
+			-- No slash: match on renderer name.
+			return self.output == renderer.name
+		elseif self.output:sub (slash + 1) == "*" then
+			-- Model is a wildcard: match on the manufacturer name.
+			local prefix = self.output:sub (1, slash)
+			return renderer.device.id:sub (1, #prefix) == prefix
+		else
+			-- Model is not a wildcard: match on the whole device name.
+			return self.output == renderer.device.id
+		end
+	end;
+
 	--- Renders raw data.
 	-- @param renderer Output @{renderer}.
 	-- @function raw:render
 	render = function (self, renderer)
-		local dev = strsplit (self.output, "/", 1)
-		local matched = false
-
-		if #dev == 1 then
-		  -- Could not split on the slash: match on renderer name.
-		  matched = self.output == renderer.name
-		elseif #dev == 2 then
-			-- Splitted on the slash: match on the device name.
-			if dev[2] == "*" then
-				-- Model is a wildcard: match on the manufacturer name.
-				local prefix = dev[1] .. "/"
-				matched = renderer.device.id:sub (1, #prefix) == prefix
+		if self:matches (renderer) then
+			renderer:write (self.data)
+		end
+	end;
+}
+
+
+--- Raw data from a file.
+--
+-- Like a @{raw} element, but the data is the contents of a file, which
+-- is written by the renderer when the document is rendered (see
+-- @{renderer:write_file}). This avoids loading big blobs of data in
+-- memory, as they are copied straight from the file to the output when
+-- possible.
+--
+-- **Attributes:**
+--
+-- * `output`: Name of the output the data applies to, as for @{raw}.
+-- * `path`: Path of the file.
+--
+-- @table rawfile
+--
+M.rawfile = M.raw:extend
+{
+	kind = "rawfile";
+
+	--- Renders the contents of the file.
+	-- @param renderer Output @{renderer}.
+	-- @function rawfile:render
+	render = function (self, renderer)
+		if self:matches (renderer) then
+			renderer:write_file (self.path)
+		end
+	end;
+}
+
+
+--- Optimization passes
+-- @section optimization_passes
+
+--- Names of the optimization passes, in the order they are applied.
+--
+-- * `drop_raw`: Removes @{raw} and @{rawfile} elements which do not match
+--   the output of the renderer.
+-- * `dedupe_options`: Removes options of @{part} elements which have the
+--   same value as the inherited ones, and replaces parts which are left
+--   without options by their children.
+-- * `flatten_parts`: Merges parts which only contain another part.
+-- * `merge_text`: Merges adjacent @{text} elements.
+--
+-- @table passes
+--
+M.passes = { "drop_raw", "dedupe_options", "flatten_parts", "merge_text" }
+
+local function copy_options (options, extra)
+	local r = {}
+	if options ~= nil then
+		for key, value in pairs (options) do r[key] = value end
+	end
+	if extra ~= nil then
+		for key, value in pairs (extra) do r[key] = value end
+	end
+	return r
+end
+
+-- Elements of a kind which may be modified by the passes: those which
+-- use the default render() method of the kind.
+local function is_plain (node, kind)
+	return node.kind == kind and node.render == M[kind].render
+end
+
+--- Optimizes a document tree before rendering it.
+--
+-- The tree is modified in place. Passes can be disabled by setting them
+-- to `false` in the `passes` table, e.g. `{ merge_text = false }`. The
+-- options in effect when the document starts are taken from the device
+-- of the renderer (`renderer.device.default`, if any) and the options
+-- of the document.
+--
+-- @param doc Document element. Packed trees are not supported.
+-- @param renderer Output @{renderer} which will be used for rendering.
+-- @param passes Table of passes to enable or disable *(Optional)*.
+-- @return Table with the number of elements removed by each pass, and
+-- the number of part `options` removed by `dedupe_options`.
+-- @function optimize
+--
+function M.optimize (doc, renderer, passes)
+	local enabled = {}
+	for _, name in ipairs (M.passes) do
+		enabled[name] = not passes or passes[name] ~= false
+	end
+	local stats = { options = 0 }
+	for _, name in ipairs (M.passes) do
+		stats[name] = 0
+	end
+
+	-- Top-down: remove redundant options, computing the options which
+	-- each element inherits. Elements are collected in pre-order.
+	local device = renderer.device
+	local inherited = { [doc] = copy_options (device and device.default,
+	                                          doc.options) }
+	local order = {}
+	local stack = { doc }
+	while #stack > 0 do
+		local node = stack[#stack]
+		stack[#stack] = nil
+		order[#order+1] = node
+
+		local options = inherited[node]
+		for _, child in ipairs (node.children or {}) do
+			if is_plain (child, "part") and child.options ~= nil then
+				if enabled.dedupe_options then
+					for key, value in pairs (child.options) do
+						if options[key] == value then
+							child.options[key] = nil
+							stats.options = stats.options + 1
+						end
+					end
+				end
+				inherited[child] = copy_options (options, child.options)
 			else
-				-- Model is not a wildcard: match on the whole device name.
-				matched = self.output == renderer.device.id
+				inherited[child] = options
 			end
+			stack[#stack+1] = child
 		end
-		if matched then
-			renderer:write (self.data)
+	end
+
+	-- Bottom-up: rebuild the lists of children, so the children of an
+	-- element are always done before the element itself.
+	for i = #order, 1, -1 do
+		local node = order[i]
+		if node.children ~= nil then
+			local children = {}
+			local text = nil -- Pieces of the last text element.
+
+			local function flush_text ()
+				if text ~= nil and #text > 1 then
+					children[#children] = M.text:clone { data = tconcat (text) }
+				end
+				text = nil
+			end
+
+			local function append (child)
+				if enabled.merge_text and is_plain (child, "text") then
+					if text ~= nil then
+						text[#text+1] = child.data
+						stats.merge_text = stats.merge_text + 1
+						return
+					end
+					text = { child.data }
+				else
+					flush_text ()
+				end
+				children[#children+1] = child
+			end
+
+			for _, child in ipairs (node.children) do
+				if enabled.drop_raw and (is_plain (child, "raw") or
+				                         is_plain (child, "rawfile")) and
+				   not child:matches (renderer) then
+					stats.drop_raw = stats.drop_raw + 1
+				elseif enabled.dedupe_options and is_plain (child, "part") and
+				       next (child.options or {}) == nil then
+					stats.dedupe_options = stats.dedupe_options + 1
+					for _, grandchild in ipairs (child.children or {}) do
+						append (grandchild)
+					end
+				elseif enabled.flatten_parts and is_plain (child, "part") and
+				       child.children ~= nil and #child.children == 1 and
+				       is_plain (child.children[1], "part") then
+					local inner = child.children[1]
+					inner.options = copy_options (child.options, inner.options)
+					stats.flatten_parts = stats.flatten_parts + 1
+					append (inner)
+				else
+					append (child)
+				end
+			end
+			flush_text ()
+			node.children = children
+		end
+	end
+
+	return stats
+end
+
+
+--- Rendering
+-- @section rendering
+
+-- Node kinds rendered by render_tree() itself, using the enter and exit
+-- functions of the renderer. Nodes of other kinds are rendered by calling
+-- their own render() method.
+local walk_kinds = { "document", "part", "text", "graphics" }
+
+-- Dispatch tables of the renderers, see M.compile().
+local compiled = setmetatable ({}, { __mode = "k" })
+
+--- Compiles the dispatch table for a renderer.
+--
+-- The dispatch table maps each node kind to the `begin_<kind>` and
+-- `end_<kind>` functions of the renderer, so they do not need to be
+-- looked up for each node. Compiled tables are cached, and this only
+-- needs to be called explicitly if the functions of a renderer are
+-- replaced after it has been used to render a document.
+--
+-- @param renderer Output @{renderer}.
+-- @return Dispatch table.
+-- @function compile
+--
+function M.compile (renderer)
+	local dispatch = {}
+	for _, kind in ipairs (walk_kinds) do
+		dispatch[kind] = {
+			enter   = renderer["begin_" .. kind];
+			exit    = renderer["end_" .. kind];
+			options = (kind == "part");
+		}
+	end
+	compiled[renderer] = dispatch
+	return dispatch
+end
+
+--- Renders a (sub)tree.
+--
+-- This does the same as calling @{element:walk} for each node, but the
+-- tree is traversed iteratively using an explicit stack, so there is no
+-- limit in how deeply elements can be nested, and the renderer functions
+-- are taken from its compiled dispatch table (see @{compile}). Elements
+-- which override their render() method, or whose kind is not known (like
+-- @{raw} elements), are rendered by calling their render() method.
+--
+-- @param root Element at the root of the tree.
+-- @param renderer Output @{renderer}.
+-- @function render_tree
+--
+function render_tree (root, renderer)
+	if root._tree ~= nil then
+		return render_packed (root, renderer)
+	end
+
+	local dispatch = compiled[renderer] or M.compile (renderer)
+	local nodes, positions, options = {}, {}, {}
+	local top = 0
+	local node = root
+
+	while true do
+		if node ~= nil then
+			-- Enter the node, pushing it to the stack. The root is always
+			-- entered: its render() method may be the one calling us.
+			local entry = dispatch[node.kind]
+			if entry == nil or (node ~= root and
+			                    node.render ~= M[node.kind].render) then
+				node:render (renderer)
+			else
+				if entry.options then
+					options[top + 1] = renderer:get_options ()
+					renderer:set_options (node.options)
+				end
+				if entry.enter ~= nil then
+					entry.enter (renderer, node)
+				end
+				top = top + 1
+				nodes[top], positions[top] = node, 0
+			end
+		end
+
+		if top == 0 then
+			return
+		end
+
+		-- Continue with the next child of the node at the top of the
+		-- stack or, if there are no more, leave the node.
+		local parent = nodes[top]
+		local children = parent.children
+		local position = positions[top] + 1
+		if children ~= nil and children[position] ~= nil then
+			positions[top] = position
+			node = children[position]
+		else
+			local entry = dispatch[parent.kind]
+			if entry.exit ~= nil then
+				entry.exit (renderer, parent)
+			end
+			if entry.options then
+				renderer:set_options (options[top])
+				options[top] = nil
+			end
+			nodes[top] = nil
+			top = top - 1
+			node = nil
+		end
+	end
+end
+M.render_tree = render_tree
+
+
+--- Packed trees
+-- @section packed_trees
+
+-- Attributes of views which are read from (or written to) the packed
+-- tree, instead of being stored in the view itself.
+local view_getters = {
+	data    = function (tree, id) return tree:data (id) end;
+	output  = function (tree, id) return tree:output (id) end;
+	path    = function (tree, id) return tree:data (id) end; -- rawfile
+	options = function (tree, id) return tree:options (id) end;
+	children = function (tree, id)
+		local children = {}
+		local child = tree:first (id)
+		while child ~= nil do
+			children[#children+1] = M.view (tree, child)
+			child = tree:next (child)
+		end
+		return children
+	end;
+}
+
+local view_setters = {
+	options = function (tree, id, value) tree:set_options (id, value) end;
+	children = function (tree, id, value)
+		error ("children of packed elements cannot be replaced")
+	end;
+}
+
+-- Methods of views which replace those of the element prototypes.
+local view_methods = {
+	has_children = function (self)
+		return self._tree:first (self._id) ~= nil
+	end;
+
+	has_child = function (self, element)
+		return element._tree == self._tree and
+		       self._tree:parent (element._id) == self._id
+	end;
+
+	child = function (self, index)
+		if index == nil then
+			return self.children
+		end
+		local child = self._tree:first (self._id)
+		for _ = 2, index do
+			if child == nil then
+				break
+			end
+			child = self._tree:next (child)
+		end
+		return child and M.view (self._tree, child)
+	end;
+
+	del_child = function (self, element)
+		if type (element) == "number" then
+			element = self:child (element)
+		end
+		if element ~= nil and self:has_child (element) then
+			self._tree:unlink (element._id)
+		end
+		return self
+	end;
+
+	add_child = function (self, element, position)
+		local id
+		if element._tree == self._tree then
+			id = element._id
+		else
+			id = M.pack (element, self._tree)._id
 		end
+		self._tree:append (self._id, id, position)
+		return self
 	end;
 }
 
+-- Metatables for the views of each kind of node, created on demand.
+local view_meta = setmetatable ({}, { __index = function (t, kind)
+	local proto = M[kind]
+	local meta = {
+		__index = function (self, key)
+			local getter = view_getters[key]
+			if getter ~= nil then
+				return getter (self._tree, self._id)
+			end
+			local method = view_methods[key]
+			if method ~= nil then
+				return method
+			end
+			return proto[key]
+		end;
+
+		__newindex = function (self, key, value)
+			local setter = view_setters[key]
+			if setter ~= nil then
+				setter (self._tree, self._id, value)
+			else
+				rawset (self, key, value)
+			end
+		end;
+	}
+	t[kind] = meta
+	return meta
+end })
+
+--- Obtains a view of a node of a packed tree.
+--
+-- A view is an object which behaves like an element of the kind of the
+-- node, so the usual element API can be used with packed trees. Note that
+-- views are created on demand: two views of the same node are different
+-- objects. Views have two additional attributes, `_tree` and `_id`.
+--
+-- @param tree A tree created with `packedtree.new()`.
+-- @param id Node identifier.
+-- @return An element.
+-- @function view
+--
+function M.view (tree, id)
+	return setmetatable ({ _tree = tree, _id = id }, view_meta[tree:kind (id)])
+end
+
+--- Converts an element, and all its descendants, into a packed tree.
+--
+-- @param element Root element.
+-- @param tree Tree where the nodes are added (optional, by default a new
+-- tree is created).
+-- @return A view of the root element in the packed tree.
+-- @function pack
+--
+function M.pack (element, tree)
+	tree = tree or lib.packedtree.new ()
+
+	local function pack_node (node)
+		local id = tree:node (node.kind, node.data or node.path, node.output)
+		if node.options ~= nil then
+			tree:set_options (id, node.options)
+		end
+		if node.children ~= nil then
+			for _, child in ipairs (node.children) do
+				tree:append (id, pack_node (child))
+			end
+		end
+		return id
+	end
+
+	return M.view (tree, pack_node (element))
+end
+
+-- Renders a packed (sub)tree. This does the same as render_tree(), but
+-- reads the structure directly from the packed tree, and creates views
+-- only for the nodes being visited.
+function render_packed (root, renderer)
+	local dispatch = compiled[renderer] or M.compile (renderer)
+	local tree = root._tree
+	local root_id = root._id
+	local ids, views, options = {}, {}, {}
+	local top = 0
+	local id = root_id
+
+	while true do
+		local kind, data, output, node_options, first = tree:get (id)
+		local view = setmetatable ({ _tree = tree, _id = id, data = data,
+		                             output = output, options = node_options },
+		                           view_meta[kind])
+		local entry = dispatch[kind]
+
+		if entry == nil then
+			view:render (renderer)
+			first = nil
+		else
+			if entry.options then
+				options[top + 1] = renderer:get_options ()
+				renderer:set_options (view.options)
+			end
+			if entry.enter ~= nil then
+				entry.enter (renderer, view)
+			end
+		end
+
+		if first ~= nil then
+			top = top + 1
+			ids[top], views[top] = id, view
+			id = first
+		else
+			-- Leave the node, and all the ancestors for which it was the
+			-- last child, until a next sibling is found.
+			if entry ~= nil then
+				if entry.exit ~= nil then
+					entry.exit (renderer, view)
+				end
+				if entry.options then
+					renderer:set_options (options[top + 1])
+				end
+			end
+			while true do
+				if id == root_id then
+					return
+				end
+				local next_id = tree:next (id)
+				if next_id ~= nil then
+					id = next_id
+					break
+				end
+				local parent = views[top]
+				entry = dispatch[tree:kind (ids[top])]
+				if entry.exit ~= nil then
+					entry.exit (renderer, parent)
+				end
+				if entry.options then
+					renderer:set_options (options[top])
+				end
+				id = ids[top]
+				ids[top], views[top], options[top] = nil, nil, nil
+				top = top - 1
+			end
+		end
+	end
+end
+
 return M
 
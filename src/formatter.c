@@ -0,0 +1,620 @@
+/***
+Word wrapping and pagination of text.
+
+Embossers break lines when they run out of space, no matter where that
+happens in a word, and the host has no way of knowing where pages end.
+A formatter lays out text itself: words are placed on lines of the width
+available for text, lines which do not fit are wrapped between words
+(words longer than a whole line are split), and a form feed is written
+when a page is full. Tabs are expanded to spaces, and line endings are
+normalized: both `CR LF` and a lone `CR` end a line like `LF` does, and
+a form feed in the input starts a new page (unless the current one is
+still empty).
+
+The width of the text area is `characters_per_line - binding_margin`,
+and its height is `lines_per_page - top_margin`: the device is still
+told about the margins, and leaves them empty by itself.
+
+Words which do not fit in the rest of a line can be hyphenated, when a
+@{hyphen} table is given: as much of the word as possible is left in the
+line, followed by a hyphen. Words which already contain a hyphen can also
+be broken after it.
+
+Text can be fed in pieces. Spaces at the end of a line are not written,
+and neither is a word at the end of a piece, which may continue in the
+next one, until @{formatter:flush} is called. Runs of characters inside
+words are found using SSE2, when available.
+
+@module formatter
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#define FORMATTER_MT "chisel.formatter"
+#define HYPHEN_MT    "chisel.hyphen"
+
+#define CHAR_FF '\f'
+
+/* Defined in the hyphen module. */
+struct hyphen_table;
+extern int hyphen_points (const struct hyphen_table*, const unsigned char*,
+                          size_t, unsigned char*);
+
+/* Longest word which can be hyphenated, must match the hyphen module. */
+#define HYPHEN_MAX_WORD 62
+
+
+typedef struct {
+    lua_Integer characters_per_line;
+    lua_Integer lines_per_page;
+    lua_Integer binding_margin;
+    lua_Integer top_margin;
+    lua_Integer tab_size;
+
+    size_t      width;       /* Columns available for text.         */
+    size_t      height;      /* Lines available for text, per page. */
+
+    size_t      col;         /* Column in the current line.         */
+    size_t      line;        /* Lines written in the current page.  */
+    size_t      spaces;      /* Spaces not written yet.             */
+    int         wrapped;     /* The line was started by wrapping.   */
+    int         cr;          /* The last character was a CR.        */
+    int         blank_page;  /* Nothing written in the current page. */
+
+    char       *word;        /* Word which continues in the next piece. */
+    size_t      word_len;
+    size_t      word_size;
+
+    const struct hyphen_table *hyphen; /* Referenced by the uservalue. */
+
+    lua_Number  lines;       /* Totals, for stats(). */
+    lua_Number  pages;
+    lua_Number  wraps;
+    lua_Number  splits;
+    lua_Number  hyphenations;
+} formatter;
+
+
+static inline formatter*
+check_formatter (lua_State *L, int index)
+{
+    return (formatter*) luaL_checkudata (L, index, FORMATTER_MT);
+}
+
+
+static inline int
+is_separator (unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == CHAR_FF;
+}
+
+
+/*
+ * Returns the length of the run of characters at the start of the buffer
+ * which are part of a word. All separators are below 0x21, so blocks are
+ * checked for bytes in that range, and only those are looked at one by
+ * one: other control characters are considered part of words.
+ */
+static size_t
+word_run (const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i space = _mm_set1_epi8 (' ');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*) (p + i));
+        int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_min_epu8 (v, space), v));
+        while (mask) {
+            int k = __builtin_ctz (mask);
+            if (is_separator (p[i + k]))
+                return i + k;
+            mask &= mask - 1;
+        }
+    }
+#endif /* __SSE2__ && __GNUC__ */
+
+    for (; i < n; i++)
+        if (is_separator (p[i]))
+            break;
+    return i;
+}
+
+
+static void
+add_spaces (luaL_Buffer *b, size_t n)
+{
+    while (n) {
+        size_t chunk = (n < LUAL_BUFFERSIZE) ? n : LUAL_BUFFERSIZE;
+        memset (luaL_prepbuffsize (b, chunk), ' ', chunk);
+        luaL_addsize (b, chunk);
+        n -= chunk;
+    }
+}
+
+
+static void
+end_line (formatter *f, luaL_Buffer *b, int wrapped)
+{
+    f->lines++;
+    f->blank_page = 0;
+    if (++f->line >= f->height) {
+        luaL_addchar (b, CHAR_FF);
+        f->line = 0;
+        f->pages++;
+        f->blank_page = 1;
+    } else {
+        luaL_addchar (b, '\n');
+    }
+    f->col = 0;
+    f->spaces = 0;
+    f->wrapped = wrapped;
+}
+
+
+static void
+end_page (formatter *f, luaL_Buffer *b)
+{
+    if (f->blank_page)
+        return;
+    luaL_addchar (b, CHAR_FF);
+    f->line = 0;
+    f->col = 0;
+    f->spaces = 0;
+    f->wrapped = 0;
+    f->pages++;
+    f->blank_page = 1;
+}
+
+
+static inline int
+is_ascii_letter (unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+/*
+ * Finds the longest part of a word which fits in "room" columns when
+ * followed by a hyphen. Returns its length, or zero if the word cannot
+ * be broken there. Punctuation around the word is kept out of the
+ * hyphenation lookup. If the part ends with a hyphen in the word itself,
+ * "*mark" is set to zero, and another one must not be added.
+ */
+static size_t
+hyphen_break (const formatter *f, const char *word, size_t len, size_t room,
+              int *mark)
+{
+    const unsigned char *w = (const unsigned char*) word;
+    unsigned char points[HYPHEN_MAX_WORD + 1];
+    size_t start, end, k, best = 0;
+
+    /* Hyphens in the word: the break goes after them. */
+    for (k = (room < len - 1) ? room : len - 1; k >= 2; k--) {
+        if (w[k - 1] == '-' && is_ascii_letter (w[k - 2]) &&
+            is_ascii_letter (w[k])) {
+            best = k;
+            *mark = 0;
+            break;
+        }
+    }
+
+    if (f->hyphen == NULL || room < 2)
+        return best;
+
+    for (start = 0; start < len && !is_ascii_letter (w[start]); start++)
+        ;
+    for (end = len; end > start && !is_ascii_letter (w[end - 1]); end--)
+        ;
+    if (end - start > HYPHEN_MAX_WORD ||
+        !hyphen_points (f->hyphen, w + start, end - start, points))
+        return best;
+
+    for (k = end - start - 1; k > 0; k--) {
+        if (points[k] && start + k + 1 <= room) {
+            if (start + k > best) {
+                best = start + k;
+                *mark = 1;
+            }
+            break;
+        }
+    }
+    return best;
+}
+
+
+static void
+place_word (formatter *f, luaL_Buffer *b, const char *word, size_t len)
+{
+    /* Break the word at hyphenation points, or move it to the next line. */
+    while (f->col + f->spaces + len > f->width) {
+        size_t used = f->col + f->spaces;
+        size_t part = 0;
+        int mark = 1;
+
+        if (used < f->width && (f->hyphen != NULL || memchr (word, '-', len)))
+            part = hyphen_break (f, word, len, f->width - used, &mark);
+
+        if (part) {
+            add_spaces (b, f->spaces);
+            luaL_addlstring (b, word, part);
+            if (mark)
+                luaL_addchar (b, '-');
+            end_line (f, b, 1);
+            f->hyphenations++;
+            word += part;
+            len -= part;
+        } else if (f->col > 0) {
+            end_line (f, b, 1);
+            f->wraps++;
+        } else {
+            break;
+        }
+    }
+
+    /* Spaces are dropped after wrapping, and when wider than a line. */
+    if (f->wrapped || f->col + f->spaces >= f->width)
+        f->spaces = 0;
+    add_spaces (b, f->spaces);
+    f->col += f->spaces;
+    f->spaces = 0;
+
+    if (len > f->width - f->col)
+        f->splits++;
+    while (len > f->width - f->col) {
+        size_t part = f->width - f->col;
+        luaL_addlstring (b, word, part);
+        word += part;
+        len -= part;
+        end_line (f, b, 1);
+    }
+
+    luaL_addlstring (b, word, len);
+    f->col += len;
+    f->wrapped = 0;
+    f->blank_page = 0;
+}
+
+
+static void
+flush_word (formatter *f, luaL_Buffer *b)
+{
+    if (f->word_len) {
+        place_word (f, b, f->word, f->word_len);
+        f->word_len = 0;
+    }
+}
+
+
+static int
+save_word (formatter *f, const unsigned char *p, size_t n)
+{
+    if (f->word_len + n > f->word_size) {
+        size_t size = f->word_size ? f->word_size : 64;
+        char *word;
+        while (size < f->word_len + n)
+            size *= 2;
+        if ((word = realloc (f->word, size)) == NULL)
+            return 0;
+        f->word = word;
+        f->word_size = size;
+    }
+    memcpy (f->word + f->word_len, p, n);
+    f->word_len += n;
+    return 1;
+}
+
+
+/*
+ * Sets the hyphenation table from the "hyphenator" field of the table at
+ * "index": nil keeps the current one, and false removes it. The formatter
+ * at "self" keeps a reference to the table in its uservalue.
+ */
+static void
+set_hyphenator (lua_State *L, formatter *f, int self, int index)
+{
+    lua_getfield (L, index, "hyphenator");
+    if (lua_isnil (L, -1)) {
+        lua_pop (L, 1);
+        return;
+    }
+
+    if (lua_toboolean (L, -1)) {
+        f->hyphen = luaL_checkudata (L, -1, HYPHEN_MT);
+    } else {
+        f->hyphen = NULL;
+        lua_pop (L, 1);
+        lua_pushnil (L);
+    }
+
+    lua_createtable (L, 1, 0);
+    lua_insert (L, -2);
+    lua_rawseti (L, -2, 1);
+    lua_setuservalue (L, self);
+}
+
+
+static void
+set_geometry (lua_State *L, formatter *f, int index)
+{
+    static const struct {
+        const char *name;
+        size_t      offset;
+        lua_Integer minimum;
+    } fields[] = {
+#define FIELD(_name, _min)  { #_name, offsetof (formatter, _name), _min }
+        FIELD (characters_per_line, 1),
+        FIELD (lines_per_page,      1),
+        FIELD (binding_margin,      0),
+        FIELD (top_margin,          0),
+        FIELD (tab_size,            1),
+#undef FIELD
+    };
+    lua_Integer value[5];
+    unsigned i;
+
+    luaL_checktype (L, index, LUA_TTABLE);
+
+    for (i = 0; i < 5; i++) {
+        lua_Integer *field = (lua_Integer*) ((char*) f + fields[i].offset);
+        lua_getfield (L, index, fields[i].name);
+        value[i] = luaL_optinteger (L, -1, *field);
+        lua_pop (L, 1);
+        if (value[i] < fields[i].minimum)
+            luaL_error (L, "%s = %d is out of range", fields[i].name,
+                        (int) value[i]);
+    }
+
+    if (value[0] <= value[2])
+        luaL_error (L, "binding_margin = %d leaves no space for text",
+                    (int) value[2]);
+    if (value[1] <= value[3])
+        luaL_error (L, "top_margin = %d leaves no space for text",
+                    (int) value[3]);
+
+    for (i = 0; i < 5; i++)
+        *(lua_Integer*) ((char*) f + fields[i].offset) = value[i];
+
+    f->width  = (size_t) (f->characters_per_line - f->binding_margin);
+    f->height = (size_t) (f->lines_per_page - f->top_margin);
+
+    /* The line may be over already, if it was made shorter. */
+    if (f->line >= f->height)
+        f->line = f->height - 1;
+}
+
+
+/***
+Creates a formatter.
+
+@function new
+@param area Table with the `characters_per_line`, `lines_per_page`,
+  `binding_margin` and `top_margin` options, which define the area used
+  for text, and optionally the `tab_size` (8 by default) and a
+  `hyphenator` (a table from the @{hyphen} module). The first two are
+  mandatory, margins are zero if not given.
+@return A formatter object.
+*/
+static int
+formatter_new (lua_State *L)
+{
+    formatter *f;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    f = lua_newuserdata (L, sizeof (formatter));
+    memset (f, 0, sizeof (formatter));
+    f->tab_size = 8;
+    f->blank_page = 1;
+    luaL_setmetatable (L, FORMATTER_MT);
+
+    set_geometry (L, f, 1);
+    set_hyphenator (L, f, lua_gettop (L), 1);
+    return 1;
+}
+
+
+/***
+Formatter objects.
+@section formatter
+*/
+
+/***
+Changes the area used for text.
+
+Text already written is not changed, the new area is used from the
+current position onwards.
+
+@function formatter:configure
+@param area Table with any of the fields accepted by @{new}. Options
+  not given keep their values; `hyphenator` can be set to `false` to
+  stop hyphenating words.
+*/
+static int
+formatter_configure (lua_State *L)
+{
+    formatter *f = check_formatter (L, 1);
+    set_geometry (L, f, 2);
+    set_hyphenator (L, f, 1, 2);
+    return 0;
+}
+
+
+/***
+Formats a piece of text.
+
+@function formatter:format
+@param text String with the text.
+@return Formatted text. A word at the end of the piece is not included,
+  as it may continue in the next one.
+*/
+static int
+formatter_format (lua_State *L)
+{
+    formatter *f = check_formatter (L, 1);
+    const unsigned char *p;
+    size_t n, i = 0;
+    luaL_Buffer b;
+
+    p = (const unsigned char*) luaL_checklstring (L, 2, &n);
+    luaL_buffinitsize (L, &b, n + n / 16);
+
+    while (i < n) {
+        unsigned char c = p[i];
+
+        if (f->cr) {
+            f->cr = 0;
+            if (c == '\n') {
+                i++;
+                continue;
+            }
+        }
+
+        if (!is_separator (c)) {
+            size_t end = i + word_run (p + i, n - i);
+            if (end == n || f->word_len) {
+                if (!save_word (f, p + i, end - i))
+                    return luaL_error (L, "out of memory");
+                if (end < n)
+                    flush_word (f, &b);
+            } else {
+                place_word (f, &b, (const char*) p + i, end - i);
+            }
+            i = end;
+            continue;
+        }
+
+        flush_word (f, &b);
+        switch (c) {
+            case ' ':
+                f->spaces++;
+                break;
+            case '\t':
+                f->spaces += f->tab_size - (f->col + f->spaces) % f->tab_size;
+                break;
+            case '\r':
+                f->cr = 1;
+                /* fall-through */
+            case '\n':
+                end_line (f, &b, 0);
+                break;
+            case CHAR_FF:
+                end_page (f, &b);
+                break;
+        }
+        i++;
+    }
+
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Writes out the word at the end of the last piece of text.
+
+This must be called at the end of the text, and before sending anything
+else to the device. Spaces at the end of the line are still not written,
+and the position in the page is kept.
+
+@function formatter:flush
+@return Formatted text, which may be empty.
+*/
+static int
+formatter_flush (lua_State *L)
+{
+    formatter *f = check_formatter (L, 1);
+    luaL_Buffer b;
+
+    luaL_buffinit (L, &b);
+    flush_word (f, &b);
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Obtains statistics.
+
+@function formatter:stats
+@return Table with the number of `pages` and `lines` written, the
+  number of lines which were `wrapped`, the number of words which were
+  `hyphenated` at the end of a line, and the number of words which were
+  `split` because they were longer than a line.
+*/
+static int
+formatter_stats (lua_State *L)
+{
+    formatter *f = check_formatter (L, 1);
+
+    lua_createtable (L, 0, 5);
+    lua_pushnumber (L, f->pages + (f->blank_page ? 0 : 1));
+    lua_setfield (L, -2, "pages");
+    lua_pushnumber (L, f->lines + (f->col ? 1 : 0));
+    lua_setfield (L, -2, "lines");
+    lua_pushnumber (L, f->wraps);
+    lua_setfield (L, -2, "wrapped");
+    lua_pushnumber (L, f->hyphenations);
+    lua_setfield (L, -2, "hyphenated");
+    lua_pushnumber (L, f->splits);
+    lua_setfield (L, -2, "split");
+    return 1;
+}
+
+
+static int
+formatter_gc (lua_State *L)
+{
+    formatter *f = check_formatter (L, 1);
+    free (f->word);
+    f->word = NULL;
+    f->word_len = f->word_size = 0;
+    return 0;
+}
+
+
+static const luaL_Reg formatter_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, formatter_ ## _name }
+    REG_ITEM (configure),
+    REG_ITEM (format),
+    REG_ITEM (flush),
+    REG_ITEM (stats),
+#undef REG_ITEM
+    { "__gc", formatter_gc },
+    { NULL, NULL }
+};
+
+static const luaL_Reg formatter_funcs[] =
+{
+    { "new", formatter_new },
+    { NULL, NULL }
+};
+
+
+int
+lua_formatter_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, FORMATTER_MT);
+    luaL_setfuncs (L, formatter_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, formatter_funcs);
+    return 1;
+}
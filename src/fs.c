@@ -1,25 +1,49 @@
 /***
 File system utilities.
 
+Big input files can be mapped in memory with @{mmap}, which returns a
+read-only @{buffer}. Buffers can be searched, split in lines, or loaded
+as Lua chunks without copying their whole contents into a Lua string:
+only the pieces which are extracted become strings.
+
 @module fs
 
 @copyright 2012 Adrian Perez <aperez@igalia.com>
 @license Distributed under terms of the MIT license.
 */
 
+#define _GNU_SOURCE /* memmem() */
+
 #include "../lua/lua.h"
 #include "../lua/lauxlib.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#endif
 #include <libgen.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 
+/* Size of the blocks copied by fs.sendfile() without sendfile(2). */
+#define FS_COPY_SIZE (64 * 1024)
+
+/* Size of the blocks read by fs.mmap() from pipes. */
+#define FS_READ_SIZE (64 * 1024)
+
+#define FS_BUFFER_MT "chisel.fs.buffer"
+#define FS_DIR_MT    "chisel.fs.dir"
+
+/* Set when the job is being cancelled, see chisel.c */
+extern int chsl_interrupted (void);
+
 
 static int
 fs_push_error (lua_State *L, const char *message)
@@ -89,6 +113,281 @@ fs_listdir (lua_State *L)
 }
 
 
+/*
+ * Directories being read by fs.dir() and fs.walk() are kept in userdata
+ * objects, so they are closed when the iterators are garbage collected.
+ */
+typedef struct {
+    DIR *dir;
+} fs_dirhandle;
+
+
+static int
+fs_dir_gc (lua_State *L)
+{
+    fs_dirhandle *d = (fs_dirhandle*) luaL_checkudata (L, 1, FS_DIR_MT);
+    if (d->dir != NULL) {
+        closedir (d->dir);
+        d->dir = NULL;
+    }
+    return 0;
+}
+
+
+/* Opens a directory, pushing the userdata for it; NULL on failure. */
+static fs_dirhandle*
+fs_dir_open (lua_State *L, int at, const char *path)
+{
+    fs_dirhandle *d;
+    DIR *dir;
+    int fd;
+
+    if ((fd = openat (at, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return NULL;
+    if ((dir = fdopendir (fd)) == NULL) {
+        int err = errno;
+        close (fd);
+        errno = err;
+        return NULL;
+    }
+
+    d = (fs_dirhandle*) lua_newuserdata (L, sizeof (fs_dirhandle));
+    d->dir = dir;
+    luaL_setmetatable (L, FS_DIR_MT);
+    return d;
+}
+
+
+/*
+ * Reads the next entry of a directory, skipping "." and "..", and hidden
+ * entries unless requested. The directory is closed at the end.
+ */
+static struct dirent*
+fs_dir_next (fs_dirhandle *d, int hidden)
+{
+    struct dirent *de;
+
+    while (d->dir != NULL && (de = readdir (d->dir)) != NULL) {
+        if (de->d_name[0] != '.')
+            return de;
+        if (de->d_name[1] == '\0' ||
+            (de->d_name[1] == '.' && de->d_name[2] == '\0'))
+            continue;
+        if (hidden)
+            return de;
+    }
+
+    if (d->dir != NULL) {
+        closedir (d->dir);
+        d->dir = NULL;
+    }
+    return NULL;
+}
+
+
+/*
+ * Type of a directory entry. It is usually known from the entry itself,
+ * and only some file systems need a lstat() to find it out.
+ */
+static const char*
+fs_dir_type (fs_dirhandle *d, struct dirent *de)
+{
+    struct stat sb;
+
+    switch (de->d_type) {
+        case DT_REG: return "file";
+        case DT_DIR: return "directory";
+        case DT_LNK: return "link";
+        case DT_UNKNOWN: break;
+        default: return "other";
+    }
+
+    if (fstatat (dirfd (d->dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+        return "other";
+    if (S_ISREG (sb.st_mode))
+        return "file";
+    if (S_ISDIR (sb.st_mode))
+        return "directory";
+    if (S_ISLNK (sb.st_mode))
+        return "link";
+    return "other";
+}
+
+
+/***
+Lists the items in a directory, along with their types.
+
+This is like @{listdir}, but the type of each entry is returned as well:
+`"file"`, `"directory"`, `"link"` (for symbolic links, which are not
+followed) or `"other"`. Types are taken from the directory entries, so
+no `stat` is needed for each of them in most file systems.
+
+@function scandir
+@param path Path to the directory (optional).
+@param hidden Return also hidden files (`false` by default).
+@return List of entries, each one a table with `name` and `type` fields,
+and the number of entries; or `nil` and an error message.
+*/
+static int
+fs_scandir (lua_State *L)
+{
+    const char *path = luaL_optstring (L, 1, ".");
+    int hidden = lua_toboolean (L, 2);
+    struct dirent *de;
+    fs_dirhandle *d;
+    int idx = 0;
+
+    assert (L);
+
+    if ((d = fs_dir_open (L, AT_FDCWD, path)) == NULL)
+        return fs_push_error (L, path);
+
+    lua_newtable (L);
+    while ((de = fs_dir_next (d, hidden)) != NULL) {
+        lua_createtable (L, 0, 2);
+        lua_pushstring (L, de->d_name);
+        lua_setfield (L, -2, "name");
+        lua_pushstring (L, fs_dir_type (d, de));
+        lua_setfield (L, -2, "type");
+        lua_rawseti (L, -2, ++idx);
+    }
+
+    lua_pushinteger (L, idx);
+    return 2;
+}
+
+
+static int
+fs_dir_iter (lua_State *L)
+{
+    fs_dirhandle *d = (fs_dirhandle*) lua_touserdata (L, lua_upvalueindex (1));
+    struct dirent *de = fs_dir_next (d, lua_toboolean (L, lua_upvalueindex (2)));
+
+    if (de == NULL)
+        return 0;
+    lua_pushstring (L, de->d_name);
+    lua_pushstring (L, fs_dir_type (d, de));
+    return 2;
+}
+
+
+/***
+Iterates over the items in a directory, along with their types.
+
+This is the iterator form of @{scandir}, which does not create a table
+for each entry:
+
+    for name, kind in fs.dir ("data") do
+      print (name, kind)
+    end
+
+@function dir
+@param path Path to the directory (optional).
+@param hidden Return also hidden files (`false` by default).
+@return Iterator function, which returns the name and the type of each
+entry; or `nil` and an error message.
+*/
+static int
+fs_dir (lua_State *L)
+{
+    const char *path = luaL_optstring (L, 1, ".");
+
+    assert (L);
+
+    lua_pushboolean (L, lua_toboolean (L, 2));
+    if (fs_dir_open (L, AT_FDCWD, path) == NULL)
+        return fs_push_error (L, path);
+    lua_insert (L, -2);
+    lua_pushcclosure (L, fs_dir_iter, 2);
+    return 1;
+}
+
+
+/*
+ * State of fs.walk(): the first upvalue is the stack of directories being
+ * read, the second one the paths of the directories in the stack, and the
+ * third one whether hidden entries are returned.
+ */
+static int
+fs_walk_iter (lua_State *L)
+{
+    int hidden = lua_toboolean (L, lua_upvalueindex (3));
+    int top = luaL_len (L, lua_upvalueindex (1));
+
+    while (top > 0) {
+        struct dirent *de;
+        const char *prefix, *type;
+        fs_dirhandle *d;
+
+        lua_rawgeti (L, lua_upvalueindex (1), top);  /*: dir */
+        d = (fs_dirhandle*) lua_touserdata (L, -1);
+
+        if ((de = fs_dir_next (d, hidden)) == NULL) {
+            lua_pop (L, 1);
+            lua_pushnil (L);
+            lua_rawseti (L, lua_upvalueindex (1), top);
+            lua_pushnil (L);
+            lua_rawseti (L, lua_upvalueindex (2), top--);
+            continue;
+        }
+
+        lua_rawgeti (L, lua_upvalueindex (2), top);  /*: dir prefix */
+        prefix = lua_tostring (L, -1);
+        lua_pushfstring (L, "%s/%s", prefix, de->d_name); /*: dir prefix path */
+        type = fs_dir_type (d, de);
+
+        /* Descend into subdirectories, after returning them. */
+        if (type[0] == 'd' && fs_dir_open (L, dirfd (d->dir), de->d_name)) {
+            lua_rawseti (L, lua_upvalueindex (1), top + 1);  /*: dir prefix path */
+            lua_pushvalue (L, -1);
+            lua_rawseti (L, lua_upvalueindex (2), top + 1);
+        }
+        lua_pushstring (L, type);  /*: dir prefix path type */
+        return 2;
+    }
+    return 0;
+}
+
+
+/***
+Iterates over the items in a directory and, recursively, in all its
+subdirectories.
+
+Each directory is returned before its contents. Symbolic links to
+directories are returned, but not followed. Subdirectories which cannot
+be read are skipped.
+
+    for path, kind in fs.walk ("data") do
+      print (path, kind)  -- e.g. "data/indexbraille/everest.lua file"
+    end
+
+@function walk
+@param path Path to the directory.
+@param hidden Return also hidden files (`false` by default).
+@return Iterator function, which returns the path and the type of each
+entry; or `nil` and an error message.
+*/
+static int
+fs_walk (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    int hidden = lua_toboolean (L, 2);
+
+    assert (L);
+
+    lua_newtable (L);                       /*: dirs */
+    if (fs_dir_open (L, AT_FDCWD, path) == NULL)
+        return fs_push_error (L, path);
+    lua_rawseti (L, -2, 1);
+    lua_newtable (L);                       /*: dirs prefixes */
+    lua_pushvalue (L, 1);
+    lua_rawseti (L, -2, 1);
+    lua_pushboolean (L, hidden);            /*: dirs prefixes hidden */
+    lua_pushcclosure (L, fs_walk_iter, 3);
+    return 1;
+}
+
+
 /***
 Checks whether a file exists.
 
@@ -199,15 +498,549 @@ fs_dirname (lua_State *L)
 }
 
 
+/***
+Obtains the canonical absolute path of a file: symbolic links, and `.`
+and `..` components, are resolved.
+
+@param path Path of an existing file.
+@return Canonical path, or `nil` and an error message.
+@function realpath
+*/
+static int
+fs_realpath (lua_State *L)
+{
+    const char *path;
+    char *real;
+    assert (L);
+
+    path = luaL_checkstring (L, 1);
+
+    if ((real = realpath (path, NULL)) == NULL)
+        return fs_push_error (L, path);
+
+    lua_pushstring (L, real);
+    free (real);
+    return 1;
+}
+
+
+/*
+ * Copies data between two descriptors with read() and write(), and adds
+ * the number of bytes written to "total". Returns zero on success.
+ */
+static int
+fs_copy (int in, int out, lua_Number *total)
+{
+    char *buffer = malloc (FS_COPY_SIZE);
+    ssize_t n;
+
+    if (buffer == NULL)
+        return -1;
+
+    while ((n = read (in, buffer, FS_COPY_SIZE)) != 0) {
+        ssize_t done = 0;
+        if (n < 0) {
+            if (errno == EINTR && !chsl_interrupted ())
+                continue;
+            break;
+        }
+        while (done < n) {
+            ssize_t ret = write (out, buffer + done, n - done);
+            if (ret < 0) {
+                if (errno == EINTR && !chsl_interrupted ())
+                    continue;
+                free (buffer);
+                return -1;
+            }
+            done += ret;
+        }
+        *total += done;
+    }
+
+    free (buffer);
+    return (n < 0) ? -1 : 0;
+}
+
+
+/***
+Writes the contents of a file to an open Lua file.
+
+Data which was written to the output file, and is still buffered, is
+flushed first. Then the contents of the file are copied by the kernel
+with `sendfile`, which works with files, pipes and sockets as output,
+so they are never read into memory; if it cannot be used (for example,
+because the input is a pipe), the file is copied in blocks.
+
+@function sendfile
+@param path Path of the file to be written.
+@param output Output file, e.g. `io.stdout`.
+@return Number of bytes written, or `nil` and an error message.
+*/
+static int
+fs_sendfile (lua_State *L)
+{
+    const char *path;
+    luaL_Stream *output;
+    lua_Number total = 0;
+    int in, out, err;
+
+    assert (L);
+
+    path = luaL_checkstring (L, 1);
+    output = (luaL_Stream*) luaL_checkudata (L, 2, LUA_FILEHANDLE);
+    if (output->closef == NULL)
+        return luaL_error (L, "attempt to use a closed file");
+
+    if ((in = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return fs_push_error (L, path);
+
+    if (fflush (output->f) != 0)
+        goto failed;
+    out = fileno (output->f);
+
+#if defined(__linux__)
+    for (;;) {
+        ssize_t n = sendfile (out, in, NULL, 0x7ffff000);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == 0)
+            goto done;
+        if (errno == EINTR && !chsl_interrupted ())
+            continue;
+        if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        goto failed;
+    }
+#endif /* __linux__ */
+
+    if (fs_copy (in, out, &total) != 0)
+        goto failed;
+
+done:
+    close (in);
+    lua_pushnumber (L, total);
+    return 1;
+
+failed:
+    err = errno;
+    close (in);
+    errno = err;
+    return fs_push_error (L, path);
+}
+
+/*
+ * Buffers hold the contents of a file, either mapped in memory (regular
+ * files) or read into a block of memory (pipes, terminals...).
+ */
+typedef struct {
+    const char *data;
+    size_t      len;
+    int         mapped;
+    int         closed;
+} fs_buffer;
+
+
+static fs_buffer*
+check_buffer (lua_State *L, int index)
+{
+    fs_buffer *b = (fs_buffer*) luaL_checkudata (L, index, FS_BUFFER_MT);
+    luaL_argcheck (L, !b->closed, index, "buffer is closed");
+    return b;
+}
+
+
+static void
+fs_buffer_release (fs_buffer *b)
+{
+    if (b->data != NULL) {
+        if (b->mapped)
+            munmap ((void*) b->data, b->len);
+        else
+            free ((void*) b->data);
+    }
+    b->data = NULL;
+    b->len = 0;
+    b->closed = 1;
+}
+
+
+/* Reads a descriptor until the end of file, into a block of memory. */
+static int
+fs_read_all (int fd, fs_buffer *b)
+{
+    size_t size = 0;
+    char *data = NULL;
+    ssize_t n;
+
+    for (;;) {
+        if (b->len + FS_READ_SIZE > size) {
+            char *p = realloc (data, size = b->len + 2 * FS_READ_SIZE + size / 2);
+            if (p == NULL) {
+                free (data);
+                errno = ENOMEM;
+                return -1;
+            }
+            data = p;
+        }
+        if ((n = read (fd, data + b->len, FS_READ_SIZE)) == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR && !chsl_interrupted ())
+                continue;
+            free (data);
+            return -1;
+        }
+        b->len += n;
+    }
+
+    b->data = data;
+    return 0;
+}
+
+
+/***
+Maps a file in memory.
+
+Regular files are mapped read-only, and the kernel is advised that they
+will be read sequentially. Anything else (e.g. a pipe) is read until the
+end into memory, so the buffer works the same in both cases. The standard
+input is read from its current offset, which is left at the end, as when
+reading it with `io.read "*a"`.
+
+@function mmap
+@param path Path of the file (optional, the standard input by default).
+@return A @{buffer}, or `nil` and an error message.
+*/
+static int
+fs_mmap (lua_State *L)
+{
+    const char *path;
+    fs_buffer *b;
+    struct stat sb;
+    off_t offset = 0;
+    int fd, err;
+
+    assert (L);
+
+    path = luaL_optstring (L, 1, NULL);
+
+    b = (fs_buffer*) lua_newuserdata (L, sizeof (fs_buffer));
+    memset (b, 0, sizeof (fs_buffer));
+    luaL_setmetatable (L, FS_BUFFER_MT);
+
+    if (path == NULL)
+        fd = STDIN_FILENO;
+    else if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return fs_push_error (L, path);
+
+    if (fstat (fd, &sb) != 0)
+        goto failed;
+
+    /*
+     * Part of the standard input may have been consumed already, e.g. by
+     * a wrapper which reads a header: only a file at its beginning can
+     * be mapped, anything else is read from where it is.
+     */
+    if (path == NULL && S_ISREG (sb.st_mode) &&
+        (offset = lseek (fd, 0, SEEK_CUR)) < 0)
+        goto failed;
+
+    if (S_ISREG (sb.st_mode) && offset == 0) {
+        if (sb.st_size > 0) {
+            void *data = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+                goto failed;
+            madvise (data, sb.st_size, MADV_SEQUENTIAL);
+            b->data = data;
+            b->len = sb.st_size;
+            b->mapped = 1;
+        }
+        if (path == NULL)
+            lseek (fd, sb.st_size, SEEK_SET);
+    }
+    else if (fs_read_all (fd, b) != 0) {
+        goto failed;
+    }
+
+    if (path != NULL)
+        close (fd);
+    return 1;
+
+failed:
+    err = errno;
+    if (path != NULL)
+        close (fd);
+    errno = err;
+    return fs_push_error (L, path ? path : "stdin");
+}
+
+
+/***
+Buffer
+@section buffer
+*/
+
+/***
+Obtains the length of a buffer, in bytes. The `#` operator can be used
+as well.
+
+@function buffer:len
+@return Length.
+*/
+static int
+fs_buffer_len (lua_State *L)
+{
+    lua_pushinteger (L, check_buffer (L, 1)->len);
+    return 1;
+}
+
+
+/* Converts a position as given to string.sub() to an offset. */
+static size_t
+fs_buffer_offset (lua_Integer pos, size_t len)
+{
+    if (pos >= 0)
+        return (size_t) pos;
+    if ((size_t) -pos > len)
+        return 0;
+    return len - ((size_t) -pos) + 1;
+}
+
+
+/***
+Extracts a part of a buffer, as `string.sub()` does.
+
+@function buffer:sub
+@param i Position of the first byte.
+@param j Position of the last byte (optional, the end by default).
+@return String.
+*/
+static int
+fs_buffer_sub (lua_State *L)
+{
+    fs_buffer *b = check_buffer (L, 1);
+    size_t i = fs_buffer_offset (luaL_checkinteger (L, 2), b->len);
+    size_t j = fs_buffer_offset (luaL_optinteger (L, 3, -1), b->len);
+
+    if (i < 1)
+        i = 1;
+    if (j > b->len)
+        j = b->len;
+    if (i > j)
+        lua_pushliteral (L, "");
+    else
+        lua_pushlstring (L, b->data + i - 1, j - i + 1);
+    return 1;
+}
+
+
+/***
+Finds a string in a buffer. Patterns are not supported: the string is
+always searched as-is.
+
+@function buffer:find
+@param s String to search for.
+@param init Position where to start searching (optional, 1 by default).
+@return Positions of the first and last bytes of the match, or `nil`.
+*/
+static int
+fs_buffer_find (lua_State *L)
+{
+    fs_buffer *b = check_buffer (L, 1);
+    size_t len;
+    const char *s = luaL_checklstring (L, 2, &len);
+    size_t init = fs_buffer_offset (luaL_optinteger (L, 3, 1), b->len);
+    const char *found;
+
+    if (init < 1)
+        init = 1;
+    if (init > b->len + 1 || len > b->len - (init - 1)) {
+        lua_pushnil (L);
+        return 1;
+    }
+    if (len == 0) {
+        lua_pushinteger (L, init);
+        lua_pushinteger (L, init - 1);
+        return 2;
+    }
+
+    found = memmem (b->data + init - 1, b->len - (init - 1), s, len);
+    if (found == NULL) {
+        lua_pushnil (L);
+        return 1;
+    }
+    lua_pushinteger (L, found - b->data + 1);
+    lua_pushinteger (L, found - b->data + len);
+    return 2;
+}
+
+
+static int
+fs_buffer_next_line (lua_State *L)
+{
+    fs_buffer *b = check_buffer (L, lua_upvalueindex (1));
+    size_t pos = (size_t) lua_tointeger (L, lua_upvalueindex (2));
+    const char *nl;
+
+    if (pos >= b->len)
+        return 0;
+
+    nl = memchr (b->data + pos, '\n', b->len - pos);
+    if (nl == NULL) {
+        lua_pushlstring (L, b->data + pos, b->len - pos);
+        pos = b->len;
+    }
+    else {
+        lua_pushlstring (L, b->data + pos, nl - (b->data + pos));
+        pos = nl - b->data + 1;
+    }
+    lua_pushinteger (L, pos);
+    lua_replace (L, lua_upvalueindex (2));
+    return 1;
+}
+
+
+/***
+Iterates over the lines of a buffer, as `io.lines()` does: the newline
+characters are not included in the lines.
+
+@function buffer:lines
+@return Iterator function.
+*/
+static int
+fs_buffer_lines (lua_State *L)
+{
+    check_buffer (L, 1);
+    lua_settop (L, 1);
+    lua_pushinteger (L, 0);
+    lua_pushcclosure (L, fs_buffer_next_line, 2);
+    return 1;
+}
+
+
+typedef struct {
+    const char *data;
+    size_t      len;
+    int         step;
+} fs_load_state;
+
+static const char*
+fs_load_reader (lua_State *L, void *ud, size_t *size)
+{
+    fs_load_state *s = (fs_load_state*) ud;
+    (void) L;
+
+    switch (s->step++) {
+        case 0:  /* Replaces the skipped first line. */
+            if (s->data != NULL && s->data[-1] == '\n') {
+                *size = 1;
+                return "\n";
+            }
+            s->step++;
+            /* Fall-through */
+        case 1:
+            *size = s->len;
+            return s->data;
+        default:
+            return NULL;
+    }
+}
+
+
+/***
+Loads a buffer as a Lua chunk, as `load()` does for strings.
+
+The chunk is parsed directly from the buffer. As with `loadfile()`, the
+first line is skipped if it starts with `#`, so documents may start
+with `#!chisel`.
+
+@function buffer:load
+@param name Name of the chunk, used in error messages.
+@param mode Whether the chunk can be text (`"t"`), binary (`"b"`) or
+both (`"bt"`, the default).
+@param env Value for the `_ENV` upvalue of the chunk (optional).
+@return Function, or `nil` and an error message.
+*/
+static int
+fs_buffer_load (lua_State *L)
+{
+    fs_buffer *b = check_buffer (L, 1);
+    const char *name = luaL_optstring (L, 2, "=(buffer)");
+    const char *mode = luaL_optstring (L, 3, NULL);
+    fs_load_state state = { b->data, b->len, 1 };
+    int has_env = !lua_isnone (L, 4);
+
+    if (b->len > 0 && b->data[0] == '#') {
+        const char *nl = memchr (b->data, '\n', b->len);
+        state.data = nl ? nl + 1 : b->data + b->len;
+        state.len = b->len - (state.data - b->data);
+        state.step = 0;
+    }
+
+    if (lua_load (L, fs_load_reader, &state, name, mode) != LUA_OK) {
+        lua_pushnil (L);
+        lua_insert (L, -2);
+        return 2;
+    }
+    if (has_env) {
+        lua_pushvalue (L, 4);
+        if (!lua_setupvalue (L, -2, 1))
+            lua_pop (L, 1);
+    }
+    return 1;
+}
+
+
+/***
+Releases the memory of a buffer. This is done as well when the buffer is
+garbage collected, but for big files it is better to do it as soon as
+possible.
+
+@function buffer:close
+*/
+static int
+fs_buffer_close (lua_State *L)
+{
+    fs_buffer *b = (fs_buffer*) luaL_checkudata (L, 1, FS_BUFFER_MT);
+    if (!b->closed)
+        fs_buffer_release (b);
+    return 0;
+}
+
+
+static const luaL_Reg fs_buffer_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, fs_buffer_ ## _name }
+    REG_ITEM (len),
+    REG_ITEM (sub),
+    REG_ITEM (find),
+    REG_ITEM (lines),
+    REG_ITEM (load),
+    REG_ITEM (close),
+#undef REG_ITEM
+    { "__len", fs_buffer_len },
+    { "__gc", fs_buffer_close },
+    { NULL, NULL }
+};
+
+
 static const luaL_Reg fs_funcs[] =
 {
 #define REG_ITEM(_name)  { #_name, fs_ ## _name }
     REG_ITEM (listdir),
+    REG_ITEM (scandir),
+    REG_ITEM (dir),
+    REG_ITEM (walk),
     REG_ITEM (exists),
     REG_ITEM (symlink),
     REG_ITEM (isdir),
+    REG_ITEM (realpath),
     REG_ITEM (basename),
     REG_ITEM (dirname),
+    REG_ITEM (sendfile),
+    REG_ITEM (mmap),
 #undef REG_ITEM
     { NULL, NULL }
 };
@@ -217,6 +1050,18 @@ int
 lua_fs_open (lua_State *L)
 {
     assert (L);
+
+    luaL_newmetatable (L, FS_DIR_MT);
+    lua_pushcfunction (L, fs_dir_gc);
+    lua_setfield (L, -2, "__gc");
+    lua_pop (L, 1);
+
+    luaL_newmetatable (L, FS_BUFFER_MT);
+    luaL_setfuncs (L, fs_buffer_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
     luaL_newlib (L, fs_funcs);
     return 1;
 }
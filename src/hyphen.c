@@ -0,0 +1,722 @@
+/***
+Hyphenation of words.
+
+Finds the points where words can be hyphenated using Liang's algorithm,
+as done by TeX: a set of *patterns* gives, for sequences of letters,
+a value for each position between them. Odd values allow a hyphen at
+that position, and even values forbid it. All the patterns which match
+somewhere in a word (with a dot marking its beginning and end) are
+looked up, and the highest value found for each position wins.
+
+Patterns are compiled with @{compile} into an *image*: a trie laid out
+in flat arrays, using offsets instead of pointers, which can be saved to
+a file and used later with @{open} without any further processing, as
+it is mapped in memory. Looking up a word walks the trie once from each
+position in the word, and patterns are short, so the time needed grows
+linearly with the length of the word. The tables shipped with Chisel
+are compiled at build time, see `src/data/_hyphenation/` and the
+`compile-hyphenation` script.
+
+Only words made of ASCII letters are hyphenated.
+
+@module hyphen
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define HYPHEN_MT      "chisel.hyphen"
+#define HYPHEN_MAGIC   "CHHY"
+#define HYPHEN_VERSION 1
+
+/* Longest word which can be hyphenated. */
+#define HYPHEN_MAX_WORD 62
+
+
+/*
+ * Image layout. Everything is stored in native byte order; the version
+ * field doubles as a byte order check. Sections follow the header in
+ * this order, so that each one is aligned:
+ *
+ *   uint32_t       root[256]       Children of the root node.
+ *   hyphen_node    nodes[nnodes]   Node zero is the root.
+ *   uint32_t       edge_node[nedges]
+ *   unsigned char  edge_char[nedges]
+ *   unsigned char  values[nvalues]
+ *
+ * The values of a node are those of the pattern which ends at the node,
+ * one for each position before, between and after its characters.
+ */
+
+typedef struct {
+    uint32_t edges;     /* First edge, edges are sorted by character. */
+    uint32_t values;    /* First value, if the node ends a pattern.   */
+    uint16_t nedges;
+    uint16_t nvalues;
+} hyphen_node;
+
+typedef struct {
+    char     magic[4];
+    uint32_t version;
+    uint32_t nnodes;
+    uint32_t nedges;
+    uint32_t nvalues;
+    uint32_t npatterns;
+    uint8_t  left_min;  /* Minimum number of letters before a hyphen. */
+    uint8_t  right_min; /* Minimum number of letters after a hyphen.  */
+    uint16_t unused;
+} hyphen_header;
+
+
+typedef struct hyphen_table {
+    const hyphen_header *header;
+    const uint32_t      *root;
+    const hyphen_node   *nodes;
+    const uint32_t      *edge_node;
+    const unsigned char *edge_char;
+    const unsigned char *values;
+
+    void                *mapping;   /* Only for images from files. */
+    size_t               size;
+} hyphen_table;
+
+
+static inline hyphen_table*
+check_table (lua_State *L, int index)
+{
+    return (hyphen_table*) luaL_checkudata (L, index, HYPHEN_MT);
+}
+
+
+static inline int
+is_letter (unsigned c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline unsigned
+to_lower (unsigned c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+static size_t
+image_size (const hyphen_header *h)
+{
+    return sizeof (hyphen_header) + 256 * sizeof (uint32_t)
+         + (size_t) h->nnodes * sizeof (hyphen_node)
+         + (size_t) h->nedges * (sizeof (uint32_t) + 1)
+         + h->nvalues;
+}
+
+
+/*
+ * Image validation and setup.
+ */
+
+static const char*
+table_setup (hyphen_table *t, const void *image, size_t size)
+{
+    const hyphen_header *h = image;
+    const char *p = image;
+    uint32_t i;
+
+    if ((uintptr_t) image % sizeof (uint32_t))
+        return "misaligned image";
+    if (size < sizeof (hyphen_header) ||
+        memcmp (h->magic, HYPHEN_MAGIC, 4) != 0)
+        return "not a hyphenation table";
+    if (h->version != HYPHEN_VERSION)
+        return "unsupported version, or wrong byte order";
+    if (image_size (h) != size || h->nnodes == 0)
+        return "truncated or corrupt image";
+
+    t->header    = h;
+    t->root      = (const uint32_t*) (p += sizeof (hyphen_header));
+    t->nodes     = (const hyphen_node*) (p += 256 * sizeof (uint32_t));
+    t->edge_node = (const uint32_t*) (p += h->nnodes * sizeof (hyphen_node));
+    t->edge_char = (const unsigned char*) (p += h->nedges * sizeof (uint32_t));
+    t->values    = (const unsigned char*) (p += h->nedges);
+
+    /* Check all indexes once, so lookups do not need to. */
+    for (i = 0; i < 256; i++)
+        if (t->root[i] >= h->nnodes)
+            return "corrupt image (root)";
+    for (i = 0; i < h->nnodes; i++) {
+        const hyphen_node *n = &t->nodes[i];
+        if ((size_t) n->edges + n->nedges > h->nedges ||
+            (size_t) n->values + n->nvalues > h->nvalues)
+            return "corrupt image (nodes)";
+    }
+    for (i = 0; i < h->nedges; i++)
+        if (t->edge_node[i] == 0 || t->edge_node[i] >= h->nnodes)
+            return "corrupt image (edges)";
+
+    return NULL;
+}
+
+
+/***
+Loads a compiled table from a file.
+
+The file is mapped in memory, and used as-is.
+
+@function open
+@param path Path to the file.
+@return A table object, or `nil` and an error message.
+*/
+static int
+hyphen_open (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    hyphen_table *t;
+    const char *err;
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+
+    if (fstat (fd, &st) != 0) {
+        close (fd);
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+    if (st.st_size == 0) {
+        close (fd);
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: empty file", path);
+        return 2;
+    }
+
+    mapping = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (mapping == MAP_FAILED) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+
+    t = lua_newuserdata (L, sizeof (hyphen_table));
+    memset (t, 0, sizeof (hyphen_table));
+    t->mapping = mapping;
+    t->size = st.st_size;
+    luaL_setmetatable (L, HYPHEN_MT);
+
+    if ((err = table_setup (t, mapping, st.st_size)) != NULL) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, err);
+        return 2;
+    }
+    return 1;
+}
+
+
+/***
+Uses a compiled table kept in a string.
+
+@function new
+@param image String with a table image, as returned by @{compile}.
+@return A table object.
+*/
+static int
+hyphen_new (lua_State *L)
+{
+    size_t size;
+    const char *image = luaL_checklstring (L, 1, &size);
+    hyphen_table *t;
+    const char *err;
+
+    t = lua_newuserdata (L, sizeof (hyphen_table));
+    memset (t, 0, sizeof (hyphen_table));
+    luaL_setmetatable (L, HYPHEN_MT);
+
+    if ((err = table_setup (t, image, size)) != NULL)
+        return luaL_argerror (L, 1, err);
+
+    /* Keep the string alive as long as the table. */
+    lua_createtable (L, 1, 0);
+    lua_pushvalue (L, 1);
+    lua_rawseti (L, -2, 1);
+    lua_setuservalue (L, -2);
+    return 1;
+}
+
+
+/*
+ * Compilation.
+ */
+
+typedef struct {
+    uint32_t child;     /* First child, children sorted by character. */
+    uint32_t sibling;
+    uint32_t values;
+    uint16_t nvalues;
+    unsigned char ch;
+} build_node;
+
+typedef struct {
+    build_node    *nodes;
+    uint32_t       nnodes;
+    unsigned char *values;
+    uint32_t       nvalues;
+} build_state;
+
+
+static uint32_t
+build_child (build_state *s, uint32_t parent, unsigned char ch)
+{
+    uint32_t *link = &s->nodes[parent].child;
+    uint32_t id;
+
+    while (*link && s->nodes[*link].ch < ch)
+        link = &s->nodes[*link].sibling;
+    if (*link && s->nodes[*link].ch == ch)
+        return *link;
+
+    id = s->nnodes++;
+    s->nodes[id].ch = ch;
+    s->nodes[id].sibling = *link;
+    *link = id;
+    return id;
+}
+
+
+/*
+ * Adds a pattern, given as its characters and a value for each position
+ * around them. Returns zero if the pattern was already added.
+ */
+static int
+build_pattern (build_state *s, const unsigned char *chars, size_t len,
+               const unsigned char *values)
+{
+    uint32_t node = 0;
+    size_t k;
+
+    for (k = 0; k < len; k++)
+        node = build_child (s, node, chars[k]);
+    if (s->nodes[node].nvalues)
+        return 0;
+
+    s->nodes[node].values = s->nvalues;
+    s->nodes[node].nvalues = (uint16_t) (len + 1);
+    memcpy (s->values + s->nvalues, values, len + 1);
+    s->nvalues += len + 1;
+    return 1;
+}
+
+
+/***
+Compiles a set of patterns.
+
+The patterns are given in a table, which may contain:
+
+ * Patterns, in the array part, written like in TeX: letters with the
+   value for the position between two of them written as a digit (zero
+   if not given), and a dot at the beginning or end for patterns which
+   only match at the beginning or end of words, e.g. `".ach4"`.
+ * `exceptions`: List of words with their hyphens written in, which
+   are hyphenated as given instead of using the patterns, e.g.
+   `"ta-ble"`. Words with no hyphens are never hyphenated.
+ * `left_min`: Minimum number of letters before a hyphen (2 by default).
+ * `right_min`: Minimum number of letters after a hyphen (3 by default).
+
+@function compile
+@param patterns Table with the patterns.
+@return String with the compiled table, which can be passed to @{new},
+  or saved to a file and loaded with @{open}.
+*/
+static int
+hyphen_compile (lua_State *L)
+{
+    hyphen_header header;
+    hyphen_node *nodes;
+    uint32_t *order, *newid, *edge_node, root[256];
+    unsigned char *edge_char;
+    build_state s;
+    uint32_t i, j, nedges, nchars, maxnodes;
+    lua_Integer left_min, right_min;
+    luaL_Buffer b;
+    int n, exceptions, nexceptions;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    n = luaL_len (L, 1);
+
+    lua_getfield (L, 1, "left_min");
+    left_min = luaL_optinteger (L, -1, 2);
+    lua_getfield (L, 1, "right_min");
+    right_min = luaL_optinteger (L, -1, 3);
+    lua_pop (L, 2);
+    if (left_min < 1 || left_min > 255 || right_min < 1 || right_min > 255)
+        return luaL_error (L, "left_min and right_min must be in the "
+                           "1-255 range");
+
+    lua_getfield (L, 1, "exceptions");
+    if (lua_isnil (L, -1)) {
+        lua_pop (L, 1);
+        lua_newtable (L);
+    }
+    luaL_checktype (L, -1, LUA_TTABLE);
+    exceptions = lua_gettop (L);
+    nexceptions = luaL_len (L, exceptions);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, HYPHEN_MAGIC, 4);
+    header.version = HYPHEN_VERSION;
+    header.left_min = (uint8_t) left_min;
+    header.right_min = (uint8_t) right_min;
+
+    /*
+     * Count characters, to know the maximum number of nodes and values.
+     * Exceptions get the dots which mark the beginning and end of words.
+     */
+    for (nchars = 0, i = 1; i <= (uint32_t) n; i++) {
+        lua_rawgeti (L, 1, i);
+        if (lua_type (L, -1) != LUA_TSTRING || lua_rawlen (L, -1) == 0)
+            return luaL_error (L, "pattern %d: must be a non-empty string",
+                               (int) i);
+        nchars += lua_rawlen (L, -1);
+        lua_pop (L, 1);
+    }
+    for (i = 1; i <= (uint32_t) nexceptions; i++) {
+        lua_rawgeti (L, exceptions, i);
+        if (lua_type (L, -1) != LUA_TSTRING || lua_rawlen (L, -1) == 0)
+            return luaL_error (L, "exception %d: must be a non-empty string",
+                               (int) i);
+        nchars += lua_rawlen (L, -1) + 2;
+        lua_pop (L, 1);
+    }
+    maxnodes = nchars + 1;
+
+    memset (&s, 0, sizeof (s));
+    s.nodes = lua_newuserdata (L, maxnodes * sizeof (build_node));
+    s.values = lua_newuserdata (L, nchars + n + nexceptions + 1);
+    memset (s.nodes, 0, maxnodes * sizeof (build_node));
+    s.nnodes = 1;
+
+    for (i = 1; i <= (uint32_t) n; i++) {
+        unsigned char chars[256], values[257];
+        const unsigned char *p;
+        size_t len, k;
+
+        lua_rawgeti (L, 1, i);
+        p = (const unsigned char*) lua_tolstring (L, -1, &len);
+
+        memset (values, 0, sizeof (values));
+        for (k = 0; len; p++, len--) {
+            if (*p >= '0' && *p <= '9') {
+                values[k] = *p - '0';
+            } else if (is_letter (*p) || *p == '.') {
+                if (k == sizeof (chars))
+                    return luaL_error (L, "pattern %d: too long", (int) i);
+                chars[k++] = (unsigned char) to_lower (*p);
+            } else {
+                return luaL_error (L, "pattern %d: invalid character '%c'",
+                                   (int) i, *p);
+            }
+        }
+        if (k == 0)
+            return luaL_error (L, "pattern %d: no letters", (int) i);
+        if (!build_pattern (&s, chars, k, values))
+            return luaL_error (L, "pattern %d: duplicate pattern", (int) i);
+        header.npatterns++;
+        lua_pop (L, 1);
+    }
+
+    /*
+     * Exceptions are added as patterns which match the whole word, with
+     * values higher than those used in patterns: 9 where a hyphen goes,
+     * and 8 elsewhere.
+     */
+    for (i = 1; i <= (uint32_t) nexceptions; i++) {
+        unsigned char chars[256], values[257];
+        const unsigned char *p;
+        size_t len, k;
+
+        lua_rawgeti (L, exceptions, i);
+        p = (const unsigned char*) lua_tolstring (L, -1, &len);
+
+        memset (values, 0, sizeof (values));
+        chars[0] = '.';
+        for (k = 1; len; p++, len--) {
+            if (*p == '-' && k > 1) {
+                values[k] = 9;
+            } else if (is_letter (*p)) {
+                if (k == sizeof (chars) - 1)
+                    return luaL_error (L, "exception %d: too long", (int) i);
+                if (k > 1 && values[k] == 0)
+                    values[k] = 8;
+                chars[k++] = (unsigned char) to_lower (*p);
+            } else {
+                return luaL_error (L, "exception %d: invalid character '%c'",
+                                   (int) i, *p);
+            }
+        }
+        if (k == 1 || values[k])
+            return luaL_error (L, "exception %d: invalid word", (int) i);
+        chars[k++] = '.';
+        if (!build_pattern (&s, chars, k, values))
+            return luaL_error (L, "exception %d: duplicate word", (int) i);
+        lua_pop (L, 1);
+    }
+
+
+    /*
+     * Number nodes in breadth-first order: the children of each node get
+     * consecutive numbers, and their edges can be stored together.
+     */
+    order = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    newid = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    nodes = lua_newuserdata (L, s.nnodes * sizeof (hyphen_node));
+    edge_node = lua_newuserdata (L, s.nnodes * sizeof (uint32_t));
+    edge_char = lua_newuserdata (L, s.nnodes);
+
+    order[0] = 0;
+    newid[0] = 0;
+    for (i = 0, j = 1, nedges = 0; i < s.nnodes; i++) {
+        uint32_t child;
+        memset (&nodes[i], 0, sizeof (hyphen_node));
+        nodes[i].edges = nedges;
+        nodes[i].values = s.nodes[order[i]].values;
+        nodes[i].nvalues = s.nodes[order[i]].nvalues;
+        for (child = s.nodes[order[i]].child; child;
+             child = s.nodes[child].sibling) {
+            newid[child] = j;
+            order[j++] = child;
+            edge_node[nedges] = newid[child];
+            edge_char[nedges] = s.nodes[child].ch;
+            nedges++;
+            nodes[i].nedges++;
+        }
+    }
+    assert (j == s.nnodes);
+
+    memset (root, 0, sizeof (root));
+    for (i = 0; i < nodes[0].nedges; i++)
+        root[edge_char[i]] = edge_node[i];
+
+    header.nnodes = s.nnodes;
+    header.nedges = nedges;
+    header.nvalues = s.nvalues;
+
+    luaL_buffinit (L, &b);
+    luaL_addlstring (&b, (const char*) &header, sizeof (header));
+    luaL_addlstring (&b, (const char*) root, sizeof (root));
+    luaL_addlstring (&b, (const char*) nodes, s.nnodes * sizeof (hyphen_node));
+    luaL_addlstring (&b, (const char*) edge_node, nedges * sizeof (uint32_t));
+    luaL_addlstring (&b, (const char*) edge_char, nedges);
+    luaL_addlstring (&b, (const char*) s.values, s.nvalues);
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/*
+ * Lookup.
+ */
+
+static inline uint32_t
+find_child (const hyphen_table *t, uint32_t node, unsigned char ch)
+{
+    const hyphen_node *n = &t->nodes[node];
+    const unsigned char *chars = t->edge_char + n->edges;
+    unsigned lo = 0, hi = n->nedges;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (chars[mid] < ch)
+            lo = mid + 1;
+        else if (chars[mid] > ch)
+            hi = mid;
+        else
+            return t->edge_node[n->edges + mid];
+    }
+    return 0;
+}
+
+
+/*
+ * Finds the hyphenation points of a word. On return, points[i] is
+ * non-zero if a hyphen can go before the character at position "i".
+ * Returns zero if the word cannot be hyphenated at all: because it is
+ * too short or too long, or it is not made only of letters.
+ *
+ * This is also used by the formatter module.
+ */
+int
+hyphen_points (const hyphen_table *t, const unsigned char *word, size_t len,
+               unsigned char *points)
+{
+    unsigned char buf[HYPHEN_MAX_WORD + 2], values[HYPHEN_MAX_WORD + 3];
+    const hyphen_header *h = t->header;
+    size_t i, j, m = len + 2;
+    int found = 0;
+
+    if (h == NULL || len > HYPHEN_MAX_WORD ||
+        len < (size_t) h->left_min + h->right_min)
+        return 0;
+
+    buf[0] = buf[len + 1] = '.';
+    for (i = 0; i < len; i++) {
+        if (!is_letter (word[i]))
+            return 0;
+        buf[i + 1] = (unsigned char) to_lower (word[i]);
+    }
+    memset (values, 0, m + 1);
+
+    for (i = 0; i < m; i++) {
+        uint32_t node = t->root[buf[i]];
+        for (j = i + 1; node; j++) {
+            const hyphen_node *nd = &t->nodes[node];
+            if (nd->nvalues) {
+                const unsigned char *v = t->values + nd->values;
+                size_t k;
+                for (k = 0; k < nd->nvalues; k++)
+                    if (v[k] > values[i + k])
+                        values[i + k] = v[k];
+            }
+            if (j >= m)
+                break;
+            node = find_child (t, node, buf[j]);
+        }
+    }
+
+    /* The value before word[i] is at values[i + 1], due to the dot. */
+    memset (points, 0, len + 1);
+    for (i = h->left_min; i + h->right_min <= len; i++)
+        if (values[i + 1] & 1)
+            found = points[i] = 1;
+    return found;
+}
+
+
+/***
+Hyphenates a word.
+
+@function table:hyphenate
+@param word Word to hyphenate.
+@param mark Optional string inserted at the hyphenation points (by
+  default `"-"`).
+@return The word with the `mark` inserted at each hyphenation point.
+  Words which cannot be hyphenated are returned unchanged.
+*/
+static int
+hyphen_hyphenate (lua_State *L)
+{
+    const hyphen_table *t = check_table (L, 1);
+    unsigned char points[HYPHEN_MAX_WORD + 1];
+    const char *word, *mark;
+    size_t len, marklen, i;
+    luaL_Buffer b;
+
+    luaL_argcheck (L, t->header != NULL, 1, "invalid table");
+    word = luaL_checklstring (L, 2, &len);
+    mark = luaL_optlstring (L, 3, "-", &marklen);
+
+    if (!hyphen_points (t, (const unsigned char*) word, len, points)) {
+        lua_settop (L, 2);
+        return 1;
+    }
+
+    luaL_buffinitsize (L, &b, len + marklen * len / 2);
+    for (i = 0; i < len; i++) {
+        if (points[i])
+            luaL_addlstring (&b, mark, marklen);
+        luaL_addchar (&b, word[i]);
+    }
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Obtains information about a table.
+
+@function table:stats
+@return Table with the number of `patterns`, `nodes` and `edges`, and
+  the `size` of the image in bytes.
+*/
+static int
+hyphen_stats (lua_State *L)
+{
+    const hyphen_table *t = check_table (L, 1);
+    luaL_argcheck (L, t->header != NULL, 1, "invalid table");
+
+    lua_createtable (L, 0, 4);
+    lua_pushinteger (L, t->header->npatterns);
+    lua_setfield (L, -2, "patterns");
+    lua_pushinteger (L, t->header->nnodes);
+    lua_setfield (L, -2, "nodes");
+    lua_pushinteger (L, t->header->nedges);
+    lua_setfield (L, -2, "edges");
+    lua_pushinteger (L, image_size (t->header));
+    lua_setfield (L, -2, "size");
+    return 1;
+}
+
+
+static int
+hyphen_gc (lua_State *L)
+{
+    hyphen_table *t = check_table (L, 1);
+    if (t->mapping)
+        munmap (t->mapping, t->size);
+    memset (t, 0, sizeof (hyphen_table));
+    return 0;
+}
+
+
+static const luaL_Reg hyphen_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, hyphen_ ## _name }
+    REG_ITEM (hyphenate),
+    REG_ITEM (stats),
+#undef REG_ITEM
+    { "__gc", hyphen_gc },
+    { NULL, NULL }
+};
+
+static const luaL_Reg hyphen_funcs[] =
+{
+#define REG_ITEM(_name)  { #_name, hyphen_ ## _name }
+    REG_ITEM (compile),
+    REG_ITEM (open),
+    REG_ITEM (new),
+#undef REG_ITEM
+    { NULL, NULL }
+};
+
+
+int
+lua_hyphen_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, HYPHEN_MT);
+    luaL_setfuncs (L, hyphen_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, hyphen_funcs);
+    return 1;
+}
@@ -0,0 +1,317 @@
+---
+-- Output journal, to resume jobs after write failures.
+--
+-- While a document is rendered, the journal counts the bytes written to
+-- the output, and at the beginning of document parts it records a
+-- *checkpoint*: the number of the part, the output offset, and the
+-- options active in the renderer. Checkpoints are only recorded after
+-- the output written so far has been flushed, so they mark data which
+-- the device (or the program in the other end of a pipe) acknowledged.
+--
+-- When a job is retried after a failure, the document is rendered again
+-- with its output discarded until the part of the last checkpoint is
+-- reached. If the output offset and options are the same as recorded,
+-- the renderer is reset and the saved options are set again, so the
+-- commands needed to bring the device to the same state are sent, and
+-- then the rest of the document is written as usual. Otherwise the
+-- journal does not belong to the document, and rendering fails.
+--
+-- The journal is a text file, with a header line followed by a line for
+-- each checkpoint:
+--
+--    chisel-journal 1 <device id>
+--    <part> <offset> <options>
+--
+-- It is removed when the document has been written completely.
+--
+-- @copyright 2012 Adrian Perez <aperez@igalia.com>
+-- @license Distributed under terms of the MIT license.
+--
+
+local tconcat  = table.concat
+local tsort    = table.sort
+local sformat  = string.format
+local tonumber = tonumber
+local pairs    = pairs
+local type     = type
+
+local M = {}
+
+
+--- Default minimum amount of output between checkpoints, in bytes.
+--
+M.interval = 64 * 1024
+
+local header_format = "chisel-journal 1 %s"
+
+
+--- Writes a flat table of options as a Lua table constructor.
+--
+local function serialize (options)
+  local keys = {}
+  for key in pairs (options) do
+    keys[#keys + 1] = key
+  end
+  tsort (keys)
+
+  local items = {}
+  for i, key in ipairs (keys) do
+    local value = options[key]
+    if type (value) == "number" then
+      value = sformat ("%.17g", value)
+    elseif type (value) == "string" then
+      value = sformat ("%q", value)
+    else
+      value = tostring (value)
+    end
+    items[i] = sformat ("[%q]=%s", key, value)
+  end
+  return "{" .. tconcat (items, ",") .. "}"
+end
+
+local function deserialize (text)
+  local chunk = load ("return " .. text, "=journal", "t", {})
+  if chunk == nil then
+    return nil
+  end
+  local ok, options = pcall (chunk)
+  return ok and type (options) == "table" and options or nil
+end
+
+local function same_options (a, b)
+  for key, value in pairs (a) do
+    if b[key] ~= value then
+      return false
+    end
+  end
+  for key in pairs (b) do
+    if a[key] == nil then
+      return false
+    end
+  end
+  return true
+end
+
+
+--- Output journal.
+--
+-- Created with @{open}.
+--
+-- @table journal
+--
+local journal = object:extend
+{
+  --- Output offset, in bytes.
+  offset = 0;
+
+  --- Number of document parts entered so far.
+  part = 0;
+
+  --- Writes data to the output, or discards it while skipping the
+  -- output which was already written before resuming.
+  --
+  -- @param data String with the data.
+  -- @function journal:write
+  --
+  write = function (self, data)
+    self.offset = self.offset + #data
+    if self._resume == nil then
+      local ok, err = self.output:write (data)
+      if not ok then
+        error (("journal: write failed at offset %i: %s"):format (self.offset
+               - #data, tostring (err)), 0)
+      end
+    end
+  end;
+
+  --- Records a checkpoint at the beginning of a part, or resumes the
+  -- output if it is the part of the last checkpoint.
+  --
+  -- @param rend Renderer.
+  -- @function journal:checkpoint
+  --
+  checkpoint = function (self, rend)
+    local part = self.part + 1
+    self.part = part
+
+    local resume = self._resume
+    if resume ~= nil then
+      if part < resume.part then
+        return
+      end
+      local options = rend:get_options ()
+      if self.offset ~= resume.offset or not same_options (options,
+                                                           resume.options) then
+        self:discard ()
+        error (("journal: %s does not match the document at part %i " ..
+                "(offset %i, expected %i)"):format (self.path, part,
+                self.offset, resume.offset), 0)
+      end
+      log_verbose ("journal: resuming at part %i, offset %i\n", part,
+                   self.offset)
+      self._resume = nil
+      -- The commands which restore the state of the device are not part
+      -- of the output of an uninterrupted run, so they are not counted:
+      -- later checkpoints must be reproducible when resuming again.
+      local offset = self.offset
+      rend:reset ()
+      rend:set_options (resume.options)
+      self.offset = offset
+      self._last = offset
+      return
+    end
+
+    if self.offset - self._last < self.interval then
+      return
+    end
+
+    -- Only record data known to be written.
+    local ok, err = self.output:flush ()
+    if not ok then
+      error (("journal: flush failed at offset %i: %s"):format (self.offset,
+             tostring (err)), 0)
+    end
+    self._file:write (part, " ", self.offset, " ",
+                      serialize (rend:get_options ()), "\n")
+    self._file:flush ()
+    self._last = self.offset
+  end;
+
+  --- Makes a renderer record checkpoints in the journal, at the beginning
+  -- of each document part.
+  --
+  -- The renderer is restored by @{journal:finish} and @{journal:discard},
+  -- so it can be attached to another journal later (renderers obtained
+  -- with `renderer.get` are shared by the whole program).
+  --
+  -- @param rend Renderer, whose output must be written with
+  -- @{journal:write}.
+  -- @return The renderer.
+  -- @function journal:attach
+  --
+  attach = function (self, rend)
+    local begin_part = rend.begin_part
+    self._rend, self._begin_part = rend, rawget (rend, "begin_part")
+    rend.begin_part = function (r, node)
+      self:checkpoint (r)
+      if begin_part ~= nil then
+        return begin_part (r, node)
+      end
+    end
+    lib.doctree.compile (rend)
+    return rend
+  end;
+
+  --- Undoes @{journal:attach}.
+  -- @function journal:detach
+  --
+  detach = function (self)
+    local rend = self._rend
+    if rend ~= nil then
+      rend.begin_part = self._begin_part
+      lib.doctree.compile (rend)
+      self._rend, self._begin_part = nil, nil
+    end
+  end;
+
+  --- Checks whether the journal had a checkpoint to resume from.
+  --
+  -- @return Part and offset of the checkpoint, or `nil`.
+  -- @function journal:resuming
+  --
+  resuming = function (self)
+    local resume = self._resume
+    if resume ~= nil then
+      return resume.part, resume.offset
+    end
+  end;
+
+  --- Completes the job: flushes the output, and removes the journal.
+  --
+  -- @return `true`, or `nil` and an error message.
+  -- @function journal:finish
+  --
+  finish = function (self)
+    if self._resume ~= nil then
+      self:discard ()
+      return nil, ("journal: %s has a checkpoint at part %i, but the " ..
+                   "document has only %i parts"):format (self.path,
+                   self._resume.part, self.part)
+    end
+    local ok, err = self.output:flush ()
+    if not ok then
+      return nil, ("journal: flush failed: %s"):format (tostring (err))
+    end
+    self:discard ()
+    return true
+  end;
+
+  --- Closes and removes the journal file, and detaches the renderer.
+  -- @function journal:discard
+  --
+  discard = function (self)
+    self:detach ()
+    if self._file ~= nil then
+      self._file:close ()
+      self._file = nil
+      os.remove (self.path)
+    end
+  end;
+}
+
+
+--- Opens a journal.
+--
+-- If the file exists, and was written for the same device, the last
+-- checkpoint in it is used to resume the output. Otherwise, a new
+-- journal is started.
+--
+-- @param path Path of the journal file.
+-- @param device Device identifier.
+-- @param output Output file (or any object with `write` and `flush`
+-- methods that return `nil` and an error message on failure).
+-- @param interval Minimum amount of output between checkpoints, in bytes
+-- *(Optional, default @{interval})*.
+-- @return A @{journal}, or `nil` and an error message.
+--
+function M.open (path, device, output, interval)
+  local header = header_format:format (device)
+  local resume = nil
+
+  local f = io.open (path, "r")
+  if f ~= nil then
+    if f:read ("*l") == header then
+      for line in f:lines () do
+        local part, offset, options = line:match ("^(%d+) (%d+) (.*)$")
+        options = options and deserialize (options)
+        if options ~= nil then
+          resume = { part = tonumber (part); offset = tonumber (offset);
+                     options = options }
+        end
+      end
+    else
+      log_verbose ("journal: %s is for a different device, ignored\n", path)
+    end
+    f:close ()
+  end
+
+  local file, err = io.open (path, resume and "a" or "w")
+  if file == nil then
+    return nil, err
+  end
+  if resume == nil then
+    file:write (header, "\n")
+    file:flush ()
+  end
+
+  return journal:clone {
+    path     = path;
+    output   = output;
+    interval = interval or M.interval;
+    _file    = file;
+    _resume  = resume;
+    _last    = 0;
+  }
+end
+
+return M
@@ -14,11 +14,14 @@ local callable     = lib.ml.callable
 local setmetatable = setmetatable
 local tconcat      = table.concat
 local mfloor       = math.floor
+local mmax         = math.max
 local tonumber     = tonumber
 local tostring     = tostring
 local pairs        = pairs
 local pcall, load  = pcall, load
 local loadfile     = loadfile
+local ipairs       = ipairs
+local type         = type
 local error        = error
 local T            = lib.doctree
 
@@ -95,6 +98,43 @@ local doc_options = {
 
   -- Graphics dot distance
   graphics_dot_distance = tonumber;
+
+  -- Wrap text in lines and pages on the host, instead of leaving it to
+  -- the device. Accepts booleans, and their usual string forms.
+  wrap_text = function (value)
+    if type (value) == "string" then
+      value = value:lower ()
+      if value == "true" or value == "yes" or value == "1" then
+        value = true
+      elseif value == "false" or value == "no" or value == "0" then
+        value = false
+      end
+    end
+    if type (value) ~= "boolean" then
+      error (("Invalid value %q for wrap_text"):format (tostring (value)))
+    end
+    return value
+  end;
+
+  -- Contraction table used to translate text, or "none". Tables are
+  -- looked up by name in "data/_contractions".
+  translation = function (value)
+    value = tostring (value)
+    if not value:match ("^[%w_%-]+$") then
+      error (("Invalid translation table name %q"):format (value))
+    end
+    return value
+  end;
+
+  -- Patterns used to hyphenate words when wrapping text, or "none". They
+  -- are looked up by name in "data/_hyphenation".
+  hyphenation = function (value)
+    value = tostring (value)
+    if not value:match ("^[%w_%-]+$") then
+      error (("Invalid hyphenation patterns name %q"):format (value))
+    end
+    return value
+  end;
 }
 doc_options.graphics_line_spacing = doc_options.line_spacing
 
@@ -123,25 +163,248 @@ function doc_funcs.raw (output, data)
 	return T.raw:clone { output = output; data = data }
 end
 
---- Parses an input string into a document tree.
+--- Whether documents may include files (with `rawfile` and `image`).
 --
--- @param input Input string.
--- @return Document tree.
+-- Files are always looked up in the directory of the document, and they
+-- must be inside of it. Programs which load documents coming from other
+-- users, whose directory may contain unrelated files (e.g. the spool
+-- directory of CUPS) should disable this.
 --
-function M.parsestring (input)
-	-- Create the sandboxed environment used for loading documents.
+M.include_files = true
+
+-- Paths of files are resolved from the directory of the document, and
+-- they must not point outside of it, even through symbolic links: a
+-- document may read the files which come along with it, but not any
+-- other file that the filter can read. Documents read from the standard
+-- input (e.g. the usual CUPS job) have no directory, and can not include
+-- files at all.
+local function resolve (path, basedir)
+	path = tostring (path)
+	if not M.include_files then
+		error (("Cannot include %q: files can not be included in documents")
+		       :format (path))
+	end
+	if basedir == nil then
+		error (("Cannot include %q: the document was not read from a file")
+		       :format (path))
+	end
+	if path:sub (1, 1) == "/" then
+		error (("Path %q is not relative to the document"):format (path))
+	end
+	for component in path:gmatch ("[^/]+") do
+		if component == ".." then
+			error (("Path %q points outside of the document directory")
+			       :format (path))
+		end
+	end
+
+	local base, err = lib.fs.realpath (basedir)
+	local real
+	if base ~= nil then
+		real, err = lib.fs.realpath (base .. "/" .. path)
+	end
+	if real == nil then
+		error (("Cannot include %q: %s"):format (path, tostring (err)))
+	end
+	local prefix = (base == "/") and base or base .. "/"
+	if real:sub (1, #prefix) ~= prefix then
+		error (("Path %q points outside of the document directory")
+		       :format (path))
+	end
+	return real
+end
+
+function doc_funcs.rawfile (output, path, basedir)
+	return T.rawfile:clone { output = output; path = resolve (path, basedir) }
+end
+
+-- Line spacing of graphics, in millimeters, for each name.
+local line_spacings = { single = 5.0; double = 10.0 }
+
+-- Size of the dots of graphics on paper, in millimeters, using the
+-- "graphics_*" options of the document. Each line of graphics is three
+-- dots tall, and dots are "graphics_dot_distance" apart in each line.
+local function graphics_dot_size (options)
+  local line_spacing = options.graphics_line_spacing or "single"
+  return options.graphics_dot_distance or 1.6,
+         (line_spacings[line_spacing] or line_spacing) / 3
+end
+
+-- Loads an image and converts it to braille graphics, scaled to keep its
+-- proportions on paper.
+local function rasterize (t, options, basedir)
+  if type (t) ~= "table" then
+    t = { t }
+  end
+  local path = resolve (t[1], basedir)
+  local image, err = lib.raster.load (path)
+  if image == nil then
+    error (err)
+  end
+
+  local dot_width, dot_height = graphics_dot_size (options)
+  local ratio = dot_width / dot_height
+
+  -- Size of the image in dots. By default, it is as many dots wide as
+  -- the image has pixels.
+  local width, height = image:size ()
+  local columns, rows
+  if t.width and t.height then
+    columns, rows = 2 * tointeger (t.width), 3 * tointeger (t.height)
+  elseif t.height then
+    rows = 3 * tointeger (t.height)
+    columns = rows * width / height / ratio
+  else
+    columns = t.width and 2 * tointeger (t.width) or width
+    rows = columns * height / width * ratio
+  end
+  columns = mmax (1, mfloor (columns + 0.5))
+  rows = mmax (1, mfloor (rows + 0.5))
+
+  if columns ~= width or rows ~= height then
+    image = image:scale (columns, rows)
+  end
+  return image:cells { dither = t.dither; threshold = t.threshold;
+                       invert = t.invert }
+end
+
+function doc_funcs.image (t, options, basedir)
+  return T.graphics:clone { data = rasterize (t, options or {}, basedir) }
+end
+
+-- Draws the shapes of a canvas as braille graphics. Coordinates are in
+-- millimeters, and converted to dots using the "graphics_*" options.
+local function draw (t, options)
+  local dot_width, dot_height = graphics_dot_size (options)
+  local x_scale, y_scale = 1 / dot_width, 1 / dot_height
+  return lib.raster.draw (t, {
+    width  = t.width  and mfloor (tonumber (t.width)  * x_scale + 0.5) + 1;
+    height = t.height and mfloor (tonumber (t.height) * y_scale + 0.5) + 1;
+    x_scale = x_scale;
+    y_scale = y_scale;
+  })
+end
+
+function doc_funcs.canvas (t, options)
+  return T.graphics:clone { data = draw (t, options or {}) }
+end
+
+-- Shapes used in canvas elements, which are tables with their kind.
+for _, kind in ipairs { "line", "polyline", "circle", "fill" } do
+  doc_funcs[kind] = function (t)
+    if type (t) ~= "table" then
+      error (("Shape %q needs a table"):format (kind))
+    end
+    t.kind = kind
+    return t
+  end
+end
+
+-- Creates the functions used to build packed trees. Elements are
+-- represented by their node identifiers while the document is loaded.
+local function packed_funcs (tree)
+	local f = {}
+
+	local function add_children (id, t)
+		for _, child in ipairs (t) do
+			tree:append (id, child)
+		end
+		return id
+	end
+
+	function f.text (t)
+		if type (t) == "table" then
+			return tree:node ("text", tconcat (t))
+		else
+			return tree:node ("text", tostring (t))
+		end
+	end
+
+	function f.graphics (t)
+		if type (t) == "table" then
+			return tree:node ("graphics", tconcat (t))
+		else
+			return tree:node ("graphics", tostring (t))
+		end
+	end
+
+	function f.image (t, options, basedir)
+		return tree:node ("graphics", rasterize (t, options or {}, basedir))
+	end
+
+	function f.canvas (t, options)
+		return tree:node ("graphics", draw (t, options or {}))
+	end
+
+	function f.document (t)
+		return add_children (tree:node ("document"), t)
+	end
+
+	function f.part (options)
+		return function (t)
+			local id = tree:node ("part")
+			tree:set_options (id, doc_funcs.options (options))
+			return add_children (id, t)
+		end
+	end
+
+	function f.raw (output, data)
+		return tree:node ("raw", data, output)
+	end
+
+	function f.rawfile (output, path, basedir)
+		return tree:node ("rawfile", resolve (path, basedir), output)
+	end
+
+	f.options = doc_funcs.options
+	return setmetatable (f, { __index = doc_funcs })
+end
+
+
+-- Creates the sandboxed environment used for loading documents, and
+-- returns it along with a function which returns the loaded document.
+local function sandbox (packed, basedir)
+	local funcs = doc_funcs
+	local tree = nil
+	if packed then
+		tree = lib.packedtree.new ()
+		funcs = packed_funcs (tree)
+	end
+
 	local env = {}
-	setmetatable (env, { __index = doc_funcs })
+	setmetatable (env, { __index = funcs })
 
 	-- The top-level document() function has to be created here as a closure
 	-- so it can reference the "result" upvalue in the containing function.
 	local result = nil
 	local options = {}
-	function env.document (...) result  = doc_funcs.document (...) end
-	function env.options  (...) options = doc_funcs.options  (...) end
+	function env.document (...) result  = funcs.document (...) end
+	function env.options  (...) options = funcs.options  (...) end
+
+	-- Images and canvases are scaled using the document options given so
+	-- far, and relative paths (of images and raw files) are resolved from
+	-- the directory of the document.
+	function env.image  (t) return funcs.image  (t, options, basedir) end
+	function env.canvas (t) return funcs.canvas (t, options) end
+	function env.rawfile (output, path)
+		return funcs.rawfile (output, path, basedir)
+	end
 
-	-- Load the chunk from the passed string
-	local chunk, err = load (input, nil, "t", env)
+	return env, function ()
+		if result == nil then
+			return nil, "no document() in input"
+		end
+		if packed then
+			result = T.view (tree, result)
+		end
+		result.options = options
+		return result
+	end
+end
+
+
+-- Runs a loaded chunk, returning the document it describes.
+local function run (chunk, err, result)
 	if chunk == nil then
 		return nil, err
 	end
@@ -151,8 +414,22 @@ function M.parsestring (input)
 		return nil, err
 	end
 
-	result.options = options
-	return result
+	return result ()
+end
+
+
+--- Parses an input string into a document tree.
+--
+-- @param input Input string.
+-- @param packed If true, the document is loaded into a packed tree, and
+-- a view of its root element is returned (see @{doctree.pack}). This uses
+-- less memory for big documents *(Optional)*.
+-- @return Document tree.
+--
+function M.parsestring (input, packed)
+	local env, result = sandbox (packed)
+	local chunk, err = load (input, nil, "t", env)
+	return run (chunk, err, result)
 end
 
 
@@ -160,33 +437,19 @@ end
 --
 -- @param input Path to input file. When omitted (or `nil`), data is read
 -- from the standard input stream.
+-- @param packed If true, the document is loaded into a packed tree *(Optional)*.
 -- @return Document tree.
 --
-function M.parse (input)
-	-- Create the sandbox environment used for loading documents.
-	local env = {}
-	setmetatable (env, { __index = doc_funcs })
-
-	-- The top-level document() function has to be created here as a closure
-	-- so it can reference the "result" upvalue in the containing function.
-	local result = nil
-	local options = {}
-	function env.document (...) result  = doc_funcs.document (...) end
-	function env.options  (...) options = doc_funcs.options  (...) end
-
-	-- Load the chunk from disk
-	local chunk, err = loadfile (input, "t", env)
-	if chunk == nil then
+function M.parse (input, packed)
+	-- The file is mapped in memory, and parsed from there.
+	local buffer, err = lib.fs.mmap (input)
+	if buffer == nil then
 		return nil, err
 	end
-
-	chunk, err = pcall (chunk)
-	if chunk == false then
-		return nil, err
-	end
-
-	result.options = options
-	return result
+	local env, result = sandbox (packed, input and lib.fs.dirname (input))
+	local chunk, err = buffer:load (input and ("@" .. input) or "=stdin", "t", env)
+	buffer:close ()
+	return run (chunk, err, result)
 end
 
 
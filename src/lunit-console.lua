@@ -39,6 +39,7 @@
           err(fullname, message, traceback)
           fail(fullname, where, message, usermessage)
           pass(testcasename, testname)
+          bench(testcasename, benchname, result)
       done()
 
       Fullname:
@@ -89,6 +90,7 @@ end
 
 
 local msgs = {}
+local benchs = {}
 
 
 function begin()
@@ -96,6 +98,7 @@ function begin()
   local total_tests = 0
   
   msgs = {} -- e
+  benchs = {}
 
   for tcname in lunit.testcases() do
     total_tc = total_tc + 1
@@ -137,6 +140,26 @@ function pass(testcasename, testname)
 end
 
 
+function bench(testcasename, benchname, result)
+  writestatus("b")
+  benchs[#benchs+1] = { name = testcasename.."."..benchname, result = result }
+end
+
+
+-- Formats a time in seconds using a suitable unit.
+local function formattime(t)
+  if t >= 1 then
+    return string.format("%8.3f s ", t)
+  elseif t >= 1e-3 then
+    return string.format("%8.3f ms", t * 1e3)
+  elseif t >= 1e-6 then
+    return string.format("%8.3f us", t * 1e6)
+  else
+    return string.format("%8.3f ns", t * 1e9)
+  end
+end
+
+
 
 function done()
   printformat("\n\n%d Assertions checked.\n", lunit.stats.assertions )
@@ -146,6 +169,16 @@ function done()
     printformat( "%3d) %s\n", i, msg )
   end
 
+  if #benchs > 0 then
+    table.sort(benchs, function(a, b) return a.name < b.name end)
+    printformat("%-44s %11s %11s %12s\n", "benchmark", "median", "MAD", "iterations")
+    for _, b in ipairs(benchs) do
+      printformat("%-44s %s %s %6d x %3d\n", b.name, formattime(b.result.median),
+          formattime(b.result.mad), b.result.iterations, b.result.samples)
+    end
+    print()
+  end
+
   printformat("Testsuite finished (%d passed, %d failed, %d errors).\n",
       lunit.stats.passed, lunit.stats.failed, lunit.stats.errors )
 end
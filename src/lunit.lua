@@ -51,6 +51,9 @@ local string_lower    = string.lower
 local string_find     = string.find
 
 local table_concat    = table.concat
+local table_sort      = table.sort
+local math_abs        = math.abs
+local os_clock        = os.clock
 
 local debug_getinfo   = debug.getinfo
 
@@ -335,6 +338,97 @@ end
 traceback_hide( assert_pass )
 
 
+-- Benchmarks.
+--
+-- In benchmark mode, functions whose name starts with "bench" are run
+-- repeatedly, and the time each call takes is measured: after a warmup,
+-- the number of calls per sample is doubled until a sample takes at
+-- least "mintime" seconds, and then "samples" samples are taken. The
+-- median and the median absolute deviation (MAD) of the time per call
+-- are reported to the test runner. The clock function can be replaced
+-- with a more precise one by assigning "lunit.clock".
+
+lunit.benchmode = false
+lunit.clock = os_clock
+lunit.benchoptions = {
+  warmup   = 0.05;
+  mintime  = 0.01;
+  samples  = 15;
+}
+
+local function median(t)
+  table_sort(t)
+  local n = #t
+  if n % 2 == 1 then
+    return t[(n + 1) / 2]
+  end
+  return (t[n / 2] + t[n / 2 + 1]) / 2
+end
+
+function lunit.measure(func)
+  local clock = lunit.clock
+  local options = lunit.benchoptions
+
+  local start = clock()
+  repeat
+    func()
+  until clock() - start >= options.warmup
+
+  local iterations, elapsed = 1, 0
+  while true do
+    start = clock()
+    for _ = 1, iterations do func() end
+    elapsed = clock() - start
+    if elapsed >= options.mintime then
+      break
+    end
+    iterations = iterations * 2
+  end
+
+  local times = {}
+  for i = 1, options.samples do
+    start = clock()
+    for _ = 1, iterations do func() end
+    times[i] = (clock() - start) / iterations
+  end
+
+  local med = median(times)
+  local deviations = {}
+  for i, t in ipairs(times) do
+    deviations[i] = math_abs(t - med)
+  end
+
+  return {
+    median     = med;
+    mad        = median(deviations);
+    iterations = iterations;
+    samples    = options.samples;
+  }
+end
+
+
+-- Fails unless "func" is faster than "reference", which is either another
+-- function or a time per call in seconds. Both functions are measured
+-- with lunit.measure(). Outside of benchmark mode the check is skipped,
+-- so regular test runs stay fast and deterministic.
+function assert_faster_than(reference, func, msg)
+  stats.assertions = stats.assertions + 1
+  if not lunit.benchmode then
+    return
+  end
+  local limit = reference
+  if is_function(reference) then
+    limit = lunit.measure(reference).median
+  end
+  local actual = lunit.measure(func).median
+  if actual >= limit then
+    failure( "assert_faster_than", msg, "expected less than %.3gs per call but was %.3gs", limit, actual )
+  end
+  return actual
+end
+traceback_hide( assert_faster_than )
+
+
 -- lunit.assert_typename functions
 
 for _, typename in ipairs(typenames) do
@@ -370,6 +464,7 @@ function lunit.clearstats()
     passed      = 0;
     failed      = 0;
     errors      = 0;
+    benchmarks  = 0;
   }
 end
 
@@ -519,6 +614,19 @@ do
     end
     return key_iter, testnames, nil
   end
+
+  -- Iterator over all benchmark names in a testcase.
+  function lunit.benchmarks(tcname)
+    local benchnames = {}
+    for key, value in pairs(testcase(tcname)) do
+      if is_string(key) and is_function(value) then
+        if string_sub(string_lower(key), 1, 5) == "bench" then
+          benchnames[key] = true
+        end
+      end
+    end
+    return key_iter, benchnames, nil
+  end
 end
 
 
@@ -563,6 +671,48 @@ end
 traceback_hide(runtest)
 
 
+function lunit.runbench(tcname, benchname)
+  orig_assert( is_string(tcname) )
+  orig_assert( is_string(benchname) )
+
+  if (not getrunner()) then
+    loadrunner("lunit-console")
+  end
+
+  local tc        = testcase(tcname)
+  local setup     = tc[setupname(tcname)]
+  local bench     = tc[benchname]
+  local teardown  = tc[teardownname(tcname)]
+  local result
+
+  local function callit(context, func)
+    if func then
+      local err = mypcall(func)
+      if err then
+        reporterrobj(context, tcname, benchname, err)
+        return false
+      end
+    end
+    return true
+  end
+  traceback_hide(callit)
+
+  report("run", tcname, benchname)
+
+  local setup_ok    =              callit( "setup", setup )
+  local bench_ok    = setup_ok and callit( "bench", function()
+                                     result = lunit.measure(bench)
+                                   end )
+  local teardown_ok = setup_ok and callit( "teardown", teardown )
+
+  if setup_ok and bench_ok and teardown_ok then
+    stats.benchmarks = stats.benchmarks + 1
+    report("bench", tcname, benchname, result)
+  end
+end
+traceback_hide(runbench)
+
+
 
 function lunit.run(testpatterns)
   clearstats()
@@ -574,6 +724,13 @@ function lunit.run(testpatterns)
         runtest(testcasename, testname)
       end
     end
+    if lunit.benchmode then
+      for benchname in lunit.benchmarks(testcasename) do
+        if selected(testpatterns, benchname) then
+          runbench(testcasename, benchname)
+        end
+      end
+    end
   end
   report("done")
   return stats
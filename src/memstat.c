@@ -0,0 +1,364 @@
+/*
+ * memstat.c
+ * Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+/*
+ * Memory accounting for the Lua VM.
+ *
+ * Wraps the allocator of a Lua state, keeping track of the current and
+ * peak amount of memory in use, and of the number of allocations. The
+ * wrapper is meant to be passed to lua_newstate(), so the memory taken by
+ * the state itself is accounted for; after chsl_memstat_detach() the
+ * memory still in use is no longer tracked. The
+ * counters are attributed to the *phase* the program is in (boot, device,
+ * parse, render...), which scripts switch by calling chisel.phase().
+ *
+ * Optionally, allocations are also attributed to the Lua function which
+ * was running when they were done. This is done by sampling: a count
+ * hook records which function is running every N instructions, and the
+ * bytes allocated since the previous sample are charged to it.
+ */
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#ifndef MEMSTAT_MAX_PHASES
+#define MEMSTAT_MAX_PHASES 16
+#endif /* !MEMSTAT_MAX_PHASES */
+
+#ifndef MEMSTAT_MAX_SITES
+#define MEMSTAT_MAX_SITES 4096
+#endif /* !MEMSTAT_MAX_SITES */
+
+#define MEMSTAT_NAME_LEN 24
+#define MEMSTAT_SITE_LEN 80
+
+
+typedef struct {
+    char      name[MEMSTAT_NAME_LEN];
+    long long allocs;     /* Number of blocks allocated.           */
+    long long frees;      /* Number of blocks freed.               */
+    long long allocated;  /* Bytes allocated (including growth).   */
+    long long freed;      /* Bytes freed (including shrinking).    */
+    long long peak;       /* Peak of bytes in use while active.    */
+    long long current;    /* Bytes in use when last left.          */
+    int       gc_kbytes;  /* lua_gc (LUA_GCCOUNT) when last left.  */
+    double    time;       /* Seconds spent in the phase.           */
+} memstat_phase;
+
+typedef struct {
+    const void *source;   /* Interned chunk name, used as key.     */
+    int         line;     /* Line where the function is defined.   */
+    char        name[MEMSTAT_SITE_LEN];
+    long long   allocs;
+    long long   bytes;
+} memstat_site;
+
+typedef struct chsl_memstat {
+    lua_Alloc      allocf;     /* Wrapped allocator.                    */
+    void          *ud;
+    long long      current;    /* Bytes currently in use.               */
+    long long      peak;       /* Maximum value reached by "current".   */
+    long long      allocs;
+    long long      frees;
+    memstat_phase  phases[MEMSTAT_MAX_PHASES];
+    int            nphases;
+    memstat_phase *phase;      /* Active phase.                         */
+    double         phase_start;
+    long long      pending_allocs; /* Not yet charged to a call site.   */
+    long long      pending_bytes;
+    memstat_site  *sites;      /* Hash table, NULL if not sampling.     */
+    int            nsites;
+} chsl_memstat;
+
+
+static double
+memstat_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+chsl_memstat*
+chsl_memstat_new (lua_Alloc allocf, void *ud, int sites)
+{
+    chsl_memstat *ms = calloc (1, sizeof (chsl_memstat));
+    if (ms == NULL)
+        return NULL;
+
+    if (sites && (ms->sites = calloc (MEMSTAT_MAX_SITES,
+                                      sizeof (memstat_site))) == NULL) {
+        free (ms);
+        return NULL;
+    }
+
+    ms->allocf = allocf;
+    ms->ud     = ud;
+    strcpy (ms->phases[0].name, "boot");
+    ms->phase  = &ms->phases[0];
+    ms->nphases = 1;
+    ms->phase_start = memstat_now ();
+    return ms;
+}
+
+
+/*
+ * Makes a Lua state use again the allocator that was wrapped.
+ */
+void
+chsl_memstat_detach (lua_State *L, chsl_memstat *ms)
+{
+    assert (L);
+    assert (ms);
+    lua_setallocf (L, ms->allocf, ms->ud);
+}
+
+
+void
+chsl_memstat_free (chsl_memstat *ms)
+{
+    if (ms) {
+        free (ms->sites);
+        free (ms);
+    }
+}
+
+
+/*
+ * Allocation function, with the semantics of lua_Alloc. The accounting
+ * data must be passed as the "ud" argument.
+ */
+void*
+chsl_memstat_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    chsl_memstat *ms = ud;
+    memstat_phase *ph = ms->phase;
+    void *nptr = (*ms->allocf) (ms->ud, ptr, osize, nsize);
+
+    if (nptr == NULL && nsize > 0)
+        return NULL; /* Failed, nothing changed. */
+
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0) {
+        if (ptr) {
+            ms->frees++;
+            ph->frees++;
+        }
+    }
+    else if (ptr == NULL) {
+        ms->allocs++;
+        ph->allocs++;
+        ms->pending_allocs++;
+    }
+
+    if (nsize > osize) {
+        ph->allocated += nsize - osize;
+        ms->pending_bytes += nsize - osize;
+    }
+    else {
+        ph->freed += osize - nsize;
+    }
+
+    ms->current += (long long) nsize - (long long) osize;
+    if (ms->current > ms->peak)
+        ms->peak = ms->current;
+    if (ms->current > ph->peak)
+        ph->peak = ms->current;
+
+    return nptr;
+}
+
+
+static void
+memstat_leave_phase (lua_State *L, chsl_memstat *ms)
+{
+    double now = memstat_now ();
+    ms->phase->time += now - ms->phase_start;
+    ms->phase->current = ms->current;
+    ms->phase->gc_kbytes = L ? lua_gc (L, LUA_GCCOUNT, 0) : 0;
+    ms->phase_start = now;
+}
+
+
+/*
+ * Switches the active phase. Phases are created on demand, and entering
+ * again a phase that was already seen accumulates into it.
+ */
+void
+chsl_memstat_phase (lua_State *L, chsl_memstat *ms, const char *name)
+{
+    int i;
+
+    assert (ms);
+    assert (name);
+
+    memstat_leave_phase (L, ms);
+
+    for (i = 0; i < ms->nphases; i++)
+        if (strncmp (ms->phases[i].name, name, MEMSTAT_NAME_LEN - 1) == 0)
+            break;
+
+    if (i == ms->nphases) {
+        if (ms->nphases == MEMSTAT_MAX_PHASES)
+            i = MEMSTAT_MAX_PHASES - 1; /* Reuse the last one. */
+        else
+            ms->nphases++;
+        strncpy (ms->phases[i].name, name, MEMSTAT_NAME_LEN - 1);
+    }
+
+    ms->phase = &ms->phases[i];
+    if (ms->current > ms->phase->peak)
+        ms->phase->peak = ms->current;
+}
+
+
+/*
+ * Charges the allocations done since the previous sample to the function
+ * described by "ar". Meant to be called from a LUA_MASKCOUNT hook.
+ */
+void
+chsl_memstat_sample (lua_State *L, chsl_memstat *ms, lua_Debug *ar)
+{
+    memstat_site *site;
+    unsigned slot, n;
+
+    if (ms->sites == NULL || ms->pending_allocs == 0)
+        return;
+
+    if (!lua_getinfo (L, "Sn", ar))
+        return;
+
+    slot = (unsigned) (((size_t) ar->source >> 4) * 31 + ar->linedefined);
+    for (n = 0; n < MEMSTAT_MAX_SITES; n++) {
+        site = &ms->sites[(slot + n) % MEMSTAT_MAX_SITES];
+        if (site->source == ar->source && site->line == ar->linedefined)
+            break;
+        if (site->source == NULL) {
+            site->source = ar->source;
+            site->line = ar->linedefined;
+            snprintf (site->name, MEMSTAT_SITE_LEN, "%s:%d (%s)",
+                      ar->short_src, ar->linedefined,
+                      ar->name ? ar->name
+                               : (*ar->what == 'm' ? "main chunk" : "?"));
+            ms->nsites++;
+            break;
+        }
+    }
+    if (n == MEMSTAT_MAX_SITES)
+        return; /* Table full, keep the counts pending. */
+
+    site->allocs += ms->pending_allocs;
+    site->bytes  += ms->pending_bytes;
+    ms->pending_allocs = ms->pending_bytes = 0;
+}
+
+
+static void
+memstat_json_string (FILE *out, const char *str)
+{
+    fputc ('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc ('\\', out);
+        if ((unsigned char) *str >= 0x20)
+            fputc (*str, out);
+    }
+    fputc ('"', out);
+}
+
+
+static int
+memstat_site_compare (const void *a, const void *b)
+{
+    const memstat_site *sa = a, *sb = b;
+    if (sa->bytes != sb->bytes)
+        return (sa->bytes < sb->bytes) ? 1 : -1;
+    return 0;
+}
+
+
+/*
+ * Writes the report. When "json" is non-zero the output is a JSON
+ * object, otherwise it is a table meant to be read by humans.
+ */
+void
+chsl_memstat_report (lua_State *L, chsl_memstat *ms, FILE *out, int json)
+{
+    struct rusage usage;
+    int i;
+
+    memstat_leave_phase (L, ms);
+
+    /* Peak resident set size of the whole process, in KiB. */
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+        usage.ru_maxrss = 0;
+
+    if (ms->sites)
+        qsort (ms->sites, MEMSTAT_MAX_SITES, sizeof (memstat_site),
+               memstat_site_compare);
+
+    if (json) {
+        fprintf (out, "{\"current\":%lld,\"peak\":%lld,\"allocs\":%lld,"
+                 "\"frees\":%lld,\"maxrss_kb\":%ld,\"phases\":[", ms->current,
+                 ms->peak, ms->allocs, ms->frees, (long) usage.ru_maxrss);
+        for (i = 0; i < ms->nphases; i++) {
+            const memstat_phase *ph = &ms->phases[i];
+            fputs (i ? ",{\"name\":" : "{\"name\":", out);
+            memstat_json_string (out, ph->name);
+            fprintf (out, ",\"allocs\":%lld,\"frees\":%lld,"
+                     "\"allocated\":%lld,\"freed\":%lld,\"peak\":%lld,"
+                     "\"current\":%lld,\"gc_kbytes\":%d,\"time\":%.6f}",
+                     ph->allocs, ph->frees,
+                     ph->allocated, ph->freed, ph->peak, ph->current,
+                     ph->gc_kbytes, ph->time);
+        }
+        fputs ("]", out);
+        if (ms->sites) {
+            fputs (",\"sites\":[", out);
+            for (i = 0; i < ms->nsites; i++) {
+                fputs (i ? ",{\"site\":" : "{\"site\":", out);
+                memstat_json_string (out, ms->sites[i].name);
+                fprintf (out, ",\"allocs\":%lld,\"bytes\":%lld}",
+                         ms->sites[i].allocs, ms->sites[i].bytes);
+            }
+            fputs ("]", out);
+        }
+        fputs ("}\n", out);
+    }
+    else {
+        fprintf (out, "memory: %lld bytes in use, %lld peak, "
+                 "%lld allocations, %lld frees, %ld KiB max RSS\n",
+                 ms->current, ms->peak, ms->allocs, ms->frees,
+                 (long) usage.ru_maxrss);
+        fprintf (out, "%-12s %10s %10s %12s %12s %12s %8s %9s\n",
+                 "phase", "allocs", "frees", "allocated", "freed",
+                 "peak", "gc KiB", "time");
+        for (i = 0; i < ms->nphases; i++) {
+            const memstat_phase *ph = &ms->phases[i];
+            fprintf (out, "%-12s %10lld %10lld %12lld %12lld %12lld %8d %8.3fs\n",
+                     ph->name, ph->allocs, ph->frees, ph->allocated,
+                     ph->freed, ph->peak, ph->gc_kbytes, ph->time);
+        }
+        if (ms->sites) {
+            fprintf (out, "\n%-56s %10s %12s\n", "site (sampled)",
+                     "allocs", "bytes");
+            for (i = 0; i < ms->nsites && i < 20; i++)
+                fprintf (out, "%-56s %10lld %12lld\n", ms->sites[i].name,
+                         ms->sites[i].allocs, ms->sites[i].bytes);
+        }
+    }
+    fflush (out);
+}
@@ -0,0 +1,611 @@
+/***
+Packed document trees.
+
+A packed tree stores the nodes of a document in a few flat arrays (kind,
+parent, first child, last child and next sibling of each node) instead of
+one Lua table per node, and the payloads of all the nodes in a single
+buffer, where identical strings are stored only once. The garbage
+collector sees a single object, no matter how big the document is.
+
+Nodes are identified by numbers, starting at 1. The @{doctree} module
+provides views over packed trees which implement the usual element API,
+and the @{loader} can build packed trees directly.
+
+@module packedtree
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define PACKEDTREE_MT "chisel.packedtree"
+
+
+/* Node kinds, indexes in packed_kinds. */
+static const char *packed_kinds[] = {
+    "document", "part", "text", "graphics", "raw", "rawfile", NULL
+};
+
+typedef struct {
+    size_t   offset;   /* Offset in the payload buffer. */
+    size_t   length;
+    unsigned hash;
+} packed_string;
+
+typedef struct {
+    unsigned       nnodes;
+    unsigned       size;     /* Allocated items in the node arrays.   */
+    unsigned char *kind;
+    unsigned      *parent;   /* Zero means no parent/child/sibling.   */
+    unsigned      *first;
+    unsigned      *last;
+    unsigned      *next;
+    unsigned      *data;     /* String identifiers, zero means empty. */
+    unsigned      *output;
+
+    char          *payload;
+    size_t         payload_len;
+    size_t         payload_size;
+
+    packed_string *strings;   /* Zero is not used.                    */
+    unsigned       nstrings;
+    unsigned       strings_size;
+    unsigned      *buckets;   /* Hash table of string identifiers.    */
+    unsigned       nbuckets;  /* Always a power of two.               */
+    size_t         deduped;   /* Bytes saved by deduplication.        */
+} packed_tree;
+
+
+static packed_tree*
+check_tree (lua_State *L, int index)
+{
+    return (packed_tree*) luaL_checkudata (L, index, PACKEDTREE_MT);
+}
+
+
+static unsigned
+check_node (lua_State *L, packed_tree *t, int index)
+{
+    lua_Integer id = luaL_checkinteger (L, index);
+    luaL_argcheck (L, id > 0 && (lua_Unsigned) id <= t->nnodes, index,
+                   "invalid node identifier");
+    return (unsigned) id;
+}
+
+
+static void*
+grow_array (lua_State *L, void *array, size_t nitems, size_t itemsize)
+{
+    void *p = realloc (array, nitems * itemsize);
+    if (p == NULL)
+        luaL_error (L, "out of memory");
+    return p;
+}
+
+
+static unsigned
+hash_string (const char *str, size_t len)
+{
+    unsigned h = 2166136261U; /* FNV-1a */
+    while (len--)
+        h = (h ^ (unsigned char) *str++) * 16777619U;
+    return h;
+}
+
+
+static void
+rehash_strings (lua_State *L, packed_tree *t)
+{
+    unsigned i, nbuckets = t->nbuckets ? t->nbuckets * 2 : 1024;
+    unsigned *buckets = calloc (nbuckets, sizeof (unsigned));
+
+    if (buckets == NULL)
+        luaL_error (L, "out of memory");
+
+    for (i = 1; i < t->nstrings; i++) {
+        unsigned slot = t->strings[i].hash & (nbuckets - 1);
+        while (buckets[slot])
+            slot = (slot + 1) & (nbuckets - 1);
+        buckets[slot] = i;
+    }
+
+    free (t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+}
+
+
+/*
+ * Adds a string to the payload buffer, returning its identifier. If the
+ * same string was already added, the existing copy is reused.
+ */
+static unsigned
+intern_string (lua_State *L, packed_tree *t, const char *str, size_t len)
+{
+    unsigned hash, slot, id;
+
+    if (len == 0)
+        return 0;
+
+    if (t->nstrings * 2 >= t->nbuckets)
+        rehash_strings (L, t);
+
+    hash = hash_string (str, len);
+    for (slot = hash & (t->nbuckets - 1); (id = t->buckets[slot]) != 0;
+         slot = (slot + 1) & (t->nbuckets - 1)) {
+        const packed_string *s = &t->strings[id];
+        if (s->hash == hash && s->length == len &&
+            memcmp (t->payload + s->offset, str, len) == 0) {
+            t->deduped += len;
+            return id;
+        }
+    }
+
+    if (t->nstrings == t->strings_size) {
+        t->strings = grow_array (L, t->strings, t->strings_size * 2,
+                                 sizeof (packed_string));
+        t->strings_size *= 2;
+    }
+
+    if (t->payload_len + len > t->payload_size) {
+        size_t size = t->payload_size;
+        while (t->payload_len + len > size)
+            size *= 2;
+        t->payload = grow_array (L, t->payload, size, 1);
+        t->payload_size = size;
+    }
+
+    memcpy (t->payload + t->payload_len, str, len);
+    t->strings[t->nstrings].offset = t->payload_len;
+    t->strings[t->nstrings].length = len;
+    t->strings[t->nstrings].hash   = hash;
+    t->payload_len += len;
+    t->buckets[slot] = t->nstrings;
+    return t->nstrings++;
+}
+
+
+static void
+push_string (lua_State *L, packed_tree *t, unsigned id)
+{
+    if (id == 0)
+        lua_pushliteral (L, "");
+    else
+        lua_pushlstring (L, t->payload + t->strings[id].offset,
+                         t->strings[id].length);
+}
+
+
+static void
+push_node (lua_State *L, unsigned id)
+{
+    if (id == 0)
+        lua_pushnil (L);
+    else
+        lua_pushinteger (L, id);
+}
+
+
+/***
+Creates an empty tree.
+
+@function new
+@return A tree.
+*/
+static int
+packedtree_new (lua_State *L)
+{
+    packed_tree *t = lua_newuserdata (L, sizeof (packed_tree));
+    memset (t, 0, sizeof (packed_tree));
+    luaL_setmetatable (L, PACKEDTREE_MT);
+
+    /* Option tables are kept in the user value, indexed by node. */
+    lua_newtable (L);
+    lua_setuservalue (L, -2);
+
+    t->payload_size = 4096;
+    t->strings_size = 256;
+    t->nstrings     = 1;
+    if ((t->payload = malloc (t->payload_size)) == NULL ||
+        (t->strings = malloc (t->strings_size * sizeof (packed_string))) == NULL)
+        return luaL_error (L, "out of memory");
+
+    return 1;
+}
+
+
+/***
+Adds a node to the tree. The node has no parent until it is appended to
+another node with @{tree:append}.
+
+@function tree:node
+@param kind Node kind: `document`, `part`, `text`, `graphics`, `raw` or
+`rawfile`.
+@param data Payload data (optional).
+@param output For `raw` nodes, name of the output (optional).
+@return Node identifier.
+*/
+static int
+packedtree_node (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    int kind = luaL_checkoption (L, 2, NULL, packed_kinds);
+    size_t len = 0;
+    const char *data = luaL_optlstring (L, 3, "", &len);
+    size_t output_len = 0;
+    const char *output = luaL_optlstring (L, 4, "", &output_len);
+    unsigned id;
+
+    if (t->nnodes + 1 >= t->size) {
+        unsigned size = t->size ? t->size * 2 : 256;
+#define GROW(_field) \
+        t->_field = grow_array (L, t->_field, size, sizeof (*t->_field))
+        GROW (kind);
+        GROW (parent);
+        GROW (first);
+        GROW (last);
+        GROW (next);
+        GROW (data);
+        GROW (output);
+#undef GROW
+        t->size = size;
+    }
+
+    id = ++t->nnodes;
+    t->kind[id]   = (unsigned char) kind;
+    t->parent[id] = t->first[id] = t->last[id] = t->next[id] = 0;
+    t->data[id]   = intern_string (L, t, data, len);
+    t->output[id] = intern_string (L, t, output, output_len);
+
+    lua_pushinteger (L, id);
+    return 1;
+}
+
+
+/***
+Appends a node as a child of another.
+
+@function tree:append
+@param parent Identifier of the parent node.
+@param child Identifier of the child node, which must not have a parent.
+@param position Insert the child at the given position in the list of
+  children, instead of appending it (optional).
+*/
+static int
+packedtree_append (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    unsigned parent = check_node (L, t, 2);
+    unsigned child = check_node (L, t, 3);
+    lua_Integer position = luaL_optinteger (L, 4, 0);
+    unsigned node;
+
+    luaL_argcheck (L, t->parent[child] == 0, 3, "node already has a parent");
+    for (node = parent; node != 0; node = t->parent[node])
+        luaL_argcheck (L, node != child, 3, "node is an ancestor of the parent");
+    t->parent[child] = parent;
+
+    if (position > 1 && t->first[parent]) {
+        /* Insert after the node at (position - 1), if it exists. */
+        unsigned prev = t->first[parent];
+        while (--position > 1 && t->next[prev])
+            prev = t->next[prev];
+        t->next[child] = t->next[prev];
+        t->next[prev] = child;
+        if (t->last[parent] == prev)
+            t->last[parent] = child;
+    }
+    else if (position == 1) {
+        t->next[child] = t->first[parent];
+        t->first[parent] = child;
+        if (t->last[parent] == 0)
+            t->last[parent] = child;
+    }
+    else {
+        if (t->last[parent])
+            t->next[t->last[parent]] = child;
+        else
+            t->first[parent] = child;
+        t->last[parent] = child;
+    }
+    return 0;
+}
+
+
+/***
+Removes a node from the list of children of its parent.
+
+The node itself, and its descendants, are kept in the tree, and it can
+be appended again somewhere else.
+
+@function tree:unlink
+@param id Node identifier.
+*/
+static int
+packedtree_unlink (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    unsigned id = check_node (L, t, 2);
+    unsigned parent = t->parent[id];
+    unsigned prev = 0, node;
+
+    if (parent == 0)
+        return 0;
+
+    for (node = t->first[parent]; node != id; node = t->next[node])
+        prev = node;
+
+    if (prev)
+        t->next[prev] = t->next[id];
+    else
+        t->first[parent] = t->next[id];
+    if (t->last[parent] == id)
+        t->last[parent] = prev;
+
+    t->parent[id] = t->next[id] = 0;
+    return 0;
+}
+
+
+/***
+Obtains the kind of a node.
+
+@function tree:kind
+@param id Node identifier.
+@return Kind name.
+*/
+static int
+packedtree_kind (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    lua_pushstring (L, packed_kinds[t->kind[check_node (L, t, 2)]]);
+    return 1;
+}
+
+
+/***
+Obtains the payload of a node.
+
+@function tree:data
+@param id Node identifier.
+@return Payload data (a string, possibly empty).
+*/
+static int
+packedtree_data (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    push_string (L, t, t->data[check_node (L, t, 2)]);
+    return 1;
+}
+
+
+/***
+Obtains the output name of a `raw` node.
+
+@function tree:output
+@param id Node identifier.
+@return Output name (a string, possibly empty).
+*/
+static int
+packedtree_output (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    push_string (L, t, t->output[check_node (L, t, 2)]);
+    return 1;
+}
+
+
+/***
+Obtains the options table of a node.
+
+@function tree:options
+@param id Node identifier.
+@return Options table, or `nil`.
+*/
+static int
+packedtree_options (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    unsigned id = check_node (L, t, 2);
+    lua_getuservalue (L, 1);
+    lua_rawgeti (L, -1, id);
+    return 1;
+}
+
+
+/***
+Sets the options table of a node.
+
+@function tree:set_options
+@param id Node identifier.
+@param options Options table, or `nil`.
+*/
+static int
+packedtree_set_options (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    unsigned id = check_node (L, t, 2);
+    if (!lua_isnoneornil (L, 3))
+        luaL_checktype (L, 3, LUA_TTABLE);
+    lua_settop (L, 3);
+    lua_getuservalue (L, 1);
+    lua_pushvalue (L, 3);
+    lua_rawseti (L, -2, id);
+    return 0;
+}
+
+
+/***
+Obtains the parent of a node.
+
+@function tree:parent
+@param id Node identifier.
+@return Node identifier, or `nil`.
+*/
+static int
+packedtree_parent (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    push_node (L, t->parent[check_node (L, t, 2)]);
+    return 1;
+}
+
+
+/***
+Obtains the first child of a node.
+
+@function tree:first
+@param id Node identifier.
+@return Node identifier, or `nil`.
+*/
+static int
+packedtree_first (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    push_node (L, t->first[check_node (L, t, 2)]);
+    return 1;
+}
+
+
+/***
+Obtains the next sibling of a node.
+
+@function tree:next
+@param id Node identifier.
+@return Node identifier, or `nil`.
+*/
+static int
+packedtree_next (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    push_node (L, t->next[check_node (L, t, 2)]);
+    return 1;
+}
+
+
+/***
+Obtains a node with all its attributes at once. This is faster than
+calling the other accessors one by one, and it is what renderers use.
+
+@function tree:get
+@param id Node identifier.
+@return Kind, payload data, output name, options table (or `nil`), first
+  child and next sibling.
+*/
+static int
+packedtree_get (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    unsigned id = check_node (L, t, 2);
+    lua_pushstring (L, packed_kinds[t->kind[id]]);
+    push_string (L, t, t->data[id]);
+    push_string (L, t, t->output[id]);
+    lua_getuservalue (L, 1);
+    lua_rawgeti (L, -1, id);
+    lua_remove (L, -2);
+    push_node (L, t->first[id]);
+    push_node (L, t->next[id]);
+    return 6;
+}
+
+
+/***
+Obtains memory usage statistics.
+
+@function tree:stats
+@return Table with the number of `nodes` and distinct `strings`, the size
+  of the `payload`, and the bytes saved by deduplication (`deduped`).
+*/
+static int
+packedtree_stats (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    lua_createtable (L, 0, 4);
+    lua_pushnumber (L, t->nnodes);
+    lua_setfield (L, -2, "nodes");
+    lua_pushnumber (L, t->nstrings - 1);
+    lua_setfield (L, -2, "strings");
+    lua_pushnumber (L, t->payload_len);
+    lua_setfield (L, -2, "payload");
+    lua_pushnumber (L, t->deduped);
+    lua_setfield (L, -2, "deduped");
+    return 1;
+}
+
+
+static int
+packedtree_len (lua_State *L)
+{
+    lua_pushinteger (L, check_tree (L, 1)->nnodes);
+    return 1;
+}
+
+
+static int
+packedtree_gc (lua_State *L)
+{
+    packed_tree *t = check_tree (L, 1);
+    free (t->kind);
+    free (t->parent);
+    free (t->first);
+    free (t->last);
+    free (t->next);
+    free (t->data);
+    free (t->output);
+    free (t->payload);
+    free (t->strings);
+    free (t->buckets);
+    memset (t, 0, sizeof (packed_tree));
+    return 0;
+}
+
+
+static const luaL_Reg packedtree_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, packedtree_ ## _name }
+    REG_ITEM (node),
+    REG_ITEM (append),
+    REG_ITEM (unlink),
+    REG_ITEM (kind),
+    REG_ITEM (data),
+    REG_ITEM (output),
+    REG_ITEM (options),
+    REG_ITEM (set_options),
+    REG_ITEM (parent),
+    REG_ITEM (first),
+    REG_ITEM (next),
+    REG_ITEM (get),
+    REG_ITEM (stats),
+#undef REG_ITEM
+    { "__len", packedtree_len },
+    { "__gc",  packedtree_gc  },
+    { NULL, NULL }
+};
+
+static const luaL_Reg packedtree_funcs[] =
+{
+    { "new", packedtree_new },
+    { NULL, NULL }
+};
+
+
+int
+lua_packedtree_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, PACKEDTREE_MT);
+    luaL_setfuncs (L, packedtree_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, packedtree_funcs);
+    return 1;
+}
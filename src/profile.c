@@ -0,0 +1,204 @@
+/*
+ * profile.c
+ * Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+/*
+ * Sampling profiler for Lua code.
+ *
+ * A LUA_MASKCOUNT hook calls chsl_profile_sample() every N instructions,
+ * which walks the Lua call stack and counts how many times each distinct
+ * stack has been seen. The result is written in the "folded stacks" text
+ * format understood by flame graph tools:
+ *
+ *    main@chiseltodev.lua:0;render@doctree.lua:180;walk@doctree.lua:150 42
+ *
+ * Note that samples are taken while the VM executes instructions, so the
+ * time spent inside C functions (string.format, table.concat...) is not
+ * measured: their cost shows up as a lower sample rate of the caller.
+ */
+
+#include "../lua/lua.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#ifndef PROFILE_MAX_DEPTH
+#define PROFILE_MAX_DEPTH 64
+#endif /* !PROFILE_MAX_DEPTH */
+
+#define PROFILE_FRAME_LEN 96
+#define PROFILE_STACK_LEN (PROFILE_MAX_DEPTH * PROFILE_FRAME_LEN)
+
+
+typedef struct {
+    char         *stack;   /* Folded stack, NULL for empty slots. */
+    unsigned long hash;
+    long long     count;
+} profile_entry;
+
+typedef struct chsl_profile {
+    profile_entry *entries;
+    size_t         size;     /* Always a power of two. */
+    size_t         used;
+    long long      samples;
+    char           buffer[PROFILE_STACK_LEN];
+} chsl_profile;
+
+
+chsl_profile*
+chsl_profile_new (void)
+{
+    chsl_profile *prof = calloc (1, sizeof (chsl_profile));
+    if (prof == NULL)
+        return NULL;
+
+    prof->size = 1024;
+    if ((prof->entries = calloc (prof->size, sizeof (profile_entry))) == NULL) {
+        free (prof);
+        return NULL;
+    }
+    return prof;
+}
+
+
+void
+chsl_profile_free (chsl_profile *prof)
+{
+    size_t i;
+
+    if (prof == NULL)
+        return;
+
+    for (i = 0; i < prof->size; i++)
+        free (prof->entries[i].stack);
+    free (prof->entries);
+    free (prof);
+}
+
+
+static unsigned long
+profile_hash (const char *str)
+{
+    unsigned long h = 2166136261UL; /* FNV-1a */
+    for (; *str; str++)
+        h = (h ^ (unsigned char) *str) * 16777619UL;
+    return h;
+}
+
+
+static profile_entry*
+profile_lookup (profile_entry *entries, size_t size, const char *stack,
+                unsigned long hash)
+{
+    size_t i = hash & (size - 1);
+    while (entries[i].stack &&
+           (entries[i].hash != hash || strcmp (entries[i].stack, stack)))
+        i = (i + 1) & (size - 1);
+    return &entries[i];
+}
+
+
+static int
+profile_grow (chsl_profile *prof)
+{
+    size_t size = prof->size * 2;
+    profile_entry *entries = calloc (size, sizeof (profile_entry));
+    size_t i;
+
+    if (entries == NULL)
+        return 0;
+
+    for (i = 0; i < prof->size; i++) {
+        if (prof->entries[i].stack) {
+            *profile_lookup (entries, size, prof->entries[i].stack,
+                             prof->entries[i].hash) = prof->entries[i];
+        }
+    }
+
+    free (prof->entries);
+    prof->entries = entries;
+    prof->size = size;
+    return 1;
+}
+
+
+/*
+ * Records the current call stack. Meant to be called from a
+ * LUA_MASKCOUNT hook.
+ */
+void
+chsl_profile_sample (lua_State *L, chsl_profile *prof)
+{
+    char names[PROFILE_MAX_DEPTH][PROFILE_FRAME_LEN];
+    profile_entry *entry;
+    unsigned long hash;
+    lua_Debug ar;
+    int depth, len;
+    char *p;
+
+    /* Collect frames, innermost first. */
+    for (depth = 0; depth < PROFILE_MAX_DEPTH &&
+                    lua_getstack (L, depth, &ar); depth++) {
+        lua_getinfo (L, "Sn", &ar);
+        if (*ar.what == 'C')
+            snprintf (names[depth], PROFILE_FRAME_LEN, "%s [C]",
+                      ar.name ? ar.name : "?");
+        else if (*ar.what == 'm')
+            snprintf (names[depth], PROFILE_FRAME_LEN, "main@%s",
+                      ar.short_src);
+        else
+            snprintf (names[depth], PROFILE_FRAME_LEN, "%s@%s:%d",
+                      ar.name ? ar.name : "?", ar.short_src, ar.linedefined);
+    }
+
+    if (depth == 0)
+        return;
+
+    /* Fold them, outermost first. Semicolons would split frames. */
+    for (p = prof->buffer; depth--; ) {
+        const char *c;
+        for (c = names[depth]; *c; c++)
+            *p++ = (*c == ';') ? ':' : *c;
+        *p++ = depth ? ';' : '\0';
+    }
+
+    len = p - prof->buffer;
+    hash = profile_hash (prof->buffer);
+    entry = profile_lookup (prof->entries, prof->size, prof->buffer, hash);
+
+    if (entry->stack == NULL) {
+        if ((entry->stack = malloc (len)) == NULL)
+            return;
+        memcpy (entry->stack, prof->buffer, len);
+        entry->hash = hash;
+        if (++prof->used * 2 > prof->size && !profile_grow (prof))
+            return;
+        entry = profile_lookup (prof->entries, prof->size, prof->buffer, hash);
+    }
+
+    entry->count++;
+    prof->samples++;
+}
+
+
+/*
+ * Writes the collected samples in folded stacks format.
+ */
+void
+chsl_profile_write (chsl_profile *prof, FILE *out)
+{
+    size_t i;
+
+    assert (prof);
+    assert (out);
+
+    for (i = 0; i < prof->size; i++)
+        if (prof->entries[i].stack)
+            fprintf (out, "%s %lld\n", prof->entries[i].stack,
+                     prof->entries[i].count);
+    fflush (out);
+}
@@ -0,0 +1,1255 @@
+/***
+Raster images, and their conversion to braille graphics.
+
+Images are grids of 8-bit gray pixels, where 0 is black and 255 is
+white. They can be read from files in the Netpbm formats for bitmaps and
+grayscale images (PBM and PGM, both in their plain and raw variants),
+scaled, and converted to the six-dot cells used by embossers to produce
+graphics: each cell covers two columns and three rows of dots, and
+a dot is embossed for each dark pixel.
+
+Converting gray levels to dots can be done by comparing each pixel with
+a threshold, which suits line art, or by Floyd–Steinberg error diffusion,
+which renders shades as patterns of dots of varying density. The per-pixel
+loops which do not carry state from one pixel to the next (thresholding,
+and inverting the image) use SSE2, when available; error diffusion is
+inherently sequential along each row.
+
+@module raster
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#define RASTER_MT "chisel.raster"
+
+/* Limits for the size of images, in pixels. */
+#define RASTER_MAX_SIDE   32768
+#define RASTER_MAX_PIXELS (64 * 1024 * 1024)
+
+/* Cells for each pattern of dots, in North American Braille ASCII. */
+static const char nabcc_cells[] =
+    " A1B'K2L@CIF/MSP\"E3H9O6R^DJG>NTQ,*5<-U8V.%[$+X!&;:4\\0Z7(_?W]#Y)=";
+
+
+typedef struct {
+    size_t        width;
+    size_t        height;
+    unsigned char pixels[1];
+} raster;
+
+
+static inline raster*
+check_raster (lua_State *L, int index)
+{
+    return (raster*) luaL_checkudata (L, index, RASTER_MT);
+}
+
+
+static raster*
+raster_push (lua_State *L, size_t width, size_t height)
+{
+    raster *r;
+
+    assert (width && height);
+    assert (width <= RASTER_MAX_SIDE && height <= RASTER_MAX_SIDE);
+
+    r = lua_newuserdata (L, offsetof (raster, pixels) + width * height);
+    r->width = width;
+    r->height = height;
+    luaL_setmetatable (L, RASTER_MT);
+    return r;
+}
+
+
+static const char*
+check_size (size_t width, size_t height)
+{
+    if (width == 0 || height == 0)
+        return "image is empty";
+    if (width > RASTER_MAX_SIDE || height > RASTER_MAX_SIDE ||
+        width * height > RASTER_MAX_PIXELS)
+        return "image is too big";
+    return NULL;
+}
+
+
+/*
+ * Netpbm headers are made of fields separated by whitespace, and comments
+ * run from a '#' to the end of the line.
+ */
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} pnm_reader;
+
+static inline int
+is_space (unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+           c == '\v' || c == '\f';
+}
+
+static void
+pnm_skip (pnm_reader *r)
+{
+    while (r->p < r->end) {
+        if (*r->p == '#') {
+            while (r->p < r->end && *r->p != '\n')
+                r->p++;
+        } else if (is_space (*r->p)) {
+            r->p++;
+        } else {
+            break;
+        }
+    }
+}
+
+static int
+pnm_number (pnm_reader *r, unsigned *value)
+{
+    unsigned v = 0;
+
+    pnm_skip (r);
+    if (r->p == r->end || *r->p < '0' || *r->p > '9')
+        return 0;
+
+    for (; r->p < r->end && *r->p >= '0' && *r->p <= '9'; r->p++) {
+        if (v > (RASTER_MAX_PIXELS - 9) / 10)
+            return 0;
+        v = v * 10 + (*r->p - '0');
+    }
+    *value = v;
+    return 1;
+}
+
+
+static const char*
+pnm_decode (lua_State *L, const unsigned char *data, size_t len)
+{
+    pnm_reader rd = { data, data + len };
+    unsigned width, height, maxval = 1;
+    const char *err;
+    raster *r;
+    size_t i, n;
+    int format;
+
+    if (len < 2 || data[0] != 'P' || data[1] < '1' || data[1] > '5' ||
+        data[1] == '3')
+        return "not a PBM or PGM image";
+    format = data[1] - '0';
+    rd.p += 2;
+
+    if (!pnm_number (&rd, &width) || !pnm_number (&rd, &height))
+        return "invalid header";
+    if ((err = check_size (width, height)) != NULL)
+        return err;
+    if (format == 2 || format == 5) {
+        if (!pnm_number (&rd, &maxval) || maxval == 0 || maxval > 65535)
+            return "invalid maximum gray value";
+    }
+
+    /* Raw formats have a single whitespace character before the data. */
+    if (format >= 4) {
+        if (rd.p == rd.end || !is_space (*rd.p))
+            return "invalid header";
+        rd.p++;
+    }
+
+    r = raster_push (L, width, height);
+    n = (size_t) width * height;
+
+    switch (format) {
+        case 1: /* Plain PBM: digits, which need not be separated. */
+            for (i = 0; i < n; i++, rd.p++) {
+                pnm_skip (&rd);
+                if (rd.p == rd.end || (*rd.p != '0' && *rd.p != '1'))
+                    return "truncated or invalid data";
+                r->pixels[i] = (*rd.p == '1') ? 0 : 255;
+            }
+            break;
+
+        case 2: /* Plain PGM: numbers. */
+            for (i = 0; i < n; i++) {
+                unsigned v;
+                if (!pnm_number (&rd, &v) || v > maxval)
+                    return "truncated or invalid data";
+                r->pixels[i] = (v * 255 + maxval / 2) / maxval;
+            }
+            break;
+
+        case 4: { /* Raw PBM: rows are packed in bytes, MSB first. */
+            size_t stride = (width + 7) / 8;
+            size_t x, y;
+            if ((size_t) (rd.end - rd.p) < stride * height)
+                return "truncated data";
+            for (y = 0; y < height; y++, rd.p += stride)
+                for (x = 0; x < width; x++)
+                    r->pixels[y * width + x] =
+                        (rd.p[x / 8] & (0x80 >> (x % 8))) ? 0 : 255;
+            break;
+        }
+
+        case 5: /* Raw PGM: one or two bytes (big endian) per pixel. */
+            if (maxval < 256) {
+                if ((size_t) (rd.end - rd.p) < n)
+                    return "truncated data";
+                if (maxval == 255) {
+                    memcpy (r->pixels, rd.p, n);
+                } else {
+                    for (i = 0; i < n; i++) {
+                        unsigned v = rd.p[i] > maxval ? maxval : rd.p[i];
+                        r->pixels[i] = (v * 255 + maxval / 2) / maxval;
+                    }
+                }
+            } else {
+                if ((size_t) (rd.end - rd.p) < 2 * n)
+                    return "truncated data";
+                for (i = 0; i < n; i++) {
+                    unsigned v = (rd.p[2 * i] << 8) | rd.p[2 * i + 1];
+                    if (v > maxval)
+                        v = maxval;
+                    r->pixels[i] = (v * 255 + maxval / 2) / maxval;
+                }
+            }
+            break;
+    }
+    return NULL;
+}
+
+
+/***
+Decodes an image in one of the Netpbm formats.
+
+Both the plain (`P1` and `P2`) and raw (`P4` and `P5`) variants of PBM and
+PGM are supported, with up to 16 bits per pixel. Gray levels are scaled
+to the 0–255 range.
+
+@function decode
+@param data String with the contents of an image file.
+@return An image object, or `nil` and an error message.
+*/
+static int
+raster_decode (lua_State *L)
+{
+    size_t len;
+    const unsigned char *data =
+        (const unsigned char*) luaL_checklstring (L, 1, &len);
+    const char *err;
+
+    if ((err = pnm_decode (L, data, len)) != NULL) {
+        lua_pushnil (L);
+        lua_pushstring (L, err);
+        return 2;
+    }
+    return 1;
+}
+
+
+/***
+Loads an image from a file in one of the Netpbm formats.
+
+@function load
+@param path Path to the file.
+@return An image object, or `nil` and an error message.
+@see decode
+*/
+static int
+raster_load (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+    unsigned char *data = NULL;
+    size_t len = 0, size = 0;
+    const char *err;
+    FILE *fp;
+
+    if ((fp = fopen (path, "rb")) == NULL) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (errno));
+        return 2;
+    }
+
+    for (;;) {
+        if (len == size) {
+            unsigned char *grown;
+            size = size ? size * 2 : 64 * 1024;
+            if ((grown = realloc (data, size)) == NULL) {
+                free (data);
+                fclose (fp);
+                return luaL_error (L, "out of memory");
+            }
+            data = grown;
+        }
+        len += fread (data + len, 1, size - len, fp);
+        if (len < size)
+            break;
+    }
+
+    if (ferror (fp)) {
+        int saved_errno = errno;
+        free (data);
+        fclose (fp);
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, strerror (saved_errno));
+        return 2;
+    }
+    fclose (fp);
+
+    err = pnm_decode (L, data, len);
+    free (data);
+
+    if (err != NULL) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s: %s", path, err);
+        return 2;
+    }
+    return 1;
+}
+
+
+/***
+Creates an image.
+
+@function new
+@param width Width, in pixels.
+@param height Height, in pixels.
+@param pixels String with `width * height` gray levels, one byte per pixel
+  and row by row. If not given, the image is white *(Optional)*.
+@return An image object.
+*/
+static int
+raster_new (lua_State *L)
+{
+    lua_Integer width = luaL_checkinteger (L, 1);
+    lua_Integer height = luaL_checkinteger (L, 2);
+    const char *pixels, *err;
+    size_t len;
+    raster *r;
+
+    luaL_argcheck (L, width > 0, 1, "must be positive");
+    luaL_argcheck (L, height > 0, 2, "must be positive");
+    if ((err = check_size (width, height)) != NULL)
+        return luaL_error (L, "%s", err);
+
+    pixels = luaL_optlstring (L, 3, NULL, &len);
+    luaL_argcheck (L, pixels == NULL || len == (size_t) (width * height), 3,
+                   "length does not match the size");
+
+    r = raster_push (L, width, height);
+    if (pixels)
+        memcpy (r->pixels, pixels, len);
+    else
+        memset (r->pixels, 255, width * height);
+    return 1;
+}
+
+
+/*
+ * Adds a line of cells, for up to three rows of dots (one byte per dot,
+ * set where a dot goes) which follow each other in memory. Blank cells at
+ * the end of the line are left out.
+ */
+static void
+pack_cells (luaL_Buffer *b, const unsigned char *dots, size_t width,
+            size_t rows, const char *cells)
+{
+    size_t columns = (width + 1) / 2;
+    char *line = luaL_prepbuffsize (b, columns + 1);
+    size_t used = 0, x;
+
+    for (x = 0; x < columns; x++) {
+        unsigned pattern = 0, bit = 1;
+        size_t dx, dy;
+        for (dx = 0; dx < 2; dx++) {
+            for (dy = 0; dy < 3; dy++, bit <<= 1) {
+                size_t px = 2 * x + dx;
+                if (px < width && dy < rows && dots[dy * width + px])
+                    pattern |= bit;
+            }
+        }
+        line[x] = cells[pattern];
+        if (pattern)
+            used = x + 1;
+    }
+    line[used] = '\n';
+    luaL_addsize (b, used + 1);
+}
+
+
+/*
+ * Obtains the "cells" field of the options table at the given index.
+ */
+static const char*
+opt_cells (lua_State *L, int index)
+{
+    const char *cells = nabcc_cells;
+    size_t len;
+
+    lua_getfield (L, index, "cells");
+    if (!lua_isnil (L, -1)) {
+        cells = luaL_checklstring (L, -1, &len);
+        luaL_argcheck (L, len == 64, index, "cells must have 64 characters");
+    }
+    lua_pop (L, 1); /* The string is still referenced by the table. */
+    return cells;
+}
+
+
+/*
+ * Shapes are drawn from their edges, in dot coordinates: the dot at row
+ * j and column i is centered at (i, j). Strokes set the dots which edges
+ * go through, and fills also set the dots whose centers are inside the
+ * shape, following the even-odd rule.
+ */
+typedef struct {
+    double x0, y0;
+    double x1, y1;
+} edge;
+
+typedef struct {
+    size_t first;   /* First edge. */
+    size_t nedges;
+    int    fill;
+    double ymin;
+    double ymax;
+} shape;
+
+enum { SHAPE_LINE, SHAPE_POLYLINE, SHAPE_CIRCLE, SHAPE_FILL };
+
+static const char *const shape_kinds[] = {
+    "line", "polyline", "circle", "fill", NULL
+};
+
+/* Number of segments used to approximate a circle, about one per dot. */
+static size_t
+circle_segments (double rx, double ry)
+{
+    double n = ceil (2 * M_PI * (rx > ry ? rx : ry));
+    return n < 8 ? 8 : (n > 4096 ? 4096 : (size_t) n);
+}
+
+
+/*
+ * Checks the shape at the top of the stack, and returns its kind. The
+ * number of edges it has is stored in *nedges.
+ */
+static int
+check_shape (lua_State *L, int i, double x_scale, double y_scale,
+             size_t *nedges)
+{
+    const char *name;
+    int kind, closed, k;
+    size_t n;
+
+    if (!lua_istable (L, -1))
+        return luaL_error (L, "shape %d: not a table", i);
+    n = lua_rawlen (L, -1);
+
+    lua_getfield (L, -1, "kind");
+    name = lua_tostring (L, -1);
+    for (kind = 0; shape_kinds[kind]; kind++)
+        if (name && strcmp (name, shape_kinds[kind]) == 0)
+            break;
+    if (shape_kinds[kind] == NULL)
+        return luaL_error (L, "shape %d: invalid kind '%s'", i,
+                           name ? name : "(none)");
+    lua_getfield (L, -2, "closed");
+    closed = lua_toboolean (L, -1);
+    lua_pop (L, 2);
+
+    /* Scaled coordinates must be finite as well, see add_shape(). */
+    for (k = 1; k <= (int) n; k++) {
+        lua_rawgeti (L, -1, k);
+        if (!lua_isnumber (L, -1))
+            return luaL_error (L, "shape %d: coordinate %d is not a number",
+                               i, k);
+        if (!isfinite (lua_tonumber (L, -1) * x_scale) ||
+            !isfinite (lua_tonumber (L, -1) * y_scale))
+            return luaL_error (L, "shape %d: coordinate %d is not finite",
+                               i, k);
+        lua_pop (L, 1);
+    }
+
+    switch (kind) {
+        case SHAPE_LINE:
+        case SHAPE_POLYLINE:
+            if (n < 4 || n % 2)
+                return luaL_error (L, "shape %d: needs pairs of coordinates "
+                                   "for two points or more", i);
+            *nedges = n / 2 - 1 + (kind == SHAPE_POLYLINE && closed);
+            break;
+
+        case SHAPE_FILL:
+            if (n < 6 || n % 2)
+                return luaL_error (L, "shape %d: needs pairs of coordinates "
+                                   "for three points or more", i);
+            *nedges = n / 2;
+            break;
+
+        case SHAPE_CIRCLE: {
+            double r;
+            if (n != 3)
+                return luaL_error (L, "shape %d: needs a center and radius", i);
+            lua_rawgeti (L, -1, 3);
+            r = lua_tonumber (L, -1);
+            lua_pop (L, 1);
+            if (!(r > 0))
+                return luaL_error (L, "shape %d: radius must be positive", i);
+            *nedges = circle_segments (r * x_scale, r * y_scale);
+            break;
+        }
+    }
+    return kind;
+}
+
+
+static inline double
+shape_coord (lua_State *L, int k, double scale)
+{
+    double value;
+    lua_rawgeti (L, -1, k);
+    value = lua_tonumber (L, -1) * scale;
+    lua_pop (L, 1);
+    return value;
+}
+
+/*
+ * Adds the edges of the shape at the top of the stack, and returns the
+ * largest coordinates found in *xmax and *ymax.
+ */
+static void
+add_shape (lua_State *L, int kind, shape *s, edge *edges,
+           double x_scale, double y_scale, double *xmax, double *ymax)
+{
+    size_t k;
+
+    lua_getfield (L, -1, "fill");
+    s->fill = (kind == SHAPE_FILL) || lua_toboolean (L, -1);
+    lua_pop (L, 1);
+
+    if (kind == SHAPE_CIRCLE) {
+        double cx = shape_coord (L, 1, x_scale);
+        double cy = shape_coord (L, 2, y_scale);
+        double rx = shape_coord (L, 3, x_scale);
+        double ry = shape_coord (L, 3, y_scale);
+        for (k = 0; k < s->nedges; k++) {
+            double a0 = 2 * M_PI * k / s->nedges;
+            double a1 = 2 * M_PI * (k + 1) / s->nedges;
+            edges[k].x0 = cx + rx * cos (a0);
+            edges[k].y0 = cy + ry * sin (a0);
+            edges[k].x1 = cx + rx * cos (a1);
+            edges[k].y1 = cy + ry * sin (a1);
+        }
+    } else {
+        size_t npoints = lua_rawlen (L, -1) / 2;
+        for (k = 0; k < s->nedges; k++) {
+            size_t a = k, b = (k + 1) % npoints;
+            edges[k].x0 = shape_coord (L, 2 * a + 1, x_scale);
+            edges[k].y0 = shape_coord (L, 2 * a + 2, y_scale);
+            edges[k].x1 = shape_coord (L, 2 * b + 1, x_scale);
+            edges[k].y1 = shape_coord (L, 2 * b + 2, y_scale);
+        }
+    }
+
+    s->ymin = HUGE_VAL;
+    s->ymax = -HUGE_VAL;
+    for (k = 0; k < s->nedges; k++) {
+        const edge *e = edges + k;
+        if (e->y0 < s->ymin) s->ymin = e->y0;
+        if (e->y1 < s->ymin) s->ymin = e->y1;
+        if (e->y0 > s->ymax) s->ymax = e->y0;
+        if (e->y1 > s->ymax) s->ymax = e->y1;
+        if (e->x0 > *xmax) *xmax = e->x0;
+        if (e->x1 > *xmax) *xmax = e->x1;
+    }
+    if (s->ymax > *ymax)
+        *ymax = s->ymax;
+}
+
+
+/* Sets the dots from column lo to column hi, both included. */
+static inline void
+set_span (unsigned char *row, size_t width, double lo, double hi)
+{
+    /* Also skips NaN, from edges which span most of the double range. */
+    if (!(lo <= hi) || hi < 0 || lo > (double) width - 1)
+        return;
+    if (lo < 0)
+        lo = 0;
+    if (hi > (double) width - 1)
+        hi = (double) width - 1;
+    memset (row + (size_t) lo, 1, (size_t) hi - (size_t) lo + 1);
+}
+
+/*
+ * Sets the dots of row y which the edge goes through: those whose
+ * extent, from x - 0.5 to x + 0.5, overlaps the part of the edge
+ * between y - 0.5 and y + 0.5.
+ */
+static void
+stroke_row (const edge *e, double y, unsigned char *row, size_t width)
+{
+    double dy = e->y1 - e->y0;
+    double xa, xb;
+
+    if ((e->y0 < e->y1 ? e->y0 : e->y1) >= y + 0.5 ||
+        (e->y0 > e->y1 ? e->y0 : e->y1) < y - 0.5)
+        return;
+
+    if (dy == 0) {
+        xa = e->x0;
+        xb = e->x1;
+    } else {
+        double ta = (y - 0.5 - e->y0) / dy;
+        double tb = (y + 0.5 - e->y0) / dy;
+        if (ta > tb) {
+            double t = ta; ta = tb; tb = t;
+        }
+        if (ta < 0) ta = 0;
+        if (tb > 1) tb = 1;
+        xa = e->x0 + ta * (e->x1 - e->x0);
+        xb = e->x0 + tb * (e->x1 - e->x0);
+    }
+    if (xa > xb) {
+        double t = xa; xa = xb; xb = t;
+    }
+
+    xa = floor (xa + 0.5);
+    xb = ceil (xb + 0.5) - 1;
+    set_span (row, width, xa, xb > xa ? xb : xa);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sets the dots of row y whose centers are inside the shape. The edges
+ * crossed by the row are found, and dots are set between each pair of
+ * crossings, from left to right. Edges include their upper end, but not
+ * the lower one, so vertices are not counted twice.
+ */
+static void
+fill_row (const shape *s, const edge *edges, double y, double *xs,
+          unsigned char *row, size_t width)
+{
+    size_t n = 0, k;
+
+    for (k = 0; k < s->nedges; k++) {
+        const edge *e = edges + s->first + k;
+        if ((e->y0 <= y && y < e->y1) || (e->y1 <= y && y < e->y0))
+            xs[n++] = e->x0 + (y - e->y0) * (e->x1 - e->x0) / (e->y1 - e->y0);
+    }
+    qsort (xs, n, sizeof (double), compare_doubles);
+
+    for (k = 0; k + 1 < n; k += 2)
+        set_span (row, width, ceil (xs[k]), ceil (xs[k + 1]) - 1);
+}
+
+
+/*
+ * Shapes of a drawing, with their edges in dot coordinates.
+ */
+typedef struct {
+    shape  *shapes;
+    edge   *edges;
+    double *xs;         /* Space for the crossings of a row. */
+    size_t  nshapes;
+    double  xmax;
+    double  ymax;
+} drawing;
+
+/*
+ * Checks the array of shapes at the given index, and sets up a drawing
+ * with them. Memory for the drawing is kept in userdata values pushed
+ * to the stack, which must be kept there while it is used.
+ */
+static void
+check_drawing (lua_State *L, int index, double x_scale, double y_scale,
+               drawing *d)
+{
+    size_t nedges = 0, maxedges = 0, i;
+
+    /* Shapes are checked first, to know how much space their edges need. */
+    d->nshapes = lua_rawlen (L, index);
+    for (i = 1; i <= d->nshapes; i++) {
+        size_t n;
+        lua_rawgeti (L, index, i);
+        check_shape (L, i, x_scale, y_scale, &n);
+        lua_pop (L, 1);
+        nedges += n;
+        if (n > maxedges)
+            maxedges = n;
+    }
+
+    d->shapes = lua_newuserdata (L, sizeof (shape) * d->nshapes + 1);
+    d->edges = lua_newuserdata (L, sizeof (edge) * nedges + 1);
+    d->xs = lua_newuserdata (L, sizeof (double) * maxedges + 1);
+    d->xmax = d->ymax = 0;
+
+    for (i = 0, nedges = 0; i < d->nshapes; i++) {
+        shape *s = d->shapes + i;
+        int kind;
+        lua_rawgeti (L, index, i + 1);
+        kind = check_shape (L, i + 1, x_scale, y_scale, &s->nedges);
+        s->first = nedges;
+        add_shape (L, kind, s, d->edges + nedges, x_scale, y_scale,
+                   &d->xmax, &d->ymax);
+        nedges += s->nedges;
+        lua_pop (L, 1);
+    }
+}
+
+/*
+ * Sets the dots of row y covered by the shapes of a drawing.
+ */
+static void
+draw_row (const drawing *d, double y, unsigned char *dots, size_t width)
+{
+    size_t i, k;
+
+    for (i = 0; i < d->nshapes; i++) {
+        const shape *s = d->shapes + i;
+        if (s->ymin >= y + 0.5 || s->ymax < y - 0.5)
+            continue;
+        if (s->fill)
+            fill_row (s, d->edges, y, d->xs, dots, width);
+        for (k = 0; k < s->nedges; k++)
+            stroke_row (d->edges + s->first + k, y, dots, width);
+    }
+}
+
+/*
+ * Obtains the "x_scale" and "y_scale" fields of the options table at the
+ * given index.
+ */
+static void
+opt_scale (lua_State *L, int index, double *x_scale, double *y_scale)
+{
+    lua_getfield (L, index, "x_scale");
+    *x_scale = luaL_optnumber (L, -1, 1);
+    lua_getfield (L, index, "y_scale");
+    *y_scale = luaL_optnumber (L, -1, 1);
+    lua_pop (L, 2);
+    luaL_argcheck (L, *x_scale > 0 && *y_scale > 0 &&
+                   isfinite (*x_scale) && isfinite (*y_scale), index,
+                   "scale must be positive and finite");
+}
+
+
+/***
+Draws shapes as braille graphics.
+
+Shapes are drawn on a grid of dots, which is converted to cells one line
+at a time, so only the three rows of dots in a line are kept in memory,
+no matter how big the drawing is. Coordinates are multiplied by the
+scale factors given, to obtain *dot coordinates*, in which the first dot
+of the first line is at (0, 0) and the next dot to its right is at
+(1, 0).
+
+Each shape is a table, in which the `kind` field is one of:
+
+* `"line"` and `"polyline"`: A line through a series of points, whose
+  coordinates are given in pairs, e.g. `{ kind = "line", 0, 0, 10, 5 }`.
+  If `closed` is `true`, the last point is joined to the first one.
+* `"fill"`: A polygon, filled, given by its points like a polyline.
+* `"circle"`: A circle, given by its center and radius, e.g.
+  `{ kind = "circle", 20, 10, 5 }`, which is filled if `fill` is `true`.
+
+@function draw
+@param shapes Array of shapes.
+@param options Table with the following fields, all of them optional:
+
+  * `width` and `height`: Size of the drawing, in dots. By default, the
+    drawing is big enough for all the shapes; parts of shapes outside of
+    it are not drawn.
+  * `x_scale` and `y_scale`: Scale factors for coordinates. The default
+    is one.
+  * `cells`: As for @{raster:cells}.
+
+@return String with the cells, with a newline at the end of each line.
+*/
+static int
+raster_draw (lua_State *L)
+{
+    double x_scale = 1, y_scale = 1;
+    lua_Integer width = 0, height = 0;
+    const char *cells = nabcc_cells;
+    size_t line, lines;
+    unsigned char *band;
+    drawing d;
+    luaL_Buffer b;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil (L, 2)) {
+        luaL_checktype (L, 2, LUA_TTABLE);
+        lua_getfield (L, 2, "width");
+        width = luaL_optinteger (L, -1, 0);
+        lua_getfield (L, 2, "height");
+        height = luaL_optinteger (L, -1, 0);
+        lua_pop (L, 2);
+        luaL_argcheck (L, width >= 0 && height >= 0, 2,
+                       "size must not be negative");
+        opt_scale (L, 2, &x_scale, &y_scale);
+        cells = opt_cells (L, 2);
+    }
+    lua_settop (L, 2);
+    check_drawing (L, 1, x_scale, y_scale, &d);
+
+    /* Checked before converting to integers, which may not fit. */
+    if (width == 0)
+        width = d.xmax < RASTER_MAX_SIDE
+              ? (lua_Integer) floor (d.xmax + 0.5) + 1 : RASTER_MAX_SIDE + 1;
+    if (height == 0)
+        height = d.ymax < RASTER_MAX_SIDE
+               ? (lua_Integer) floor (d.ymax + 0.5) + 1 : RASTER_MAX_SIDE + 1;
+    if (width > RASTER_MAX_SIDE || height > RASTER_MAX_SIDE)
+        return luaL_error (L, "drawing is too big");
+
+    band = lua_newuserdata (L, 3 * width);
+    lines = (height + 2) / 3;
+
+    luaL_buffinit (L, &b);
+    for (line = 0; line < lines; line++) {
+        size_t rows = height - 3 * line, row;
+        if (rows > 3)
+            rows = 3;
+
+        memset (band, 0, 3 * width);
+        for (row = 0; row < rows; row++)
+            draw_row (&d, 3 * line + row, band + row * width, width);
+        pack_cells (&b, band, width, rows, cells);
+    }
+
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Image objects.
+@section raster
+*/
+
+/***
+Obtains the size of an image.
+
+@function raster:size
+@return Width and height, in pixels.
+*/
+static int
+raster_size (lua_State *L)
+{
+    raster *r = check_raster (L, 1);
+    lua_pushinteger (L, r->width);
+    lua_pushinteger (L, r->height);
+    return 2;
+}
+
+
+/***
+Obtains the pixels of an image.
+
+@function raster:pixels
+@return String with one byte per pixel, row by row.
+*/
+static int
+raster_pixels (lua_State *L)
+{
+    raster *r = check_raster (L, 1);
+    lua_pushlstring (L, (const char*) r->pixels, r->width * r->height);
+    return 1;
+}
+
+
+/*
+ * Ranges of source pixels covered by each destination pixel. When
+ * reducing, each range has at least one pixel; when enlarging, ranges
+ * have a single pixel, which is repeated.
+ */
+static void
+scale_ranges (size_t src, size_t dst, size_t *first, size_t *last)
+{
+    size_t i;
+    for (i = 0; i < dst; i++) {
+        first[i] = (uint64_t) i * src / dst;
+        last[i]  = (uint64_t) (i + 1) * src / dst;
+        if (last[i] <= first[i])
+            last[i] = first[i] + 1;
+    }
+}
+
+/***
+Scales an image.
+
+Each pixel of the new image has the average gray level of the area of the
+original image it covers, so fine details are blended together instead
+of being dropped when an image is reduced.
+
+@function raster:scale
+@param width Width of the new image, in pixels.
+@param height Height of the new image, in pixels.
+@return A new image object.
+*/
+static int
+raster_scale (lua_State *L)
+{
+    raster *r = check_raster (L, 1);
+    lua_Integer width = luaL_checkinteger (L, 2);
+    lua_Integer height = luaL_checkinteger (L, 3);
+    size_t *x0, *x1, *y0, *y1;
+    const char *err;
+    raster *s;
+    size_t x, y;
+
+    luaL_argcheck (L, width > 0, 2, "must be positive");
+    luaL_argcheck (L, height > 0, 3, "must be positive");
+    if ((err = check_size (width, height)) != NULL)
+        return luaL_error (L, "%s", err);
+
+    if ((x0 = malloc (sizeof (size_t) * 2 * (width + height))) == NULL)
+        return luaL_error (L, "out of memory");
+    x1 = x0 + width;
+    y0 = x1 + width;
+    y1 = y0 + height;
+    scale_ranges (r->width, width, x0, x1);
+    scale_ranges (r->height, height, y0, y1);
+
+    s = raster_push (L, width, height);
+    for (y = 0; y < (size_t) height; y++) {
+        for (x = 0; x < (size_t) width; x++) {
+            uint64_t sum = 0;
+            size_t i, j, area;
+            for (j = y0[y]; j < y1[y]; j++) {
+                const unsigned char *row = r->pixels + j * r->width;
+                for (i = x0[x]; i < x1[x]; i++)
+                    sum += row[i];
+            }
+            area = (x1[x] - x0[x]) * (y1[y] - y0[y]);
+            s->pixels[y * width + x] = (sum + area / 2) / area;
+        }
+    }
+
+    free (x0);
+    return 1;
+}
+
+
+/***
+Paints shapes on an image, in black.
+
+@function raster:paint
+@param shapes Array of shapes, as for @{draw}. Coordinates are in pixels,
+  multiplied by the scale factors given.
+@param options Table with the `x_scale` and `y_scale` fields, as for
+  @{draw} *(Optional)*.
+@return The image itself.
+*/
+static int
+raster_paint (lua_State *L)
+{
+    raster *r = check_raster (L, 1);
+    double x_scale = 1, y_scale = 1;
+    unsigned char *row;
+    size_t x, y;
+    drawing d;
+
+    luaL_checktype (L, 2, LUA_TTABLE);
+    if (!lua_isnoneornil (L, 3)) {
+        luaL_checktype (L, 3, LUA_TTABLE);
+        opt_scale (L, 3, &x_scale, &y_scale);
+    }
+    lua_settop (L, 3);
+    check_drawing (L, 2, x_scale, y_scale, &d);
+
+    row = lua_newuserdata (L, r->width);
+    for (y = 0; y < r->height; y++) {
+        unsigned char *pixels = r->pixels + y * r->width;
+        memset (row, 0, r->width);
+        draw_row (&d, y, row, r->width);
+        for (x = 0; x < r->width; x++)
+            if (row[x])
+                pixels[x] = 0;
+    }
+
+    lua_settop (L, 1);
+    return 1;
+}
+
+
+/***
+Encodes an image in one of the Netpbm formats.
+
+@function raster:encode
+@param format Either `"pgm"` (the default) for a grayscale image, or
+  `"pbm"` for a bitmap, in which pixels darker than middle gray are black.
+  The raw variants of the formats are used.
+@return String with the contents of an image file.
+*/
+static int
+raster_encode (lua_State *L)
+{
+    static const char *const formats[] = { "pgm", "pbm", NULL };
+    raster *r = check_raster (L, 1);
+    int format = luaL_checkoption (L, 2, "pgm", formats);
+    luaL_Buffer b;
+    size_t x, y;
+
+    luaL_buffinit (L, &b);
+    if (format == 0) {
+        lua_pushfstring (L, "P5\n%d %d\n255\n", (int) r->width,
+                         (int) r->height);
+        luaL_addvalue (&b);
+        luaL_addlstring (&b, (const char*) r->pixels, r->width * r->height);
+    } else {
+        size_t stride = (r->width + 7) / 8;
+        lua_pushfstring (L, "P4\n%d %d\n", (int) r->width, (int) r->height);
+        luaL_addvalue (&b);
+        for (y = 0; y < r->height; y++) {
+            const unsigned char *pixels = r->pixels + y * r->width;
+            unsigned char *out = (unsigned char*) luaL_prepbuffsize (&b, stride);
+            memset (out, 0, stride);
+            for (x = 0; x < r->width; x++)
+                if (pixels[x] < 128)
+                    out[x / 8] |= 0x80 >> (x % 8);
+            luaL_addsize (&b, stride);
+        }
+    }
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/*
+ * Inverts gray levels, so light pixels become dots.
+ */
+static void
+invert_pixels (unsigned char *p, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi8 ((char) 0xFF);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*) (p + i));
+        _mm_storeu_si128 ((__m128i*) (p + i), _mm_xor_si128 (v, ones));
+    }
+#endif /* __SSE2__ */
+
+    for (; i < n; i++)
+        p[i] = ~p[i];
+}
+
+
+/*
+ * Replaces pixels by 1 where a dot goes (darker than the threshold), and
+ * by 0 elsewhere. A pixel is below the threshold when the minimum of both,
+ * with the threshold lowered by one, is the pixel itself.
+ */
+static void
+threshold_pixels (unsigned char *p, size_t n, unsigned threshold)
+{
+    size_t i = 0;
+
+    if (threshold == 0) {
+        memset (p, 0, n);
+        return;
+    }
+
+#if defined(__SSE2__)
+    {
+        const __m128i limit = _mm_set1_epi8 ((char) (threshold - 1));
+        const __m128i one = _mm_set1_epi8 (1);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128 ((const __m128i*) (p + i));
+            __m128i below = _mm_cmpeq_epi8 (_mm_min_epu8 (v, limit), v);
+            _mm_storeu_si128 ((__m128i*) (p + i), _mm_and_si128 (below, one));
+        }
+    }
+#endif /* __SSE2__ */
+
+    for (; i < n; i++)
+        p[i] = p[i] < threshold;
+}
+
+
+/*
+ * Floyd–Steinberg error diffusion, leaving 1 where a dot goes and 0
+ * elsewhere, like threshold_pixels(). Rows are scanned in alternating
+ * directions, which avoids the diagonal artifacts of always scanning
+ * them from left to right. Errors for the current and the next row are
+ * kept with a pixel of padding at both sides.
+ */
+static int
+diffuse_pixels (unsigned char *p, size_t width, size_t height,
+                unsigned threshold)
+{
+    int *errors = calloc (2 * (width + 2), sizeof (int));
+    int *cur, *next;
+    size_t x, y;
+
+    if (errors == NULL)
+        return 0;
+
+    for (y = 0; y < height; y++) {
+        unsigned char *row = p + y * width;
+        int step = (y % 2) ? -1 : 1;
+
+        cur = errors + (y % 2) * (width + 2) + 1;
+        next = errors + ((y + 1) % 2) * (width + 2) + 1;
+        memset (next - 1, 0, sizeof (int) * (width + 2));
+
+        for (x = 0; x < width; x++) {
+            size_t i = (step > 0) ? x : width - 1 - x;
+            int value = row[i] + cur[i] / 16;
+            int dot = value < (int) threshold;
+            int error = value - (dot ? 0 : 255);
+
+            row[i] = dot;
+            cur[i + step]  += error * 7;
+            next[i - step] += error * 3;
+            next[i]        += error * 5;
+            next[i + step] += error;
+        }
+    }
+
+    free (errors);
+    return 1;
+}
+
+
+/***
+Converts an image to braille graphics.
+
+Each cell covers two columns and three rows of pixels, which become its
+dots; if the size of the image is not a multiple of that, it is padded
+with white. Blank cells at the end of each line are not written.
+
+@function raster:cells
+@param options Table with the following fields, all of them optional:
+
+  * `dither`: Either `"threshold"` (the default) or `"floyd-steinberg"`.
+  * `threshold`: Gray level (0–256) below which pixels are dark. The
+    default is 128.
+  * `invert`: If `true`, light pixels become dots instead.
+  * `cells`: String with the 64 characters used for each pattern of dots,
+    indexed by the sum of 2^(dot - 1) for each dot. The default is North
+    American Braille ASCII.
+
+@return String with the cells, with a newline at the end of each line.
+*/
+static int
+raster_cells (lua_State *L)
+{
+    static const char *const dithers[] = { "threshold", "floyd-steinberg", NULL };
+    raster *r = check_raster (L, 1);
+    const char *cells = nabcc_cells;
+    lua_Integer threshold = 128;
+    int dither = 0, invert = 0;
+    size_t n = r->width * r->height;
+    size_t columns, lines, y;
+    unsigned char *dots;
+    luaL_Buffer b;
+
+    if (!lua_isnoneornil (L, 2)) {
+        luaL_checktype (L, 2, LUA_TTABLE);
+
+        lua_getfield (L, 2, "dither");
+        dither = luaL_checkoption (L, -1, "threshold", dithers);
+        lua_getfield (L, 2, "threshold");
+        threshold = luaL_optinteger (L, -1, threshold);
+        luaL_argcheck (L, threshold >= 0 && threshold <= 256, 2,
+                       "threshold is out of range");
+        lua_getfield (L, 2, "invert");
+        invert = lua_toboolean (L, -1);
+        lua_pop (L, 3);
+        cells = opt_cells (L, 2);
+    }
+
+    if ((dots = malloc (n)) == NULL)
+        return luaL_error (L, "out of memory");
+    memcpy (dots, r->pixels, n);
+
+    if (invert)
+        invert_pixels (dots, n);
+    if (dither == 0) {
+        threshold_pixels (dots, n, threshold);
+    } else if (!diffuse_pixels (dots, r->width, r->height, threshold)) {
+        free (dots);
+        return luaL_error (L, "out of memory");
+    }
+
+    columns = (r->width + 1) / 2;
+    lines = (r->height + 2) / 3;
+
+    luaL_buffinitsize (L, &b, lines * (columns + 1));
+    for (y = 0; y < lines; y++) {
+        size_t rows = r->height - 3 * y;
+        pack_cells (&b, dots + 3 * y * r->width, r->width,
+                    rows < 3 ? rows : 3, cells);
+    }
+
+    free (dots);
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+static const luaL_Reg raster_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, raster_ ## _name }
+    REG_ITEM (size),
+    REG_ITEM (pixels),
+    REG_ITEM (scale),
+    REG_ITEM (cells),
+    REG_ITEM (paint),
+    REG_ITEM (encode),
+#undef REG_ITEM
+    { NULL, NULL }
+};
+
+static const luaL_Reg raster_funcs[] =
+{
+#define REG_ITEM(_name)  { #_name, raster_ ## _name }
+    REG_ITEM (new),
+    REG_ITEM (decode),
+    REG_ITEM (load),
+    REG_ITEM (draw),
+#undef REG_ITEM
+    { NULL, NULL }
+};
+
+
+int
+lua_raster_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, RASTER_MT);
+    luaL_setfuncs (L, raster_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, raster_funcs);
+    return 1;
+}
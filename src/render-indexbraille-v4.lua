@@ -5,15 +5,21 @@
 -- @license Distributed under terms of the MIT license.
 --
 
-local deepcopy = lib.util.deepcopy
 local callable = lib.ml.callable
 local tstring  = lib.ml.tstring
 local renderer = lib.renderer
 local cset     = lib.charset
-local abs      = math.abs
+local trace    = lib.trace
+local encode   = lib.v4command.encode
 local pairs    = pairs
+local ipairs   = ipairs
+local type     = type
+local next     = next
 local error    = error
 
+local begin_graphics_command = cset.ESC .. "\001" -- Begin 6-dot graphics.
+local end_graphics_command   = cset.ESC .. "\002" -- End 6-dot graphics.
+
 
 --- Support functions
 -- @section dev_ibv4_support
@@ -40,19 +46,115 @@ local line_spacings = {
 local line_spacings_by_name = { single = 5.0; double = 10.0 }
 
 
-local function value_for_closest_key (tab, value)
-  local code = tab[value]
-  if code == nil then
-    -- Search for the closest match
-    local closest
-    for candidate, candidate_code in pairs (tab) do
-      if closest == nil or abs (candidate - value) < abs (closest - value) then
-        closest, code = candidate, candidate_code
+--- Commands which set each option, and their arguments. Options with
+-- `values` are sent as the code of the closest supported value; the
+-- supported values are narrowed down to those listed in the device data
+-- by @{command_map}. See @{v4command.new} for the format.
+--
+local option_commands = {
+  dot_distance        = { "DGD"; values = dot_distances };
+  line_spacing        = { "DLS"; values = line_spacings;
+                          names = line_spacings_by_name };
+  top_margin          = { "DTM"; minimum = 0 };
+  binding_margin      = { "DBI"; minimum = 0 };
+  lines_per_page      = { "DLP"; minimum = 0 };
+  characters_per_line = { "DCH"; minimum = 0 };
+}
+
+
+--- Command encoders for each device, created by @{ibv4:get_encoder}.
+--
+local encoders = setmetatable ({}, { __mode = "k" })
+
+
+--- Contraction tables, loaded on demand by @{ibv4:translation_option}.
+--
+local contraction_tables = {}
+
+
+--- Hyphenation tables, loaded on demand by @{ibv4:hyphenation_option}.
+--
+local hyphenation_tables = {}
+
+
+--- Options which define how text is laid out, see @{ibv4:update_formatter}.
+--
+local text_layout_options = {
+  characters_per_line = true;
+  lines_per_page      = true;
+  binding_margin      = true;
+  top_margin          = true;
+  wrap_text           = true;
+  hyphenation         = true;
+}
+
+
+--- Names of the options used for graphics, without the `graphics_`
+-- prefix (or `false` for other options), computed on demand.
+--
+local graphics_options = setmetatable ({}, { __index = function (t, key)
+  local option = false
+  if key:sub (1, #"graphics_") == "graphics_" then
+    option = key:sub (#"graphics_" + 1)
+  end
+  t[key] = option
+  return option
+end })
+
+
+--- Trace event identifiers.
+--
+local trace_begin_document = trace.event ("ibv4:begin_document")
+local trace_end_document   = trace.event ("ibv4:end_document")
+
+--- Trace event identifiers for option changes, created on demand.
+--
+local trace_option = setmetatable ({}, { __index = function (t, option)
+  local event = trace.event ("ibv4:option:" .. option)
+  t[option] = event
+  return event
+end })
+
+
+--- Builds the map of options to commands for a device.
+--
+-- Options with a set of values only accept the values listed for the
+-- option in the device data (when the protocol supports any of them),
+-- and names of values (like `single = 5.0`) are taken from it as well.
+--
+-- @param device Device data (see @{device.get}).
+-- @return Table suitable for @{v4command.new}.
+-- @function command_map
+--
+local function command_map (device)
+  local map = {}
+  for option, spec in pairs (option_commands) do
+    local info = device.options and device.options[option]
+    local entry = { spec[1]; minimum = spec.minimum; maximum = spec.maximum;
+                    values = spec.values; names = spec.names }
+
+    if info ~= nil and spec.values ~= nil then
+      local values, names = {}, {}
+      for _, value in ipairs (info) do
+        if type (value) == "number" then
+          values[value] = spec.values[value]
+        end
+      end
+      for name, value in pairs (info) do
+        if type (name) == "string" and type (value) == "number" then
+          names[name] = value
+        end
+      end
+      if next (values) ~= nil then
+        entry.values = values
+      end
+      if next (names) ~= nil then
+        entry.names = names
       end
     end
-    value = closest
+    map[option] = entry
   end
-  return value, code
+  return map
 end
 
 
@@ -97,53 +199,76 @@ ibv4.description = [[\
 Output to Index Braille embossers using version 4 of the protocol.
 ]]
 
+--- Intersects two sets of options (see @{intersect_options}).
+ibv4.intersect_options = intersect_options
+
 --- Sends data inside an escape sequence.
 --
 -- Escape sequences are made by an ASCII escape character, a sequence of
 -- a command and its arguments, and a semicolon used for terminating the
 -- escape sequence.
 --
--- @param ... Format string and its arguments. Those are passed as-is
--- to `renderer:format`.
+-- @param name Command name, e.g. `"DCH"`.
+-- @param arg Argument, either a number or a string *(Optional)*.
 -- @return The renderer itself, to allow chaining commands.
 --
-function ibv4:esc (...)
-	return self:write (cset.ESC):format (...):write (";")
+function ibv4:esc (name, arg)
+	return self:write (encode (name, arg))
 end
 
---- Sends a dot-distance option. The value passed will be searched in
--- the @{dot_distances} table. If not found, the closest value will be
--- chosen.
+
+--- Obtains the command encoder for the device of the renderer. Encoders
+-- are created from @{command_map} the first time, and then reused.
+--
+-- @return A @{v4command} encoder.
+--
+function ibv4:get_encoder ()
+  local device = self.device
+  local encoder = encoders[device]
+  if encoder == nil then
+    encoder = lib.v4command.new (command_map (device), self.name)
+    encoders[device] = encoder
+  end
+  return encoder
+end
+
+
+-- Sends the command for an option handled by the encoder.
+local function send_option (self, option, value)
+  local data, chosen = self:get_encoder ():option (option, value)
+  log_debug ("%s:%s requested %s, chosen %s\n", self.name, option,
+             tostring (value), tostring (chosen))
+  self:write (data)
+  return chosen
+end
+
+
+--- Sends a dot-distance option. The command is obtained from the encoder
+-- of the device (see @{ibv4:get_encoder}), which chooses the closest of the
+-- dot distances that @{command_map} found supported by the device. A value
+-- the device does not support is thus replaced by its closest one, and
+-- the value actually sent is returned.
 --
 -- @param value Dot distance, in millimeters.
 -- @return Actual value selected.
 --
 function ibv4:dot_distance_option (value)
-  local chosen, code = value_for_closest_key (dot_distances, value,
-                                              self.name .. ":dot_distance_option")
-	log_debug ("%s:dot_distance requested %f, chosen %f\n", self.name, value, chosen)
-	self:esc ("DGD%i", code)
-	return chosen
+  return send_option (self, "dot_distance", value)
 end
 
 
---- Sends a line-spacing option. The value passed will be searched in the
--- @{line_spacings} table. If not found, the closest value will be chosen.
+--- Sends a line-spacing option. The command is obtained from the encoder
+-- of the device (see @{ibv4:get_encoder}), which chooses the closest of the
+-- line spacings that @{command_map} found supported by the device. Names
+-- are looked up in the device data as well; an unknown name raises an
+-- error, and an unsupported value is replaced by its closest one.
 --
 -- @param value Line spacing, in millimeters. The string values `"single"`
 --   and `"double"` are also accepted.
 -- @return Actual value selected.
 --
 function ibv4:line_spacing_option (value)
-  if type (value) == "string" then
-    value = line_spacings_by_name[value]
-  end
-
-  local chosen, code = value_for_closest_key (line_spacings, value,
-                                              self.name .. ":line_spacing_option")
-	log_debug ("%s:line_spacing requested %f, chosen %f\n", self.name, value, chosen)
-  self:esc ("DLS%i", code)
-  return chosen
+  return send_option (self, "line_spacing", value)
 end
 
 
@@ -158,9 +283,9 @@ function ibv4:copies_option (value)
   if value < 1 or value > 10000 then
     error (("%s: copies = %i out of the 1-10.000 range"):format (self.name, value))
   end
-  if value > 2 then
+  if value > 1 then
     log_debug ("%s:copies %i\n", self.name, value)
-    self:esc ("DMC%i", value)
+    self:esc ("DMC", value)
   end
 end
 
@@ -170,11 +295,7 @@ end
 -- @param value Number of empty lines to leave at the top of pages.
 --
 function ibv4:top_margin_option (value)
-  if value < 0 then
-    error (("%s: top_margin = %i is negative"):format (self.name, value))
-  end
-  log_debug ("%s:top_margin %i\n", self.name, value)
-  self:esc ("DTM%i", value)
+  send_option (self, "top_margin", value)
 end
 
 
@@ -184,11 +305,7 @@ end
 -- margin in each line.
 --
 function ibv4:binding_margin_option (value)
-  if value < 0 then
-    error (("%s: binding_margin = %i is negative"):format (self.name, value))
-  end
-  log_debug ("%s:binding_margin %i\n", self.name, value)
-  self:esc ("DBI%i", value)
+  send_option (self, "binding_margin", value)
 end
 
 
@@ -197,11 +314,7 @@ end
 -- @param value Number of lines to fit in each page.
 --
 function ibv4:lines_per_page_option (value)
-  if value < 0 then
-    error (("%s: lines_per_page = %i is negative"):format (self.name, value))
-  end
-  log_debug ("%s:lines_per_page %i\n", self.name, value)
-  self:esc ("DLP%i", value)
+  send_option (self, "lines_per_page", value)
 end
 
 
@@ -210,18 +323,130 @@ end
 -- @param value Number of character to fit in each line.
 --
 function ibv4:characters_per_line_option (value)
-  if value < 0 then
-    error (("%s: characters_per_line = %i is negative"):format (self.name, value))
+  send_option (self, "characters_per_line", value)
+end
+
+
+--- Sets the contraction table used to translate text. This does not send
+-- anything to the device: text is translated before writing it.
+--
+-- @param value Name of a table in `data/_contractions/`, or `"none"`.
+--
+function ibv4:translation_option (value)
+  if value == "none" then
+    self._contraction = nil
+    return
   end
-  log_debug ("%s:characters_per_line %i\n", self.name, value)
-  self:esc ("DCH%i", value)
+
+  local tab = contraction_tables[value]
+  if tab == nil then
+    local path = ("%s/data/_contractions/%s.ctb"):format (chisel.libdir, value)
+    local err
+    tab, err = lib.contract.open (path)
+    if tab == nil then
+      error (("%s: translation = %q is not available (%s)"):format (self.name,
+             value, err))
+    end
+    contraction_tables[value] = tab
+  end
+  log_debug ("%s:translation %s\n", self.name, value)
+  self._contraction = tab
+end
+
+
+--- Sets whether text is wrapped and paginated by the renderer. This does
+-- not send anything to the device, see @{ibv4:update_formatter}.
+--
+-- @param value Boolean.
+--
+function ibv4:wrap_text_option (value)
+  log_debug ("%s:wrap_text %s\n", self.name, tostring (value))
+end
+
+
+--- Sets the patterns used to hyphenate words when wrapping text. This
+-- does not send anything to the device, and has no effect unless the
+-- `wrap_text` option is enabled.
+--
+-- @param value Name of a table in `data/_hyphenation/`, or `"none"`.
+--
+function ibv4:hyphenation_option (value)
+  if value == "none" then
+    self._hyphenator = nil
+    return
+  end
+
+  local tab = hyphenation_tables[value]
+  if tab == nil then
+    local path = ("%s/data/_hyphenation/%s.htb"):format (chisel.libdir, value)
+    local err
+    tab, err = lib.hyphen.open (path)
+    if tab == nil then
+      error (("%s: hyphenation = %q is not available (%s)"):format (self.name,
+             value, err))
+    end
+    hyphenation_tables[value] = tab
+  end
+  log_debug ("%s:hyphenation %s\n", self.name, value)
+  self._hyphenator = tab
+end
+
+
+--- Creates, reconfigures, or removes the formatter used to lay out text,
+-- according to the current `wrap_text` and `hyphenation` options, and the
+-- text area options.
+--
+function ibv4:update_formatter ()
+  local options = self._options
+  if not options.wrap_text then
+    self._formatter = nil
+    return
+  end
+
+  local area = {
+    characters_per_line = options.characters_per_line;
+    lines_per_page      = options.lines_per_page;
+    binding_margin      = options.binding_margin or 0;
+    top_margin          = options.top_margin or 0;
+    hyphenator          = self._hyphenator or false;
+  }
+  if self._formatter == nil then
+    self._formatter = lib.formatter.new (area)
+  else
+    self._formatter:configure (area)
+  end
+end
+
+
+--- Writes text, passing it through the contraction table, the braille
+-- ASCII translator and the formatter, as needed.
+--
+-- @param data String with the text.
+--
+function ibv4:write_text (data)
+	if self._contraction ~= nil then
+		data = self._contraction:translate (data)
+	end
+	if self._translator ~= nil then
+		data = self._translator:translate (data)
+	end
+	if self._formatter ~= nil then
+		data = self._formatter:format (data)
+	end
+	return self:write (data)
 end
 
 
 function ibv4:begin_document (node)
+	trace.record (trace_begin_document)
+
+	-- Text is translated to the braille ASCII table of the device.
+	self._translator = self.device:create_translator ()
+	self._formatter  = nil
+
 	-- The version parameter does not control any setting, but allows to
 	-- track which combiation of driver/version generated the data stream.
-	self:esc ("DVchisel-v%s", chisel.version)
+	self:esc ("DV", "chisel-v" .. chisel.version)
 
 	-- Set the initial options
 	if self.device.default ~= nil then
@@ -238,6 +463,32 @@ end
 
 
 function ibv4:end_document (node)
+	trace.record (trace_end_document)
+
+	-- Write out an incomplete UTF-8 sequence at the end of the text.
+	if self._translator ~= nil then
+		local data = self._translator:flush ()
+		if self._formatter ~= nil then
+			data = self._formatter:format (data)
+		end
+		self:write (data)
+		if log_verbose_enabled and self._translator:unknown () > 0 then
+			log_verbose ("%s: %i characters could not be translated\n",
+			             self.name, self._translator:unknown ())
+		end
+	end
+
+	-- Same for the word at the end of the text.
+	if self._formatter ~= nil then
+		self:write (self._formatter:flush ())
+		if log_verbose_enabled then
+			local stats = self._formatter:stats ()
+			log_verbose ("%s: text laid out in %i pages, %i lines (%i wrapped, %i hyphenated, %i split words)\n",
+			             self.name, stats.pages, stats.lines, stats.wrapped,
+			             stats.hyphenated, stats.split)
+		end
+	end
+
 	-- Also, reset the device to the default options at the end of
 	-- the document, to leave it in a well-known state.
 	if self.device.default ~= nil then
@@ -247,34 +498,61 @@ function ibv4:end_document (node)
 end
 
 
+function ibv4:cancel ()
+	-- Pending text is dropped, and a block of graphics is closed, so the
+	-- commands which follow are not taken as graphics data.
+	if self._graphics then
+		self:write (end_graphics_command)
+		self._graphics = nil
+	end
+	self._translator = nil
+	self._formatter  = nil
+	return renderer.cancel (self)
+end
+
+
 function ibv4:begin_text (node)
-	self:write (node.data)
+	self:write_text (node.data)
 end
 
 
 function ibv4:begin_graphics (node)
-  local old_options = self:get_options ()
+  local old_options = {}
   local gfx_options = {}
 
-  -- Modify the "graphics_*" options only
-  for key, value in pairs (old_options) do
-    if key:sub (1, #"graphics_") == "graphics_" then
-      gfx_options[key:sub (#"graphics_" + 1)] = value
+  -- Pending text goes before the graphics. Note that the formatter does
+  -- not know about the space taken by graphics in the page.
+  if self._formatter ~= nil then
+    self:write (self._formatter:flush ())
+  end
+
+  -- Save the current options (their values are never tables, so there is
+  -- no need for a deep copy), and modify the "graphics_*" options only.
+  for key, value in pairs (self._options) do
+    old_options[key] = value
+    local option = graphics_options[key]
+    if option then
+      gfx_options[option] = value
     end
   end
 
   -- Temporarily enable the graphics options, send out the
   -- graphics data, and the restore the saved options.
   self:set_options (gfx_options)
-  self:write (cset.ESC):write ("\001") -- 0x1B 0x01 - begin 6-dot graphics.
-  self:write (node.data)               -- Write graphics data payload.
-  self:write (cset.ESC):write ("\002") -- 0x1B 0x02 - end 6-dot graphics.
+  self._graphics = true
+  self:write (begin_graphics_command)
+  self:write (node.data)
+  self:write (end_graphics_command)
+  self._graphics = nil
   self:set_options (old_options)
 end
 
 
 function ibv4:set_options (options)
-	log_debug ("ibv4:set_options(): %s\n", tstring (options))
+	if log_debug_enabled then
+		log_debug ("ibv4:set_options(): %s\n", tstring (options))
+	end
+
 	local changed_options
 	if self._options == nil then
 		changed_options = options
@@ -283,25 +561,58 @@ function ibv4:set_options (options)
 		changed_options = intersect_options (self._options, options)
 	end
 
+	-- Pending text is laid out with the options in effect when it was given.
+	if self._formatter ~= nil and next (changed_options) ~= nil then
+		self:write (self._formatter:flush ())
+	end
+
+	-- Commands for all the options handled by the encoder are sent at once.
+	local encoder = self:get_encoder ()
+	local commands = encoder:options (changed_options)
+	if #commands > 0 then
+		self:write (commands)
+	end
+
+	local update_formatter = false
 	for option, value in pairs (changed_options) do
 		-- Update the table tracking the current options
 		self._options[option] = value
+		trace.record (trace_option[option], tonumber (value) or 0)
 
-		-- Call the method which sets the option (if exists)
-		local method = self[option .. "_option"]
-		if callable (method) then
-			method (self, value)
+		-- Other options call the method which sets them (if exists)
+		if option_commands[option] ~= nil then
+			if log_debug_enabled then
+				log_debug ("%s:%s %s\n", self.name, option, tostring (value))
+			end
 		else
-			log_debug ("%s: ignoring option %q\n", self.name, option)
+			local method = self[option .. "_option"]
+			if callable (method) then
+				method (self, value)
+			else
+				log_debug ("%s: ignoring option %q\n", self.name, option)
+			end
+		end
+
+		if text_layout_options[option] then
+			update_formatter = true
 		end
 	end
 
+	if update_formatter then
+		self:update_formatter ()
+	end
+
 	return self
 end
 
 function ibv4:get_options ()
-	-- This returns a *copy* of the options table
-	return deepcopy (self._options)
+	-- This returns a *copy* of the options table. Option values are never
+	-- tables, so there is no need for a deep copy.
+	local options = {}
+	for key, value in pairs (self._options) do
+		options[key] = value
+	end
+	return options
 end
 
 return ibv4
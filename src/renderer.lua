@@ -8,6 +8,29 @@
 local safe_require = lib.ml.safe (require)
 local io_write = io.write
 
+-- Writes to the standard output are split in chunks of this size, which is
+-- at most PIPE_BUF. Writing a chunk to a pipe then either succeeds, or is
+-- interrupted before anything is written, so a signal which cancels the
+-- job is not held back by a device which does not read the rest of a long
+-- text (see renderer:cancel).
+local write_chunk = 4096
+
+local function write_stdout (self, data)
+	local size = #data
+	if size <= write_chunk then
+		io_write (data)
+	else
+		for i = 1, size, write_chunk do
+			io_write (data:sub (i, i + write_chunk - 1))
+		end
+	end
+	return self
+end
+
+-- Size of the blocks read by renderer:write_file() when the data can not
+-- be copied directly to the standard output.
+local file_block_size = 64 * 1024
+
 --- Base class for output rendering.
 --
 -- A renderer implements the conversion from a document tree to a data
@@ -31,8 +54,42 @@ local renderer = object:extend
 	-- @return The renderer itself, to allow call-chaining.
 	-- @function renderer:write
 	--
-	write = function (self, data)
-		io_write (data)
+	write = write_stdout;
+
+	--- Writes the contents of a file to the backend.
+	--
+	-- When the data is sent to the standard output (that is, when the
+	-- @{renderer:write} method was not overridden), the file is copied
+	-- with `fs.sendfile()`, so its contents are not read into memory.
+	-- Otherwise the file is read in blocks, which are passed to the
+	-- write method.
+	--
+	-- @param path Path of the file.
+	-- @return The renderer itself, to allow call-chaining.
+	-- @function renderer:write_file
+	--
+	write_file = function (self, path)
+		if self.write == write_stdout then
+			local size, err = lib.fs.sendfile (path, io.stdout)
+			if size == nil then
+				error (err, 0)
+			end
+			log_debug ("%s: copied %i bytes from '%s'\n", self.name, size, path)
+			return self
+		end
+
+		local file, err = io.open (path, "rb")
+		if file == nil then
+			error (err, 0)
+		end
+		while true do
+			local block = file:read (file_block_size)
+			if block == nil then
+				break
+			end
+			self:write (block)
+		end
+		file:close ()
 		return self
 	end;
 
@@ -58,6 +115,85 @@ local renderer = object:extend
 		log_debug ("renderer:get_options() unimplemented for '%s'\n", self.name)
 	end;
 
+	--- Forgets the state accumulated while rendering a document.
+	--
+	-- Renderers keep track of the options currently active in the device
+	-- (in the `_options` attribute) to avoid sending redundant commands.
+	-- When the same renderer is used for more than one document, this
+	-- must be called before rendering each of them, so the next document
+	-- starts from a clean state.
+	--
+	-- @return The renderer itself, to allow call-chaining.
+	-- @function renderer:reset
+	--
+	reset = function (self)
+		self._options = nil
+		return self
+	end;
+
+	--- Leaves the device in a known state after a job is cancelled.
+	--
+	-- Called instead of finishing the document when rendering stops in
+	-- the middle of it (see `chisel.interrupted()`). The renderer state is
+	-- forgotten, and the default options of the device are sent again.
+	-- Subclasses which may be in the middle of a multi-command sequence
+	-- (e.g. a block of graphics) must close it first.
+	--
+	-- @return The renderer itself, to allow call-chaining.
+	-- @function renderer:cancel
+	--
+	cancel = function (self)
+		local default = self.device and self.device.default
+		self:reset ()
+		if default ~= nil then
+			self:set_options (default)
+		end
+		return self
+	end;
+
+	--- Renders a document, making the number of copies in its options.
+	--
+	-- Renderers which can ask the device to make copies (those with a
+	-- `copies_option` method) get the `copies` option as any other one.
+	-- Otherwise the option is removed from the document, which is then
+	-- rendered once into a @{spool}, and its output written as many times
+	-- as copies are needed, without walking the document again.
+	--
+	-- @param doc Document to render.
+	-- @param threshold Amount of output kept in memory before spooling it
+	-- to a temporary file, in bytes *(Optional)*.
+	-- @return The renderer itself, to allow call-chaining.
+	-- @function renderer:render_copies
+	--
+	render_copies = function (self, doc, threshold)
+		local copies = doc.options and doc.options.copies or 1
+		if copies <= 1 or self.copies_option ~= nil then
+			doc:render (self)
+			return self
+		end
+
+		log_debug ("%s: making %i copies from a spool\n", self.name, copies)
+		doc.options.copies = nil
+
+		local output = lib.spool.new (threshold)
+		local write = rawget (self, "write")
+		self.write = function (rend, data)
+			output:write (data)
+			return rend
+		end
+		local ok, err = pcall (doc.render, doc, self)
+		self.write = write
+
+		if ok then
+			output:replay (function (data) self:write (data) end, copies)
+		end
+		output:close ()
+		if not ok then
+			error (err, 0)
+		end
+		return self
+	end;
+
 	--- Gets a particular renderer given its name.
 	--
 	-- @param name Name of the output renderer, e.g. `indexbraille-v4`.
@@ -7,20 +7,31 @@
 
 if chisel.options["--help"] then
   print [=[
-Usage: chisel-ut file1.lua [file2.lua [... fileN.lua]]
+Usage: chisel-ut [bench=1] file1.lua [file2.lua [... fileN.lua]]
 
 Runs the given Lua source files as unit tests.
+
+With bench=1, functions whose name starts with "bench" are run as
+benchmarks as well, and checks done with assert_faster_than() are
+enabled. The time per call of each benchmark is reported.
 ]=]
   return
 end
 
 local lunit = lib.lunit
 
+if chisel.options.bench then
+  lunit.benchmode = true
+  lunit.clock = chisel.now
+end
+
 for _, filename in ipairs (chisel.argv) do
-  print ("loading: " .. filename)
-  local ut_env = lunit.module (filename, "seeall")
-  local chunk  = assert (loadfile (filename, "bt", ut_env))
-  chunk ()
+  if not filename:find ("=", 1, true) then
+    print ("loading: " .. filename)
+    local ut_env = lunit.module (filename, "seeall")
+    local chunk  = assert (loadfile (filename, "bt", ut_env))
+    chunk ()
+  end
 end
 
 io.stdout:write ("running:")
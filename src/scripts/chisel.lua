@@ -6,9 +6,7 @@
 -- Distributed under terms of the MIT license.
 --
 
-local isdir = lib.fs.isdir
-local listdir = lib.fs.listdir
-local basename = lib.fs.basename
+local readdir = lib.fs.dir
 
 local filter_out_commands = {
   ["chisel-ut"] = true;
@@ -20,8 +18,8 @@ Usage: chisel -S <command> -- <command arguments...>
 The following is a list of the available commands:
 ]]
 
-for _, name in ipairs (listdir (chisel.libdir .. "/scripts/")) do
-  if name:sub (-#".lua") == ".lua" then
+for name, kind in readdir (chisel.libdir .. "/scripts/") do
+  if kind ~= "directory" and name:sub (-#".lua") == ".lua" then
     name = name:sub (1, -#".lua"-1)
     if not filter_out_commands[name] then
       print (" - " .. name)
@@ -11,11 +11,55 @@
 if chisel.options["--help"] then
   print [[
 Usage: chiseltodev [device=id] < input.chsl > output.raw
+       chiseltodev [device=id] tee=DEST,...,DEST [lag=N] < input.chsl
+       chiseltodev [device=id] journal=FILE [checkpoint=N] < input.chsl
+       chiseltodev [device=id] out=DIR input1.chsl ... inputN.chsl
+       chiseltodev [device=id] out=DIR manifest=FILE
 
 Converts a Chisel document to a data stream mixing text and commands
 suitable for sending to a particular embosser device. The device can
 be specified as a command line argument, or alternatively by defining
 the CHISEL_DEVICE environment variable.
+
+When an output directory is given with "out=DIR", all the input files
+listed in the command line (or in the manifest file, one per line) are
+rendered in a single run, writing "DIR/<name>.raw" for each input. A
+failure in one of the documents does not stop the rest of the batch.
+Inputs with the same name in different directories are rejected.
+
+With "tee=DEST,...", the document is rendered once and the output is
+written to all the destinations at the same time. Each destination is
+either "-" (the standard output), "|command" (a command run by the
+shell, which reads the output from its standard input), "tcp:host:port",
+"unix:path" for a socket, or the path of a file. Output is buffered for
+each destination, so a slow one does not hold back the rest, unless it
+falls behind by more than "lag" bytes (1M by default; a "k" or "M"
+suffix may be used).
+
+With "journal=FILE", the progress of the output is recorded in the given
+file at the beginning of document parts, at most every "checkpoint"
+bytes (64k by default). If writing the output fails, running the same
+command again resumes it from the last recorded part, after sending
+the commands which set up the device as it was at that point. The
+journal is removed once the whole document has been written. Copies
+made by replaying the output are not recorded.
+
+Copies requested by the "copies" option of a document (or by CUPS) are
+made by the device, if it supports it. Otherwise the document is
+rendered once, and its output written as many times as needed. Up to
+"spool" bytes of output (8M by default) are kept in memory for this,
+and a temporary file is used for bigger documents.
+
+When the job is cancelled with SIGTERM or SIGINT, rendering stops and
+the commands which set the default options of the device are sent.
+
+Passing "tree=packed" loads documents into a packed tree, which uses
+less memory for big documents.
+
+Before rendering, documents are simplified by a set of optimization
+passes (drop_raw, dedupe_options, flatten_parts, merge_text). Use
+"optimize=none" to disable them, or "optimize=pass1,pass2,..." to run
+only the given ones. Packed trees are not optimized.
   ]]
   return
 end
@@ -36,17 +80,45 @@ local input_file = nil
 -- Set of options which override document options.
 local options_overrides = {}
 
+-- Load documents into packed trees.
+local packed = chisel.options.tree == "packed"
 
-if running_on_cups and chisel.argv[6] ~= nil then
-  input_file = chisel.argv[6]
+-- Optimization passes to run on documents before rendering them.
+local passes = nil
+if chisel.options.optimize ~= nil then
+  passes = {}
+  for _, name in ipairs (lib.doctree.passes) do
+    passes[name] = false
+  end
+  for name in chisel.options.optimize:gmatch ("[^,]+") do
+    if passes[name] == nil and name ~= "none" then
+      chisel.die ("Unknown optimization pass %q\n", name)
+    end
+    passes[name] = true
+  end
+end
+
+
+if running_on_cups then
+  -- CUPS passes the number of copies as 4th argument, but only expects
+  -- the filter to make them when the input is a file given in argv[6];
+  -- input from stdin has been copied already. They are made by the
+  -- device when it supports it, or else by replaying the output.
+  if chisel.argv[6] ~= nil then
+    input_file = chisel.argv[6]
+    options_overrides.copies = tonumber (chisel.argv[4])
+  end
 
-  -- CUPS passes the number of copies as 4th argument.
-  options_overrides.copies = tonumber (chisel.argv[4])
+  -- Jobs come from other users, and argv[6] is in the spool directory,
+  -- along with the files of other jobs: do not let them include files.
+  lib.loader.include_files = false
 
   -- TODO CUPS passes more job options in argv[5]
 end
 
 
+chisel.phase ("device")
+
 -- Get output device. This is done as first step, so it is possible
 -- to tell the user early whether the chosen device is not available.
 --
@@ -141,25 +213,263 @@ end
 
 log_debug ("device: %s (%s)\n", dev, dev.name)
 
-doc, err = lib.loader.parse (input_file)
-if doc == nil then
-  if chisel.loglevel == 0 then
-    chisel.die ("Could not parse input document\n")
-  else
-    chisel.die ("Could not parse input document\n%s\n", err)
-  end
-end
-
 -- Apply the extra options
 options_overrides, err = lib.loader.validate_options (options_overrides)
 if options_overrides == nil then
   chisel.die ("Invalid options: %s", err)
 end
 
-for name, value in pairs (options_overrides) do
-  doc.options[name] = value
+
+-- Parses a size in bytes, with an optional "k" or "M" suffix.
+local function parse_size (value)
+  local number, suffix = value:match ("^(%d+)([kM]?)$")
+  if number == nil then
+    return nil
+  end
+  return tonumber (number) * ({ [""] = 1; k = 1024; M = 1024 * 1024 })[suffix]
 end
 
--- Output document to the device
-doc:render (assert (dev:create_renderer ()))
 
+-- Output kept in memory when making copies, before using a temporary file.
+local spool_threshold = parse_size (chisel.options.spool or "8M")
+if spool_threshold == nil then
+  chisel.die ("Invalid spool value %q\n", chisel.options.spool)
+end
+
+
+local function render_document (input_file, rend)
+  chisel.phase ("parse")
+  local doc, err = lib.loader.parse (input_file, packed)
+  if doc == nil then
+    return nil, err
+  end
+
+  for name, value in pairs (options_overrides) do
+    doc.options[name] = value
+  end
+
+  if not packed then
+    chisel.phase ("optimize")
+    local stats = lib.doctree.optimize (doc, rend, passes)
+    if log_verbose_enabled then
+      for _, name in ipairs (lib.doctree.passes) do
+        log_verbose ("optimize: %s removed %i elements\n", name, stats[name])
+      end
+      log_verbose ("optimize: %i redundant part options\n", stats.options)
+    end
+  end
+
+  -- Output document to the device
+  chisel.phase ("render")
+  rend:render_copies (doc, spool_threshold)
+  return true
+end
+local safe_render_document = lib.ml.safe (render_document)
+
+
+-- CUPS cancels jobs with SIGTERM, which stops rendering with an error. In
+-- that case the device is reset to its default options, as it would be at
+-- the end of the document, the output flushed, and the program exits.
+local function check_cancelled (rend, flush)
+  if not chisel.interrupted () then
+    return
+  end
+  log_verbose ("job cancelled, resetting the device\n")
+  pcall (rend.cancel, rend)
+  if flush ~= nil then
+    pcall (flush)
+  end
+  chisel.die ("Job cancelled\n")
+end
+
+
+if chisel.options.tee then
+  local destinations = {}
+  for dest in chisel.options.tee:gmatch ("[^,]+") do
+    destinations[#destinations+1] = dest
+  end
+
+  local lag = parse_size (chisel.options.lag or "1M")
+  if lag == nil then
+    chisel.die ("Invalid lag value %q\n", chisel.options.lag)
+  end
+
+  local output, err = lib.tee.open (destinations, { lag = lag })
+  if output == nil then
+    chisel.die ("Cannot open output: %s\n", err)
+  end
+
+  local rend = assert (dev:create_renderer (function (self, data)
+    output:write (data)
+    return self
+  end))
+  local ok, err = safe_render_document (input_file, rend)
+  if not ok then
+    check_cancelled (rend, function () output:close () end)
+  end
+  local written, write_err = output:close ()
+
+  if log_verbose_enabled then
+    local stats = output:stats ()
+    for _, sink in ipairs (stats) do
+      log_verbose ("tee: %s: %i bytes, lag up to %i bytes, waited %i times%s\n",
+                   sink.destination, sink.written, sink.lag, sink.waits,
+                   sink.error and (" (" .. sink.error .. ")") or "")
+    end
+    log_verbose ("tee: %.3fs waiting for destinations\n", stats.wait_time)
+  end
+
+  if not ok then
+    chisel.die ("Could not render input document\n%s\n", tostring (err))
+  end
+  if not written then
+    chisel.die ("Could not write output: %s\n", write_err)
+  end
+  return
+end
+
+
+if chisel.options.journal then
+  local interval = parse_size (chisel.options.checkpoint or "64k")
+  if interval == nil then
+    chisel.die ("Invalid checkpoint value %q\n", chisel.options.checkpoint)
+  end
+
+  local journal, err = lib.journal.open (chisel.options.journal, dev.id,
+                                         io.stdout, interval)
+  if journal == nil then
+    chisel.die ("Cannot open journal: %s\n", err)
+  end
+
+  local rend = assert (dev:create_renderer (function (self, data)
+    journal:write (data)
+    return self
+  end))
+  local ok, err = safe_render_document (input_file, journal:attach (rend))
+  if not ok then
+    -- The journal is kept, to resume the job later.
+    check_cancelled (rend, function () io.stdout:flush () end)
+    chisel.die ("Could not render input document\n%s\n", tostring (err))
+  end
+  ok, err = journal:finish ()
+  if not ok then
+    chisel.die ("Could not write output: %s\n", err)
+  end
+  return
+end
+
+
+if not chisel.options.out then
+  local rend = assert (dev:create_renderer ())
+  local status, ok, err = pcall (render_document, input_file, rend)
+  if not status then
+    check_cancelled (rend, function () io.stdout:flush () end)
+    error (ok, 0)
+  end
+  if not ok then
+    if chisel.loglevel == 0 then
+      chisel.die ("Could not parse input document\n")
+    else
+      chisel.die ("Could not parse input document\n%s\n", err)
+    end
+  end
+  return
+end
+
+
+--
+-- Batch mode: the device and the renderer are set up only once, and then
+-- reused for each one of the input documents.
+--
+local outdir = chisel.options.out
+if not lib.fs.isdir (outdir) then
+  chisel.die ("Output directory %q does not exist\n", outdir)
+end
+
+local inputs = {}
+for _, arg in ipairs (chisel.argv) do
+  if not arg:find ("=", 1, true) and arg:sub (1, 1) ~= "-" then
+    inputs[#inputs+1] = arg
+  end
+end
+
+if chisel.options.manifest then
+  local manifest, err = io.open (chisel.options.manifest, "r")
+  if manifest == nil then
+    chisel.die ("Cannot open manifest: %s\n", err)
+  end
+  for line in manifest:lines () do
+    line = line:match ("^%s*(.-)%s*$")
+    if #line > 0 and line:sub (1, 1) ~= "#" then
+      inputs[#inputs+1] = line
+    end
+  end
+  manifest:close ()
+end
+
+if #inputs == 0 then
+  chisel.die ("No input documents given\n")
+end
+
+-- Outputs are named after the inputs, without their directories: fail
+-- before rendering anything if two of them would be written to the same
+-- file, instead of letting one overwrite the other.
+local outputs, output_input = {}, {}
+for i, input in ipairs (inputs) do
+  local name = lib.fs.basename (input):gsub ("%.chsl$", "")
+  local path = outdir .. "/" .. name .. ".raw"
+  if output_input[path] ~= nil then
+    chisel.die ("Inputs %q and %q would both be written to %q\n",
+                output_input[path], input, path)
+  end
+  output_input[path] = input
+  outputs[i] = path
+end
+
+local output = nil
+local rend = assert (dev:create_renderer (function (self, data)
+  output:write (data)
+  return self
+end))
+
+local failures = 0
+local batch_start = chisel.now ()
+
+for i, input in ipairs (inputs) do
+  local path = outputs[i]
+  local start = chisel.now ()
+  local ok, err
+
+  output, err = io.open (path, "wb")
+  if output ~= nil then
+    ok, err = safe_render_document (input, rend:reset ())
+    output:close ()
+    if not ok then
+      os.remove (path)
+    end
+  end
+  -- All the documents are rendered in the same Lua state: collecting the
+  -- garbage of each one lets the allocator release the memory it used.
+  collectgarbage ()
+
+  if ok then
+    io.stderr:write (("%s: ok (%.3fs)\n"):format (input, chisel.now () - start))
+  else
+    failures = failures + 1
+    io.stderr:write (("%s: FAILED (%.3fs)\n"):format (input, chisel.now () - start))
+    if err ~= nil then
+      io.stderr:write (("  %s\n"):format (tostring (err)))
+    end
+    lib.trace.dump ()
+    -- Output goes to files, there is no device to reset.
+    if chisel.interrupted () then
+      chisel.die ("Job cancelled\n")
+    end
+  end
+end
+
+io.stderr:write (("%i documents, %i failed (%.3fs)\n"):format (#inputs,
+                 failures, chisel.now () - batch_start))
+if failures > 0 then
+  os.exit (1)
+end
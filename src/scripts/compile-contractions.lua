@@ -0,0 +1,70 @@
+--
+-- compile-contractions.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+if chisel.options["--help"] then
+  print [[
+Usage: compile-contractions in=FILE.rules out=FILE.ctb
+
+Compiles a table of contraction rules to the format used for translating
+text to contracted braille. Each line of the input has an opcode, the
+characters to match, and their replacement in braille ASCII; lines which
+start with "#" are comments. See the tables in data/_contractions/ for
+examples.
+  ]]
+  return
+end
+
+local input, output = chisel.options["in"], chisel.options.out
+if not input or not output then
+  chisel.die ("Usage: compile-contractions in=FILE.rules out=FILE.ctb\n")
+end
+
+-- Opcodes which set a field of the table, instead of adding a rule.
+local indicators = {
+  capsign = true;
+  capword = true;
+  numsign = true;
+  letsign = true;
+  decpoint = true;
+}
+
+local rules = { digits = {} }
+local lineno = 0
+
+for line in io.lines (input) do
+  lineno = lineno + 1
+  if not line:match ("^%s*#") and line:match ("%S") then
+    local fields = {}
+    for field in line:gmatch ("%S+") do
+      fields[#fields+1] = field
+    end
+
+    local opcode = fields[1]
+    if indicators[opcode] and #fields == 2 then
+      rules[opcode] = fields[2]
+    elseif opcode == "digit" and #fields == 3 and fields[2]:match ("^%d$") then
+      rules.digits[fields[2]] = fields[3]
+    elseif #fields == 3 then
+      rules[#rules+1] = fields
+    else
+      chisel.die ("%s:%i: invalid rule\n", input, lineno)
+    end
+  end
+end
+
+local ok, image = pcall (lib.contract.compile, rules)
+if not ok then
+  chisel.die ("%s: %s\n", input, image)
+end
+
+local out = assert (io.open (output, "wb"))
+out:write (image)
+out:close ()
+
+local stats = lib.contract.new (image):stats ()
+log_verbose ("%s: %i rules, %i nodes, %i bytes\n", output, stats.rules,
+             stats.nodes, stats.size)
@@ -0,0 +1,64 @@
+--
+-- compile-hyphenation.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+if chisel.options["--help"] then
+  print [[
+Usage: compile-hyphenation in=FILE.pat out=FILE.htb
+
+Compiles a set of hyphenation patterns to the format used for finding
+hyphenation points in words. Lines of the input contain patterns, or
+set the "left_min" and "right_min" values, or give an "exception"; lines
+which start with "#" are comments. See the files in data/_hyphenation/
+for examples.
+  ]]
+  return
+end
+
+local input, output = chisel.options["in"], chisel.options.out
+if not input or not output then
+  chisel.die ("Usage: compile-hyphenation in=FILE.pat out=FILE.htb\n")
+end
+
+local patterns = { exceptions = {} }
+local lineno = 0
+
+for line in io.lines (input) do
+  lineno = lineno + 1
+  if not line:match ("^%s*#") and line:match ("%S") then
+    local fields = {}
+    for field in line:gmatch ("%S+") do
+      fields[#fields+1] = field
+    end
+
+    local keyword = fields[1]
+    if (keyword == "left_min" or keyword == "right_min") and #fields == 2
+        and tonumber (fields[2]) then
+      patterns[keyword] = tonumber (fields[2])
+    elseif keyword == "exception" and #fields == 2 then
+      patterns.exceptions[#patterns.exceptions+1] = fields[2]
+    elseif keyword:match ("^[%a%d%.]+$") then
+      for _, pattern in ipairs (fields) do
+        patterns[#patterns+1] = pattern
+      end
+    else
+      chisel.die ("%s:%i: invalid line\n", input, lineno)
+    end
+  end
+end
+
+local ok, image = pcall (lib.hyphen.compile, patterns)
+if not ok then
+  chisel.die ("%s: %s\n", input, image)
+end
+
+local out = assert (io.open (output, "wb"))
+out:write (image)
+out:close ()
+
+local stats = lib.hyphen.new (image):stats ()
+log_verbose ("%s: %i patterns, %i nodes, %i bytes\n", output, stats.patterns,
+             stats.nodes, stats.size)
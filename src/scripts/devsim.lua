@@ -0,0 +1,148 @@
+--
+-- devsim.lua
+-- Copyright (C) 2012 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Virtual embosser: decodes the data stream that chiseltodev writes for
+-- an Index Braille device, lays it out in pages, and reports statistics.
+
+if chisel.options["--help"] then
+  print [[
+Usage: devsim [device=id] [input=FILE] [format=stats|text|pbm] [out=PATH]
+              [throttle=yes|N] [resolution=N]
+
+Decodes a data stream for Index Braille devices (V4 protocol), as written
+by chiseltodev, and simulates how the device lays it out in pages. The
+stream is read from the standard input unless "input=FILE" is given. The
+device can also be specified with the CHISEL_DEVICE environment variable;
+its default options and paper size are used as the initial state.
+
+Output formats:
+
+  stats   Statistics about the stream and the pages (the default).
+  text    The cells of each page as text, with a form feed after each
+          page, written to the "out" file (or the standard output).
+  pbm     An image of each page, written as "PAGE.pbm" in the "out"
+          directory. The "resolution" is in pixels per millimeter (4 by
+          default).
+
+Statistics are written to the standard error stream for the other formats.
+
+With "throttle=yes", the stream is read at the speed the device embosses
+pages (its "throughput", in pages per minute), so that programs writing to
+devsim through a pipe are slowed down as with an actual device. A number
+of pages per minute can be given instead.
+  ]]
+  return
+end
+
+
+local devname = chisel.options.device or os.getenv ("CHISEL_DEVICE")
+if devname == nil then
+  chisel.die ("No device given, pass 'device=...' in the command line\n")
+end
+
+local dev, err = lib.ml.safe (lib.device.get) (devname)
+if dev == nil then
+  chisel.die ("Unknown device name %q\n%s\n", devname, tostring (err))
+end
+if dev.renderer ~= "indexbraille-v4" then
+  chisel.die ("Device %q does not use the Index Braille V4 protocol\n", devname)
+end
+
+local throughput = chisel.options.throttle
+if throughput == "yes" then
+  throughput = tonumber (dev.throughput)
+  if throughput == nil then
+    chisel.die ("Device %q does not define its throughput\n", devname)
+  end
+elseif throughput ~= nil then
+  throughput = tonumber (throughput)
+  if throughput == nil or throughput <= 0 then
+    chisel.die ("Invalid throttle value %q\n", chisel.options.throttle)
+  end
+end
+
+local format = chisel.options.format or "stats"
+local out = chisel.options.out
+local resolution = tonumber (chisel.options.resolution or 4)
+
+local sim = lib.devsim.new (dev, throughput)
+local output = nil
+
+if format == "text" then
+  output = io.stdout
+  if out ~= nil then
+    output = assert (io.open (out, "wb"))
+  end
+  function sim:on_page (page)
+    output:write (lib.devsim.page_text (page), "\f")
+  end
+elseif format == "pbm" then
+  if out == nil or not lib.fs.isdir (out) then
+    chisel.die ("Output directory %q does not exist\n", tostring (out))
+  end
+  function sim:on_page (page)
+    local path = ("%s/%04i.pbm"):format (out, page.number)
+    local f = assert (io.open (path, "wb"))
+    f:write (self:page_image (page, resolution):encode ("pbm"))
+    f:close ()
+  end
+elseif format ~= "stats" then
+  chisel.die ("Unknown output format %q\n", format)
+end
+
+
+local input = io.stdin
+if chisel.options.input then
+  input, err = io.open (chisel.options.input, "rb")
+  if input == nil then
+    chisel.die ("Cannot open input: %s\n", err)
+  end
+end
+
+local start = chisel.now ()
+while true do
+  local data = input:read (4096)
+  if data == nil then
+    break
+  end
+  sim:feed (data)
+end
+local stats = sim:finish ()
+local elapsed = chisel.now () - start
+
+if output ~= nil and output ~= io.stdout then
+  output:close ()
+end
+
+
+local report = (format == "stats") and io.stdout or io.stderr
+local function line (name, fmt, ...)
+  report:write (("%-12s" .. fmt .. "\n"):format (name .. ":", ...))
+end
+
+line ("device", "%s (stream from %s)", devname, sim.version or "unknown")
+line ("bytes", "%i (%.3f s, %.1f MB/s)", stats.bytes, elapsed,
+      stats.bytes / elapsed / 1e6)
+line ("pages", "%i (%i copies)", stats.pages, stats.copies)
+line ("lines", "%i (%i wrapped)", stats.lines, stats.wrapped)
+line ("graphics", "%i blocks", stats.graphics)
+line ("commands", "%i (%i switches, %i redundant, %i unknown, %i invalid)",
+      stats.commands, stats.switches, stats.redundant, stats.unknown,
+      stats.invalid)
+
+local names = {}
+for name in pairs (stats.command) do
+  names[#names + 1] = name
+end
+table.sort (names)
+for _, name in ipairs (names) do
+  line ("  " .. name, "%i", stats.command[name])
+end
+
+if stats.truncated then
+  line ("warning", "the stream ends in the middle of a command or graphics")
+end
@@ -29,9 +29,10 @@ local running_on_cups = os.getenv ("CUPS_SERVERROOT") ~= nil and
                         #chisel.argv >= 5
 
 local options
+local input_file = nil
 if running_on_cups and chisel.argv[6] ~= nil then
-  -- Reassign stdin
-  io.input (chisel.argv[6])
+  -- Read from the file instead of stdin
+  input_file = chisel.argv[6]
 
   -- CUPS passes the number of copies as 4th argument.
   options = {}
@@ -63,9 +64,15 @@ print ("}")
 print ("document {")
 print ("  text {")
 
-for line in io.lines () do
+-- The input is mapped in memory, so only the lines are copied.
+local input, err = lib.fs.mmap (input_file)
+if input == nil then
+  chisel.die ("texttochisel: %s\n", err)
+end
+for line in input:lines () do
 	print (string.format ("    %q,", line .. "\n"))
 end
+input:close ()
 
 -- footer
 print ("  }")
@@ -0,0 +1,154 @@
+---
+-- Spooling of output data.
+--
+-- A spool keeps the data written to it, so it can be written out several
+-- times later, e.g. to make copies of a rendered document without
+-- rendering it again (see @{renderer:render_copies}). Data is kept in
+-- memory until it grows over a threshold, and from then on it is moved
+-- to a temporary file, which is removed when the spool is closed.
+--
+-- @copyright 2012 Adrian Perez <aperez@igalia.com>
+-- @license Distributed under terms of the MIT license.
+--
+
+local tconcat = table.concat
+
+local M = {}
+
+
+--- Default amount of data kept in memory, in bytes.
+--
+M.threshold = 8 * 1024 * 1024
+
+--- Size of the blocks read from the temporary file when replaying.
+--
+local block_size = 64 * 1024
+
+-- Raises an error if an operation on the temporary file failed, so a full
+-- disk does not go unnoticed and truncate the copies.
+local function check (what, ok, err)
+  if not ok then
+    error (("spool: %s failed: %s"):format (what, tostring (err)))
+  end
+  return ok
+end
+
+
+--- Output spool.
+--
+-- Created with @{new}.
+--
+-- @table spool
+--
+local spool = object:extend
+{
+  --- Number of bytes written to the spool.
+  size = 0;
+
+  --- Adds data to the spool.
+  --
+  -- @param data String with the data.
+  -- @return The spool itself.
+  -- @function spool:write
+  --
+  write = function (self, data)
+    local size = self.size + #data
+    self.size = size
+
+    local file = self._file
+    if file == nil then
+      local chunks = self._chunks
+      chunks[#chunks + 1] = data
+      if size <= self.threshold then
+        return self
+      end
+
+      -- Move everything written so far to a temporary file.
+      local err
+      file, err = io.tmpfile ()
+      if file == nil then
+        error (("spool: cannot create temporary file: %s"):format (err))
+      end
+      file:setvbuf ("full", block_size)
+      check ("write", file:write (tconcat (chunks)))
+      self._file, self._chunks = file, nil
+      log_debug ("spool: moved %i bytes to a temporary file\n", size)
+    else
+      check ("write", file:write (data))
+    end
+    return self
+  end;
+
+  --- Writes the contents of the spool a number of times.
+  --
+  -- @param writef Function called with each piece of data.
+  -- @param times Number of times to write the contents *(Optional,
+  -- default 1)*.
+  -- @return The spool itself.
+  -- @function spool:replay
+  --
+  replay = function (self, writef, times)
+    times = times or 1
+    local file = self._file
+
+    if file == nil then
+      -- Join the chunks once, instead of writing them one by one.
+      local data = tconcat (self._chunks)
+      self._chunks = { data }
+      for _ = 1, times do
+        writef (data)
+      end
+      return self
+    end
+
+    check ("flush", file:flush ())
+    for _ = 1, times do
+      check ("seek", file:seek ("set", 0))
+      while true do
+        local block, err = file:read (block_size)
+        if block == nil then
+          check ("read", err == nil, err)
+          break
+        end
+        writef (block)
+      end
+    end
+    check ("seek", file:seek ("end", 0))
+    return self
+  end;
+
+  --- Checks whether the contents of the spool were moved to a file.
+  --
+  -- @return Boolean.
+  -- @function spool:spilled
+  --
+  spilled = function (self)
+    return self._file ~= nil
+  end;
+
+  --- Discards the contents of the spool, removing its temporary file.
+  -- @function spool:close
+  --
+  close = function (self)
+    if self._file ~= nil then
+      self._file:close ()
+    end
+    self._file, self._chunks, self.size = nil, {}, 0
+  end;
+}
+
+
+--- Creates a spool.
+--
+-- @param threshold Amount of data kept in memory, in bytes *(Optional,
+-- default @{threshold})*.
+-- @return A @{spool}.
+--
+function M.new (threshold)
+  return spool:clone {
+    threshold = threshold or M.threshold;
+    _chunks   = {};
+  }
+end
+
+return M
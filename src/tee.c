@@ -0,0 +1,665 @@
+/***
+Writing the same output to several destinations.
+
+A *tee* sends each piece of data written to it to a set of *sinks*:
+files, the standard output, commands (which get the data in their
+standard input) or sockets. Each sink has its own buffer, and data is
+written to all of them without blocking, so a slow device does not stall
+the others. Only when the data buffered for a sink goes over the *lag*
+limit, writing waits (using `poll`) until the sink catches up.
+
+Destinations are given as strings:
+
+* `-`: The standard output.
+* `|command`: A command run with `/bin/sh -c`.
+* `tcp:host:port`: A TCP connection.
+* `unix:path`: A connection to a Unix domain socket.
+* Anything else is the path of a file, which is created or truncated.
+
+A sink which fails (for example, because a command exits early) is
+closed and its buffered data dropped, while the rest continue; the
+error is reported by @{tee:close}.
+
+@module tee
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#define _GNU_SOURCE /* pipe2() */
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define TEE_MT "chisel.tee"
+
+/* Default lag limit, in bytes. */
+#define TEE_DEFAULT_LAG (1024 * 1024)
+
+/* Data is buffered for each sink until there is this much of it. */
+#define TEE_FLUSH_SIZE (64 * 1024)
+
+/* Longest error message kept for a sink. */
+#define TEE_ERROR_SIZE 160
+
+/* Set when the job is being cancelled, see chisel.c */
+extern int chsl_interrupted (void);
+
+
+typedef struct {
+    int           fd;
+    pid_t         pid;         /* Child process for commands, or zero.    */
+    size_t        chunk;       /* See sink_write(), zero if non-blocking. */
+    char         *data;
+    size_t        start;       /* First byte pending to be written.       */
+    size_t        length;      /* Bytes in the buffer, including written. */
+    size_t        size;
+    size_t        written;
+    size_t        max_lag;
+    unsigned      waits;       /* Times writing waited for this sink.     */
+    char          error[TEE_ERROR_SIZE];
+} tee_sink;
+
+typedef struct {
+    unsigned      nsinks;
+    size_t        lag;
+    int           closed;
+    double        wait_time;
+    tee_sink      sinks[1];
+} tee_output;
+
+
+static inline tee_output*
+check_tee (lua_State *L, int index)
+{
+    return (tee_output*) luaL_checkudata (L, index, TEE_MT);
+}
+
+
+static inline size_t
+sink_pending (const tee_sink *s)
+{
+    return s->length - s->start;
+}
+
+
+static void
+sink_fail (tee_sink *s, const char *what, int err)
+{
+    if (s->error[0] == '\0')
+        snprintf (s->error, TEE_ERROR_SIZE, "%s: %s", what, strerror (err));
+    if (s->fd >= 0 && s->fd != STDOUT_FILENO)
+        close (s->fd);
+    s->fd = -1;
+    s->start = s->length = 0;
+}
+
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Writes data without blocking, returns the number of bytes written.
+ *
+ * The standard output is shared with other processes (including the
+ * commands started for other sinks), so it is not switched to
+ * non-blocking mode. Instead, writing waits until it is ready, and then
+ * writes at most "chunk" bytes, which do not block for pipes.
+ */
+static size_t
+sink_write (tee_sink *s, const char *data, size_t len)
+{
+    size_t done = 0;
+
+    while (s->fd >= 0 && done < len) {
+        size_t n = len - done;
+        ssize_t ret;
+
+        if (s->chunk > 0) {
+            struct pollfd pfd = { s->fd, POLLOUT, 0 };
+            if (poll (&pfd, 1, 0) == 0)
+                break;
+            if (n > s->chunk)
+                n = s->chunk;
+        }
+        if ((ret = write (s->fd, data + done, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                sink_fail (s, "write", errno);
+            break;
+        }
+        done += (size_t) ret;
+    }
+
+    s->written += done;
+    return done;
+}
+
+
+/* Writes as much of the pending data as possible without blocking. */
+static void
+sink_flush (tee_sink *s)
+{
+    s->start += sink_write (s, s->data + s->start, sink_pending (s));
+    if (s->start == s->length)
+        s->start = s->length = 0;
+}
+
+
+static int
+sink_append (tee_sink *s, const char *data, size_t len)
+{
+    /* Empty writes are skipped: data may be NULL, see memcpy() below. */
+    if (s->fd < 0 || len == 0)
+        return 1;
+
+    /* Move the pending data to the beginning before growing the buffer. */
+    if (s->length + len > s->size && s->start > 0) {
+        memmove (s->data, s->data + s->start, sink_pending (s));
+        s->length -= s->start;
+        s->start = 0;
+    }
+    if (s->length + len > s->size) {
+        size_t size = s->size ? s->size : 4096;
+        char *p;
+        while (size < s->length + len)
+            size *= 2;
+        if ((p = realloc (s->data, size)) == NULL)
+            return 0;
+        s->data = p;
+        s->size = size;
+    }
+    memcpy (s->data + s->length, data, len);
+    s->length += len;
+    if (sink_pending (s) > s->max_lag)
+        s->max_lag = sink_pending (s);
+    return 1;
+}
+
+
+/*
+ * Waits until the sinks with more than "limit" bytes pending are below
+ * it, writing to all the sinks in the meantime. The time spent, and the
+ * sinks which were waited for, are counted in the statistics if "count"
+ * is set. A signal which cancels the job stops waiting.
+ */
+static void
+tee_wait (tee_output *t, size_t limit, int count)
+{
+    struct pollfd fds[t->nsinks];
+    unsigned index[t->nsinks];
+    unsigned char waited[t->nsinks];
+    double start = 0.0;
+
+    memset (waited, 0, t->nsinks);
+
+    for (;;) {
+        unsigned i, nfds = 0, lagging = 0;
+
+        for (i = 0; i < t->nsinks; i++) {
+            tee_sink *s = &t->sinks[i];
+            if (s->fd < 0 || sink_pending (s) == 0)
+                continue;
+            if (sink_pending (s) > limit) {
+                if (lagging++ == 0 && start == 0.0 && count)
+                    start = now ();
+                if (count && !waited[i]) {
+                    waited[i] = 1;
+                    s->waits++;
+                }
+            }
+            fds[nfds].fd = s->fd;
+            fds[nfds].events = POLLOUT;
+            fds[nfds].revents = 0;
+            index[nfds++] = i;
+        }
+        if (lagging == 0)
+            break;
+
+        if (poll (fds, nfds, -1) < 0) {
+            if (errno == EINTR && chsl_interrupted ())
+                break;
+            if (errno == EINTR)
+                continue;
+            for (i = 0; i < nfds; i++)
+                sink_fail (&t->sinks[index[i]], "poll", errno);
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                sink_fail (&t->sinks[index[i]], "write", EPIPE);
+            } else if (fds[i].revents & (POLLOUT | POLLHUP)) {
+                /* Writing after a hang up gives the actual error. */
+                sink_flush (&t->sinks[index[i]]);
+            }
+        }
+    }
+
+    if (start != 0.0)
+        t->wait_time += now () - start;
+}
+
+
+static int
+open_command (tee_sink *s, const char *command)
+{
+    int fds[2];
+
+    if (pipe2 (fds, O_CLOEXEC) < 0)
+        return -1;
+
+    if ((s->pid = fork ()) < 0) {
+        int err = errno;
+        close (fds[0]);
+        close (fds[1]);
+        errno = err;
+        return -1;
+    }
+
+    if (s->pid == 0) {
+        signal (SIGPIPE, SIG_DFL);
+        dup2 (fds[0], STDIN_FILENO);
+        execl ("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit (127);
+    }
+
+    close (fds[0]);
+    return fds[1];
+}
+
+
+static int
+open_tcp (const char *address)
+{
+    struct addrinfo hints, *info, *ai;
+    char host[256];
+    const char *port = strrchr (address, ':');
+    int fd = -1, ret;
+
+    if (port == NULL || (size_t) (port - address) >= sizeof (host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy (host, address, port - address);
+    host[port - address] = '\0';
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo (host, port + 1, &hints, &info)) != 0) {
+        errno = (ret == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = info; ai != NULL; ai = ai->ai_next) {
+        fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (info);
+    return fd;
+}
+
+
+static int
+open_unix (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) < 0) {
+        int err = errno;
+        close (fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+
+static int
+sink_open (tee_sink *s, const char *dest)
+{
+    if (strcmp (dest, "-") == 0) {
+        struct stat st;
+        s->fd = STDOUT_FILENO;
+        s->chunk = PIPE_BUF;
+        if (fstat (s->fd, &st) == 0 && S_ISREG (st.st_mode))
+            s->chunk = SIZE_MAX;
+        return 1;
+    }
+
+    if (dest[0] == '|')
+        s->fd = open_command (s, dest + 1);
+    else if (strncmp (dest, "tcp:", 4) == 0)
+        s->fd = open_tcp (dest + 4);
+    else if (strncmp (dest, "unix:", 5) == 0)
+        s->fd = open_unix (dest + 5);
+    else
+        s->fd = open (dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (s->fd < 0)
+        return 0;
+
+    fcntl (s->fd, F_SETFL, fcntl (s->fd, F_GETFL) | O_NONBLOCK);
+    return 1;
+}
+
+
+/* Closes the file descriptors, and waits for the commands to exit. */
+static void
+tee_release (tee_output *t)
+{
+    unsigned i;
+
+    for (i = 0; i < t->nsinks; i++) {
+        tee_sink *s = &t->sinks[i];
+        if (s->fd >= 0 && s->fd != STDOUT_FILENO)
+            close (s->fd);
+        s->fd = -1;
+
+        if (s->pid > 0) {
+            int status;
+            while (waitpid (s->pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            if (s->error[0] == '\0' && WIFEXITED (status) &&
+                WEXITSTATUS (status) != 0)
+                snprintf (s->error, TEE_ERROR_SIZE, "exited with status %d",
+                          WEXITSTATUS (status));
+            else if (s->error[0] == '\0' && WIFSIGNALED (status))
+                snprintf (s->error, TEE_ERROR_SIZE, "killed by signal %d",
+                          WTERMSIG (status));
+            s->pid = 0;
+        }
+
+        free (s->data);
+        s->data = NULL;
+        s->start = s->length = s->size = 0;
+    }
+    t->closed = 1;
+}
+
+
+/***
+Opens a set of destinations.
+
+Writing to commands or sockets which were closed must not terminate the
+program, so `SIGPIPE` is ignored from then on.
+
+@function open
+@tparam table destinations Array of destination strings.
+@tparam[opt] table options Table with the `lag` limit, in bytes (one
+megabyte by default).
+@treturn tee The new tee, or `nil` and an error message if any of the
+destinations could not be opened.
+*/
+static int
+tee_open (lua_State *L)
+{
+    tee_output *t;
+    unsigned i, n;
+    size_t lag = TEE_DEFAULT_LAG;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    n = luaL_len (L, 1);
+    luaL_argcheck (L, n > 0, 1, "no destinations given");
+    if (!lua_isnoneornil (L, 2)) {
+        luaL_checktype (L, 2, LUA_TTABLE);
+        lua_getfield (L, 2, "lag");
+        if (!lua_isnil (L, -1)) {
+            lua_Number value = luaL_checknumber (L, -1);
+            luaL_argcheck (L, value >= 0, 2, "lag must not be negative");
+            lag = (size_t) value;
+        }
+        lua_pop (L, 1);
+    }
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti (L, 1, i);
+        if (lua_type (L, -1) != LUA_TSTRING)
+            return luaL_error (L, "destination %d: must be a string", i);
+        lua_pop (L, 1);
+    }
+
+    t = lua_newuserdata (L, sizeof (tee_output) + (n - 1) * sizeof (tee_sink));
+    memset (t, 0, sizeof (tee_output) + (n - 1) * sizeof (tee_sink));
+    for (i = 0; i < n; i++)
+        t->sinks[i].fd = -1;
+    t->nsinks = n;
+    t->lag = lag;
+    luaL_setmetatable (L, TEE_MT);
+
+    signal (SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < n; i++) {
+        const char *dest;
+        lua_rawgeti (L, 1, i + 1);
+        dest = lua_tostring (L, -1);
+        if (!sink_open (&t->sinks[i], dest)) {
+            int err = errno;
+            tee_release (t);
+            lua_pushnil (L);
+            lua_pushfstring (L, "%s: %s", dest, strerror (err));
+            return 2;
+        }
+        lua_pop (L, 1);
+    }
+
+    /* Keep the destinations, for the statistics. */
+    lua_pushvalue (L, 1);
+    lua_setuservalue (L, -2);
+    return 1;
+}
+
+
+/***
+Writes data to all the sinks.
+
+Small pieces of data are buffered, and written out when there are
+enough of them. Returns as soon as the data is buffered for all the
+sinks, unless one of them has more data pending than the lag limit, in
+which case it waits until it does not.
+
+@function tee:write
+@tparam string data Data to write.
+@treturn tee The tee itself.
+*/
+static int
+tee_write (lua_State *L)
+{
+    tee_output *t = check_tee (L, 1);
+    size_t len, i;
+    const char *data = luaL_checklstring (L, 2, &len);
+
+    luaL_argcheck (L, !t->closed, 1, "tee is closed");
+
+    for (i = 0; i < t->nsinks; i++) {
+        tee_sink *s = &t->sinks[i];
+        if (s->fd < 0)
+            continue;
+        /* Avoid copying big pieces when the sink can take them right away. */
+        if (sink_pending (s) == 0 && len >= TEE_FLUSH_SIZE) {
+            size_t done = sink_write (s, data, len);
+            if (!sink_append (s, data + done, len - done))
+                return luaL_error (L, "out of memory");
+        } else {
+            if (!sink_append (s, data, len))
+                return luaL_error (L, "out of memory");
+            if (sink_pending (s) >= TEE_FLUSH_SIZE)
+                sink_flush (s);
+        }
+    }
+
+    tee_wait (t, t->lag, 1);
+    lua_settop (L, 1);
+    return 1;
+}
+
+
+/***
+Writes all the pending data, and closes the sinks.
+
+@function tee:close
+@treturn bool `true` if all the data was written to all the sinks, or
+`nil` and a message with the errors otherwise.
+*/
+static int
+tee_close (lua_State *L)
+{
+    tee_output *t = check_tee (L, 1);
+    luaL_Buffer b;
+    unsigned i;
+    int failed = 0;
+
+    if (!t->closed) {
+        tee_wait (t, 0, 0);
+        tee_release (t);
+    }
+
+    lua_getuservalue (L, 1);
+    luaL_buffinit (L, &b);
+    for (i = 0; i < t->nsinks; i++) {
+        if (t->sinks[i].error[0] == '\0')
+            continue;
+        if (failed++)
+            luaL_addstring (&b, "; ");
+        lua_rawgeti (L, 2, i + 1);
+        luaL_addvalue (&b);
+        luaL_addstring (&b, ": ");
+        luaL_addstring (&b, t->sinks[i].error);
+    }
+    luaL_pushresult (&b);
+
+    if (!failed) {
+        lua_pushboolean (L, 1);
+        return 1;
+    }
+    lua_pushnil (L);
+    lua_insert (L, -2);
+    return 2;
+}
+
+
+/***
+Obtains statistics for each sink.
+
+@function tee:stats
+@treturn table Array with a table for each destination, with its
+`destination` string, the number of bytes `written` to it, its maximum
+`lag` in bytes, the number of `waits` for it to catch up, and its
+`error` message if it failed. The `wait_time` field of the array is the
+total time spent waiting, in seconds.
+*/
+static int
+tee_stats (lua_State *L)
+{
+    tee_output *t = check_tee (L, 1);
+    unsigned i;
+
+    lua_getuservalue (L, 1);
+    lua_createtable (L, t->nsinks, 1);
+    for (i = 0; i < t->nsinks; i++) {
+        tee_sink *s = &t->sinks[i];
+        lua_createtable (L, 0, 5);
+        lua_rawgeti (L, 2, i + 1);
+        lua_setfield (L, -2, "destination");
+        lua_pushnumber (L, s->written);
+        lua_setfield (L, -2, "written");
+        lua_pushnumber (L, s->max_lag);
+        lua_setfield (L, -2, "lag");
+        lua_pushnumber (L, s->waits);
+        lua_setfield (L, -2, "waits");
+        if (s->error[0] != '\0') {
+            lua_pushstring (L, s->error);
+            lua_setfield (L, -2, "error");
+        }
+        lua_rawseti (L, -2, i + 1);
+    }
+    lua_pushnumber (L, t->wait_time);
+    lua_setfield (L, -2, "wait_time");
+    return 1;
+}
+
+
+static int
+tee_gc (lua_State *L)
+{
+    tee_output *t = check_tee (L, 1);
+    if (!t->closed)
+        tee_release (t);
+    return 0;
+}
+
+
+static const luaL_Reg tee_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, tee_ ## _name }
+    REG_ITEM (write),
+    REG_ITEM (close),
+    REG_ITEM (stats),
+#undef REG_ITEM
+    { "__gc", tee_gc },
+    { NULL, NULL }
+};
+
+static const luaL_Reg tee_funcs[] =
+{
+    { "open", tee_open },
+    { NULL, NULL }
+};
+
+
+int
+lua_tee_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, TEE_MT);
+    luaL_setfuncs (L, tee_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, tee_funcs);
+    return 1;
+}
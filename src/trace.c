@@ -0,0 +1,215 @@
+/***
+Lightweight event tracing.
+
+Events are recorded in a fixed-size ring buffer of binary records, kept
+in memory, which is only written out when something goes wrong: if the
+script being run raises an uncaught error, the most recent events are
+dumped to the standard error stream. Recording an event is cheap, and it
+does not allocate memory, so it can be done in hot paths.
+
+The size of the ring (in number of records) is set with the `-T` command
+line flag; `-T 0` disables tracing, making @{record} return immediately.
+
+@module trace
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef TRACE_MAX_EVENTS
+#define TRACE_MAX_EVENTS 256
+#endif /* !TRACE_MAX_EVENTS */
+
+
+typedef struct {
+    double        time;   /* Seconds since tracing was started. */
+    unsigned      event;  /* Index in trace_names.              */
+    lua_Number    a, b;   /* Event arguments.                   */
+} trace_record;
+
+static trace_record *trace_ring  = NULL;
+static size_t        trace_size  = 0;
+static size_t        trace_next  = 0;   /* Next slot to write.       */
+static size_t        trace_count = 0;   /* Records written in total. */
+static double        trace_start = 0.0;
+static char         *trace_names[TRACE_MAX_EVENTS];
+static unsigned      trace_nnames = 0;
+
+
+static double
+trace_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Allocates the ring buffer. Passing zero disables tracing.
+ */
+int
+chsl_trace_init (size_t size)
+{
+    free (trace_ring);
+    trace_ring  = NULL;
+    trace_size  = 0;
+    trace_next  = 0;
+    trace_count = 0;
+    trace_start = trace_now ();
+
+    if (size == 0)
+        return 1;
+
+    if ((trace_ring = calloc (size, sizeof (trace_record))) == NULL)
+        return 0;
+
+    trace_size = size;
+    return 1;
+}
+
+
+/*
+ * Writes the recorded events, oldest first.
+ */
+void
+chsl_trace_dump (FILE *out)
+{
+    size_t i, n;
+
+    if (trace_count == 0)
+        return;
+
+    n = (trace_count < trace_size) ? trace_count : trace_size;
+    fprintf (out, "trace: last %lu of %lu events\n",
+             (unsigned long) n, (unsigned long) trace_count);
+
+    for (i = trace_next + trace_size - n; n--; i++) {
+        const trace_record *r = &trace_ring[i % trace_size];
+        fprintf (out, "[%12.6f] %s %.14g %.14g\n", r->time,
+                 trace_names[r->event], (double) r->a, (double) r->b);
+    }
+    fflush (out);
+}
+
+
+void
+chsl_trace_free (void)
+{
+    unsigned i;
+    chsl_trace_init (0);
+    for (i = 0; i < trace_nnames; i++)
+        free (trace_names[i]);
+    trace_nnames = 0;
+}
+
+
+/***
+Obtains the identifier for an event name.
+
+Identifiers are to be passed to @{record}. It is recommended to obtain
+them once, and save them for later use.
+
+@function event
+@param name Event name.
+@return Event identifier (a number).
+*/
+static int
+trace_event (lua_State *L)
+{
+    const char *name = luaL_checkstring (L, 1);
+    unsigned i;
+
+    for (i = 0; i < trace_nnames; i++) {
+        if (strcmp (trace_names[i], name) == 0) {
+            lua_pushinteger (L, i);
+            return 1;
+        }
+    }
+
+    if (trace_nnames == TRACE_MAX_EVENTS)
+        return luaL_error (L, "too many trace events (maximum is %d)",
+                           TRACE_MAX_EVENTS);
+
+    if ((trace_names[trace_nnames] = strdup (name)) == NULL)
+        return luaL_error (L, "out of memory");
+
+    lua_pushinteger (L, trace_nnames++);
+    return 1;
+}
+
+
+/***
+Records an event.
+
+@function record
+@param event Event identifier, as returned by @{event}.
+@param a First argument (optional, must be a number).
+@param b Second argument (optional, must be a number).
+*/
+static int
+trace_rec (lua_State *L)
+{
+    trace_record *r;
+    lua_Integer event;
+
+    if (trace_size == 0)
+        return 0;
+
+    event = luaL_checkinteger (L, 1);
+    luaL_argcheck (L, event >= 0 && (unsigned) event < trace_nnames, 1,
+                   "invalid event identifier");
+
+    r = &trace_ring[trace_next];
+    r->time  = trace_now () - trace_start;
+    r->event = (unsigned) event;
+    r->a     = luaL_optnumber (L, 2, 0);
+    r->b     = luaL_optnumber (L, 3, 0);
+
+    trace_next = (trace_next + 1) % trace_size;
+    trace_count++;
+    return 0;
+}
+
+
+/***
+Writes the recorded events to the standard error stream.
+
+@function dump
+*/
+static int
+trace_dump (lua_State *L)
+{
+    (void) L;
+    chsl_trace_dump (stderr);
+    return 0;
+}
+
+
+static const luaL_Reg trace_funcs[] =
+{
+    { "event",  trace_event },
+    { "record", trace_rec   },
+    { "dump",   trace_dump  },
+    { NULL, NULL }
+};
+
+
+int
+lua_trace_open (lua_State *L)
+{
+    assert (L);
+    luaL_newlib (L, trace_funcs);
+    lua_pushinteger (L, trace_size);
+    lua_setfield (L, -2, "size");
+    return 1;
+}
@@ -0,0 +1,521 @@
+/***
+Encoding of Index Braille V4 commands.
+
+Commands are escape sequences made of an ASCII escape character, a
+three letter command name, a numeric argument and a semicolon, e.g.
+`ESC DCH32;`. An *encoder* is created with @{new} from a map of device
+options to the commands which set them, and then turns option values
+into command bytes without going through `string.format`.
+
+Options are either *ranges*, where the value is sent as the argument
+after checking it against the allowed minimum and maximum, or sets of
+*values*, where the closest supported value is chosen and sent as its
+code. The complete command for each value of a set is prepared when the
+encoder is created, and for ranges the command name is.
+
+@module v4command
+
+@copyright 2012 Adrian Perez <aperez@igalia.com>
+@license Distributed under terms of the MIT license.
+*/
+
+#include "../lua/lua.h"
+#include "../lua/lauxlib.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+
+#define V4COMMAND_MT "chisel.v4command"
+
+/* Most values supported for an option, and longest command. */
+#define V4COMMAND_MAX_VALUES 16
+#define V4COMMAND_MAX_BYTES  32  /* ESC, name, 20 digits and ';' */
+
+
+typedef struct {
+    char   bytes[V4COMMAND_MAX_BYTES];
+    size_t len;
+} v4command_template;
+
+typedef struct {
+    const char        *option;  /* Owned by the map in the uservalue. */
+    v4command_template prefix;  /* ESC and the command name.          */
+    long               minimum;
+    long               maximum;
+    unsigned           nvalues; /* Zero for ranges.                   */
+    double             values[V4COMMAND_MAX_VALUES];
+    v4command_template commands[V4COMMAND_MAX_VALUES];
+} v4command_entry;
+
+typedef struct {
+    unsigned        nentries;
+    v4command_entry entries[1];
+} v4command_encoder;
+
+
+static inline v4command_encoder*
+check_encoder (lua_State *L, int index)
+{
+    return (v4command_encoder*) luaL_checkudata (L, index, V4COMMAND_MT);
+}
+
+
+/* Writes a number in decimal, returns the number of bytes written. */
+static size_t
+format_long (char *out, long value)
+{
+    char digits[24];
+    size_t n = 0, len = 0;
+    unsigned long v = (value < 0) ? -(unsigned long) value : (unsigned long) value;
+
+    do {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+
+    if (value < 0)
+        out[len++] = '-';
+    while (n > 0)
+        out[len++] = digits[--n];
+    return len;
+}
+
+
+/*
+ * Converts a number to a command argument. Returns zero if the number is
+ * not integral, or does not fit in a long.
+ */
+static int
+number_to_long (double value, long *out)
+{
+    if (value != floor (value) ||
+        value < (double) LONG_MIN || value >= -(double) LONG_MIN)
+        return 0;
+    *out = (long) value;
+    return 1;
+}
+
+
+static size_t
+make_command (char *out, const char *name, size_t name_len, long arg, int with_arg)
+{
+    size_t len = 0;
+    out[len++] = '\033';
+    memcpy (out + len, name, name_len);
+    len += name_len;
+    if (with_arg) {
+        len += format_long (out + len, arg);
+        out[len++] = ';';
+    }
+    return len;
+}
+
+
+/***
+Encodes a single command.
+
+@function encode
+@tparam string name Command name, e.g. `"DCH"`.
+@param arg Argument, either a number or a string *(Optional)*.
+@treturn string The escape sequence.
+*/
+static int
+v4command_encode (lua_State *L)
+{
+    size_t name_len, arg_len = 0;
+    const char *name = luaL_checklstring (L, 1, &name_len);
+    const char *arg = NULL;
+    luaL_Buffer b;
+
+    if (lua_type (L, 2) == LUA_TNUMBER) {
+        char digits[24];
+        long value;
+        if (!number_to_long (lua_tonumber (L, 2), &value))
+            return luaL_argerror (L, 2, "number has no integer representation");
+        arg_len = format_long (digits, value);
+        lua_pushlstring (L, digits, arg_len);
+        lua_replace (L, 2);
+    }
+    arg = luaL_optlstring (L, 2, "", &arg_len);
+
+    luaL_buffinit (L, &b);
+    luaL_addchar (&b, '\033');
+    luaL_addlstring (&b, name, name_len);
+    luaL_addlstring (&b, arg, arg_len);
+    luaL_addchar (&b, ';');
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/*
+ * Reads the definition of an option at the top of the stack into an
+ * entry, see v4command_new() for the format.
+ */
+static void
+check_entry (lua_State *L, v4command_entry *e, const char *option)
+{
+    size_t name_len;
+    const char *name;
+    long code = 0;
+
+    lua_rawgeti (L, -1, 1);
+    name = lua_tolstring (L, -1, &name_len);
+    if (name == NULL || name_len == 0 || name_len > 8)
+        luaL_error (L, "option %s: invalid command name", option);
+    e->prefix.len = make_command (e->prefix.bytes, name, name_len, 0, 0);
+    lua_pop (L, 1);
+
+    e->minimum = LONG_MIN;
+    e->maximum = LONG_MAX;
+    lua_getfield (L, -1, "minimum");
+    lua_getfield (L, -2, "maximum");
+    if ((!lua_isnil (L, -2) &&
+         !number_to_long (luaL_checknumber (L, -2), &e->minimum)) ||
+        (!lua_isnil (L, -1) &&
+         !number_to_long (luaL_checknumber (L, -1), &e->maximum)))
+        luaL_error (L, "option %s: limits must be integers", option);
+    lua_pop (L, 2);
+
+    lua_getfield (L, -1, "values");
+    if (!lua_isnil (L, -1)) {
+        luaL_checktype (L, -1, LUA_TTABLE);
+        lua_pushnil (L);
+        while (lua_next (L, -2)) {
+            v4command_template *t;
+            unsigned i = e->nvalues;
+            double value;
+
+            if (e->nvalues == V4COMMAND_MAX_VALUES)
+                luaL_error (L, "option %s: too many values", option);
+            if (lua_type (L, -2) != LUA_TNUMBER || lua_type (L, -1) != LUA_TNUMBER)
+                luaL_error (L, "option %s: values must map numbers to codes", option);
+            if (!number_to_long (lua_tonumber (L, -1), &code))
+                luaL_error (L, "option %s: codes must be integers", option);
+
+            /* Keep them sorted, so the first closest value always wins. */
+            value = lua_tonumber (L, -2);
+            e->nvalues++;
+            while (i > 0 && e->values[i - 1] > value) {
+                e->values[i] = e->values[i - 1];
+                e->commands[i] = e->commands[i - 1];
+                i--;
+            }
+            e->values[i] = value;
+            t = &e->commands[i];
+            t->len = make_command (t->bytes, name, name_len, code, 1);
+            lua_pop (L, 1);
+        }
+        if (e->nvalues == 0)
+            luaL_error (L, "option %s: no values", option);
+    }
+    lua_pop (L, 1);
+}
+
+
+/***
+Creates an encoder.
+
+Each option is defined by a table with the command name as its first
+item, and either a `values` table, which maps the supported values to
+the codes sent for them, or the `minimum` and `maximum` values allowed
+(both optional). A `names` table may map strings to values, as in
+`{ single = 5.0 }`.
+
+@function new
+@tparam table options Table which maps option names to definitions.
+@tparam string prefix Prefix for error messages *(Optional)*.
+@treturn encoder The encoder.
+@usage
+encoder = v4command.new {
+  dot_distance   = { "DGD"; values = { [2.0] = 0; [2.5] = 1 } };
+  binding_margin = { "DBI"; minimum = 0 };
+}
+*/
+static int
+v4command_new (lua_State *L)
+{
+    v4command_encoder *enc;
+    unsigned n = 0, i = 0;
+
+    luaL_checktype (L, 1, LUA_TTABLE);
+    luaL_optstring (L, 2, "v4command");
+    lua_settop (L, 2);
+
+    lua_pushnil (L);
+    while (lua_next (L, 1)) {
+        if (lua_type (L, -2) != LUA_TSTRING)
+            return luaL_error (L, "option names must be strings");
+        luaL_checktype (L, -1, LUA_TTABLE);
+        n++;
+        lua_pop (L, 1);
+    }
+
+    enc = lua_newuserdata (L, sizeof (v4command_encoder) +
+                              (n ? n - 1 : 0) * sizeof (v4command_entry));
+    memset (enc, 0, sizeof (v4command_encoder));
+    luaL_setmetatable (L, V4COMMAND_MT);
+
+    /*
+     * The uservalue keeps the error prefix, maps each option to the
+     * index of its entry, and each index to its table of names.
+     */
+    lua_newtable (L);
+    lua_pushvalue (L, 2);
+    lua_rawseti (L, -2, 0);
+
+    lua_pushnil (L);
+    while (lua_next (L, 1)) {
+        v4command_entry *e = &enc->entries[i];
+        memset (e, 0, sizeof (v4command_entry));
+        e->option = lua_tostring (L, -2);
+        check_entry (L, e, e->option);
+
+        lua_getfield (L, -1, "names");
+        if (!lua_isnil (L, -1)) {
+            luaL_checktype (L, -1, LUA_TTABLE);
+            lua_rawseti (L, -4, i + 1);
+        } else {
+            lua_pop (L, 1);
+        }
+
+        lua_pop (L, 1);
+        lua_pushvalue (L, -1);
+        lua_pushinteger (L, i);
+        lua_rawset (L, -4);
+        i++;
+    }
+    enc->nentries = n;
+
+    lua_setuservalue (L, -2);
+    return 1;
+}
+
+
+/*
+ * Finds the entry for an option, given its name at the index. Returns
+ * NULL if the encoder does not handle the option. The uservalue of the
+ * encoder must be at the top of the stack.
+ */
+static v4command_entry*
+find_entry (lua_State *L, v4command_encoder *enc, int index)
+{
+    v4command_entry *e = NULL;
+    lua_pushvalue (L, index);
+    lua_rawget (L, -2);
+    if (lua_type (L, -1) == LUA_TNUMBER)
+        e = &enc->entries[lua_tointeger (L, -1)];
+    lua_pop (L, 1);
+    return e;
+}
+
+
+/*
+ * Writes the command for the value at the index to "out", which must
+ * have room for V4COMMAND_MAX_BYTES, and returns the value chosen. The
+ * number of bytes written is stored in "len". The uservalue of the
+ * encoder is used for error messages and names. The stack is left as
+ * it was, so callers may use it to build their results.
+ */
+static double
+encode_option (lua_State *L, v4command_encoder *enc, v4command_entry *e,
+               int index, int uservalue, char *out, size_t *len)
+{
+    double value;
+
+    if (lua_type (L, index) == LUA_TSTRING) {
+        lua_rawgeti (L, uservalue, (int) (e - enc->entries) + 1);
+        if (lua_istable (L, -1)) {
+            lua_pushvalue (L, index);
+            lua_rawget (L, -2);
+            lua_remove (L, -2);
+        }
+        if (lua_type (L, -1) != LUA_TNUMBER) {
+            lua_rawgeti (L, uservalue, 0);
+            luaL_error (L, "%s: %s = %s is not a valid value",
+                        lua_tostring (L, -1), e->option,
+                        lua_tostring (L, index));
+        }
+        value = lua_tonumber (L, -1);
+        lua_pop (L, 1);
+    } else if (lua_type (L, index) == LUA_TNUMBER) {
+        value = lua_tonumber (L, index);
+    } else {
+        lua_rawgeti (L, uservalue, 0);
+        luaL_error (L, "%s: %s must be a number, got %s", lua_tostring (L, -1),
+                    e->option, luaL_typename (L, index));
+        return 0;
+    }
+
+    if (e->nvalues > 0) {
+        /* Pick the closest of the supported values. */
+        unsigned i, best = 0;
+        for (i = 1; i < e->nvalues; i++) {
+            if (fabs (e->values[i] - value) < fabs (e->values[best] - value))
+                best = i;
+        }
+        memcpy (out, e->commands[best].bytes, *len = e->commands[best].len);
+        return e->values[best];
+    } else {
+        long v = 0;
+        if (!number_to_long (value, &v)) {
+            lua_rawgeti (L, uservalue, 0);
+            luaL_error (L, "%s: %s = %f is not an integer",
+                        lua_tostring (L, -1), e->option, value);
+        }
+        if (v < e->minimum || v > e->maximum) {
+            lua_rawgeti (L, uservalue, 0);
+            if (e->maximum == LONG_MAX && e->minimum == 0)
+                luaL_error (L, "%s: %s = %d is negative", lua_tostring (L, -1),
+                            e->option, (int) v);
+            luaL_error (L, "%s: %s = %d out of the %d-%d range",
+                        lua_tostring (L, -1), e->option, (int) v,
+                        (int) e->minimum, (int) e->maximum);
+        }
+        memcpy (out, e->prefix.bytes, e->prefix.len);
+        *len = e->prefix.len + format_long (out + e->prefix.len, v);
+        out[(*len)++] = ';';
+        return v;
+    }
+}
+
+
+/***
+Encodes the command which sets an option.
+
+@function encoder:option
+@tparam string option Option name.
+@param value Value for the option.
+@treturn string The command, or `nil` if the encoder does not handle the
+option.
+@treturn number The value chosen: for options with a set of values, the
+closest one to the requested value.
+@raise If the value is not valid for the option.
+*/
+static int
+v4command_option (lua_State *L)
+{
+    v4command_encoder *enc = check_encoder (L, 1);
+    v4command_entry *e;
+    char command[V4COMMAND_MAX_BYTES];
+    size_t len;
+    double chosen;
+
+    luaL_checkstring (L, 2);
+    lua_settop (L, 3);
+    lua_getuservalue (L, 1);
+    if ((e = find_entry (L, enc, 2)) == NULL) {
+        lua_pushnil (L);
+        return 1;
+    }
+
+    chosen = encode_option (L, enc, e, 3, 4, command, &len);
+    lua_pushlstring (L, command, len);
+    lua_pushnumber (L, chosen);
+    return 2;
+}
+
+
+/***
+Encodes the commands which set a group of options.
+
+Options which the encoder does not handle are skipped. Commands are
+written in the order of the options in the encoder, which is the same
+for any table.
+
+@function encoder:options
+@tparam table options Table which maps option names to values.
+@treturn string The commands, which may be empty.
+@raise If a value is not valid for its option.
+*/
+static int
+v4command_options (lua_State *L)
+{
+    v4command_encoder *enc = check_encoder (L, 1);
+    char command[V4COMMAND_MAX_BYTES];
+    size_t len;
+    unsigned i;
+    luaL_Buffer b;
+
+    luaL_checktype (L, 2, LUA_TTABLE);
+    lua_settop (L, 2);
+    lua_getuservalue (L, 1);
+    luaL_buffinit (L, &b);
+
+    /*
+     * Look up each option handled by the encoder, instead of traversing
+     * the table: no slots are kept on the stack between additions to the
+     * buffer, and each command is complete before it is added.
+     */
+    for (i = 0; i < enc->nentries; i++) {
+        v4command_entry *e = &enc->entries[i];
+        lua_pushstring (L, e->option);
+        lua_rawget (L, 2);
+        if (lua_isnil (L, -1)) {
+            lua_pop (L, 1);
+            continue;
+        }
+        encode_option (L, enc, e, lua_gettop (L), 3, command, &len);
+        lua_pop (L, 1);
+        luaL_addlstring (&b, command, len);
+    }
+
+    luaL_pushresult (&b);
+    return 1;
+}
+
+
+/***
+Checks whether the encoder handles an option.
+
+@function encoder:handles
+@tparam string option Option name.
+@treturn boolean
+*/
+static int
+v4command_handles (lua_State *L)
+{
+    v4command_encoder *enc = check_encoder (L, 1);
+    luaL_checkstring (L, 2);
+    lua_settop (L, 2);
+    lua_getuservalue (L, 1);
+    lua_pushboolean (L, find_entry (L, enc, 2) != NULL);
+    return 1;
+}
+
+
+static const luaL_Reg v4command_methods[] =
+{
+#define REG_ITEM(_name)  { #_name, v4command_ ## _name }
+    REG_ITEM (option),
+    REG_ITEM (options),
+    REG_ITEM (handles),
+#undef REG_ITEM
+    { NULL, NULL }
+};
+
+static const luaL_Reg v4command_funcs[] =
+{
+    { "new", v4command_new },
+    { "encode", v4command_encode },
+    { NULL, NULL }
+};
+
+
+int
+lua_v4command_open (lua_State *L)
+{
+    assert (L);
+
+    luaL_newmetatable (L, V4COMMAND_MT);
+    luaL_setfuncs (L, v4command_methods, 0);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    lua_pop (L, 1);
+
+    luaL_newlib (L, v4command_funcs);
+    return 1;
+}
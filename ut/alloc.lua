@@ -0,0 +1,42 @@
+--
+-- ut/alloc.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Keeps lots of small blocks of the given size alive, and returns the
+-- amount of memory reserved by the pool while they were.
+local function fill (size, count)
+  local blocks = {}
+  local padding = ("x"):rep (size - 8)
+  for i = 1, count do
+    blocks[i] = ("%s%08i"):format (padding, i)
+  end
+  local reserved = chisel.allocstats ().reserved
+  blocks = nil
+  collectgarbage ()
+  collectgarbage ()
+  return reserved
+end
+
+function test_pool_release()
+  local stats = chisel.allocstats ()
+  if stats == nil then
+    return -- Running with the system allocator.
+  end
+  local slack = (stats.spare_max + 4) * stats.chunk_size
+
+  collectgarbage ()
+  local before = chisel.allocstats ().reserved
+  local peak = fill (40, 100000)
+  assert_true (peak > before + 2 * slack)
+
+  -- Empty chunks are released, except for a few spares.
+  stats = chisel.allocstats ()
+  assert_true (stats.reserved <= before + slack)
+  assert_true (stats.released > 0)
+
+  -- Chunks released by a size class are reused by others.
+  assert_true (fill (200, 25000) <= peak + slack)
+end
@@ -0,0 +1,79 @@
+--
+-- ut/batch.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+-- Batch mode of chiseltodev, run as a separate process: the tests run
+-- from the top of the source tree, where the chisel binary is built.
+
+local function make_dir ()
+  local root = os.tmpname ()
+  os.remove (root)
+  os.execute (("mkdir -p %s/a %s/b %s/out"):format (root, root, root))
+  return root
+end
+
+local function write_file (path, data)
+  local file = assert (io.open (path, "w"))
+  file:write (data)
+  file:close ()
+end
+
+local exists = lib.fs.exists
+
+-- Returns true if the command succeeded (nil otherwise), and its
+-- standard error.
+local function chiseltodev (root, ...)
+  local cmd = ("./chisel -L %s -S chiseltodev device=indexbraille/everest " ..
+               "out=%s/out %s 2> %s/stderr"):format (chisel.libdir, root,
+               table.concat ({ ... }, " "), root)
+  local ok = os.execute (cmd)
+  local file = assert (io.open (root .. "/stderr"))
+  local stderr = file:read ("*a")
+  file:close ()
+  return ok, stderr
+end
+
+function test_batch()
+  local root = make_dir ()
+  write_file (root .. "/a/one.chsl", 'document { text "one" }\n')
+  write_file (root .. "/b/two.chsl", 'document { text "two" }\n')
+  write_file (root .. "/b/bad.chsl", 'document { text = }\n')
+
+  local ok, stderr = chiseltodev (root, root .. "/a/one.chsl",
+                                  root .. "/b/bad.chsl", root .. "/b/two.chsl")
+  -- The failing document does not stop the rest, but the exit status
+  -- reports it.
+  assert_nil (ok)
+  assert_true (exists (root .. "/out/one.raw"))
+  assert_true (exists (root .. "/out/two.raw"))
+  assert_false (exists (root .. "/out/bad.raw"))
+  assert_match ("one.chsl: ok", stderr)
+  assert_match ("bad.chsl: FAILED", stderr)
+  assert_match ("3 documents, 1 failed", stderr)
+
+  local file = assert (io.open (root .. "/out/two.raw", "rb"))
+  assert_match ("two$", file:read ("*a"))
+  file:close ()
+
+  os.execute ("rm -rf " .. root)
+end
+
+function test_batch_collision()
+  local root = make_dir ()
+  write_file (root .. "/a/same.chsl", 'document { text "a" }\n')
+  write_file (root .. "/b/same.chsl", 'document { text "b" }\n')
+  write_file (root .. "/b/other.chsl", 'document { text "c" }\n')
+
+  local ok, stderr = chiseltodev (root, root .. "/b/other.chsl",
+                                  root .. "/a/same.chsl", root .. "/b/same.chsl")
+  assert_nil (ok)
+  assert_match ("would both be written to", stderr)
+  -- Nothing is rendered.
+  assert_false (exists (root .. "/out/other.raw"))
+  assert_false (exists (root .. "/out/same.raw"))
+
+  os.execute ("rm -rf " .. root)
+end
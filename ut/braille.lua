@@ -0,0 +1,93 @@
+--
+-- ut/braille.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local braille = lib.braille
+local device  = lib.device
+
+local nabcc = " A1B'K2L@CIF/MSP\"E3H9O6R^DJG>NTQ,*5<-U8V.%[$+X!&;:4\\0Z7(_?W]#Y)="
+
+
+local function new (chars, unknown)
+  return braille.new { cells = nabcc; chars = chars; unknown = unknown }
+end
+
+function test_new_invalid()
+  assert_error (function () braille.new {} end)
+  assert_error (function () braille.new { cells = "ABC" } end)
+  assert_error (function () new { [65] = "x" } end)     -- ASCII key
+  assert_error (function () new { ["ab"] = "x" } end)   -- Not one character
+  local ok, err = pcall (new, { ["ab"] = "x" })
+  assert_match ("key 'ab' is not a single UTF%-8 character", err)
+end
+
+function test_ascii()
+  local t = new ()
+  local text = ("Lorem ipsum dolor sit amet.\n"):rep (10)
+  assert_equal (text, t:translate (text))
+  assert_equal ("", t:translate (""))
+  assert_equal (0, t:unknown ())
+end
+
+function test_braille_patterns()
+  local t = new ()
+  -- U+2800 (blank), U+2801 (dot 1), U+2803 (dots 1-2), U+283F (dots 1-6)
+  assert_equal (" AB=", t:translate ("\226\160\128\226\160\129\226\160\131\226\160\191"))
+  -- U+28C1 has dots 1, 7 and 8: the last two are ignored.
+  assert_equal ("xAx", t:translate ("x\226\163\129x"))
+end
+
+function test_chars_and_unknown()
+  local t = new ({ [0x2019] = "'"; ["\195\169"] = "E"; [0x2026] = "..." }, "?")
+  assert_equal ("it's", t:translate ("it\226\128\153s"))
+  assert_equal ("Ecole...", t:translate ("\195\169cole\226\128\166"))
+  assert_equal ("a?b", t:translate ("a\226\130\172b")) -- Euro sign
+  assert_equal (1, t:unknown ())
+end
+
+function test_invalid_passthrough()
+  local t = new ()
+  -- Latin-1 bytes, a lone continuation byte, and an overlong sequence.
+  assert_equal ("caf\233!", t:translate ("caf\233!"))
+  assert_equal ("\128", t:translate ("\128"))
+  assert_equal ("\192\175", t:translate ("\192\175"))
+  assert_equal (0, t:unknown ())
+end
+
+function test_split_sequence()
+  local t = new ()
+  assert_equal ("ab", t:translate ("ab\226"))
+  assert_equal ("", t:translate ("\160"))
+  assert_equal ("Acd", t:translate ("\129cd"))
+
+  -- An incomplete sequence at the end is flushed unchanged.
+  assert_equal ("x", t:translate ("x\226\160"))
+  assert_equal ("\226\160", t:flush ())
+  assert_equal ("", t:flush ())
+
+  -- A sequence which turns out to be invalid is passed through.
+  assert_equal ("", t:translate ("\226"))
+  assert_equal ("\226zA", t:translate ("z\226\160\129"))
+end
+
+function test_device_translator()
+  local t = device.get ("indexbraille/everest"):create_translator ()
+  assert_not_nil (t)
+  assert_equal ("A--'", t:translate ("\226\160\129\226\128\148\226\128\153"))
+end
+
+
+local bench_ascii   = ("Lorem ipsum dolor sit amet, consectetur.\n"):rep (1000)
+local bench_unicode = ("\226\160\135\226\160\149\226\160\151\226\160\145 "):rep (8000)
+local bench_t       = new ()
+
+function bench_translate_ascii()
+  bench_t:translate (bench_ascii)
+end
+
+function bench_translate_braille()
+  bench_t:translate (bench_unicode)
+end
@@ -0,0 +1,102 @@
+--
+-- ut/contract.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local contract = lib.contract
+
+
+local rules = {
+  capsign = ","; capword = ",,"; numsign = "#"; letsign = ";";
+  digits = { ["1"] = "A"; ["2"] = "B"; ["0"] = "J" };
+
+  { "always",     "the", "!" };
+  { "always",     "th",  "?" };
+  { "always",     "and", "&" };
+  { "word",       "be",  "2" };
+  { "begword",    "be",  "2" };
+  { "midword",    "ea",  "2" };
+  { "endword",    "ed",  "$" };
+  { "midendword", "ing", "+" };
+  { "word",       "it",  "X" };
+}
+
+local function new ()
+  return contract.new (contract.compile (rules))
+end
+
+function test_compile_invalid()
+  assert_error (function () contract.compile { { "sometimes", "a", "b" } } end)
+  assert_error (function () contract.compile { { "always", "", "b" } } end)
+  assert_error (function () contract.compile { { "always", "a" } } end)
+  assert_error (function () contract.new ("not a table") end)
+  -- A truncated image is rejected.
+  local image = contract.compile (rules)
+  assert_error (function () contract.new (image:sub (1, -2)) end)
+end
+
+function test_longest_match()
+  local t = new ()
+  assert_equal ("! cat", t:translate ("the cat"))
+  assert_equal ("?is", t:translate ("this"))
+  assert_equal ("h& s&", t:translate ("hand sand"))
+  assert_equal ("no rules here", t:translate ("no rules here"))
+end
+
+function test_word_position()
+  local t = new ()
+  assert_equal ("2", t:translate ("be"))
+  assert_equal ("2cause", t:translate ("because"))
+  assert_equal ("br2d", t:translate ("bread"))      -- Middle of a word
+  assert_equal ("eat", t:translate ("eat"))         -- Not in the middle
+  assert_equal ("end$", t:translate ("ended"))      -- End of a word
+  assert_equal ("edit", t:translate ("edit"))       -- Not at the end
+  assert_equal ("s+", t:translate ("sing"))
+  assert_equal ("ingot", t:translate ("ingot"))
+  assert_equal ("X, its", t:translate ("it, its"))  -- Whole words only
+end
+
+function test_indicators()
+  local t = new ()
+  assert_equal (",! cat", t:translate ("The cat"))
+  assert_equal (",,! ,,CAT", t:translate ("THE CAT"))
+  assert_equal (",A ,B", t:translate ("A B"))       -- Single letters
+  assert_equal ("#ABJ", t:translate ("120"))
+  assert_equal ("#A;a #Bx", t:translate ("1a 2x"))
+end
+
+function test_decimal_numbers()
+  local t = new ()
+  -- Periods and commas between digits do not start a new number.
+  assert_equal ("#A.B", t:translate ("1.2"))
+  assert_equal ("#A,JJ", t:translate ("1,00"))
+  assert_equal ("#A. #B", t:translate ("1. 2"))
+  assert_equal ("#A.a", t:translate ("1.a"))
+  assert_equal ("#A.", t:translate ("1."))
+
+  rules.decpoint = "'"
+  t = new ()
+  rules.decpoint = nil
+  assert_equal ("#A'B'J", t:translate ("1.2.0"))
+  assert_equal ("#A. #B", t:translate ("1. 2"))
+end
+
+function test_open()
+  local t, err = contract.open (chisel.libdir .. "/data/_contractions/en-us-g2.ctb")
+  assert_not_nil (t, err)
+  assert_equal (",! *", t:translate ("The child"))
+  assert_equal ("Y C D X4", t:translate ("you can do it."))
+  assert_equal ("#C.AD", t:translate ("3.14"))
+  assert_equal ("#A1JJJ4", t:translate ("1,000."))
+  assert_nil (contract.open (chisel.libdir .. "/data/_contractions/none.ctb"))
+end
+
+
+local bench_table = new ()
+local bench_text  = ("The breadth of the standing stone, and it be done.\n"):rep (200)
+
+function bench_translate()
+  bench_table:translate (bench_text)
+end
@@ -0,0 +1,57 @@
+--
+-- ut/device.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local device   = lib.device
+local deepcopy = lib.util.deepcopy
+
+
+function test_get()
+  local dev = device.get ("indexbraille/everest")
+  assert_table (dev)
+  assert_equal ("indexbraille/everest", dev.id)
+  assert_equal ("indexbraille-v4", dev.renderer)
+end
+
+function test_get_unknown()
+  assert_error (function () device.get ("nobody/nothing") end)
+end
+
+
+local intersect_options = lib["render-indexbraille-v4"].intersect_options
+
+function test_intersect_options()
+  local old = { copies = 1; lines_per_page = 26; dot_distance = 2.5 }
+  local r = intersect_options (old, { copies = 2; lines_per_page = 26;
+                                      binding_margin = 3 })
+  assert_equal (2, r.copies)
+  assert_nil (r.lines_per_page) -- Unchanged
+  assert_nil (r.binding_margin) -- Not present in the old options
+  assert_nil (r.dot_distance)   -- Not present in the new options
+end
+
+-- Renderers call intersect_options() each time a part changes options,
+-- and it must stay cheaper than making a copy of them.
+function test_intersect_options_cheaper_than_copy()
+  local old = device.get ("indexbraille/everest").options
+  local new = { lines_per_page = 20 }
+  assert_faster_than (function () deepcopy (old) end,
+                      function () intersect_options (old, new) end)
+end
+
+
+function bench_get()
+  device.get ("indexbraille/everest")
+end
+
+local bench_old = { copies = 1; lines_per_page = 26; dot_distance = 2.5;
+                    characters_per_line = 32; line_spacing = "single";
+                    binding_margin = 0; top_margin = 0 }
+local bench_new = { lines_per_page = 20; top_margin = 1 }
+
+function bench_intersect_options()
+  intersect_options (bench_old, bench_new)
+end
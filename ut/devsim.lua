@@ -0,0 +1,114 @@
+--
+-- ut/devsim.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local devsim = lib.devsim
+local device = lib.device
+
+
+-- Pages of four cells per line and two lines per page.
+local setup = "\027DCH4;\027DLP2;"
+
+local function simulate (chunks)
+  local sim = devsim.new (device.get ("indexbraille/everest"))
+  local pages = {}
+  function sim:on_page (page)
+    pages[#pages + 1] = devsim.page_text (page)
+  end
+  for _, chunk in ipairs (chunks) do
+    sim:feed (chunk)
+  end
+  return sim:finish (), pages, sim
+end
+
+
+function test_pages()
+  local stats, pages = simulate { setup .. "ABCDEFG\r\nH\r\nIJ\fK" }
+  assert_equal (3, stats.pages)
+  assert_equal (5, stats.lines)
+  assert_equal (1, stats.wrapped)
+  assert_equal ("ABCD\nEFG\n", pages[1])
+  assert_equal ("H\nIJ\n", pages[2])
+  assert_equal ("K\n", pages[3])
+  assert_nil (stats.truncated)
+end
+
+function test_split_stream()
+  -- The same stream, split at each byte, gives the same pages.
+  local stream = setup .. "\027DBI1;AB\r\nCD\027\001\064\027\002EF\r"
+  local chunks = {}
+  for i = 1, #stream do
+    chunks[i] = stream:sub (i, i)
+  end
+  local _, whole = simulate { stream }
+  local stats, split = simulate (chunks)
+  assert_equal (#whole, #split)
+  for i = 1, #whole do
+    assert_equal (whole[i], split[i])
+  end
+  assert_equal (" AB\n CD\n", split[1])
+  assert_equal (" @\n EF\n", split[2])
+  assert_equal (1, stats.graphics)
+end
+
+function test_commands()
+  local stats, _, sim = simulate { setup ..
+    "\027DCH4;\027DGD2;\027DMC3;\027DXX1;\027DLP0;\027DVchisel;A" }
+  assert_equal (8, stats.commands)
+  assert_equal (4, stats.switches)
+  assert_equal (1, stats.redundant)
+  assert_equal (1, stats.unknown)
+  assert_equal (1, stats.invalid)
+  assert_equal (3, stats.copies)
+  assert_equal (2, stats.command.DCH)
+  assert_equal (1.6, sim.options.dot_distance)
+  assert_equal ("chisel", sim.version)
+  assert_equal (1, stats.pages)
+end
+
+function test_truncated()
+  assert_true (simulate { "AB\027DCH" }.truncated)
+  assert_true (simulate { "AB\027\001AB" }.truncated)
+end
+
+function test_page_image()
+  local _, _, sim = simulate {}
+  local image = sim:page_image ({ number = 1; top_margin = 0; lines = {
+    { mode = "text"; data = "A"; dot_distance = 2.5; line_spacing = 5;
+      cell_spacing = 3.5; binding_margin = 0 } } }, 1)
+  local w, h = image:size ()
+  assert_equal (216, w)   -- US Letter
+  assert_equal (280, h)
+  -- A single dot: one dark pixel, or a few of them around it.
+  local dots = select (2, image:pixels ():gsub ("%z", ""))
+  assert_true (dots >= 1 and dots <= 4)
+end
+
+function test_cancel()
+  -- A job cancelled in the middle of a block of graphics: the renderer
+  -- closes it, and sets the default options again.
+  local dev = device.get ("indexbraille/everest")
+  local output = {}
+  local rend = dev:create_renderer (function (self, data)
+    if data == "=?L\n" then
+      error ("interrupted")
+    end
+    output[#output + 1] = data
+    return self
+  end):clone ()
+  local T = lib.doctree
+  local doc = T.document:clone { children = {};
+                                 options = { characters_per_line = 20 } }
+  doc:add_child (T.text:clone { data = "AB\r\n" })
+  doc:add_child (T.graphics:clone { data = "=?L\n" })
+  assert_false (pcall (doc.render, doc, rend))
+  assert_true (simulate { table.concat (output) }.truncated)
+
+  rend:cancel ()
+  local stats, _, sim = simulate { table.concat (output) }
+  assert_nil (stats.truncated)
+  assert_equal (dev.default.characters_per_line, sim.options.characters_per_line)
+end
@@ -0,0 +1,388 @@
+--
+-- ut/doctree.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local T = lib.doctree
+
+
+-- Renderer which records the calls made to it.
+local function recorder ()
+  local calls = {}
+  local function record (name)
+    return function (self, node) calls[#calls+1] = name end
+  end
+  return {
+    begin_document = record ("begin_document");
+    end_document   = record ("end_document");
+    begin_text     = record ("begin_text");
+    end_text       = record ("end_text");
+  }, calls
+end
+
+local function make_document (ntexts)
+  local doc = T.document:clone { children = {} }
+  for i = 1, ntexts do
+    doc:add_child (T.text:clone { data = "text " .. i })
+  end
+  return doc
+end
+
+
+function test_walk_order()
+  local rend, calls = recorder ()
+  make_document (2):render (rend)
+  assert_equal (6, #calls)
+  assert_equal ("begin_document", calls[1])
+  assert_equal ("begin_text",     calls[2])
+  assert_equal ("end_text",       calls[3])
+  assert_equal ("begin_text",     calls[4])
+  assert_equal ("end_text",       calls[5])
+  assert_equal ("end_document",   calls[6])
+end
+
+function test_walk_missing_functions()
+  local calls = {}
+  local rend = { begin_text = function () calls[#calls+1] = true end }
+  make_document (3):render (rend)
+  assert_equal (3, #calls)
+end
+
+
+local bench_document = make_document (100)
+local bench_renderer = {
+  begin_text = function (self, node) end;
+}
+
+function bench_walk()
+  bench_document:render (bench_renderer)
+end
+
+
+function test_walk_part_options()
+  local current = { n = 0 }
+  local seen = {}
+  local rend = {
+    get_options = function (self) return current end;
+    set_options = function (self, options) current = options; return self end;
+    begin_text  = function (self, node) seen[#seen+1] = current.n end;
+  }
+  local doc = T.document:clone { children = {
+    T.part:clone { options = { n = 1 }, children = {
+      T.text:clone { data = "a" },
+      T.part:clone { options = { n = 2 }, children = {
+        T.text:clone { data = "b" },
+      }},
+      T.text:clone { data = "c" },
+    }},
+    T.text:clone { data = "d" },
+  }}
+  doc:render (rend)
+  assert_equal (1, seen[1])
+  assert_equal (2, seen[2])
+  assert_equal (1, seen[3])
+  assert_equal (0, seen[4])
+  assert_equal (0, current.n)
+end
+
+function test_walk_custom_render()
+  local calls = 0
+  local custom = T.text:extend {
+    render = function (self, renderer)
+      calls = calls + 1
+      T.text.render (self, renderer)
+    end;
+  }
+  local rend, recorded = recorder ()
+  local doc = T.document:clone { children = { custom:clone { data = "x" } } }
+  doc:render (rend)
+  assert_equal (1, calls)
+  assert_equal (4, #recorded)
+  assert_equal ("begin_text", recorded[2])
+end
+
+function test_walk_deep_nesting()
+  local rend = {
+    get_options = function (self) return {} end;
+    set_options = function (self, options) return self end;
+  }
+  local texts = 0
+  function rend.begin_text (self, node) texts = texts + 1 end
+
+  local doc = T.document:clone { children = {} }
+  local node = doc
+  for i = 1, 200000 do
+    local part = T.part:clone { options = {} }
+    node:add_child (part)
+    node = part
+  end
+  node:add_child (T.text:clone { data = "deep" })
+  doc:render (rend)
+  assert_equal (1, texts)
+end
+
+
+local function make_parts_document ()
+  return T.document:clone { options = { n = 0 }, children = {
+    T.part:clone { options = { n = 1 }, children = {
+      T.text:clone { data = "a" },
+      T.raw:clone { output = "test", data = "raw" },
+      T.text:clone { data = "a" },
+    }},
+    T.graphics:clone { data = "g" },
+  }}
+end
+
+-- Renderer which records calls along with the payload of the nodes.
+local function payload_recorder ()
+  local calls = {}
+  local current = {}
+  local function record (name)
+    return function (self, node)
+      calls[#calls+1] = name .. ":" .. tostring (node.data) .. ":" ..
+                        tostring (current.n)
+    end
+  end
+  return {
+    name = "test";
+    write = function (self, data) calls[#calls+1] = "write:" .. data end;
+    get_options = function (self) return current end;
+    set_options = function (self, options) current = options; return self end;
+    begin_document = record ("begin_document");
+    end_document   = record ("end_document");
+    begin_part     = record ("begin_part");
+    end_part       = record ("end_part");
+    begin_text     = record ("begin_text");
+    begin_graphics = record ("begin_graphics");
+  }, calls
+end
+
+function test_packed_render_same_as_tables()
+  local rend, expected = payload_recorder ()
+  make_parts_document ():render (rend)
+
+  local packed = T.pack (make_parts_document ())
+  local rend, calls = payload_recorder ()
+  packed:render (rend)
+
+  assert_equal (#expected, #calls)
+  for i = 1, #expected do
+    assert_equal (expected[i], calls[i])
+  end
+end
+
+function test_packed_dedup()
+  local packed = T.pack (make_parts_document ())
+  local stats = packed._tree:stats ()
+  assert_equal (6, stats.nodes)
+  assert_equal (1, stats.deduped) -- The second "a"
+end
+
+function test_packed_element_api()
+  local doc = T.pack (make_parts_document ())
+  assert_true (doc:has_children ())
+  assert_equal (2, #doc.children)
+  assert_equal (0, doc.options.n)
+
+  local part = doc:child (1)
+  assert_equal ("part", part.kind)
+  assert_equal (1, part.options.n)
+  assert_true (doc:has_child (part))
+  assert_equal ("raw", part:child (2).data)
+  assert_equal ("test", part:child (2).output)
+  assert_nil (part:child (4))
+
+  part:del_child (2)
+  assert_equal (2, #part.children)
+  assert_equal ("a", part:child (2).data)
+
+  part:add_child (T.text:clone { data = "b" }, 1)
+  part:add_child (T.text:clone { data = "c" })
+  assert_equal (4, #part.children)
+  assert_equal ("b", part:child (1).data)
+  assert_equal ("c", part:child (4).data)
+
+  -- Moving a node inside the same tree.
+  local moved = doc:child (2)
+  doc:del_child (moved)
+  part:add_child (moved, 2)
+  assert_equal (1, #doc.children)
+  assert_equal ("graphics", part:child (2).kind)
+end
+
+function test_packed_loader()
+  local input = [[
+    options { lines_per_page = 20 }
+    document {
+      part { copies = 2 } { text { "a", "b" } };
+      raw ("test", "x");
+    }
+  ]]
+  local doc = lib.loader.parsestring (input, true)
+  assert_not_nil (doc._tree)
+  assert_equal (20, doc.options.lines_per_page)
+  assert_equal (2, doc:child (1).options.copies)
+  assert_equal ("ab", doc:child (1):child (1).data)
+  assert_equal ("x", doc:child (2).data)
+end
+
+function test_rawfile()
+  local dir = os.tmpname ()
+  os.remove (dir)
+  os.execute ("mkdir -p " .. dir .. "/blobs")
+  local file = io.open (dir .. "/blobs/data.bin", "wb")
+  file:write (("0123456789"):rep (10000))
+  file:close ()
+  file = io.open (dir .. "/doc.chsl", "w")
+  file:write [[
+    document {
+      text "a";
+      rawfile ("test", "blobs/data.bin");
+    }
+  ]]
+  file:close ()
+
+  local output = {}
+  local rend = lib.renderer:clone {
+    name = "test";
+    write = function (self, data)
+      output[#output+1] = data
+      return self
+    end;
+    begin_text = function (self, node) self:write (node.data) end;
+  }
+
+  for _, packed in ipairs { false, true } do
+    output = {}
+    lib.loader.parse (dir .. "/doc.chsl", packed):render (rend)
+    assert_equal ("a" .. ("0123456789"):rep (10000), table.concat (output))
+  end
+
+  -- Files outside of the directory of the document can not be read, not even
+  -- through symbolic links, and neither can files that do not exist.
+  os.execute ("ln -s /etc/passwd " .. dir .. "/blobs/link")
+  local function include (path)
+    file = io.open (dir .. "/bad.chsl", "w")
+    file:write (("document { rawfile (%q, %q) }"):format ("test", path))
+    file:close ()
+    return lib.loader.parse (dir .. "/bad.chsl")
+  end
+  for _, path in ipairs { "/etc/passwd", "../data.bin", "blobs/../../x",
+                          "blobs/link", "missing" } do
+    local doc, err = include (path)
+    assert_nil (doc)
+    assert_match (path, err)
+  end
+
+  -- Documents which are not read from a file can not include files at all.
+  local doc, err = lib.loader.parsestring [[
+    document { rawfile ("test", "blobs/data.bin") }
+  ]]
+  assert_nil (doc)
+  assert_match ("not read from a file", err)
+
+  lib.loader.include_files = false
+  doc, err = include ("blobs/data.bin")
+  lib.loader.include_files = true
+  assert_nil (doc)
+  assert_match ("can not be included", err)
+  os.execute ("rm -rf " .. dir)
+end
+
+local optimize_renderer = { name = "test"; device = { id = "maker/model" } }
+
+function test_raw_matches()
+  local function matches (output)
+    return T.raw:clone { output = output }:matches (optimize_renderer)
+  end
+  assert_true  (matches ("test"))
+  assert_true  (matches ("maker/model"))
+  assert_true  (matches ("maker/*"))
+  assert_false (matches ("other"))
+  assert_false (matches ("maker/other"))
+  assert_false (matches ("other/*"))
+end
+
+function test_optimize_drop_raw()
+  local doc = T.document:clone { children = {
+    T.raw:clone { output = "test", data = "1" },
+    T.raw:clone { output = "other", data = "2" },
+    T.raw:clone { output = "maker/*", data = "3" },
+    T.raw:clone { output = "other/model", data = "4" },
+    T.rawfile:clone { output = "other", path = "5" },
+  }}
+  local stats = T.optimize (doc, optimize_renderer)
+  assert_equal (3, stats.drop_raw)
+  assert_equal (2, #doc.children)
+  assert_equal ("1", doc.children[1].data)
+  assert_equal ("3", doc.children[2].data)
+end
+
+function test_optimize_dedupe_options()
+  local doc = T.document:clone { options = { n = 0, m = 2 }, children = {
+    T.part:clone { options = { n = 0 }, children = {
+      T.text:clone { data = "a" },
+    }},
+    T.part:clone { options = { n = 1, m = 2 }, children = {
+      T.part:clone { options = { n = 1 }, children = {
+        T.graphics:clone { data = "b" },
+      }},
+    }},
+  }}
+  local stats = T.optimize (doc, optimize_renderer, { merge_text = false })
+  assert_equal (3, stats.options)
+  assert_equal (2, stats.dedupe_options)
+  assert_equal (2, #doc.children)
+  assert_equal ("text", doc.children[1].kind)
+  assert_equal ("part", doc.children[2].kind)
+  assert_equal (1, doc.children[2].options.n)
+  assert_nil (doc.children[2].options.m)
+  assert_equal ("graphics", doc.children[2].children[1].kind)
+end
+
+function test_optimize_flatten_parts()
+  local doc = T.document:clone { options = {}, children = {
+    T.part:clone { options = { a = 1 }, children = {
+      T.part:clone { options = { b = 2 }, children = {
+        T.part:clone { options = { a = 3 }, children = {
+          T.text:clone { data = "a" },
+          T.text:clone { data = "b" },
+        }},
+      }},
+    }},
+  }}
+  local stats = T.optimize (doc, optimize_renderer, { merge_text = false })
+  assert_equal (2, stats.flatten_parts)
+  assert_equal (1, #doc.children)
+  local part = doc.children[1]
+  assert_equal (3, part.options.a)
+  assert_equal (2, part.options.b)
+  assert_equal (2, #part.children)
+end
+
+function test_optimize_merge_text()
+  local function make ()
+    return T.document:clone { children = {
+      T.text:clone { data = "a" },
+      T.text:clone { data = "b" },
+      T.part:clone { options = {}, children = { T.text:clone { data = "c" } } },
+      T.graphics:clone { data = "g" },
+      T.text:clone { data = "d" },
+    }}
+  end
+
+  local doc = make ()
+  local stats = T.optimize (doc, optimize_renderer)
+  assert_equal (2, stats.merge_text) -- "b", and "c" once its part is gone.
+  assert_equal (3, #doc.children)
+  assert_equal ("abc", doc.children[1].data)
+  assert_equal ("d", doc.children[3].data)
+
+  doc = make ()
+  stats = T.optimize (doc, optimize_renderer, { merge_text = false,
+                                               dedupe_options = false })
+  assert_equal (0, stats.merge_text)
+  assert_equal (5, #doc.children)
+end
@@ -0,0 +1,113 @@
+--
+-- ut/formatter.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local formatter = lib.formatter
+
+
+local function format (area, ...)
+  local f = formatter.new (area)
+  local out = {}
+  for i = 1, select ("#", ...) do
+    out[#out+1] = f:format ((select (i, ...)))
+  end
+  out[#out+1] = f:flush ()
+  return table.concat (out), f
+end
+
+function test_new_invalid()
+  assert_error (function () formatter.new {} end)
+  assert_error (function () formatter.new { characters_per_line = 10 } end)
+  assert_error (function ()
+    formatter.new { characters_per_line = 10; lines_per_page = 5;
+                    binding_margin = 10 }
+  end)
+  assert_error (function ()
+    formatter.new { characters_per_line = 10; lines_per_page = 5;
+                    top_margin = -1 }
+  end)
+end
+
+function test_wrap()
+  local area = { characters_per_line = 10; lines_per_page = 25 }
+  assert_equal ("the quick\nbrown fox\njumps", format (area, "the quick brown fox jumps"))
+  -- Spaces at the wrapping point are dropped, a full line is not wrapped.
+  assert_equal ("abcde fghi\njk", format (area, "abcde fghi    jk"))
+  -- The binding margin makes lines shorter.
+  area.binding_margin = 4
+  assert_equal ("the\nquick\nbrown\nfox", format (area, "the quick brown fox"))
+end
+
+function test_split()
+  local text, f = format ({ characters_per_line = 4; lines_per_page = 25 },
+                          "a abcdefghij")
+  assert_equal ("a\nabcd\nefgh\nij", text)
+  assert_equal (1, f:stats ().split)
+  assert_equal (1, f:stats ().wrapped)
+end
+
+function test_tabs_and_line_endings()
+  local area = { characters_per_line = 20; lines_per_page = 25; tab_size = 4 }
+  assert_equal ("a   b\nc\nd\ne", format (area, "a\tb\r\nc\rd\ne"))
+  -- A CR LF split between pieces is still a single line ending.
+  assert_equal ("a\nb", format (area, "a\r", "\nb"))
+end
+
+function test_pages()
+  local area = { characters_per_line = 5; lines_per_page = 4; top_margin = 1 }
+  local text, f = format (area, "one two three four")
+  assert_equal ("one\ntwo\nthree\ffour", text)
+  assert_equal (2, f:stats ().pages)
+  assert_equal (4, f:stats ().lines)
+
+  -- Explicit form feeds are kept, but do not produce blank pages.
+  assert_equal ("a\fb", format (area, "a\f\fb"))
+  assert_equal ("a\nb\nc\fd", format (area, "a\nb\nc\n\fd"))
+end
+
+function test_pieces()
+  local area = { characters_per_line = 10; lines_per_page = 25 }
+  local f = formatter.new (area)
+  assert_equal ("hello", f:format ("hello wor"))
+  assert_equal ("\nworld", f:format ("ld and"))
+  assert_equal (" and", f:format (" more"))
+  assert_equal ("", f:format (""))
+  assert_equal ("\nmore", f:flush ())
+  assert_equal ("", f:flush ())
+end
+
+function test_configure()
+  local f = formatter.new { characters_per_line = 20; lines_per_page = 25 }
+  assert_equal ("aaa bbb", f:format ("aaa bbb ccc"))
+  f:configure { characters_per_line = 8 }
+  assert_equal ("\nccc", f:flush ())
+  assert_error (function () f:configure { characters_per_line = 0 } end)
+end
+
+function test_hyphenation()
+  local h = lib.hyphen.new (lib.hyphen.compile { "1na", "1ta" })
+  local area = { characters_per_line = 10; lines_per_page = 25; hyphenator = h }
+  local text, f = format (area, "a banana a lot")
+  assert_equal ("a banana a\nlot", text)
+  text, f = format (area, "the bananas")
+  assert_equal ("the bana-\nnas", text)
+  assert_equal (1, f:stats ().hyphenated)
+  -- Punctuation is not part of the lookup, and words with hyphens can be
+  -- broken after them.
+  assert_equal ("one (bana-\nnas)", format (area, "one (bananas)"))
+  assert_equal ("lots well-\nknown", format (area, "lots well-known"))
+  -- Without a hyphenator, only existing hyphens are used.
+  area.hyphenator = false
+  assert_equal ("the\nbananas", format (area, "the bananas"))
+end
+
+
+local bench_text = ("Lorem ipsum dolor sit amet, consectetur adipiscing elit. "):rep (1000)
+local bench_f    = formatter.new { characters_per_line = 40; lines_per_page = 25 }
+
+function bench_format()
+  bench_f:format (bench_text)
+end
@@ -0,0 +1,167 @@
+--
+-- ut/fs.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local fs = lib.fs
+
+
+function test_sendfile()
+  local path = os.tmpname ()
+  local data = ("0123456789abcdef"):rep (20000)
+  local input = io.open (path, "wb")
+  input:write (data)
+  input:close ()
+
+  -- Buffered output is written before the contents of the file.
+  local output = io.tmpfile ()
+  output:write ("head")
+  assert_equal (#data, fs.sendfile (path, output))
+  output:write ("tail")
+  output:seek ("set", 0)
+  assert_equal ("head" .. data .. "tail", output:read ("*a"))
+  output:close ()
+
+  os.remove (path)
+  local size, err = fs.sendfile (path, io.tmpfile ())
+  assert_nil (size)
+  assert_match ("No such file", err)
+end
+
+local function mmap_string (data)
+  local path = os.tmpname ()
+  local file = io.open (path, "wb")
+  file:write (data)
+  file:close ()
+  local buffer = assert (fs.mmap (path))
+  os.remove (path)
+  return buffer
+end
+
+function test_mmap()
+  local buffer = mmap_string ("first line\nsecond\n\nlast")
+  assert_equal (23, #buffer)
+  assert_equal (23, buffer:len ())
+  assert_equal ("first", buffer:sub (1, 5))
+  assert_equal ("last", buffer:sub (-4))
+  assert_equal ("", buffer:sub (10, 5))
+  assert_equal (12, buffer:find ("second"))
+  assert_equal (23, select (2, buffer:find ("st", 13)))
+  assert_nil (buffer:find ("missing"))
+
+  local lines = {}
+  for line in buffer:lines () do
+    lines[#lines + 1] = line
+  end
+  assert_equal (4, #lines)
+  assert_equal ("second", lines[2])
+  assert_equal ("", lines[3])
+  assert_equal ("last", lines[4])
+
+  buffer:close ()
+  assert_error (function () buffer:sub (1) end)
+end
+
+function test_mmap_not_regular()
+  -- Read into memory instead of being mapped.
+  local buffer = assert (fs.mmap ("/dev/null"))
+  assert_equal (0, #buffer)
+  assert_nil (buffer:lines () ())
+  assert_nil (fs.mmap ("/nonexistent"))
+end
+
+function test_mmap_load()
+  local env = {}
+  local chunk = mmap_string ("#!chisel\nvalue = 42\n"):load ("=test", "t", env)
+  chunk ()
+  assert_equal (42, env.value)
+
+  local chunk, err = mmap_string ("#!chisel\n\nvalue = \n"):load ("=test")
+  assert_nil (chunk)
+  assert_match ("^test:4:", err)
+end
+
+local function make_tree ()
+  local root = os.tmpname ()
+  os.remove (root)
+  os.execute (("mkdir -p %s/sub/deeper %s/.hidden"):format (root, root))
+  for _, name in ipairs { "file", "sub/inner", "sub/deeper/leaf" } do
+    io.open (root .. "/" .. name, "w"):close ()
+  end
+  fs.symlink ("sub", root .. "/link")
+  return root
+end
+
+function test_scandir()
+  local root = make_tree ()
+  local types = {}
+  local entries, count = fs.scandir (root)
+  for _, entry in ipairs (entries) do
+    types[entry.name] = entry.type
+  end
+  assert_equal (3, count)
+  assert_equal ("file", types.file)
+  assert_equal ("directory", types.sub)
+  assert_equal ("link", types.link)
+  assert_nil (types[".hidden"])
+
+  -- The iterator returns the same, and hidden entries if requested.
+  local n = 0
+  for name, kind in fs.dir (root, true) do
+    assert_true (name == ".hidden" or types[name] == kind)
+    n = n + 1
+  end
+  assert_equal (4, n)
+
+  assert_nil (fs.dir (root .. "/file"))
+  os.execute ("rm -rf " .. root)
+end
+
+function test_walk()
+  local root = make_tree ()
+  local found = {}
+  for path, kind in fs.walk (root) do
+    found[#found + 1] = path:sub (#root + 2)
+    found[path:sub (#root + 2)] = kind
+  end
+  assert_equal (6, #found)
+  assert_equal ("file", found["sub/deeper/leaf"])
+  assert_equal ("link", found.link)
+  -- Directories come before their contents, and links are not followed.
+  local position = {}
+  for i, path in ipairs (found) do
+    position[path] = i
+  end
+  assert_true (position["sub"] < position["sub/inner"])
+  assert_true (position["sub/deeper"] < position["sub/deeper/leaf"])
+  assert_nil (position["link/inner"])
+  os.execute ("rm -rf " .. root)
+end
+
+function test_mmap_stdin_offset()
+  -- The standard input is read from its offset, e.g. after a header was
+  -- consumed by another program, and it is left at the end.
+  local input, script = os.tmpname (), os.tmpname ()
+  local file = io.open (input, "wb")
+  file:write ("header\nbody of the document\n")
+  file:close ()
+  file = io.open (script, "w")
+  file:write ('io.write (lib.fs.mmap ():sub (1), "|", lib.fs.mmap ():len ())')
+  file:close ()
+
+  local function run (skip)
+    local proc = io.popen (("{ dd bs=1 count=%i of=/dev/null 2> /dev/null; " ..
+                            "./chisel -L %s -S %s; } < %s"):format (skip,
+                            chisel.libdir, script, input))
+    local output = proc:read ("*a")
+    proc:close ()
+    return output
+  end
+  assert_equal ("header\nbody of the document\n|0", run (0))
+  assert_equal ("body of the document\n|0", run (7))
+
+  os.remove (input)
+  os.remove (script)
+end
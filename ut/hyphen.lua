@@ -0,0 +1,72 @@
+--
+-- ut/hyphen.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local hyphen = lib.hyphen
+
+
+local patterns = {
+  left_min = 2; right_min = 2;
+  exceptions = { "ta-ble", "present" };
+
+  "1ba", "1be", "1ca", "1na", "4b1n", "n1n", ".pre1",
+}
+
+local function new ()
+  return hyphen.new (hyphen.compile (patterns))
+end
+
+function test_compile_invalid()
+  assert_error (function () hyphen.compile { "" } end)
+  assert_error (function () hyphen.compile { "a1b", "a1b" } end)
+  assert_error (function () hyphen.compile { "a-b" } end)
+  assert_error (function () hyphen.compile { "123" } end)
+  assert_error (function () hyphen.compile { exceptions = { "-ab" } } end)
+  assert_error (function () hyphen.compile { exceptions = { "ab-" } } end)
+  assert_error (function () hyphen.new ("not an image") end)
+end
+
+function test_hyphenate()
+  local t = new ()
+  assert_equal ("ba-na-na", t:hyphenate ("banana"))
+  assert_equal ("BA-NA-NA", t:hyphenate ("BANANA"))
+  assert_equal ("ba|na|na", t:hyphenate ("banana", "|"))
+  -- Even values win over odd ones, and left_min/right_min are honored.
+  assert_equal ("cab-na", t:hyphenate ("cabna"))
+  assert_equal ("pre-ca", t:hyphenate ("preca"))
+end
+
+function test_exceptions()
+  local t = new ()
+  assert_equal ("ta-ble", t:hyphenate ("table"))
+  assert_equal ("present", t:hyphenate ("present"))
+  assert_equal ("pre-sents", t:hyphenate ("presents"))
+end
+
+function test_not_hyphenated()
+  local t = new ()
+  assert_equal ("ab", t:hyphenate ("ab"))
+  assert_equal ("bana,na", t:hyphenate ("bana,na"))
+  assert_equal (("ba"):rep (40), t:hyphenate (("ba"):rep (40)))
+end
+
+function test_shipped_patterns()
+  local t = hyphen.open (chisel.libdir .. "/data/_hyphenation/en-us.htb")
+  assert_not_nil (t)
+  assert_equal ("hy-phen-ation", t:hyphenate ("hyphenation"))
+  assert_equal ("doc-u-men-ta-tion", t:hyphenate ("documentation"))
+  assert_equal ("as-so-ciate", t:hyphenate ("associate"))
+end
+
+
+local bench_t     = new ()
+local bench_words = { "banana", "cabana", "present", "table", "preca" }
+
+function bench_hyphenate()
+  for i = 1, 1000 do
+    bench_t:hyphenate (bench_words[i % #bench_words + 1])
+  end
+end
@@ -0,0 +1,181 @@
+--
+-- ut/journal.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local journal = lib.journal
+local device  = lib.device
+local devsim  = lib.devsim
+local T       = lib.doctree
+
+local dev  = device.get ("indexbraille/everest")
+local path = os.tmpname ()
+
+
+-- Parts alternating the line length, with a page of text each.
+local function make_document ()
+  local doc = T.document:clone { children = {}, options = {} }
+  for i = 1, 20 do
+    local part = T.part:clone {
+      children = {};
+      options = { characters_per_line = (i % 2 == 0) and 30 or 32 };
+    }
+    part:add_child (T.text:clone {
+      data = ("part %i, line of text\r\n"):format (i):rep (25) .. "\f";
+    })
+    doc:add_child (part)
+  end
+  return doc
+end
+
+-- Output which fails after writing a number of bytes.
+local function make_output (limit)
+  local output = { data = {}, size = 0 }
+  function output:write (data)
+    if limit ~= nil and self.size + #data > limit then
+      return nil, "device went away"
+    end
+    self.data[#self.data + 1] = data
+    self.size = self.size + #data
+    return self
+  end
+  function output:flush ()
+    return true
+  end
+  function output:result ()
+    return table.concat (self.data)
+  end
+  return output
+end
+
+-- Renders the document, returning the checkpoint used to resume the
+-- output, if any.
+local function render (output, interval)
+  local jnl = assert (journal.open (path, dev.id, output, interval))
+  local part, offset = jnl:resuming ()
+  local rend = dev:create_renderer (function (self, data)
+    jnl:write (data)
+    return self
+  end):clone ()
+  jnl:attach (rend)
+  local ok, err = pcall (function () make_document ():render (rend:reset ()) end)
+  if ok then
+    ok, err = jnl:finish ()
+  end
+  return ok, err, part, offset
+end
+
+local function pages (data)
+  local sim = devsim.new (dev)
+  local result = {}
+  function sim:on_page (page)
+    result[#result + 1] = devsim.page_text (page)
+  end
+  sim:feed (data)
+  sim:finish ()
+  return table.concat (result, "\f")
+end
+
+
+function test_complete()
+  local output = make_output ()
+  assert_true (render (output, 1024))
+  -- The journal is removed once the output is complete.
+  assert_nil (io.open (path, "r"))
+end
+
+function test_resume()
+  local complete = make_output ()
+  assert_true (render (complete, 1024))
+  complete = complete:result ()
+
+  local failed = make_output (#complete / 2)
+  local ok, err = render (failed, 1024)
+  assert_false (ok)
+  assert_match ("device went away", err)
+
+  local resumed = make_output ()
+  local ok, err, part, offset = render (resumed, 1024)
+  assert_true (ok, err)
+  assert_true (part > 1)
+  assert_true (offset <= failed.size)
+  assert_nil (io.open (path, "r"))
+
+  -- Data written up to the checkpoint, followed by the resumed output,
+  -- is embossed as the complete document.
+  local data = failed:result ():sub (1, offset) .. resumed:result ()
+  assert_true (#resumed:result () < #complete)
+  assert_equal (pages (complete), pages (data))
+end
+
+function test_resume_twice()
+  local complete = make_output ()
+  assert_true (render (complete, 1024))
+  complete = complete:result ()
+
+  -- The device fails again after resuming: checkpoints recorded while
+  -- resumed must match a third run.
+  local first = make_output (#complete / 3)
+  assert_false (render (first, 1024))
+  local second = make_output (#complete / 2)
+  local ok, err, part1, offset1 = render (second, 1024)
+  assert_false (ok)
+  assert_match ("device went away", err)
+
+  local third = make_output ()
+  local ok, err, part2, offset2 = render (third, 1024)
+  assert_true (ok, err)
+  assert_true (part2 > part1)
+  assert_nil (io.open (path, "r"))
+
+  -- The second run wrote the commands which restore the state of the
+  -- device, followed by the output from the first checkpoint on.
+  local resumed = second:result ()
+  local restore = resumed:find (complete:sub (offset1 + 1, offset1 + 64), 1,
+                                true) - 1
+  local data = first:result ():sub (1, offset1) ..
+               resumed:sub (1, restore + offset2 - offset1) ..
+               third:result ()
+  assert_equal (pages (complete), pages (data))
+end
+
+function test_attach_restored()
+  -- A renderer shared by several journals, as in batch mode.
+  local rend
+  local jnl
+  rend = dev:create_renderer (function (self, data)
+    jnl:write (data)
+    return self
+  end)
+  local begin_part = rend.begin_part
+  for _ = 1, 2 do
+    jnl = assert (journal.open (path, dev.id, make_output (), 1024))
+    jnl:attach (rend)
+    make_document ():render (rend:reset ())
+    assert_true (jnl:finish ())
+    assert_equal (begin_part, rend.begin_part)
+  end
+  -- Clones made by other tests would inherit the options.
+  rend:reset ()
+end
+
+function test_mismatch()
+  local failed = make_output (4096)
+  assert_false (render (failed, 1024))
+
+  -- A different document does not match the journal.
+  local jnl = assert (journal.open (path, dev.id, make_output (), 1024))
+  local rend = dev:create_renderer (function (self, data)
+    jnl:write (data)
+    return self
+  end):clone ()
+  jnl:attach (rend)
+  local doc = make_document ()
+  table.remove (doc.children, 1)
+  local ok, err = pcall (doc.render, doc, rend)
+  assert_false (ok)
+  assert_match ("does not match", err)
+  assert_nil (io.open (path, "r"))
+end
@@ -0,0 +1,48 @@
+--
+-- ut/ml.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local split = lib.ml.split
+
+
+function test_split_default_delimiter()
+  local r = split ("foo  bar\tbaz")
+  assert_equal (3, #r)
+  assert_equal ("foo", r[1])
+  assert_equal ("bar", r[2])
+  assert_equal ("baz", r[3])
+end
+
+function test_split_pattern()
+  local r = split ("a,b,,c", ",")
+  assert_equal (4, #r)
+  assert_equal ("a", r[1])
+  assert_equal ("",  r[3])
+  assert_equal ("c", r[4])
+end
+
+function test_split_limit()
+  local r = split ("a,b,c", ",", 2)
+  assert_equal (2, #r)
+  assert_equal ("a",   r[1])
+  assert_equal ("b,c", r[2])
+end
+
+function test_split_empty()
+  assert_equal (0, #split (""))
+end
+
+
+local bench_line = "dot_distance=2.5 line_spacing=single copies=1 " ..
+                   "characters_per_line=32 lines_per_page=26"
+
+function bench_split_whitespace()
+  split (bench_line)
+end
+
+function bench_split_pattern()
+  split (bench_line, "[ =]")
+end
@@ -0,0 +1,205 @@
+--
+-- ut/raster.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local raster = lib.raster
+local loader = lib.loader
+local mfloor = math.floor
+
+
+-- A 4x6 bitmap: a frame of dots with a hole in the middle.
+local pbm = "P1\n# A comment\n4 6\n1111\n1001\n1001\n1001\n1001\n1111\n"
+
+function test_decode_invalid()
+  assert_nil (raster.decode ("P3\n1 1\n255\n0 0 0\n"))
+  assert_nil (raster.decode ("P2\n2 2\n255\n0 0 0\n"))    -- Truncated
+  assert_nil (raster.decode ("P2\n1 1\n100\n101\n"))      -- Above maxval
+  assert_nil (raster.decode ("P5\n0 1\n255\n"))           -- Empty
+  assert_nil (raster.decode ("P4\n99999 99999\n"))        -- Too big
+  assert_error (function () raster.new (2, 2, "abc") end)
+end
+
+function test_decode_formats()
+  local expected = "\0\255\255\0"
+  assert_equal (expected, raster.decode ("P1\n2 2\n1001"):pixels ())
+  assert_equal (expected, raster.decode ("P4\n2 2\n\128\064"):pixels ())
+  assert_equal (expected, raster.decode ("P2 2 2 15 0 15 15 0"):pixels ())
+  assert_equal (expected, raster.decode ("P5\n2 2\n255\n" .. expected):pixels ())
+  assert_equal ("\0\128", raster.decode ("P5 2 1 1000 \0\0\1\244"):pixels ())
+
+  local w, h = raster.decode (pbm):size ()
+  assert_equal (4, w)
+  assert_equal (6, h)
+end
+
+function test_cells()
+  local image = raster.decode (pbm)
+  -- Dots 1-2-3-4 and 1-4-5-6 in the first line, 1-2-3-6 and 3-4-5-6
+  -- in the second.
+  assert_equal ("P?\nV#\n", image:cells ())
+  -- Dots 5-6 and 2-3, then 4-5 and 1-2.
+  assert_equal (";2\n^B\n", image:cells { invert = true; threshold = 200 })
+  assert_equal ("L\n", raster.new (1, 3, "\0\0\0"):cells ())
+  assert_equal ("\n", raster.new (2, 3):cells ())
+  assert_equal ("==\n", raster.new (4, 3, ("\100"):rep (12)):cells {
+    threshold = 101 })
+  assert_error (function () image:cells { dither = "random" } end)
+end
+
+-- Cells which show the number of dots in each pattern.
+local counts = {}
+for pattern = 0, 63 do
+  local n = 0
+  for bit = 0, 5 do
+    n = n + mfloor (pattern / 2^bit) % 2
+  end
+  counts[pattern + 1] = tostring (n)
+end
+counts = table.concat (counts)
+
+function test_floyd_steinberg()
+  -- Middle gray gives dots in about half of the places.
+  local cells = raster.new (60, 60, ("\128"):rep (3600)):cells {
+    dither = "floyd-steinberg"; cells = counts }
+  local dots = 0
+  for n in cells:gmatch ("%d") do
+    dots = dots + tonumber (n)
+  end
+  assert_equal (20, select (2, cells:gsub ("\n", "")))
+  assert_true (dots > 1700 and dots < 1900)
+
+  assert_equal ("=\n", raster.new (2, 3, ("\0"):rep (6)):cells {
+    dither = "floyd-steinberg" })
+  assert_equal ("\n", raster.new (2, 3):cells { dither = "floyd-steinberg" })
+end
+
+function test_scale()
+  local image = raster.new (4, 2, "\0\0\255\255\0\0\255\255")
+  assert_equal ("\0\255", image:scale (2, 1):pixels ())
+  assert_equal ("\128", image:scale (1, 1):pixels ())
+  assert_equal ("\0\0\0\0\255\255\255\255", image:scale (8, 1):pixels ())
+end
+
+function test_image_element()
+  local dir = os.tmpname ()
+  os.remove (dir)
+  os.execute ("mkdir -p " .. dir)
+  local f = io.open (dir .. "/image.pbm", "w")
+  f:write (pbm)
+  f:close ()
+
+  -- Documents are written next to the image, which is referred to by
+  -- a relative path.
+  local function parse (element, options)
+    local f = io.open (dir .. "/doc.chsl", "w")
+    f:write (("options { %s }\ndocument { image %s }"):format (options or "",
+                                                              element))
+    f:close ()
+    local doc = assert (loader.parse (dir .. "/doc.chsl"))
+    return doc.children[1]
+  end
+
+  -- Dots of 1.5mm in lines of 4.5mm are square, the image is unchanged.
+  local square = "graphics_dot_distance = 1.5; graphics_line_spacing = 4.5"
+  assert_equal ("graphics", parse ('"image.pbm"', square).kind)
+  assert_equal ("P?\nV#\n", parse ('"image.pbm"', square).data)
+  -- Gray areas which are half covered are left blank.
+  assert_equal ("X\n", parse ('{ "image.pbm"; width = 1 }', square).data)
+  assert_equal ("X\n", parse ('{ "image.pbm"; width = 1; height = 1 }').data)
+
+  -- Dots twice as tall as they are wide halve the height.
+  assert_equal ("L_\n", parse ('{ "image.pbm"; height = 1 }',
+    "graphics_dot_distance = 1.5; graphics_line_spacing = 9").data)
+
+  -- Paths outside of the directory of the document are rejected.
+  assert_error (function () parse (("%q"):format (dir .. "/image.pbm")) end)
+  assert_error (function () parse ('"../image.pbm"') end)
+
+  os.remove (dir .. "/image.pbm")
+  assert_error (function () parse ('"image.pbm"') end)
+  os.execute ("rm -rf " .. dir)
+end
+
+function test_draw_invalid()
+  assert_error (function () raster.draw { { kind = "square", 0, 0, 1 } } end)
+  assert_error (function () raster.draw { { kind = "line", 0, 0, 1 } } end)
+  assert_error (function () raster.draw { { kind = "fill", 0, 0, 1, 1 } } end)
+  assert_error (function () raster.draw { { kind = "circle", 0, 0, -1 } } end)
+  assert_error (function () raster.draw { { kind = "line", 0, 0, "x", 1 } } end)
+  assert_error (function () raster.draw ({}, { x_scale = 0 }) end)
+end
+
+function test_draw_not_finite()
+  local nan, inf = 0/0, math.huge
+  local function draw_error (shape, options)
+    local ok, err = pcall (raster.draw, { shape }, options)
+    assert_false (ok)
+    return err
+  end
+  assert_match ("not finite", draw_error { kind = "line", nan, 0, 5, 5 })
+  assert_match ("not finite", draw_error { kind = "line", 0, 0, inf, 5 })
+  assert_match ("not finite", draw_error { kind = "fill", 0, 0, 5, -inf, 1, 1 })
+  assert_match ("not finite", draw_error { kind = "circle", 2, 2, nan })
+  assert_match ("not finite", draw_error { kind = "circle", 2, 2, inf })
+  -- Finite coordinates which overflow when scaled.
+  assert_match ("not finite", draw_error ({ kind = "line", 0, 0, 1e308, 1 },
+                                          { x_scale = 10 }))
+  assert_match ("scale", draw_error ({ kind = "line", 0, 0, 1, 1 },
+                                     { y_scale = inf }))
+  assert_match ("too big", draw_error { kind = "line", 0, 0, 1e300, 1 })
+  -- Edges spanning most of the range of doubles are clipped.
+  assert_equal ("CC\n", raster.draw ({ { kind = "line", -1e308, 0, 1e308, 0 } },
+                                     { width = 4, height = 3 }))
+end
+
+function test_draw_lines()
+  assert_equal ("CCC\n", raster.draw { { kind = "line", 0, 0, 5, 0 } })
+  assert_equal ("L\nL\n", raster.draw { { kind = "line", 0, 0, 0, 5 } })
+  assert_equal ("E'\n @5\n", raster.draw { { kind = "line", 0, 0, 5, 5 } })
+  -- The last point is joined to the first one in closed polylines.
+  assert_equal ("C?\n", raster.draw { { kind = "polyline", 0, 0, 3, 0, 3, 2 } })
+  assert_equal ("D=\n", raster.draw { { kind = "polyline", closed = true,
+                                        0, 0, 3, 0, 3, 2 } })
+  -- Coordinates are scaled, and shapes are clipped to the size given.
+  assert_equal ("CCC\n", raster.draw ({ { kind = "line", 0, 0, 2.5, 0 } },
+                                      { x_scale = 2 }))
+  assert_equal ("CC\n\n", raster.draw ({ { kind = "line", 0, 0, 9, 0 } },
+                                       { width = 4; height = 4 }))
+end
+
+function test_draw_fills()
+  assert_equal ("==\n==\n", raster.draw { { kind = "fill", 0, 0, 3, 0, 3, 5, 0, 5 } })
+  local outline = raster.draw { { kind = "circle", 10, 10, 9 } }
+  local disc = raster.draw { { kind = "circle", 10, 10, 9; fill = true } }
+  assert_equal (7, select (2, outline:gsub ("\n", "")))
+  assert_equal (7, select (2, disc:gsub ("\n", "")))
+  -- Only the outline in the middle of the circle, and all dots in the disc.
+  assert_match ("\n;B +\\\n", outline)
+  assert_match ("\n;=+%(\n", disc)
+end
+
+function test_canvas_element()
+  local doc = assert (loader.parsestring [[
+    options { graphics_dot_distance = 2; graphics_line_spacing = 3 }
+    document {
+      canvas { width = 10; height = 2; line { 0, 0, 10, 0 } };
+      canvas { polyline { 0, 0, 4, 2 } };
+    }
+  ]])
+  assert_equal ("graphics", doc.children[1].kind)
+  assert_equal ("CCC\n", doc.children[1].data)
+  assert_equal ("E'\n", doc.children[2].data)
+  assert_nil (loader.parsestring "document { canvas { line (3) } }")
+  assert_nil (loader.parsestring "document { canvas { { 1, 2 } } }")
+end
+
+function test_paint_encode()
+  local image = raster.new (8, 2):paint { { kind = "line", 0, 0, 3, 0 } }
+  assert_equal ("\0\0\0\0\255\255\255\255" .. ("\255"):rep (8), image:pixels ())
+  assert_equal ("P4\n8 2\n\240\0", image:encode ("pbm"))
+  assert_equal ("P5\n8 2\n255\n" .. image:pixels (), image:encode ())
+  assert_error (function () image:encode ("png") end)
+end
@@ -0,0 +1,113 @@
+--
+-- ut/spool.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local spool = lib.spool
+local T     = lib.doctree
+
+
+local function replay (output, times)
+  local result = {}
+  output:replay (function (data) result[#result+1] = data end, times)
+  return table.concat (result)
+end
+
+
+function test_memory()
+  local output = spool.new ()
+  assert_equal (output, output:write ("abc"):write ("def"))
+  assert_equal (6, output.size)
+  assert_false (output:spilled ())
+  assert_equal ("abcdefabcdef", replay (output, 2))
+  -- Writing after replaying keeps all the data.
+  output:write ("g")
+  assert_equal ("abcdefg", replay (output))
+  output:close ()
+  assert_equal ("", replay (output))
+end
+
+function test_spill()
+  local output = spool.new (10)
+  local chunk = ("0123456789"):rep (10000)
+  output:write ("abc")
+  assert_false (output:spilled ())
+  output:write (chunk):write ("xyz")
+  assert_true (output:spilled ())
+  assert_equal (#chunk + 6, output.size)
+  local expected = "abc" .. chunk .. "xyz"
+  assert_equal (expected:rep (3), replay (output, 3))
+  output:write ("!")
+  assert_equal (expected .. "!", replay (output))
+  output:close ()
+end
+
+function test_file_errors()
+  local output = spool.new (1)
+  output:write ("abc")
+  assert_true (output:spilled ())
+
+  -- A temporary file in a full disk.
+  local file = output._file
+  output._file = setmetatable ({
+    write = function () return nil, "No space left on device" end;
+    flush = function () return nil, "No space left on device" end;
+  }, { __index = function (_, name)
+    return function (_, ...) return file[name] (file, ...) end
+  end })
+  local ok, err = pcall (output.write, output, "def")
+  assert_false (ok)
+  assert_match ("spool: write failed: No space left", err)
+  ok, err = pcall (replay, output)
+  assert_false (ok)
+  assert_match ("spool: flush failed", err)
+
+  output._file = file
+  output:close ()
+end
+
+
+-- Renderer which can not make copies by itself.
+local plain = lib.renderer:extend {
+  name = "plain";
+  begin_text = function (self, node) self:write (node.data) end;
+}
+
+function test_render_copies()
+  local output = {}
+  local rend = plain:clone {
+    write = function (self, data)
+      output[#output+1] = data
+      return self
+    end;
+  }
+  local function make_document (copies)
+    local doc = T.document:clone { children = {}, options = { copies = copies } }
+    doc:add_child (T.text:clone { data = "one " })
+    doc:add_child (T.text:clone { data = "two\n" })
+    return doc
+  end
+
+  local doc = make_document (3)
+  rend:render_copies (doc, 2)
+  assert_equal (("one two\n"):rep (3), table.concat (output))
+  assert_nil (doc.options.copies)
+
+  output = {}
+  rend:render_copies (make_document (1))
+  assert_equal ("one two\n", table.concat (output))
+
+  -- Renderers which make copies by themselves get the option instead.
+  output = {}
+  local copies
+  rend.copies_option = function (self, value) copies = value end
+  rend.begin_document = function (self, node)
+    self:copies_option (node.options.copies)
+  end
+  T.compile (rend)
+  rend:render_copies (make_document (3))
+  assert_equal ("one two\n", table.concat (output))
+  assert_equal (3, copies)
+end
@@ -0,0 +1,73 @@
+--
+-- ut/tee.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local tee = lib.tee
+
+
+local function read_file (path)
+  local f = assert (io.open (path, "rb"))
+  local data = f:read ("*a")
+  f:close ()
+  return data
+end
+
+
+function test_open_invalid()
+  assert_error (function () tee.open {} end)
+  assert_error (function () tee.open { 1 } end)
+  assert_error (function () tee.open ({ "-" }, { lag = -1 }) end)
+  assert_nil (tee.open { "/nonexistent/directory/file" })
+end
+
+function test_files_and_commands()
+  local a, b = os.tmpname (), os.tmpname ()
+  local output = assert (tee.open ({ a, "|cat > " .. b }, { lag = 1000 }))
+  local chunks = {}
+  for i = 1, 200 do
+    chunks[i] = ("line %i\n"):format (i):rep (i)
+    assert_equal (output, output:write (chunks[i]))
+  end
+  assert_true (output:close ())
+
+  local expected = table.concat (chunks)
+  assert_equal (expected, read_file (a))
+  assert_equal (expected, read_file (b))
+
+  local stats = output:stats ()
+  assert_equal (2, #stats)
+  assert_equal (a, stats[1].destination)
+  assert_equal (#expected, stats[1].written)
+  assert_equal (#expected, stats[2].written)
+  assert_nil (stats[2].error)
+  assert_error (function () output:write ("x") end)
+  os.remove (a)
+  os.remove (b)
+end
+
+function test_slow_and_failed_sinks()
+  local a, b = os.tmpname (), os.tmpname ()
+  local output = assert (tee.open ({ a, "|sleep 0.2; cat > " .. b,
+                                     "|head -c 10 > /dev/null" },
+                                   { lag = 64 * 1024 }))
+  local chunk = ("x"):rep (100 * 1024)
+  for i = 1, 20 do
+    output:write (chunk)
+  end
+  local ok, err = output:close ()
+  assert_nil (ok)
+  assert_match ("head", err)
+
+  -- The slow sink got all the data, and was waited for.
+  assert_equal (#chunk * 20, #read_file (a))
+  assert_equal (#chunk * 20, #read_file (b))
+  local stats = output:stats ()
+  assert_true (stats[2].waits > 0)
+  assert_string (stats[3].error)
+  assert_true (stats[3].written < #chunk * 20)
+  os.remove (a)
+  os.remove (b)
+end
@@ -82,3 +82,18 @@ function test_rupdate_array_table()
   assert_equal (5, r[5])
 end
 
+
+
+local bench_options = {
+  dot_distance = 2.5; line_spacing = "single"; characters_per_line = 32;
+  lines_per_page = 26; graphics = { dot_distance = 1.6; line_spacing = 5 };
+}
+
+function bench_deepcopy()
+  deepcopy (bench_options)
+end
+
+function bench_rupdate()
+  rupdate (deepcopy (bench_options), { lines_per_page = 20;
+                                       graphics = { dot_distance = 2.0 } })
+end
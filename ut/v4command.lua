@@ -0,0 +1,95 @@
+--
+-- ut/v4command.lua
+-- Copyright (C) 2013 Adrian Perez <aperez@igalia.com>
+--
+-- Distributed under terms of the MIT license.
+--
+
+local v4command = lib.v4command
+
+
+local encoder = v4command.new ({
+  dot_distance   = { "DGD"; values = { [2.0] = 0; [2.5] = 1; [1.6] = 2 } };
+  line_spacing   = { "DLS"; values = { [5.0] = 50; [10.0] = 100 };
+                     names = { single = 5.0; double = 10.0 } };
+  binding_margin = { "DBI"; minimum = 0 };
+  copies         = { "DMC"; minimum = 1; maximum = 10000 };
+}, "test")
+
+
+function test_encode()
+  assert_equal ("\027DCH32;", v4command.encode ("DCH", 32))
+  assert_equal ("\027DVchisel;", v4command.encode ("DV", "chisel"))
+  assert_equal ("\027DTM-1;", v4command.encode ("DTM", -1))
+end
+
+function test_option_values()
+  local data, chosen = encoder:option ("dot_distance", 2.5)
+  assert_equal ("\027DGD1;", data)
+  assert_equal (2.5, chosen)
+  -- The closest value is chosen.
+  data, chosen = encoder:option ("dot_distance", 1.7)
+  assert_equal ("\027DGD2;", data)
+  assert_equal (1.6, chosen)
+  assert_equal ("\027DLS100;", encoder:option ("line_spacing", "double"))
+  assert_equal ("\027DLS50;", encoder:option ("line_spacing", 4))
+  assert_error (function () encoder:option ("line_spacing", "triple") end)
+end
+
+function test_option_ranges()
+  assert_equal ("\027DBI0;", encoder:option ("binding_margin", 0))
+  assert_equal ("\027DMC10000;", encoder:option ("copies", 10000))
+  assert_error (function () encoder:option ("binding_margin", -1) end)
+  assert_error (function () encoder:option ("copies", 10001) end)
+  assert_error (function () encoder:option ("copies", true) end)
+  assert_error (function () encoder:option ("copies", 2.5) end)
+  assert_error (function () encoder:option ("binding_margin", 0/0) end)
+  assert_error (function () encoder:option ("binding_margin", 1e300) end)
+  assert_nil (encoder:option ("pagesize", "A4"))
+  assert_true (encoder:handles ("copies"))
+  assert_false (encoder:handles ("pagesize"))
+end
+
+function test_options()
+  assert_equal ("", encoder:options {})
+  assert_equal ("", encoder:options { pagesize = "A4"; [1] = 2 })
+  local data = encoder:options { dot_distance = 2; copies = 3; pagesize = "A4" }
+  assert_true (data == "\027DGD0;\027DMC3;" or data == "\027DMC3;\027DGD0;")
+  assert_error (function () encoder:options { copies = 1.5 } end)
+
+  -- More commands than fit in the initial buffer, each encoded in full.
+  local many = {}
+  for i = 1, 400 do
+    many[("option%03i"):format (i)] = { "DOPTION" .. i % 10; minimum = 0 }
+  end
+  local big = v4command.new (many)
+  local values = {}
+  for option in pairs (many) do
+    values[option] = 123456789012
+  end
+  data = big:options (values)
+  local count = 0
+  for command in data:gmatch ("\027DOPTION%d123456789012;") do
+    count = count + 1
+  end
+  assert_equal (400, count)
+  assert_equal (400 * #"\027DOPTION0123456789012;", #data)
+end
+
+function test_new_invalid()
+  assert_error (function () v4command.new { x = { "" } } end)
+  assert_error (function () v4command.new { x = { "DGD"; values = {} } } end)
+  assert_error (function () v4command.new { x = { "DGD"; values = { a = 1 } } } end)
+  assert_error (function () v4command.new { [1] = { "DGD" } } end)
+  assert_error (function () v4command.new { x = { "DGD"; values = { [1] = 0.5 } } } end)
+  assert_error (function () v4command.new { x = { "DGD"; minimum = 0.5 } } end)
+  assert_error (function () v4command.encode ("DCH", 3.5) end)
+end
+
+
+local bench_options = { dot_distance = 1.6; line_spacing = "single";
+                        binding_margin = 2; copies = 1; pagesize = "A4" }
+
+function bench_options()
+  encoder:options (bench_options)
+end